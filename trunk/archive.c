@@ -0,0 +1,387 @@
+/* Contains the implementation of the Minicast time-shift archive, which keeps
+   the last part of the stream (up to hours) for listeners who join in the
+   past, e.g. with "/?offset=-600" for ten minutes back.
+
+   The archive is a ring in a temporary file that is mapped into memory. The
+   server writes each published block to it at the block's stream position
+   modulo the ring size, so that a listener's position means the same in the
+   stream buffer and in the archive. The server writes to the view without a
+   lock, so listeners behind the stream buffer are sent a copy of the data,
+   which is checked afterwards against 'archive_written' (like a sequence
+   count) to find out if a write reached it meanwhile; the oldest
+   ARCHIVE_MARGIN bytes are not handed out, so that this is rare. An index of
+   block starts and their publication times, about one a second, is used to
+   find where a listener starts and to pace it in real time, and a ring of
+   title changes gives listeners the titles of the past. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Definitions
+#define ARCHIVE_MIN_SIZE	(4)			// megabytes
+#define ARCHIVE_MAX_SIZE	(ENGINE_MAX_TIMESHIFT)	// megabytes
+#define ARCHIVE_MARGIN		(1048576)	// oldest bytes not handed out
+#define ARCHIVE_MARKS		(65536)		// index entries (18 hours at one a
+										// second)
+#define ARCHIVE_MARK_INTERVAL	(1000000)	// microseconds between index
+											// entries
+#define ARCHIVE_TITLES		(256)		// title changes kept
+
+// Function prototypes
+
+// Internal functions
+static void release_archive();
+
+// API functions
+int archive_open(unsigned long size);
+void archive_close();
+int archive_enabled();
+void archive_write( unsigned __int64 position, const char *data, unsigned length,
+                    unsigned __int64 time );
+int archive_read(unsigned __int64 position, char *data, unsigned *length);
+unsigned __int64 archive_seek(unsigned __int64 time);
+unsigned __int64 archive_limit(unsigned __int64 time);
+void archive_add_title(unsigned __int64 position, const char *packet);
+const char *archive_find_title(unsigned __int64 position);
+void archive_get_stats(engine_stats_t *stats);
+
+
+// Index entry: a block start and the time it was published
+typedef struct archive_mark
+{
+	unsigned __int64 position, time;
+} archive_mark_t;
+
+// Title change
+typedef struct archive_title
+{
+	unsigned __int64 position;		// stream position from which it applies
+	char packet[METADATA_SIZE];
+} archive_title_t;
+
+
+// Global variables
+static CRITICAL_SECTION archive_access;	// controls access to the extent and
+										// the index
+static HANDLE archive_file = INVALID_HANDLE_VALUE, archive_mapping;
+static char *archive_view;				// NULL if there is no archive
+static unsigned long archive_size;		// bytes
+static unsigned __int64 archive_start,	// stream position of the first byte
+                        archive_total,	// and of the byte after the last one
+										// written
+                        archive_written;	// and of the byte after the
+										// newest write begun
+static archive_mark_t *marks;			// ring of ARCHIVE_MARKS entries
+static unsigned marks_count;			// index entries made
+static archive_title_t *titles;			// ring of ARCHIVE_TITLES changes
+static unsigned titles_count;			// title changes recorded
+
+
+/* Opens an archive of 'size' megabytes. Returns zero on success; the server
+   goes on without an archive otherwise. */
+int archive_open(unsigned long size)
+{
+	char path[MAX_PATH];
+	int length;
+
+	archive_view = NULL;
+	archive_mapping = NULL;
+	archive_start = archive_total = archive_written = 0;
+	marks_count = titles_count = 0;
+	InitializeCriticalSection(&archive_access);
+	if(size == 0)
+		return 0;
+	if(size < ARCHIVE_MIN_SIZE)
+		size = ARCHIVE_MIN_SIZE;
+	if(size > ARCHIVE_MAX_SIZE)
+		size = ARCHIVE_MAX_SIZE;
+	archive_size = size << 20;
+
+	// Create a temporary file that is deleted once closed; the data mostly
+	// stays in the page cache
+	length = (int)GetTempPath(sizeof(path), path);
+	if(length <= 0 || length >= (int)sizeof(path) - 32)
+		goto cleanup;
+	sprintf(path + length, "Minicast-%lu.shift", (unsigned long)GetCurrentProcessId());
+	archive_file = CreateFile( path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+	                           FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL );
+	if(archive_file == INVALID_HANDLE_VALUE)
+		goto cleanup;
+	if((archive_mapping = CreateFileMapping( archive_file, NULL, PAGE_READWRITE,
+	                                         0, archive_size, NULL )) == NULL)
+		goto cleanup;
+	if((archive_view = (char*)MapViewOfFile( archive_mapping, FILE_MAP_WRITE,
+	                                         0, 0, archive_size )) == NULL)
+		goto cleanup;
+
+	if((marks = (archive_mark_t*)malloc(ARCHIVE_MARKS * sizeof(archive_mark_t))) == NULL)
+		goto cleanup;
+	if((titles = (archive_title_t*)malloc(ARCHIVE_TITLES * sizeof(archive_title_t))) == NULL)
+		goto cleanup;
+
+	return 0;
+
+cleanup:
+	release_archive();
+	return -1;
+}
+
+void archive_close()
+{
+	release_archive();
+	DeleteCriticalSection(&archive_access);
+}
+
+/* Releases the memory and the file of the archive. */
+static void release_archive()
+{
+	if(archive_view != NULL)
+		UnmapViewOfFile(archive_view);
+	if(archive_mapping != NULL)
+		CloseHandle(archive_mapping);
+	if(archive_file != INVALID_HANDLE_VALUE)
+		CloseHandle(archive_file);
+	free(marks);
+	free(titles);
+	archive_view = NULL;
+	archive_mapping = NULL;
+	archive_file = INVALID_HANDLE_VALUE;
+	marks = NULL;
+	titles = NULL;
+}
+
+int archive_enabled()
+{
+	return archive_view != NULL && marks != NULL && titles != NULL;
+}
+
+/* Returns the stream position of the oldest byte handed out. Must be called
+   with archive_access held. */
+static unsigned __int64 archive_first()
+{
+	if(archive_total - archive_start > archive_size - ARCHIVE_MARGIN)
+		return archive_total - (archive_size - ARCHIVE_MARGIN);
+	return archive_start;
+}
+
+/* Returns the index of the oldest index entry of a block that is handed out,
+   or marks_count if there is none. Must be called with archive_access held. */
+static unsigned first_mark()
+{
+	unsigned lo, hi, mid;
+	unsigned __int64 first;
+
+	first = archive_first();
+	lo = (marks_count > ARCHIVE_MARKS) ? marks_count - ARCHIVE_MARKS : 0;
+	hi = marks_count;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(marks[mid % ARCHIVE_MARKS].position < first)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Returns the index of the first index entry, from 'lo' on, of a block
+   published after 'time', or marks_count if there is none. Must be called
+   with archive_access held. */
+static unsigned find_mark(unsigned lo, unsigned __int64 time)
+{
+	unsigned hi = marks_count, mid;
+
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(marks[mid % ARCHIVE_MARKS].time <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Writes a block published at 'time' at stream position 'position'; called
+   by the server for each block, in order. */
+void archive_write( unsigned __int64 position, const char *data, unsigned length,
+                    unsigned __int64 time )
+{
+	archive_mark_t *mark;
+	unsigned long pos, first_part_size;
+
+	if(!archive_enabled() || length == 0)
+		return;
+	if(length > ARCHIVE_MARGIN)
+		return;
+
+	EnterCriticalSection(&archive_access);
+	if(position != archive_total)
+	{
+		// The stream restarted elsewhere; forget what came before
+		archive_start = archive_total = position;
+		marks_count = 0;
+	}
+	archive_written = position + length;
+	LeaveCriticalSection(&archive_access);
+
+	// Overwrite the oldest data without the lock; archive_read() finds out
+	// from 'archive_written' if a copy it made was overwritten
+	pos = (unsigned long)(position % archive_size);
+	if(pos + length <= archive_size)
+	{
+		memcpy(archive_view + pos, data, length);
+	}
+	else
+	{
+		first_part_size = archive_size - pos;
+		memcpy(archive_view + pos, data, first_part_size);
+		memcpy(archive_view, data + first_part_size, length - first_part_size);
+	}
+
+	EnterCriticalSection(&archive_access);
+	archive_total = position + length;
+	if( marks_count == 0 ||
+		time - marks[(marks_count - 1) % ARCHIVE_MARKS].time >= ARCHIVE_MARK_INTERVAL )
+	{
+		mark = &marks[marks_count++ % ARCHIVE_MARKS];
+		mark->position = position;
+		mark->time     = time;
+	}
+	LeaveCriticalSection(&archive_access);
+}
+
+/* Copies up to 'length' bytes of archived data from a stream position to
+   'data', and returns in 'length' the number copied. Returns zero on success,
+   or -1 if the position is not held (overwritten, also while copying, or not
+   written yet). */
+int archive_read(unsigned __int64 position, char *data, unsigned *length)
+{
+	unsigned long pos;
+	unsigned __int64 available;
+	int result = -1;
+
+	if(!archive_enabled())
+		return -1;
+
+	EnterCriticalSection(&archive_access);
+	if(position >= archive_first() && position < archive_total)
+	{
+		pos = (unsigned long)(position % archive_size);
+		available = archive_total - position;
+		if(available > archive_size - pos)
+			available = archive_size - pos;
+		if(available < *length)
+			*length = (unsigned)available;
+		result = 0;
+	}
+	LeaveCriticalSection(&archive_access);
+	if(result != 0)
+		return -1;
+
+	// Copy without the lock, then check that no write begun since reached
+	// the copied bytes; a write overwrites the bytes 'archive_size' before
+	// those it adds, and a restart moves 'archive_start' past them
+	memcpy(data, archive_view + pos, *length);
+	EnterCriticalSection(&archive_access);
+	if(position < archive_start || archive_written - position > archive_size)
+		result = -1;
+	LeaveCriticalSection(&archive_access);
+
+	return result;
+}
+
+/* Returns the stream position of the first block published at or after
+   'time' that is held (0 for the oldest); the position after the data written
+   if there is none. */
+unsigned __int64 archive_seek(unsigned __int64 time)
+{
+	unsigned n;
+	unsigned __int64 position;
+
+	if(!archive_enabled())
+		return 0;
+
+	EnterCriticalSection(&archive_access);
+	n = first_mark();
+	if(time > 0)
+		n = find_mark(n, time - 1);
+	position = (n < marks_count) ? marks[n % ARCHIVE_MARKS].position : archive_total;
+	LeaveCriticalSection(&archive_access);
+
+	return position;
+}
+
+/* Returns the stream position up to which the stream had been published by
+   'time' (at index granularity), for pacing time-shifted listeners. */
+unsigned __int64 archive_limit(unsigned __int64 time)
+{
+	unsigned n;
+	unsigned __int64 position;
+
+	if(!archive_enabled())
+		return 0;
+
+	EnterCriticalSection(&archive_access);
+	n = find_mark((marks_count > ARCHIVE_MARKS) ? marks_count - ARCHIVE_MARKS : 0, time);
+	position = (n < marks_count) ? marks[n % ARCHIVE_MARKS].position : archive_total;
+	LeaveCriticalSection(&archive_access);
+
+	return position;
+}
+
+/* Records a title change at a stream position. Titles are added and looked up
+   under the server's metadata lock. */
+void archive_add_title(unsigned __int64 position, const char *packet)
+{
+	archive_title_t *title;
+
+	if(!archive_enabled())
+		return;
+	title = &titles[titles_count++ % ARCHIVE_TITLES];
+	title->position = position;
+	memcpy(title->packet, packet, METADATA_SIZE);
+}
+
+/* Returns the metadata packet of the latest title change at or before a
+   stream position, or NULL if none is kept. */
+const char *archive_find_title(unsigned __int64 position)
+{
+	unsigned first, n;
+
+	if(!archive_enabled())
+		return NULL;
+
+	first = (titles_count > ARCHIVE_TITLES) ? titles_count - ARCHIVE_TITLES : 0;
+	for(n = titles_count; n > first; --n)
+		if(titles[(n - 1) % ARCHIVE_TITLES].position <= position)
+			return titles[(n - 1) % ARCHIVE_TITLES].packet;
+	return NULL;
+}
+
+void archive_get_stats(engine_stats_t *stats)
+{
+	unsigned n;
+
+	if(!archive_enabled())
+		return;
+
+	EnterCriticalSection(&archive_access);
+	stats->timeshift_size = archive_size;
+	stats->timeshift_fill = archive_total - archive_first();
+	n = first_mark();
+	if(n < marks_count)
+		stats->timeshift_time = marks[(marks_count - 1) % ARCHIVE_MARKS].time -
+		                        marks[n % ARCHIVE_MARKS].time;
+	LeaveCriticalSection(&archive_access);
+}
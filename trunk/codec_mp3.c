@@ -0,0 +1,135 @@
+/* Contains the MP3 encoder backend, which drives the LAME DLL through the
+   BladeMP3EncDLL API. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <string.h>
+#include <malloc.h>
+
+// Include MP3 encoder header
+#define _BLADEDLL
+#include "BladeMP3EncDLL.h"
+
+
+// Quality setting for the LAME DLL; the high byte must be the inverse of the
+// low byte for the setting to be used
+#define LAME_QUALITY(q) ((WORD)((q) | ((~(q) & 0xFF) << 8)))
+
+
+// LAME settings by preset
+static const struct {
+	LONG preset;
+	WORD quality;
+} presets[ENCODER_PRESETS] = {
+	{ LQP_HIGH_QUALITY,   0               },
+	{ LQP_NORMAL_QUALITY, LAME_QUALITY(5) },
+	{ LQP_LOW_QUALITY,    LAME_QUALITY(7) },
+	{ LQP_LOW_QUALITY,    LAME_QUALITY(9) } };
+
+
+static void *mp3_open( const codec_settings_t *settings, codec_format_t *format,
+                       unsigned *input_size, unsigned *output_size )
+{
+	BE_CONFIG config;
+	HBE_STREAM *stream;
+	DWORD input_samples, output_bytes;
+	short preset = settings->preset;
+
+	if(preset < ENCODER_PRESET_HIGH || preset >= ENCODER_PRESETS)
+		preset = ENCODER_PRESET_HIGH;
+
+	// Set correct configuration
+	memset(&config, 0, sizeof(config));
+	config.dwConfig = BE_CONFIG_LAME;
+	config.format.LHV1.dwStructVersion = CURRENT_STRUCT_VERSION;
+	config.format.LHV1.dwStructSize = CURRENT_STRUCT_SIZE;
+	config.format.LHV1.dwSampleRate = settings->sampling_rate;
+	config.format.LHV1.dwReSampleRate = 0;
+	if(settings->channels == 1)
+		config.format.LHV1.nMode = BE_MP3_MODE_MONO;
+	else
+		switch(settings->mode)
+		{
+		default:
+		case CHANNELS_JOINT:	config.format.LHV1.nMode = BE_MP3_MODE_JSTEREO; break;
+		case CHANNELS_STEREO:	config.format.LHV1.nMode = BE_MP3_MODE_STEREO;  break;
+		}
+	config.format.LHV1.dwBitrate = settings->bitrate;
+	config.format.LHV1.nPreset = presets[preset].preset;
+	config.format.LHV1.nQuality = presets[preset].quality;
+	config.format.LHV1.bCRC = TRUE;
+	config.format.LHV1.nVbrMethod = VBR_METHOD_NONE;
+	config.format.LHV1.bNoRes = settings->no_reservoir ? TRUE : FALSE;
+
+	if((stream = (HBE_STREAM*)malloc(sizeof(HBE_STREAM))) == NULL)
+		return NULL;
+	if(beInitStream(&config, &input_samples, &output_bytes, stream) != BE_ERR_SUCCESSFUL)
+	{
+		free(stream);
+		return NULL;
+	}
+
+	format->codec         = &codec_mp3;
+	format->sampling_rate = settings->sampling_rate;
+	format->channels      = settings->channels;
+	format->frame_size    = 0;	// frames carry their own headers
+	format->frame_samples = 0;
+	*input_size  = input_samples * 2; // 16-bit samples
+	*output_size = output_bytes;
+	return stream;
+}
+
+static int mp3_encode( void *stream, const char *input, unsigned input_size,
+                       char *output, unsigned *output_size )
+{
+	DWORD size = 0;
+	BE_ERR result;
+
+	result = beEncodeChunk( *(HBE_STREAM*)stream, input_size/2, (short*)input,
+	                        (PBYTE)output, &size );
+	*output_size = size;
+	return (result == BE_ERR_SUCCESSFUL) ? 0 : -1;
+}
+
+static int mp3_finish(void *stream, char *output, unsigned *output_size)
+{
+	DWORD size = 0;
+	BE_ERR result;
+
+	result = beDeinitStream(*(HBE_STREAM*)stream, (PBYTE)output, &size);
+	*output_size = size;
+	return (result == BE_ERR_SUCCESSFUL) ? 0 : -1;
+}
+
+static void mp3_close(void *stream)
+{
+	beCloseStream(*(HBE_STREAM*)stream);
+	free(stream);
+}
+
+static unsigned mp3_stream_header(const codec_format_t *format, char *header)
+{
+	return 0;  // MP3 streams can be joined at any frame
+}
+
+static int mp3_parse_frame( const codec_format_t *format, const unsigned char *data,
+                            codec_frame_t *frame )
+{
+	return mp3_parse_header(data, frame);
+}
+
+static unsigned mp3_silent( const codec_format_t *format, const unsigned char *header,
+                            char *frame )
+{
+	return mp3_silent_frame(header, frame);
+}
+
+const codec_t codec_mp3 = {
+	"mp3", "audio/mpeg",
+	mp3_open, mp3_encode, mp3_finish, mp3_close,
+	mp3_stream_header, mp3_parse_frame, mp3_find_sync, mp3_silent };
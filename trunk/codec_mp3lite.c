@@ -0,0 +1,1206 @@
+/* Contains the built-in MP3 encoder backend: a lightweight MPEG-1 Layer III
+   encoder for 32, 44.1 and 48 kHz, meant for machines where the LAME DLL
+   costs too much CPU time per stream. It is experimental: its frames have
+   only been checked against a decoder written from the standard alongside
+   it, not against a reference decoder such as mpg123, and it encodes about
+   45 times faster than real time (128 kbps stereo, one core), which falls
+   well short of the several hundred times that would make it worth using
+   in place of LAME's faster presets.
+
+   The signal path follows the standard (polyphase filterbank with the
+   standard's analysis window, 18-point MDCT with long blocks only, alias
+   reduction, optional mid/side stereo). The filterbank uses 32-bit integer
+   arithmetic and the MDCT single precision floating point, both with SSE2
+   where the processor has it. There is no psychoacoustic model: the rate
+   loop looks for the finest global step at which a granule fits its share
+   of the frame, coded with whichever Huffman tables of the standard need the
+   fewest bits, and the loop around it raises the scalefactors of bands whose
+   noise exceeds a fixed fraction of their energy, so that quiet bands keep
+   some precision. Frames do not use the bit reservoir. Quality is below
+   LAME's, but the output is a plain constant bitrate stream that any player
+   decodes. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <string.h>
+#include <malloc.h>
+#include <math.h>
+#include <emmintrin.h>
+
+
+// Definitions
+#define FRAME_SAMPLES	(1152)	// samples per channel per frame
+#define GRANULE_SIZE	(576)	// samples per channel per granule
+#define HISTORY_SIZE	(480)	// samples of the last granule the filterbank needs
+#define SUBBANDS		(32)
+#define BANDS			(22)	// scalefactor bands (long blocks)
+#define PI				(3.14159265358979323846)
+#define XR_LIMIT		(2147483520.0f)	// largest float below 2^31
+#define IX_MAX			(8206)	// largest quantized value (15 plus 13 linbits)
+#define GAIN_OFFSET		(210)	// global gain of a step of 1
+#define STEP_MIN		(-270)	// range of step exponents: the global gain
+#define STEP_MAX		(45)	// minus GAIN_OFFSET and 4 per scalefactor
+#define OUTER_MAX		(8)		// max. scalefactor passes per granule
+#define NOISE_RATIO		(0.05)	// noise allowed in a band, relative to its
+								// energy (-13 dB)
+#define NOISE_FLOOR		(1e-10)	// noise allowed per line in any case (about
+								// that of 16-bit samples)
+#define MODE_STEREO		(0)
+#define MODE_JOINT		(1)		// mid/side stereo
+#define MODE_MONO		(3)
+
+
+// Per granule and channel side information
+typedef struct granule
+{
+	unsigned part2_3_length, big_values, global_gain, scalefac_compress;
+	unsigned table_select[3], region0_count, region1_count;
+	unsigned count1, count1_table;		// count1 table B if set
+} granule_t;
+
+// Stream state
+typedef struct mp3lite_stream
+{
+	codec_format_t format;
+	int use_sse2;
+	unsigned channels, mode;
+	unsigned bitrate_index, sampling_index;
+	unsigned frame_bytes, side_bytes;	// frame size without padding
+	unsigned long padding_step, padding_rest;	// see encode_frame()
+	const short *bands;					// scalefactor band boundaries
+	unsigned cutoff;					// MDCT lines above this are not coded
+
+	short window[512];					// analysis window, time-reversed (Q19)
+	short matrix[SUBBANDS][64];			// analysis matrix, columns reversed (Q14)
+	float mdct[18][36];					// MDCT window and cosines
+	int alias_cs[8], alias_ca[8];		// alias reduction butterflies (Q15)
+	float steps[STEP_MAX - STEP_MIN + 1];	// 2^(-3e/16): scales the lines to the
+											// power of 3/4 for a step of 2^(e/4)
+	float levels[IX_MAX + 1];			// n^(4/3), the magnitude of value n in steps
+
+	short input[2][HISTORY_SIZE + GRANULE_SIZE];
+	float subband[2][18][SUBBANDS];		// filterbank output of the last granule
+	int xr[2][GRANULE_SIZE];			// MDCT lines; 2^27 is full scale
+	float xr34[GRANULE_SIZE];			// magnitudes of the lines of a channel to
+										// the power of 3/4 (full scale 1.0)
+	int ix[GRANULE_SIZE];				// quantized lines
+	unsigned char scalefac[BANDS];
+} mp3lite_stream_t;
+
+// Bit writer
+typedef struct bits
+{
+	unsigned char *data;
+	unsigned pos;
+} bits_t;
+
+
+// MPEG-1 Layer III bitrates (kbps) by index, and sampling rates by index
+static const short bitrates[15] = {
+	0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 };
+static const unsigned sampling_rates[3] = { 44100, 48000, 32000 };
+
+// Scalefactor band boundaries for long blocks, by sampling rate index
+static const short band_limits[3][BANDS + 1] = {
+	{ 0, 4, 8, 12, 16, 20, 24, 30, 36, 44, 52, 62, 74, 90, 110, 134, 162, 196,
+	  238, 288, 342, 418, 576 },
+	{ 0, 4, 8, 12, 16, 20, 24, 30, 36, 42, 50, 60, 72, 88, 106, 128, 156, 190,
+	  230, 276, 330, 384, 576 },
+	{ 0, 4, 8, 12, 16, 20, 24, 30, 36, 44, 54, 66, 82, 102, 126, 156, 194, 240,
+	  296, 364, 448, 550, 576 } };
+
+// Scalefactor sizes by scalefac_compress (for bands 0-10 and 11-20)
+static const unsigned char slen1[16] = { 0, 0, 0, 0, 3, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4 };
+static const unsigned char slen2[16] = { 0, 1, 2, 3, 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 2, 3 };
+
+// Alias reduction coefficients
+static const double alias_c[8] = {
+	-0.6, -0.535, -0.33, -0.185, -0.095, -0.041, -0.0142, -0.0037 };
+
+/* First half of the analysis window of the standard (ISO/IEC 11172-3, Table
+   C.1), as 32 * 65536 * C[i] without the sign changes every 64 coefficients;
+   the second half mirrors it (see build_tables()). */
+static const int window_base[257] = {
+	0, -1, -1, -1, -1, -1, -1, -2, -2, -2, -2, -3,
+	-3, -4, -4, -5, -5, -6, -7, -7, -8, -9, -10, -11,
+	-13, -14, -16, -17, -19, -21, -24, -26, -29, -31, -35, -38,
+	-41, -45, -49, -53, -58, -63, -68, -73, -79, -85, -91, -97,
+	-104, -111, -117, -125, -132, -139, -147, -154, -161, -169, -176, -183,
+	-190, -196, -202, -208, -213, -218, -222, -225, -227, -228, -228, -227,
+	-224, -221, -215, -208, -200, -189, -177, -163, -146, -127, -106, -83,
+	-57, -29, 2, 36, 72, 111, 153, 197, 244, 294, 347, 401,
+	459, 519, 581, 645, 711, 779, 848, 919, 991, 1064, 1137, 1210,
+	1283, 1356, 1428, 1498, 1567, 1634, 1698, 1759, 1817, 1870, 1919, 1962,
+	2001, 2032, 2057, 2075, 2085, 2087, 2080, 2063, 2037, 2000, 1952, 1893,
+	1822, 1739, 1644, 1535, 1414, 1280, 1131, 970, 794, 605, 402, 185,
+	-45, -288, -545, -814, -1095, -1388, -1692, -2006, -2330, -2663, -3004, -3351,
+	-3705, -4063, -4425, -4788, -5153, -5517, -5879, -6237, -6589, -6935, -7271, -7597,
+	-7910, -8209, -8491, -8755, -8998, -9219, -9416, -9585, -9727, -9838, -9916, -9959,
+	-9966, -9935, -9863, -9750, -9592, -9389, -9139, -8840, -8492, -8092, -7640, -7134,
+	-6574, -5959, -5288, -4561, -3776, -2935, -2037, -1082, -70, 998, 2122, 3300,
+	4533, 5818, 7154, 8540, 9975, 11455, 12980, 14548, 16155, 17799, 19478, 21189,
+	22929, 24694, 26482, 28289, 30112, 31947, 33791, 35640, 37489, 39336, 41176, 43006,
+	44821, 46617, 48390, 50137, 51853, 53534, 55178, 56778, 58333, 59838, 61289, 62684,
+	64019, 65290, 66494, 67629, 68692, 69679, 70590, 71420, 72169, 72835, 73415, 73908,
+	74313, 74630, 74856, 74992, 75038 };
+
+/* Huffman code tables of the standard for pairs of values (tables 1 to 24;
+   4 and 14 do not exist) and for quadruples of values up to 1 (count1 table
+   A; table B is the inverted value in 4 bits). The lengths do not include
+   the sign bits. */
+typedef struct huffman_table
+{
+	unsigned size;					// values per dimension (0 if none coded)
+	unsigned linbits;				// extra bits of values from 15 up
+	const unsigned short *codes;
+	const unsigned char *lengths;
+} huffman_table_t;
+
+static const unsigned short codes1[4] = { 1, 1, 1, 0 };
+static const unsigned char lengths1[4] = { 1, 3, 2, 3 };
+
+static const unsigned short codes2[9] = { 1, 2, 1, 3, 1, 1, 3, 2, 0 };
+static const unsigned char lengths2[9] = { 1, 3, 6, 3, 3, 5, 5, 5, 6 };
+
+static const unsigned short codes3[9] = { 3, 2, 1, 1, 1, 1, 3, 2, 0 };
+static const unsigned char lengths3[9] = { 2, 2, 6, 3, 2, 5, 5, 5, 6 };
+
+static const unsigned short codes5[16] = { 1, 2, 6, 5, 3, 1, 4, 4, 7, 5, 7, 1, 6, 1, 1, 0 };
+static const unsigned char lengths5[16] = { 1, 3, 6, 7, 3, 3, 6, 7, 6, 6, 7, 8, 7, 6, 7, 8 };
+
+static const unsigned short codes6[16] = { 7, 3, 5, 1, 6, 2, 3, 2, 5, 4, 4, 1, 3, 3, 2, 0 };
+static const unsigned char lengths6[16] = { 3, 3, 5, 7, 3, 2, 4, 5, 4, 4, 5, 6, 6, 5, 6, 7 };
+
+static const unsigned short codes7[36] = {
+	1, 2, 10, 19, 16, 10,
+	3, 3, 7, 10, 5, 3,
+	11, 4, 13, 17, 8, 4,
+	12, 11, 18, 15, 11, 2,
+	7, 6, 9, 14, 3, 1,
+	6, 4, 5, 3, 2, 0 };
+static const unsigned char lengths7[36] = {
+	1, 3, 6, 8, 8, 9,
+	3, 4, 6, 7, 7, 8,
+	6, 5, 7, 8, 8, 9,
+	7, 7, 8, 9, 9, 9,
+	7, 7, 8, 9, 9, 10,
+	8, 8, 9, 10, 10, 10 };
+
+static const unsigned short codes8[36] = {
+	3, 4, 6, 18, 12, 5,
+	5, 1, 2, 16, 9, 3,
+	7, 3, 5, 14, 7, 3,
+	19, 17, 15, 13, 10, 4,
+	13, 5, 8, 11, 5, 1,
+	12, 4, 4, 1, 1, 0 };
+static const unsigned char lengths8[36] = {
+	2, 3, 6, 8, 8, 9,
+	3, 2, 4, 8, 8, 8,
+	6, 4, 6, 8, 8, 9,
+	8, 8, 8, 9, 9, 10,
+	8, 7, 8, 9, 10, 10,
+	9, 8, 9, 9, 11, 11 };
+
+static const unsigned short codes9[36] = {
+	7, 5, 9, 14, 15, 7,
+	6, 4, 5, 5, 6, 7,
+	7, 6, 8, 8, 8, 5,
+	15, 6, 9, 10, 5, 1,
+	11, 7, 9, 6, 4, 1,
+	14, 4, 6, 2, 6, 0 };
+static const unsigned char lengths9[36] = {
+	3, 3, 5, 6, 8, 9,
+	3, 3, 4, 5, 6, 8,
+	4, 4, 5, 6, 7, 8,
+	6, 5, 6, 7, 7, 8,
+	7, 6, 7, 7, 8, 9,
+	8, 7, 8, 8, 9, 9 };
+
+static const unsigned short codes10[64] = {
+	1, 2, 10, 23, 35, 30, 12, 17,
+	3, 3, 8, 12, 18, 21, 12, 7,
+	11, 9, 15, 21, 32, 40, 19, 6,
+	14, 13, 22, 34, 46, 23, 18, 7,
+	20, 19, 33, 47, 27, 22, 9, 3,
+	31, 22, 41, 26, 21, 20, 5, 3,
+	14, 13, 10, 11, 16, 6, 5, 1,
+	9, 8, 7, 8, 4, 4, 2, 0 };
+static const unsigned char lengths10[64] = {
+	1, 3, 6, 8, 9, 9, 9, 10,
+	3, 4, 6, 7, 8, 9, 8, 8,
+	6, 6, 7, 8, 9, 10, 9, 9,
+	7, 7, 8, 9, 10, 10, 9, 10,
+	8, 8, 9, 10, 10, 10, 10, 10,
+	9, 9, 10, 10, 11, 11, 10, 11,
+	8, 8, 9, 10, 10, 10, 11, 11,
+	9, 8, 9, 10, 10, 11, 11, 11 };
+
+static const unsigned short codes11[64] = {
+	3, 4, 10, 24, 34, 33, 21, 15,
+	5, 3, 4, 10, 32, 17, 11, 10,
+	11, 7, 13, 18, 30, 31, 20, 5,
+	25, 11, 19, 59, 27, 18, 12, 5,
+	35, 33, 31, 58, 30, 16, 7, 5,
+	28, 26, 32, 19, 17, 15, 8, 14,
+	14, 12, 9, 13, 14, 9, 4, 1,
+	11, 4, 6, 6, 6, 3, 2, 0 };
+static const unsigned char lengths11[64] = {
+	2, 3, 5, 7, 8, 9, 8, 9,
+	3, 3, 4, 6, 8, 8, 7, 8,
+	5, 5, 6, 7, 8, 9, 8, 8,
+	7, 6, 7, 9, 8, 10, 8, 9,
+	8, 8, 8, 9, 9, 10, 9, 10,
+	8, 8, 9, 10, 10, 11, 10, 11,
+	8, 7, 7, 8, 9, 10, 10, 10,
+	8, 7, 8, 9, 10, 10, 10, 10 };
+
+static const unsigned short codes12[64] = {
+	9, 6, 16, 33, 41, 39, 38, 26,
+	7, 5, 6, 9, 23, 16, 26, 11,
+	17, 7, 11, 14, 21, 30, 10, 7,
+	17, 10, 15, 12, 18, 28, 14, 5,
+	32, 13, 22, 19, 18, 16, 9, 5,
+	40, 17, 31, 29, 17, 13, 4, 2,
+	27, 12, 11, 15, 10, 7, 4, 1,
+	27, 12, 8, 12, 6, 3, 1, 0 };
+static const unsigned char lengths12[64] = {
+	4, 3, 5, 7, 8, 9, 9, 9,
+	3, 3, 4, 5, 7, 7, 8, 8,
+	5, 4, 5, 6, 7, 8, 7, 8,
+	6, 5, 6, 6, 7, 8, 8, 8,
+	7, 6, 7, 7, 8, 8, 8, 9,
+	8, 7, 8, 8, 8, 9, 8, 9,
+	8, 7, 7, 8, 8, 9, 9, 10,
+	9, 8, 8, 9, 9, 9, 9, 10 };
+
+static const unsigned short codes13[256] = {
+	1, 5, 14, 21, 34, 51, 46, 71, 42, 52, 68, 52, 67, 44, 43, 19,
+	3, 4, 12, 19, 31, 26, 44, 33, 31, 24, 32, 24, 31, 35, 22, 14,
+	15, 13, 23, 36, 59, 49, 77, 65, 29, 40, 30, 40, 27, 33, 42, 16,
+	22, 20, 37, 61, 56, 79, 73, 64, 43, 76, 56, 37, 26, 31, 25, 14,
+	35, 16, 60, 57, 97, 75, 114, 91, 54, 73, 55, 41, 48, 53, 23, 24,
+	58, 27, 50, 96, 76, 70, 93, 84, 77, 58, 79, 29, 74, 49, 41, 17,
+	47, 45, 78, 74, 115, 94, 90, 79, 69, 83, 71, 50, 59, 38, 36, 15,
+	72, 34, 56, 95, 92, 85, 91, 90, 86, 73, 77, 65, 51, 44, 43, 42,
+	43, 20, 30, 44, 55, 78, 72, 87, 78, 61, 46, 54, 37, 30, 20, 16,
+	53, 25, 41, 37, 44, 59, 54, 81, 66, 76, 57, 54, 37, 18, 39, 11,
+	35, 33, 31, 57, 42, 82, 72, 80, 47, 58, 55, 21, 22, 26, 38, 22,
+	53, 25, 23, 38, 70, 60, 51, 36, 55, 26, 34, 23, 27, 14, 9, 7,
+	34, 32, 28, 39, 49, 75, 30, 52, 48, 40, 52, 28, 18, 17, 9, 5,
+	45, 21, 34, 64, 56, 50, 49, 45, 31, 19, 12, 15, 10, 7, 6, 3,
+	48, 23, 20, 39, 36, 35, 53, 21, 16, 23, 13, 10, 6, 1, 4, 2,
+	16, 15, 17, 27, 25, 20, 29, 11, 17, 12, 16, 8, 1, 1, 0, 1 };
+static const unsigned char lengths13[256] = {
+	1, 4, 6, 7, 8, 9, 9, 10, 9, 10, 11, 11, 12, 12, 13, 13,
+	3, 4, 6, 7, 8, 8, 9, 9, 9, 9, 10, 10, 11, 12, 12, 12,
+	6, 6, 7, 8, 9, 9, 10, 10, 9, 10, 10, 11, 11, 12, 13, 13,
+	7, 7, 8, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 13, 13,
+	8, 7, 9, 9, 10, 10, 11, 11, 10, 11, 11, 12, 12, 13, 13, 14,
+	9, 8, 9, 10, 10, 10, 11, 11, 11, 11, 12, 11, 13, 13, 14, 14,
+	9, 9, 10, 10, 11, 11, 11, 11, 11, 12, 12, 12, 13, 13, 14, 14,
+	10, 9, 10, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 14, 16, 16,
+	9, 8, 9, 10, 10, 11, 11, 12, 12, 12, 12, 13, 13, 14, 15, 15,
+	10, 9, 10, 10, 11, 11, 11, 13, 12, 13, 13, 14, 14, 14, 16, 15,
+	10, 10, 10, 11, 11, 12, 12, 13, 12, 13, 14, 13, 14, 15, 16, 17,
+	11, 10, 10, 11, 12, 12, 12, 12, 13, 13, 13, 14, 15, 15, 15, 16,
+	11, 11, 11, 12, 12, 13, 12, 13, 14, 14, 15, 15, 15, 16, 16, 16,
+	12, 11, 12, 13, 13, 13, 14, 14, 14, 14, 14, 15, 16, 15, 16, 16,
+	13, 12, 12, 13, 13, 13, 15, 14, 14, 17, 15, 15, 15, 17, 16, 16,
+	12, 12, 13, 14, 14, 14, 15, 14, 15, 15, 16, 16, 19, 18, 19, 16 };
+
+static const unsigned short codes15[256] = {
+	7, 12, 18, 53, 47, 76, 124, 108, 89, 123, 108, 119, 107, 81, 122, 63,
+	13, 5, 16, 27, 46, 36, 61, 51, 42, 70, 52, 83, 65, 41, 59, 36,
+	19, 17, 15, 24, 41, 34, 59, 48, 40, 64, 50, 78, 62, 80, 56, 33,
+	29, 28, 25, 43, 39, 63, 55, 93, 76, 59, 93, 72, 54, 75, 50, 29,
+	52, 22, 42, 40, 67, 57, 95, 79, 72, 57, 89, 69, 49, 66, 46, 27,
+	77, 37, 35, 66, 58, 52, 91, 74, 62, 48, 79, 63, 90, 62, 40, 38,
+	125, 32, 60, 56, 50, 92, 78, 65, 55, 87, 71, 51, 73, 51, 70, 30,
+	109, 53, 49, 94, 88, 75, 66, 122, 91, 73, 56, 42, 64, 44, 21, 25,
+	90, 43, 41, 77, 73, 63, 56, 92, 77, 66, 47, 67, 48, 53, 36, 20,
+	71, 34, 67, 60, 58, 49, 88, 76, 67, 106, 71, 54, 38, 39, 23, 15,
+	109, 53, 51, 47, 90, 82, 58, 57, 48, 72, 57, 41, 23, 27, 62, 9,
+	86, 42, 40, 37, 70, 64, 52, 43, 70, 55, 42, 25, 29, 18, 11, 11,
+	118, 68, 30, 55, 50, 46, 74, 65, 49, 39, 24, 16, 22, 13, 14, 7,
+	91, 44, 39, 38, 34, 63, 52, 45, 31, 52, 28, 19, 14, 8, 9, 3,
+	123, 60, 58, 53, 47, 43, 32, 22, 37, 24, 17, 12, 15, 10, 2, 1,
+	71, 37, 34, 30, 28, 20, 17, 26, 21, 16, 10, 6, 8, 6, 2, 0 };
+static const unsigned char lengths15[256] = {
+	3, 4, 5, 7, 7, 8, 9, 9, 9, 10, 10, 11, 11, 11, 12, 13,
+	4, 3, 5, 6, 7, 7, 8, 8, 8, 9, 9, 10, 10, 10, 11, 11,
+	5, 5, 5, 6, 7, 7, 8, 8, 8, 9, 9, 10, 10, 11, 11, 11,
+	6, 6, 6, 7, 7, 8, 8, 9, 9, 9, 10, 10, 10, 11, 11, 11,
+	7, 6, 7, 7, 8, 8, 9, 9, 9, 9, 10, 10, 10, 11, 11, 11,
+	8, 7, 7, 8, 8, 8, 9, 9, 9, 9, 10, 10, 11, 11, 11, 12,
+	9, 7, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 11, 11, 12, 12,
+	9, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 10, 11, 11, 11, 12,
+	9, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 12, 12, 12,
+	9, 8, 9, 9, 9, 9, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12,
+	10, 9, 9, 9, 10, 10, 10, 10, 10, 11, 11, 11, 11, 12, 13, 12,
+	10, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 13,
+	11, 10, 9, 10, 10, 10, 11, 11, 11, 11, 11, 11, 12, 12, 13, 13,
+	11, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 12, 13, 13,
+	12, 11, 11, 11, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 12, 13,
+	12, 11, 11, 11, 11, 11, 11, 12, 12, 12, 12, 12, 13, 13, 13, 13 };
+
+static const unsigned short codes16[256] = {
+	1, 5, 14, 44, 74, 63, 110, 93, 172, 149, 138, 242, 225, 195, 376, 17,
+	3, 4, 12, 20, 35, 62, 53, 47, 83, 75, 68, 119, 201, 107, 207, 9,
+	15, 13, 23, 38, 67, 58, 103, 90, 161, 72, 127, 117, 110, 209, 206, 16,
+	45, 21, 39, 69, 64, 114, 99, 87, 158, 140, 252, 212, 199, 387, 365, 26,
+	75, 36, 68, 65, 115, 101, 179, 164, 155, 264, 246, 226, 395, 382, 362, 9,
+	66, 30, 59, 56, 102, 185, 173, 265, 142, 253, 232, 400, 388, 378, 445, 16,
+	111, 54, 52, 100, 184, 178, 160, 133, 257, 244, 228, 217, 385, 366, 715, 10,
+	98, 48, 91, 88, 165, 157, 148, 261, 248, 407, 397, 372, 380, 889, 884, 8,
+	85, 84, 81, 159, 156, 143, 260, 249, 427, 401, 392, 383, 727, 713, 708, 7,
+	154, 76, 73, 141, 131, 256, 245, 426, 406, 394, 384, 735, 359, 710, 352, 11,
+	139, 129, 67, 125, 247, 233, 229, 219, 393, 743, 737, 720, 885, 882, 439, 4,
+	243, 120, 118, 115, 227, 223, 396, 746, 742, 736, 721, 712, 706, 223, 436, 6,
+	202, 224, 222, 218, 216, 389, 386, 381, 364, 888, 443, 707, 440, 437, 1728, 4,
+	747, 211, 210, 208, 370, 379, 734, 723, 714, 1735, 883, 877, 876, 3459, 865, 2,
+	377, 369, 102, 187, 726, 722, 358, 711, 709, 866, 1734, 871, 3458, 870, 434, 0,
+	12, 10, 7, 11, 10, 17, 11, 9, 13, 12, 10, 7, 5, 3, 1, 3 };
+static const unsigned char lengths16[256] = {
+	1, 4, 6, 8, 9, 9, 10, 10, 11, 11, 11, 12, 12, 12, 13, 9,
+	3, 4, 6, 7, 8, 9, 9, 9, 10, 10, 10, 11, 12, 11, 12, 8,
+	6, 6, 7, 8, 9, 9, 10, 10, 11, 10, 11, 11, 11, 12, 12, 9,
+	8, 7, 8, 9, 9, 10, 10, 10, 11, 11, 12, 12, 12, 13, 13, 10,
+	9, 8, 9, 9, 10, 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 9,
+	9, 8, 9, 9, 10, 11, 11, 12, 11, 12, 12, 13, 13, 13, 14, 10,
+	10, 9, 9, 10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 14, 10,
+	10, 9, 10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 13, 15, 15, 10,
+	10, 10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 13, 14, 14, 14, 10,
+	11, 10, 10, 11, 11, 12, 12, 13, 13, 13, 13, 14, 13, 14, 13, 11,
+	11, 11, 10, 11, 12, 12, 12, 12, 13, 14, 14, 14, 15, 15, 14, 10,
+	12, 11, 11, 11, 12, 12, 13, 14, 14, 14, 14, 14, 14, 13, 14, 11,
+	12, 12, 12, 12, 12, 13, 13, 13, 13, 15, 14, 14, 14, 14, 16, 11,
+	14, 12, 12, 12, 13, 13, 14, 14, 14, 16, 15, 15, 15, 17, 15, 11,
+	13, 13, 11, 12, 14, 14, 13, 14, 14, 15, 16, 15, 17, 15, 14, 11,
+	9, 8, 8, 9, 9, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 8 };
+
+static const unsigned short codes24[256] = {
+	15, 13, 46, 80, 146, 262, 248, 434, 426, 669, 653, 649, 621, 517, 1032, 88,
+	14, 12, 21, 38, 71, 130, 122, 216, 209, 198, 327, 345, 319, 297, 279, 42,
+	47, 22, 41, 74, 68, 128, 120, 221, 207, 194, 182, 340, 315, 295, 541, 18,
+	81, 39, 75, 70, 134, 125, 116, 220, 204, 190, 178, 325, 311, 293, 271, 16,
+	147, 72, 69, 135, 127, 118, 112, 210, 200, 188, 352, 323, 306, 285, 540, 14,
+	263, 66, 129, 126, 119, 114, 214, 202, 192, 180, 341, 317, 301, 281, 262, 12,
+	249, 123, 121, 117, 113, 215, 206, 195, 185, 347, 330, 308, 291, 272, 520, 10,
+	435, 115, 111, 109, 211, 203, 196, 187, 353, 332, 313, 298, 283, 531, 381, 17,
+	427, 212, 208, 205, 201, 193, 186, 177, 169, 320, 303, 286, 268, 514, 377, 16,
+	335, 199, 197, 191, 189, 181, 174, 333, 321, 305, 289, 275, 521, 379, 371, 11,
+	668, 184, 183, 179, 175, 344, 331, 314, 304, 290, 277, 530, 383, 373, 366, 10,
+	652, 346, 171, 168, 164, 318, 309, 299, 287, 276, 263, 513, 375, 368, 362, 6,
+	648, 322, 316, 312, 307, 302, 292, 284, 269, 261, 512, 376, 370, 364, 359, 4,
+	620, 300, 296, 294, 288, 282, 273, 266, 515, 380, 374, 369, 365, 361, 357, 2,
+	1033, 280, 278, 274, 267, 264, 259, 382, 378, 372, 367, 363, 360, 358, 356, 0,
+	43, 20, 19, 17, 15, 13, 11, 9, 7, 6, 4, 7, 5, 3, 1, 3 };
+static const unsigned char lengths24[256] = {
+	4, 4, 6, 7, 8, 9, 9, 10, 10, 11, 11, 11, 11, 11, 12, 9,
+	4, 4, 5, 6, 7, 8, 8, 9, 9, 9, 10, 10, 10, 10, 10, 8,
+	6, 5, 6, 7, 7, 8, 8, 9, 9, 9, 9, 10, 10, 10, 11, 7,
+	7, 6, 7, 7, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 7,
+	8, 7, 7, 8, 8, 8, 8, 9, 9, 9, 10, 10, 10, 10, 11, 7,
+	9, 7, 8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 10, 7,
+	9, 8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 10, 11, 7,
+	10, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 10, 11, 11, 8,
+	10, 9, 9, 9, 9, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 8,
+	10, 9, 9, 9, 9, 9, 9, 10, 10, 10, 10, 10, 11, 11, 11, 8,
+	11, 9, 9, 9, 9, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 8,
+	11, 10, 9, 9, 9, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 8,
+	11, 10, 10, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 8,
+	11, 10, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 8,
+	12, 10, 10, 10, 10, 10, 10, 11, 11, 11, 11, 11, 11, 11, 11, 8,
+	8, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 4 };
+
+static const unsigned char quad_codes[16] = { 1, 5, 4, 5, 6, 5, 4, 4, 7, 3, 6, 0, 7, 2, 3, 1 };
+static const unsigned char quad_lengths[16] = { 1, 4, 4, 5, 4, 6, 5, 6, 4, 5, 5, 6, 5, 6, 6, 6 };
+
+
+static const huffman_table_t huffman_tables[32] = {
+	{  0,  0, NULL,    NULL      },
+	{  2,  0, codes1,  lengths1  },
+	{  3,  0, codes2,  lengths2  },
+	{  3,  0, codes3,  lengths3  },
+	{  0,  0, NULL,    NULL      },
+	{  4,  0, codes5,  lengths5  },
+	{  4,  0, codes6,  lengths6  },
+	{  6,  0, codes7,  lengths7  },
+	{  6,  0, codes8,  lengths8  },
+	{  6,  0, codes9,  lengths9  },
+	{  8,  0, codes10, lengths10 },
+	{  8,  0, codes11, lengths11 },
+	{  8,  0, codes12, lengths12 },
+	{ 16,  0, codes13, lengths13 },
+	{  0,  0, NULL,    NULL      },
+	{ 16,  0, codes15, lengths15 },
+	{ 16,  1, codes16, lengths16 },
+	{ 16,  2, codes16, lengths16 },
+	{ 16,  3, codes16, lengths16 },
+	{ 16,  4, codes16, lengths16 },
+	{ 16,  6, codes16, lengths16 },
+	{ 16,  8, codes16, lengths16 },
+	{ 16, 10, codes16, lengths16 },
+	{ 16, 13, codes16, lengths16 },
+	{ 16,  4, codes24, lengths24 },
+	{ 16,  5, codes24, lengths24 },
+	{ 16,  6, codes24, lengths24 },
+	{ 16,  7, codes24, lengths24 },
+	{ 16,  8, codes24, lengths24 },
+	{ 16,  9, codes24, lengths24 },
+	{ 16, 11, codes24, lengths24 },
+	{ 16, 13, codes24, lengths24 } };
+
+
+/* Fills the tables of a stream. The analysis window C[i] of the standard is
+   symmetric around i = 256 apart from its signs, which change every 64
+   coefficients. */
+static void build_tables(mp3lite_stream_t *stream)
+{
+	double h, c;
+	int n, k;
+
+	for(n = 0; n < 512; ++n)
+	{
+		h = window_base[(n <= 256) ? n : 512 - n] / 65536.0;
+		if((n / 64) & 1)
+			h = -h;	// absorbs the sign of the modulation every 64 samples
+		stream->window[511 - n] = (short)floor(h / 32.0 * 524288.0 + 0.5);
+	}
+
+	for(n = 0; n < SUBBANDS; ++n)
+		for(k = 0; k < 64; ++k)
+			stream->matrix[n][63 - k] =
+				(short)floor(cos((2*n + 1)*(k - 16)*PI/64.0) * 16384.0 + 0.5);
+
+	for(k = 0; k < 18; ++k)
+		for(n = 0; n < 36; ++n)
+			stream->mdct[k][n] = (float)( sin(PI/36.0*(n + 0.5)) *
+				cos(PI/72.0*(2*n + 19)*(2*k + 1)) / 9.0 );
+
+	for(k = 0; k < 8; ++k)
+	{
+		c = sqrt(1.0 + alias_c[k]*alias_c[k]);
+		stream->alias_cs[k] = (int)floor(32768.0 / c + 0.5);
+		stream->alias_ca[k] = (int)floor(32768.0 * alias_c[k] / c + 0.5);
+	}
+
+	for(n = 0; n <= STEP_MAX - STEP_MIN; ++n)
+		stream->steps[n] = (float)pow(2.0, -0.1875 * (n + STEP_MIN));
+	for(n = 0; n <= IX_MAX; ++n)
+		stream->levels[n] = (float)pow((double)n, 4.0/3.0);
+}
+
+/* Windows 512 input samples, newest last, into 64 partial sums (Q4). */
+static void window_scalar(const mp3lite_stream_t *stream, const short *input, short *y)
+{
+	int q, r, sum;
+
+	for(q = 0; q < 64; ++q)
+	{
+		sum = 0;
+		for(r = 0; r < 512; r += 64)
+			sum += input[q + r] * stream->window[q + r];
+		sum >>= 15;
+		y[q] = (short)((sum > 32767) ? 32767 : (sum < -32768) ? -32768 : sum);
+	}
+}
+
+static void window_sse2(const mp3lite_stream_t *stream, const short *input, short *y)
+{
+	__m128i samples, coefficients, low, high, sum_low, sum_high;
+	int q, r;
+
+	for(q = 0; q < 64; q += 8)
+	{
+		sum_low = sum_high = _mm_setzero_si128();
+		for(r = 0; r < 512; r += 64)
+		{
+			samples      = _mm_loadu_si128((const __m128i*)(input + q + r));
+			coefficients = _mm_loadu_si128((const __m128i*)(stream->window + q + r));
+			low  = _mm_mullo_epi16(samples, coefficients);
+			high = _mm_mulhi_epi16(samples, coefficients);
+			sum_low  = _mm_add_epi32(sum_low,  _mm_unpacklo_epi16(low, high));
+			sum_high = _mm_add_epi32(sum_high, _mm_unpackhi_epi16(low, high));
+		}
+		_mm_storeu_si128( (__m128i*)(y + q),
+		                  _mm_packs_epi32( _mm_srai_epi32(sum_low, 15),
+		                                   _mm_srai_epi32(sum_high, 15) ) );
+	}
+}
+
+/* Computes the 32 subband samples (Q12) from the partial sums. */
+static void matrix_scalar(const mp3lite_stream_t *stream, const short *y, int *subband)
+{
+	int n, k, sum;
+
+	for(n = 0; n < SUBBANDS; ++n)
+	{
+		sum = 0;
+		for(k = 0; k < 64; k += 2)
+			sum += ( stream->matrix[n][k]*y[k] + stream->matrix[n][k + 1]*y[k + 1] ) >> 6;
+		subband[n] = sum;
+	}
+}
+
+static void matrix_sse2(const mp3lite_stream_t *stream, const short *y, int *subband)
+{
+	__m128i sum;
+	int n, k, lanes[4];
+
+	for(n = 0; n < SUBBANDS; ++n)
+	{
+		sum = _mm_setzero_si128();
+		for(k = 0; k < 64; k += 8)
+			sum = _mm_add_epi32( sum, _mm_srai_epi32( _mm_madd_epi16(
+				_mm_loadu_si128((const __m128i*)(stream->matrix[n] + k)),
+				_mm_loadu_si128((const __m128i*)(y + k)) ), 6 ) );
+		_mm_storeu_si128((__m128i*)lanes, sum);
+		subband[n] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+}
+
+/* Computes the 18 MDCT lines of each subband from its last 36 samples (the
+   last and the current granule). */
+static void mdct_scalar(const mp3lite_stream_t *stream, float (*x)[SUBBANDS], int *xr)
+{
+	float sum;
+	int n, k, t;
+
+	for(n = 0; n < SUBBANDS; ++n)
+		for(k = 0; k < 18; ++k)
+		{
+			sum = 0.0f;
+			for(t = 0; t < 36; ++t)
+				sum += x[t][n] * stream->mdct[k][t];
+			sum = (sum > XR_LIMIT) ? XR_LIMIT : (sum < -XR_LIMIT) ? -XR_LIMIT : sum;
+			xr[n*18 + k] = (int)floor(sum + 0.5);
+		}
+}
+
+/* Likewise, for four neighbouring subbands at a time. */
+static void mdct_sse2(const mp3lite_stream_t *stream, float (*x)[SUBBANDS], int *xr)
+{
+	__m128 sum, limit = _mm_set1_ps(XR_LIMIT), bottom = _mm_set1_ps(-XR_LIMIT);
+	int n, k, t, lanes[4];
+
+	for(n = 0; n < SUBBANDS; n += 4)
+		for(k = 0; k < 18; ++k)
+		{
+			sum = _mm_setzero_ps();
+			for(t = 0; t < 36; ++t)
+				sum = _mm_add_ps( sum, _mm_mul_ps( _mm_loadu_ps(x[t] + n),
+				                                   _mm_set1_ps(stream->mdct[k][t]) ) );
+			sum = _mm_max_ps(_mm_min_ps(sum, limit), bottom);
+			_mm_storeu_si128((__m128i*)lanes, _mm_cvtps_epi32(sum));
+			xr[n*18 + k]       = lanes[0];
+			xr[(n + 1)*18 + k] = lanes[1];
+			xr[(n + 2)*18 + k] = lanes[2];
+			xr[(n + 3)*18 + k] = lanes[3];
+		}
+}
+
+/* Runs the filterbank and MDCT over the granule in the input buffer of a
+   channel, leaving the MDCT lines in xr. */
+static void transform(mp3lite_stream_t *stream, unsigned channel)
+{
+	short y[64];
+	int subband[18][SUBBANDS];
+	float x[36][SUBBANDS];
+	int *xr = stream->xr[channel];
+	int t, n, k, a, b;
+
+	for(t = 0; t < 18; ++t)
+	{
+		if(stream->use_sse2)
+		{
+			window_sse2(stream, stream->input[channel] + t*SUBBANDS, y);
+			matrix_sse2(stream, y, subband[t]);
+		}
+		else
+		{
+			window_scalar(stream, stream->input[channel] + t*SUBBANDS, y);
+			matrix_scalar(stream, y, subband[t]);
+		}
+	}
+	memmove( stream->input[channel], stream->input[channel] + GRANULE_SIZE,
+	         HISTORY_SIZE * sizeof(short) );
+
+	// Undo the frequency inversion of the odd subbands
+	for(t = 1; t < 18; t += 2)
+		for(n = 1; n < SUBBANDS; n += 2)
+			subband[t][n] = -subband[t][n];
+
+	// MDCT over the last and the current granule
+	memcpy(x, stream->subband[channel], sizeof(stream->subband[channel]));
+	for(t = 0; t < 18; ++t)
+		for(n = 0; n < SUBBANDS; ++n)
+			x[18 + t][n] = (float)subband[t][n];
+	memcpy(stream->subband[channel], x[18], sizeof(stream->subband[channel]));
+	if(stream->use_sse2)
+		mdct_sse2(stream, x, xr);
+	else
+		mdct_scalar(stream, x, xr);
+
+	// Alias reduction between neighbouring subbands
+	for(n = 1; n < SUBBANDS; ++n)
+		for(k = 0; k < 8; ++k)
+		{
+			a = xr[n*18 - 1 - k];
+			b = xr[n*18 + k];
+			xr[n*18 - 1 - k] = (int)( ( (__int64)a * stream->alias_cs[k] +
+			                            (__int64)b * stream->alias_ca[k] ) >> 15 );
+			xr[n*18 + k]     = (int)( ( (__int64)b * stream->alias_cs[k] -
+			                            (__int64)a * stream->alias_ca[k] ) >> 15 );
+		}
+}
+
+static void put_bits(bits_t *bits, unsigned value, unsigned count)
+{
+	while(count-- > 0)
+	{
+		if(value & (1u << count))
+			bits->data[bits->pos >> 3] |= (unsigned char)(0x80 >> (bits->pos & 7));
+		++bits->pos;
+	}
+}
+
+/* Returns the number of bits of the pairs of quantized lines from 'start' to
+   'end' with the given table, and writes them if 'bits' is not NULL. */
+static unsigned code_pairs( const int *ix, unsigned start, unsigned end, unsigned table,
+                            bits_t *bits )
+{
+	const huffman_table_t *huffman = &huffman_tables[table];
+	unsigned escape = (huffman->linbits > 0) ? 15 : 16;
+	unsigned size = 0, i, x, y, v;
+
+	for(i = start; i < end && huffman->size > 0; i += 2)
+	{
+		x = (ix[i]     < 0) ? -ix[i]     : ix[i];
+		y = (ix[i + 1] < 0) ? -ix[i + 1] : ix[i + 1];
+		v = ((x < escape) ? x : 15)*huffman->size + ((y < escape) ? y : 15);
+		size += huffman->lengths[v] + (x != 0) + (y != 0) +
+		        huffman->linbits*((x >= escape) + (y >= escape));
+		if(bits)
+		{
+			put_bits(bits, huffman->codes[v], huffman->lengths[v]);
+			if(x >= escape)
+				put_bits(bits, x - 15, huffman->linbits);
+			if(x != 0)
+				put_bits(bits, ix[i] < 0, 1);
+			if(y >= escape)
+				put_bits(bits, y - 15, huffman->linbits);
+			if(y != 0)
+				put_bits(bits, ix[i + 1] < 0, 1);
+		}
+	}
+	return size;
+}
+
+/* Likewise for the quadruples of values up to 1 from 'start' to 'end', with
+   count1 table A or (if 'table_b' is set) B. */
+static unsigned code_quads( const int *ix, unsigned start, unsigned end, int table_b,
+                            bits_t *bits )
+{
+	unsigned size = 0, i, n, v, length;
+
+	for(i = start; i < end; i += 4)
+	{
+		v = ((ix[i] != 0) << 3) | ((ix[i + 1] != 0) << 2) |
+		    ((ix[i + 2] != 0) << 1) | (ix[i + 3] != 0);
+		length = table_b ? 4 : quad_lengths[v];
+		size += length + (ix[i] != 0) + (ix[i + 1] != 0) + (ix[i + 2] != 0) + (ix[i + 3] != 0);
+		if(bits)
+		{
+			put_bits(bits, table_b ? (~v & 15) : quad_codes[v], length);
+			for(n = 0; n < 4; ++n)
+				if(ix[i + n] != 0)
+					put_bits(bits, ix[i + n] < 0, 1);
+		}
+	}
+	return size;
+}
+
+/* Returns the table that codes the pairs from 'start' to 'end' in the fewest
+   bits, and those bits in 'size'. */
+static unsigned choose_table(const int *ix, unsigned start, unsigned end, unsigned *size)
+{
+	// Tables by the largest value they code without linbits
+	static const unsigned char candidates[6][3] = {
+		{ 1, 0, 0 }, { 2, 3, 0 }, { 5, 6, 0 }, { 7, 8, 9 }, { 10, 11, 12 }, { 13, 15, 0 } };
+	static const unsigned limits[6] = { 1, 2, 3, 5, 7, 15 };
+	unsigned peak = 0, i, table, best = 0, bits;
+
+	for(i = start; i < end; ++i)
+		if((unsigned)((ix[i] < 0) ? -ix[i] : ix[i]) > peak)
+			peak = (ix[i] < 0) ? -ix[i] : ix[i];
+	*size = 0;
+	if(peak == 0)
+		return 0;
+
+	if(peak <= 15)
+	{
+		for(table = 0; limits[table] < peak; ++table) { }
+		for(i = 0; i < 3 && candidates[table][i] != 0; ++i)
+		{
+			bits = code_pairs(ix, start, end, candidates[table][i], NULL);
+			if(i == 0 || bits < *size)
+			{
+				best = candidates[table][i];
+				*size = bits;
+			}
+		}
+		return best;
+	}
+
+	// Larger values: the variants of tables 16 and 24 with the fewest
+	// linbits that reach the peak
+	for(table = 16; peak - 15 >= (1u << huffman_tables[table].linbits); ++table) { }
+	best = table;
+	*size = code_pairs(ix, start, end, table, NULL);
+	for(table = 24; peak - 15 >= (1u << huffman_tables[table].linbits); ++table) { }
+	if((bits = code_pairs(ix, start, end, table, NULL)) < *size)
+	{
+		best = table;
+		*size = bits;
+	}
+	return best;
+}
+
+/* Returns where the second and third big value regions of a granule start
+   (region0_count and region1_count count scalefactor bands, less one). */
+static void region_bounds( const mp3lite_stream_t *stream, const granule_t *granule,
+                           unsigned *region1, unsigned *region2 )
+{
+	unsigned big_end = 2*granule->big_values;
+
+	*region1 = stream->bands[granule->region0_count + 1];
+	*region2 = stream->bands[granule->region0_count + granule->region1_count + 2];
+	if(*region1 > big_end)
+		*region1 = big_end;
+	if(*region2 > big_end)
+		*region2 = big_end;
+}
+
+/* Partitions the quantized lines into big values, count1 and zero regions,
+   picks the Huffman tables and returns the number of bits needed. */
+static unsigned count_lines(const mp3lite_stream_t *stream, granule_t *granule)
+{
+	const int *ix = stream->ix;
+	unsigned i, end, region1, region2, size, other;
+
+	for(i = GRANULE_SIZE; i > 1 && ix[i - 1] == 0 && ix[i - 2] == 0; i -= 2) { }
+	end = i;
+	for(; i > 3 && ix[i - 1] >= -1 && ix[i - 1] <= 1 && ix[i - 2] >= -1 && ix[i - 2] <= 1 &&
+	               ix[i - 3] >= -1 && ix[i - 3] <= 1 && ix[i - 4] >= -1 && ix[i - 4] <= 1;
+	      i -= 4) { }
+	granule->big_values = i/2;
+	granule->count1 = (end - i)/4;
+
+	// Each of the three regions of big values gets its own table; their
+	// bounds are fixed at scalefactor bands 8 and 16
+	granule->region0_count = 7;
+	granule->region1_count = 7;
+	region_bounds(stream, granule, &region1, &region2);
+	granule->table_select[0] = choose_table(ix, 0, region1, &size);
+	granule->table_select[1] = choose_table(ix, region1, region2, &other);
+	size += other;
+	granule->table_select[2] = choose_table(ix, region2, i, &other);
+	size += other;
+
+	other = code_quads(ix, i, end, 1, NULL);
+	granule->count1_table = (other < code_quads(ix, i, end, 0, NULL));
+	return size + code_quads(ix, i, end, granule->count1_table, NULL);
+}
+
+/* Quantizes the lines of a channel with the given global gain and the
+   stream's scalefactors. Returns non-zero if a value exceeds IX_MAX. */
+static int quantize_lines(mp3lite_stream_t *stream, const int *xr, int gain)
+{
+	int *ix = stream->ix;
+	unsigned b, i;
+	float scale, value;
+
+	for(b = 0; b < BANDS; ++b)
+	{
+		scale = stream->steps[gain - GAIN_OFFSET - 4*stream->scalefac[b] - STEP_MIN];
+		for(i = stream->bands[b]; i < (unsigned)stream->bands[b + 1]; ++i)
+		{
+			value = stream->xr34[i] * scale;
+			if(value > IX_MAX)
+				return -1;
+			ix[i] = (int)(value + 0.4054f);
+			if(xr[i] < 0)
+				ix[i] = -ix[i];
+		}
+	}
+	return 0;
+}
+
+/* Picks the scalefac_compress that holds the stream's scalefactors in the
+   fewest bits; returns those bits. */
+static unsigned scalefactor_bits(const mp3lite_stream_t *stream, granule_t *granule)
+{
+	unsigned b, max_low = 0, max_high = 0, compress, part2 = ~0u;
+
+	for(b = 0; b < BANDS - 1; ++b)
+		if(b < 11 && stream->scalefac[b] > max_low)
+			max_low = stream->scalefac[b];
+		else if(b >= 11 && stream->scalefac[b] > max_high)
+			max_high = stream->scalefac[b];
+	for(compress = 0; compress < 16; ++compress)
+		if( max_low < (1u << slen1[compress]) && max_high < (1u << slen2[compress]) &&
+			11*slen1[compress] + 10*slen2[compress] < part2 )
+		{
+			granule->scalefac_compress = compress;
+			part2 = 11*slen1[compress] + 10*slen2[compress];
+		}
+	return part2;
+}
+
+/* Returns non-zero if the lines of a channel fit in 'budget' bits with the
+   given global gain, leaving them quantized in ix. */
+static int fits( mp3lite_stream_t *stream, const int *xr, granule_t *granule, unsigned part2,
+                 unsigned budget, int gain )
+{
+	return quantize_lines(stream, xr, gain) == 0 &&
+	       part2 + count_lines(stream, granule) <= budget;
+}
+
+/* The rate loop: finds the finest global gain, from 'low' up, at which the
+   lines of a channel fit in 'budget' bits with the stream's scalefactors,
+   leaving them in ix and the side information in 'granule'. Returns the bits
+   used, or ~0u if they do not fit even with the coarsest step. */
+static unsigned rate_loop( mp3lite_stream_t *stream, const int *xr, granule_t *granule,
+                           unsigned part2, unsigned budget, int low )
+{
+	int high = 256, gain = -1;
+
+	// After amplifying scalefactors by a step, the gain of the last pass
+	// plus 4 quantizes the other bands more coarsely and the amplified ones
+	// as before, so it usually fits
+	if(low > 0 && low + 4 < high)
+	{
+		if(fits(stream, xr, granule, part2, budget, gain = low + 4))
+			high = gain;
+		else
+			low = gain + 1;
+	}
+
+	// The bits needed fall as the gain rises
+	while(low < high)
+	{
+		gain = (low + high) / 2;
+		if(fits(stream, xr, granule, part2, budget, gain))
+			high = gain;
+		else
+			low = gain + 1;
+	}
+	if(high > 255)
+		return ~0u;
+
+	if(gain != high)
+		fits(stream, xr, granule, part2, budget, high);
+	granule->global_gain = high;
+	granule->part2_3_length = part2 + count_lines(stream, granule);
+	return granule->part2_3_length;
+}
+
+/* Quantizes the MDCT lines of a channel so that they fit in 'budget' bits,
+   filling the side information and scalefactors. Each pass runs the rate
+   loop, then amplifies the bands whose noise is above what they may have;
+   the pass with the least noise relative to that is kept. Returns the bits
+   used. */
+static unsigned quantize(mp3lite_stream_t *stream, unsigned channel, granule_t *granule, unsigned budget)
+{
+	const int *xr = stream->xr[channel];
+	int best_ix[GRANULE_SIZE];
+	unsigned char best_scalefac[BANDS], over[BANDS];
+	granule_t best;
+	double allowed[BANDS], x, energy, noise, step, worst, least = 0.0;
+	unsigned b, i, pass, part2, size, used = ~0u, limit, amplified;
+
+	// Lines to the power of 3/4 (none above the cutoff), and the noise each
+	// band may have
+	for(b = 0; b < BANDS; ++b)
+	{
+		energy = 0.0;
+		for(i = stream->bands[b]; i < (unsigned)stream->bands[b + 1]; ++i)
+		{
+			x = (i < stream->cutoff) ? fabs((double)xr[i]) / 134217728.0 : 0.0;
+			stream->xr34[i] = (float)sqrt(x * sqrt(x));
+			energy += x*x;
+		}
+		allowed[b] = energy*NOISE_RATIO + NOISE_FLOOR*(stream->bands[b + 1] - stream->bands[b]);
+	}
+
+	memset(granule, 0, sizeof(*granule));
+	memset(stream->scalefac, 0, sizeof(stream->scalefac));
+	for(pass = 0; pass < OUTER_MAX; ++pass)
+	{
+		part2 = scalefactor_bits(stream, granule);
+		size = rate_loop( stream, xr, granule, part2, budget,
+		                  (pass > 0) ? (int)granule->global_gain : 0 );
+		if(size == ~0u)
+			break;
+
+		// Measure the noise of each band against what it may have
+		worst = 0.0;
+		for(b = 0; b < BANDS; ++b)
+		{
+			step = pow(2.0, ( (int)granule->global_gain - GAIN_OFFSET -
+			                  4*stream->scalefac[b] ) / 4.0);
+			noise = 0.0;
+			for(i = stream->bands[b]; i < (unsigned)stream->bands[b + 1] && i < stream->cutoff; ++i)
+			{
+				x = fabs((double)xr[i]) / 134217728.0 -
+				    stream->levels[(stream->ix[i] < 0) ? -stream->ix[i] : stream->ix[i]] * step;
+				noise += x*x;
+			}
+			over[b] = (noise > allowed[b]);
+			if(noise / allowed[b] > worst)
+				worst = noise / allowed[b];
+		}
+		if(used == ~0u || worst < least)
+		{
+			memcpy(best_ix, stream->ix, sizeof(best_ix));
+			memcpy(best_scalefac, stream->scalefac, sizeof(best_scalefac));
+			memcpy(&best, granule, sizeof(best));
+			least = worst;
+			used = size;
+		}
+		if(worst <= 1.0)
+			break;
+
+		// Amplify the bands over their noise, while the scalefactors reach
+		// (15 for bands 0-10, 7 for bands 11-20, none above) and some band
+		// stays as it was
+		amplified = 0;
+		for(b = 0; b < BANDS - 1; ++b)
+		{
+			limit = (b < 11) ? 15 : 7;
+			if(over[b] && stream->scalefac[b] == limit)
+				break;
+			if(over[b])
+				++stream->scalefac[b];
+			if(stream->scalefac[b] > 0)
+				++amplified;
+		}
+		if(b < BANDS - 1 || amplified == BANDS - 1)
+			break;
+	}
+
+	if(used == ~0u)
+	{
+		// Cannot fit even at the coarsest step; send silence
+		memset(stream->ix, 0, GRANULE_SIZE * sizeof(int));
+		memset(stream->scalefac, 0, sizeof(stream->scalefac));
+		memset(granule, 0, sizeof(*granule));
+		granule->global_gain = GAIN_OFFSET;
+		return 0;
+	}
+
+	memcpy(stream->ix, best_ix, sizeof(best_ix));
+	memcpy(stream->scalefac, best_scalefac, sizeof(best_scalefac));
+	memcpy(granule, &best, sizeof(best));
+	return used;
+}
+
+/* Writes the scalefactors and lines of a granule to the main data. */
+static void write_granule(const mp3lite_stream_t *stream, const granule_t *granule, bits_t *bits)
+{
+	unsigned b, big_end = 2*granule->big_values, region1, region2;
+
+	for(b = 0; b < BANDS - 1; ++b)
+		put_bits( bits, stream->scalefac[b],
+		          (b < 11) ? slen1[granule->scalefac_compress] : slen2[granule->scalefac_compress] );
+	region_bounds(stream, granule, &region1, &region2);
+	code_pairs(stream->ix, 0, region1, granule->table_select[0], bits);
+	code_pairs(stream->ix, region1, region2, granule->table_select[1], bits);
+	code_pairs(stream->ix, region2, big_end, granule->table_select[2], bits);
+	code_quads( stream->ix, big_end, big_end + 4*granule->count1, granule->count1_table,
+	            bits );
+}
+
+static unsigned encode_frame( mp3lite_stream_t *stream, const short *samples, unsigned count,
+                              char *output )
+{
+	unsigned char main_data[MP3_MAX_FRAME_SIZE];
+	granule_t granules[2][2];
+	bits_t bits, side;
+	unsigned frame_bytes = stream->frame_bytes, padding = 0, budget, used = 0;
+	unsigned gr, ch, i, left;
+	int l, r;
+	__int64 sum, difference;
+
+	// Pad a frame now and then to keep the exact bitrate
+	stream->padding_rest += stream->padding_step;
+	if(stream->padding_rest >= stream->format.sampling_rate)
+	{
+		stream->padding_rest -= stream->format.sampling_rate;
+		padding = 1;
+		++frame_bytes;
+	}
+
+	memset(main_data, 0, sizeof(main_data));
+	bits.data = main_data;
+	bits.pos = 0;
+	left = (frame_bytes - 4 - stream->side_bytes) * 8;
+
+	for(gr = 0; gr < 2; ++gr)
+	{
+		for(ch = 0; ch < stream->channels; ++ch)
+		{
+			for(i = 0; i < GRANULE_SIZE; ++i)
+				stream->input[ch][HISTORY_SIZE + i] = (gr*GRANULE_SIZE + i < count) ?
+					samples[(gr*GRANULE_SIZE + i)*stream->channels + ch] : 0;
+			transform(stream, ch);
+		}
+
+		if(stream->mode == MODE_JOINT)
+			for(i = 0; i < GRANULE_SIZE; ++i)
+			{
+				// Mid and side, each scaled by 1/sqrt(2)
+				sum        = (__int64)stream->xr[0][i] + stream->xr[1][i];
+				difference = (__int64)stream->xr[0][i] - stream->xr[1][i];
+				l = (int)((sum * 23170) >> 15);
+				r = (int)((difference * 23170) >> 15);
+				stream->xr[0][i] = l;
+				stream->xr[1][i] = r;
+			}
+
+		for(ch = 0; ch < stream->channels; ++ch)
+		{
+			// Share the bits left evenly among the granules left
+			budget = left / ((2 - gr)*stream->channels - ch);
+			if(budget > 4095)
+				budget = 4095;
+			used = quantize(stream, ch, &granules[gr][ch], budget);
+			write_granule(stream, &granules[gr][ch], &bits);
+			left -= used;
+		}
+	}
+
+	// Header: MPEG-1 Layer III without CRC
+	memset(output, 0, frame_bytes);
+	side.data = (unsigned char*)output;
+	side.pos = 0;
+	put_bits(&side, 0x7FF, 11);
+	put_bits(&side, 3, 2);		// MPEG-1
+	put_bits(&side, 1, 2);		// Layer III
+	put_bits(&side, 1, 1);		// no CRC
+	put_bits(&side, stream->bitrate_index, 4);
+	put_bits(&side, stream->sampling_index, 2);
+	put_bits(&side, padding, 1);
+	put_bits(&side, 0, 1);		// private
+	put_bits(&side, stream->mode, 2);
+	put_bits(&side, (stream->mode == MODE_JOINT) ? 2 : 0, 2);	// mid/side on
+	put_bits(&side, 0, 1);		// not copyrighted
+	put_bits(&side, 1, 1);		// original
+	put_bits(&side, 0, 2);		// no emphasis
+
+	// Side information
+	put_bits(&side, 0, 9);		// main data begins in this frame
+	put_bits(&side, 0, (stream->channels == 1) ? 5 : 3);
+	put_bits(&side, 0, 4*stream->channels);	// no scalefactors shared
+	for(gr = 0; gr < 2; ++gr)
+		for(ch = 0; ch < stream->channels; ++ch)
+		{
+			const granule_t *granule = &granules[gr][ch];
+			put_bits(&side, granule->part2_3_length, 12);
+			put_bits(&side, granule->big_values, 9);
+			put_bits(&side, granule->global_gain, 8);
+			put_bits(&side, granule->scalefac_compress, 4);
+			put_bits(&side, 0, 1);	// long blocks
+			for(i = 0; i < 3; ++i)
+				put_bits(&side, granule->table_select[i], 5);
+			put_bits(&side, granule->region0_count, 4);
+			put_bits(&side, granule->region1_count, 3);
+			put_bits(&side, 0, 1);	// no preemphasis
+			put_bits(&side, 1, 1);	// scalefactors in steps of 2
+			put_bits(&side, granule->count1_table, 1);
+		}
+
+	memcpy(output + 4 + stream->side_bytes, main_data, (bits.pos + 7)/8);
+	return frame_bytes;
+}
+
+static void *mp3lite_open( const codec_settings_t *settings, codec_format_t *format,
+                         unsigned *input_size, unsigned *output_size )
+{
+	mp3lite_stream_t *stream;
+	unsigned index, rate, cutoff;
+
+	// MPEG-1 sampling rates only; the LAME backend handles the others
+	for(index = 0; index < 3 && sampling_rates[index] != settings->sampling_rate; ++index) { }
+	if(index == 3 || settings->channels < 1 || settings->channels > 2)
+		return NULL;
+
+	if((stream = (mp3lite_stream_t*)_aligned_malloc(sizeof(mp3lite_stream_t), CACHE_LINE_SIZE)) == NULL)
+		return NULL;
+	memset(stream, 0, sizeof(*stream));
+	build_tables(stream);
+	stream->use_sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE);
+
+	stream->sampling_index = index;
+	stream->bands    = band_limits[index];
+	stream->channels = settings->channels;
+	stream->mode     = (settings->channels == 1) ? MODE_MONO :
+	                   (settings->mode == CHANNELS_STEREO) ? MODE_STEREO : MODE_JOINT;
+
+	// Take the nearest bitrate not above the one configured
+	for(index = 14; index > 1 && bitrates[index] > settings->bitrate; --index) { }
+	stream->bitrate_index = index;
+	rate = bitrates[index] * 1000;
+	stream->frame_bytes  = 144 * rate / settings->sampling_rate;
+	stream->padding_step = (144 * rate) % settings->sampling_rate;
+	stream->side_bytes   = (settings->channels == 1) ? 17 : 32;
+
+	// Without a psychoacoustic model, spend the bits on the lower
+	// frequencies: the bandwidth grows with the bitrate per channel
+	cutoff = 4000 + 100 * bitrates[index] / settings->channels;
+	if(cutoff > settings->sampling_rate / 2)
+		cutoff = settings->sampling_rate / 2;
+	stream->cutoff = cutoff * 2 * GRANULE_SIZE / settings->sampling_rate;
+
+	stream->format.codec         = &codec_mp3;	// the frames are plain MP3
+	stream->format.sampling_rate = settings->sampling_rate;
+	stream->format.channels      = settings->channels;
+	memcpy(format, &stream->format, sizeof(*format));
+	*input_size  = FRAME_SAMPLES * settings->channels * 2;
+	*output_size = MP3_MAX_FRAME_SIZE;
+	return stream;
+}
+
+static int mp3lite_encode( void *stream, const char *input, unsigned input_size,
+                         char *output, unsigned *output_size )
+{
+	mp3lite_stream_t *state = (mp3lite_stream_t*)stream;
+
+	*output_size = encode_frame( state, (const short*)input,
+	                             input_size / (2 * state->channels), output );
+	return 0;
+}
+
+static int mp3lite_finish(void *stream, char *output, unsigned *output_size)
+{
+	// One more frame of silence flushes the filterbank delay
+	*output_size = encode_frame((mp3lite_stream_t*)stream, NULL, 0, output);
+	return 0;
+}
+
+static void mp3lite_close(void *stream)
+{
+	_aligned_free(stream);
+}
+
+// The frame functions are those of codec_mp3, which the stream format names
+const codec_t codec_mp3lite = {
+	"mp3lite", "audio/mpeg",
+	mp3lite_open, mp3lite_encode, mp3lite_finish, mp3lite_close,
+	NULL, NULL, NULL, NULL };
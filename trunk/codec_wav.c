@@ -0,0 +1,270 @@
+/* Contains the built-in WAV encoder backends: uncompressed 16-bit PCM and
+   IMA ADPCM (4 bits per sample). Both cost next to no CPU time, which suits
+   local networks and monitoring, where bandwidth matters less than CPU.
+
+   The stream starts with a RIFF header of unknown length; audio follows in
+   fixed-size frames (a group of samples for PCM, a block for ADPCM), each of
+   which a listener may start at. */
+
+#include "engine_internal.h"
+
+// Include standard library headers
+#include <string.h>
+#include <malloc.h>
+
+
+// Definitions
+#define PCM_FRAME_SAMPLES	(1152)		// samples per channel per PCM frame
+#define WAVE_FORMAT_PCM_TAG	(0x0001)
+#define WAVE_FORMAT_IMA_TAG	(0x0011)
+#define WAV_UNKNOWN_SIZE	(0xFFFFFFFF)	// chunk size of a live stream
+
+
+// Stream state
+typedef struct wav_stream
+{
+	codec_format_t format;
+	int index[2];			// ADPCM step index per channel, kept across blocks
+} wav_stream_t;
+
+
+// IMA ADPCM step sizes and step index adjustments
+static const short ima_steps[89] = {
+	    7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+	   19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+	   50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+	  130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+	  337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+	  876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+	 2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+	 5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767 };
+
+static const int ima_index_adjust[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+
+// Little-endian output helpers
+static char *put16(char *p, unsigned value)
+{
+	p[0] = (char)(value & 0xFF);
+	p[1] = (char)((value >> 8) & 0xFF);
+	return p + 2;
+}
+
+static char *put32(char *p, unsigned long value)
+{
+	p = put16(p, (unsigned)(value & 0xFFFF));
+	return put16(p, (unsigned)(value >> 16));
+}
+
+/* Returns the ADPCM block size in bytes for a format, following the usual
+   Windows convention (256 bytes per channel at 11 kHz, doubling with the
+   sampling rate). */
+static unsigned adpcm_block_align(unsigned sampling_rate, unsigned channels)
+{
+	unsigned block = 256 * channels;
+
+	if(sampling_rate > 11025)
+		block *= 2;
+	if(sampling_rate > 22050)
+		block *= 2;
+	return block;
+}
+
+static void *wav_open( const codec_t *codec, const codec_settings_t *settings,
+                       codec_format_t *format, unsigned *input_size,
+                       unsigned *output_size )
+{
+	wav_stream_t *stream;
+	unsigned channels = settings->channels;
+
+	if((stream = (wav_stream_t*)malloc(sizeof(wav_stream_t))) == NULL)
+		return NULL;
+
+	stream->format.codec         = codec;
+	stream->format.sampling_rate = settings->sampling_rate;
+	stream->format.channels      = channels;
+	if(codec == &codec_adpcm)
+	{
+		stream->format.frame_size    = adpcm_block_align(settings->sampling_rate, channels);
+		stream->format.frame_samples = (stream->format.frame_size - 4*channels)*2/channels + 1;
+	}
+	else
+	{
+		stream->format.frame_size    = PCM_FRAME_SAMPLES * channels * 2;
+		stream->format.frame_samples = PCM_FRAME_SAMPLES;
+	}
+	stream->index[0] = stream->index[1] = 0;
+
+	memcpy(format, &stream->format, sizeof(*format));
+	*input_size  = stream->format.frame_samples * channels * 2;
+	*output_size = stream->format.frame_size;
+	return stream;
+}
+
+static void *pcm_open( const codec_settings_t *settings, codec_format_t *format,
+                       unsigned *input_size, unsigned *output_size )
+{
+	return wav_open(&codec_pcm, settings, format, input_size, output_size);
+}
+
+static void *adpcm_open( const codec_settings_t *settings, codec_format_t *format,
+                         unsigned *input_size, unsigned *output_size )
+{
+	return wav_open(&codec_adpcm, settings, format, input_size, output_size);
+}
+
+static int pcm_encode( void *stream, const char *input, unsigned input_size,
+                       char *output, unsigned *output_size )
+{
+	// Samples are passed in native (little-endian) order already
+	memcpy(output, input, input_size);
+	*output_size = input_size;
+	return 0;
+}
+
+/* Encodes one sample, updating the predictor and step index; returns the
+   4-bit code. */
+static unsigned adpcm_encode_sample(int sample, int *predictor, int *index)
+{
+	int diff = sample - *predictor, step = ima_steps[*index], delta = step >> 3;
+	unsigned code = 0;
+
+	if(diff < 0)
+	{
+		code = 8;
+		diff = -diff;
+	}
+	if(diff >= step) { code |= 4; diff -= step; delta += step; }
+	step >>= 1;
+	if(diff >= step) { code |= 2; diff -= step; delta += step; }
+	step >>= 1;
+	if(diff >= step) { code |= 1; delta += step; }
+
+	*predictor += (code & 8) ? -delta : delta;
+	if(*predictor > 32767)
+		*predictor = 32767;
+	else if(*predictor < -32768)
+		*predictor = -32768;
+
+	*index += ima_index_adjust[code & 7];
+	if(*index < 0)
+		*index = 0;
+	else if(*index > 88)
+		*index = 88;
+	return code;
+}
+
+/* Encodes a block. Input shorter than a block (at the end of a stream) is
+   padded with silence, since ADPCM blocks have a fixed size. */
+static int adpcm_encode( void *handle, const char *input, unsigned input_size,
+                         char *output, unsigned *output_size )
+{
+	wav_stream_t *stream = (wav_stream_t*)handle;
+	const short *samples = (const short*)input;
+	unsigned channels = stream->format.channels,
+	         count = input_size / (2 * channels), n, c, k, low, high;
+	int predictor[2];
+	char *p = output;
+
+	for(c = 0; c < channels; ++c)
+	{
+		// Block header: the first sample, stored exactly, and the step index
+		predictor[c] = (count > 0) ? samples[c] : 0;
+		p = put16(p, (unsigned)predictor[c] & 0xFFFF);
+		*p++ = (char)stream->index[c];
+		*p++ = 0;
+	}
+
+	// The remaining samples, in groups of 8 per channel (4 bytes, the earlier
+	// sample of each pair in the low nibble), channels interleaved
+	for(n = 1; n < stream->format.frame_samples; n += 8)
+		for(c = 0; c < channels; ++c)
+			for(k = n; k < n + 8; k += 2)
+			{
+				low  = adpcm_encode_sample( (k < count) ? samples[k*channels + c] : 0,
+				                            &predictor[c], &stream->index[c] );
+				high = adpcm_encode_sample( (k + 1 < count) ? samples[(k + 1)*channels + c] : 0,
+				                            &predictor[c], &stream->index[c] );
+				*p++ = (char)(low | (high << 4));
+			}
+
+	*output_size = stream->format.frame_size;
+	return 0;
+}
+
+static int wav_finish(void *stream, char *output, unsigned *output_size)
+{
+	*output_size = 0;  // nothing is held back
+	return 0;
+}
+
+static void wav_close(void *stream)
+{
+	free(stream);
+}
+
+static unsigned wav_stream_header(const codec_format_t *format, char *header)
+{
+	int adpcm = (format->codec == &codec_adpcm);
+	char *p = header;
+
+	memcpy(p, "RIFF", 4);  p = put32(p + 4, WAV_UNKNOWN_SIZE);
+	memcpy(p, "WAVEfmt ", 8);  p = put32(p + 8, adpcm ? 20 : 16);
+	p = put16(p, adpcm ? WAVE_FORMAT_IMA_TAG : WAVE_FORMAT_PCM_TAG);
+	p = put16(p, format->channels);
+	p = put32(p, format->sampling_rate);
+	p = put32(p, (unsigned long)format->frame_size * format->sampling_rate /
+	             format->frame_samples);	// bytes per second
+	if(adpcm)
+	{
+		p = put16(p, format->frame_size);	// block size
+		p = put16(p, 4);					// bits per sample
+		p = put16(p, 2);					// size of the extra format data
+		p = put16(p, format->frame_samples);
+	}
+	else
+	{
+		p = put16(p, format->channels * 2);
+		p = put16(p, 16);
+	}
+	memcpy(p, "data", 4);  p = put32(p + 4, WAV_UNKNOWN_SIZE);
+
+	return (unsigned)(p - header);
+}
+
+static int wav_parse_frame( const codec_format_t *format, const unsigned char *data,
+                            codec_frame_t *frame )
+{
+	// Frames have a fixed size and are not marked in the data
+	frame->size          = format->frame_size;
+	frame->bitrate       = 0;
+	frame->sampling_rate = format->sampling_rate;
+	frame->samples       = format->frame_samples;
+	frame->channels      = format->channels;
+	return 0;
+}
+
+static unsigned wav_find_sync(const unsigned char *data, unsigned length)
+{
+	return 0;  // every position is taken as a frame boundary
+}
+
+static unsigned wav_silent_frame( const codec_format_t *format, const unsigned char *header,
+                                  char *frame )
+{
+	// Zero samples, and for ADPCM a zero first sample and step index with
+	// zero codes, which decode to zero as well
+	memset(frame, 0, format->frame_size);
+	return format->frame_size;
+}
+
+const codec_t codec_pcm = {
+	"pcm", "audio/wav",
+	pcm_open, pcm_encode, wav_finish, wav_close,
+	wav_stream_header, wav_parse_frame, wav_find_sync, wav_silent_frame };
+
+const codec_t codec_adpcm = {
+	"adpcm", "audio/wav",
+	adpcm_open, adpcm_encode, wav_finish, wav_close,
+	wav_stream_header, wav_parse_frame, wav_find_sync, wav_silent_frame };
@@ -10,19 +10,59 @@
 #include <string.h>
 #include <stdio.h>
 #include <malloc.h>
+#include <emmintrin.h>
 
-// Include MP3 encoder header
-#define _BLADEDLL
-#include "BladeMP3EncDLL.h"
 
+// Definitions
+#define QUEUE_MAX_BYTES	(8388608)	// max. raw data queued (about 47 seconds at
+									// 44.1 kHz stereo); since the pacer holds
+									// the encoder back to real time, input
+									// that stays faster is discarded
+#define STARVATION_TIMEOUT	(500)		// milliseconds without input after
+									// which silence is sent to listeners
+#define GOVERNOR_INTERVAL	(5000000)	// microseconds between governor decisions
+#define GOVERNOR_RTF_LOW	(1.5)		// real-time factor below which the
+									// governor steps down
+#define GOVERNOR_RTF_HIGH	(4.0)		// real-time factor above which it steps
+#define GOVERNOR_HOLD		(3)			// up again, for this many intervals
+#define GOVERNOR_QUEUE_MAX	(1000000)	// microseconds of queued audio above
+									// which the governor steps down
+#define GOVERNOR_STEP_MIN	(30000000)	// min. microseconds between steps
+#define GOVERNOR_DEFER_MAX	(10000000)	// max. microseconds a step waits for
+									// quiet input
+#define QUIET_PEAK			(128)		// peak sample value (-48 dBFS) up to
+									// which input counts as quiet
+#define MONO_RATIO		(10000.0)		// signal to channel difference energy
+									// ratio (40 dB) from which stereo input
+									// counts as mono
+#define STEREO_RATIO	(1000.0)		// ratio (30 dB) below which it counts as
+									// stereo again, while encoded as mono
+#define MONO_ENTER_TIME	(3000000)	// microseconds of mono input in a row
+									// after which it is encoded as mono
+#define MONO_LEAVE_TIME	(250000)	// microseconds of stereo input in a row
+									// after which it is encoded as stereo again
+#define MONO_SWITCH_MIN	(30000000)	// min. microseconds from a switch to the
+									// next switch to mono
+#define MONO_LEAVE_DEFER_MAX (10000000)	// max. microseconds the switch back to
+									// stereo waits for quiet input
+#define POOL_GRANULE	(4096)		// entry capacities are multiples of this
+#define POOL_MAX_ENTRIES	(64)		// free entries kept for reuse
 
 // Function prototypes
 
 // API functions
 int start_encoder_thread(const encoder_config_t *config);
 int stop_encoder_thread();
+void encoder_update_config(const encoder_config_t *config);
 int encoder_enqueue_raw_data( const short *samples, unsigned samples_size,
 	                          unsigned channels, unsigned sampling_rate );
+int encoder_enqueue_raw_vector( const engine_block_t *blocks, unsigned count,
+                                unsigned channels, unsigned sampling_rate );
+short *encoder_acquire( unsigned num_samples, unsigned channels,
+                        unsigned sampling_rate, int *result );
+int encoder_commit(short *samples, unsigned num_samples);
+int encoder_enqueue_encoded_data(const char *data, unsigned length);
+void encoder_get_stats(engine_stats_t *stats);
 
 // Thread function
 static DWORD WINAPI run_encoder(LPVOID unused);
@@ -31,7 +71,15 @@ static DWORD WINAPI run_encoder(LPVOID unused);
 // Encoder queue entries
 typedef struct queue_entry {
 	struct queue_entry *next;
+	unsigned capacity;				// bytes of data the entry can hold
 	unsigned samples_size, sampling_rate, channels;
+	int encoded;					// set if the data are MP3 frames to pass
+									// through (samples_size is their size)
+	int mono;						// for stereo data, whether the channels
+									// are the same (-1 until compared)
+	int quiet;						// for stereo data, set if no sample is
+									// louder than QUIET_PEAK (once compared)
+	unsigned __int64 timestamp;		// time the entry was queued
 	// char samples[];  -- sample data follows!
 } queue_entry_t;
 
@@ -44,50 +92,593 @@ static HANDLE encoder_thread,
 static CRITICAL_SECTION queue_access; // controls access to the encoder queue
 
 static queue_entry_t *volatile queue_first, *queue_last;
-static encoder_config_t encoder_config;  // pointer to encoder configuration
+static encoder_config_t encoder_config;  // protected by queue_access
+static int volatile encoder_reconfigure; // set when encoder_config has changed
+static short volatile backend_in_use;	// ENCODER_CODEC_* of the open stream
+										// (after any fallback); -1 if none
+static int volatile encoder_stopping;	// set when the encoder thread has been
+										// told to exit but was not joined yet
+
+// Idle policy state, owned by the thread calling encoder_enqueue_raw_data
+static short idle_policy, idle_timeout;
+static unsigned __int64 idle_since;		// time the last listener left (0 if any)
+static unsigned volatile queue_depth, queue_bytes;  // protected by queue_access
+
+// Free queue entries, kept so that queuing data does not allocate memory
+static CRITICAL_SECTION pool_access;	// controls access to the pool
+static queue_entry_t *pool_first;
+static unsigned pool_count;
+
+
+// Statistics counters of the threads passing data in: blocks and bytes are
+// written under queue_access, drops and idle discards with counter_add_shared()
+typedef struct ingest_counters {
+	unsigned __int64 blocks, drops, idle, bytes;
+} ingest_counters_t;
+
+// Statistics counters written by the encoder thread
+typedef struct encoder_counters {
+	unsigned __int64 audio_time, encode_time, bytes_out, pace_time, silent_frames;
+	unsigned __int64 steps_down, steps_up, mono_switches;
+	engine_latency_t latency_queue, latency_encode;
+} encoder_counters_t;
+
+// CPU time used by encoder threads that have exited, and the number of times
+// the thread was started; protected by queue_access
+static unsigned __int64 encoder_cpu_time, encoder_starts;
+
+// Statistics counters written by the thread calling encoder_enqueue_encoded_data
+typedef struct passthrough_counters {
+	unsigned __int64 bytes, discarded;
+} passthrough_counters_t;
+
+// Passthrough state, owned by the thread calling encoder_enqueue_encoded_data
+typedef struct passthrough_state {
+	unsigned char carry[MP3_MAX_FRAME_SIZE];	// partial frame left from the
+	unsigned carry_size;						// last call
+} passthrough_state_t;
+
+static passthrough_state_t passthrough_state;
+
+static CACHE_ALIGN ingest_counters_t  volatile ingest_counters;
+static CACHE_ALIGN passthrough_counters_t volatile passthrough_counters;
+static CACHE_ALIGN encoder_counters_t volatile encoder_counters;
+
+// Encoder backends by ENCODER_CODEC_*
+static const codec_t *const codecs[] = { &codec_mp3, &codec_pcm, &codec_adpcm,
+                                          &codec_mp3lite };
+#define NUM_CODECS (sizeof(codecs)/sizeof(codecs[0]))
+
+// Valid bitrates, in kbps
+static const short bitrates[] = {
+	8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 192, 224, 256, 320 };
+#define NUM_BITRATES (sizeof(bitrates)/sizeof(bitrates[0]))
+
+// Governor state, owned by the encoder thread
+static short volatile governor_preset, governor_bitrate;	// settings in use
+static unsigned __int64 governor_start;		// start of the current interval
+static unsigned __int64 governor_audio_time, governor_encode_time, governor_pace_time;
+static unsigned governor_headroom;			// intervals with headroom in a row
+static short governor_next_preset, governor_next_bitrate;	// settings to step to
+static unsigned __int64 governor_due;		// time a step was decided (0 if none
+											// is pending)
+static unsigned __int64 governor_step_time;	// time of the last step (0 if none)
+
+// Mono detection state, owned by the encoder thread
+static int use_sse2;					// set if the processor has SSE2
+static int mono_input;					// set while stereo input is encoded
+										// as mono
+static unsigned __int64 mono_run,		// duration of mono and stereo input in
+                        stereo_run;		// a row (quiet input counts as neither)
+static unsigned __int64 mono_switch_time;	// time of the last switch (0 if none)
+static unsigned __int64 mono_switch_due;	// time a switch was decided (0 if none
+											// is waiting for quiet input)
+static short volatile mono_bitrate;		// bitrate in use while mono_input is
+										// set
+
+
+/* Returns a queue entry with room for 'size' bytes of data, reusing a free
+   one if possible, or NULL if none could be allocated. */
+static queue_entry_t *acquire_entry(unsigned size)
+{
+	queue_entry_t *entry, **link;
+
+	EnterCriticalSection(&pool_access);
+	for(link = &pool_first; (entry = *link) != NULL; link = &entry->next)
+		if(entry->capacity >= size)
+		{
+			*link = entry->next;
+			--pool_count;
+			break;
+		}
+	LeaveCriticalSection(&pool_access);
+
+	if(entry == NULL)
+	{
+		size = (size + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE;
+		if((entry = (queue_entry_t*)malloc(sizeof(queue_entry_t) + size)) == NULL)
+			return NULL;
+		entry->capacity = size;
+	}
+	return entry;
+}
+
+/* Returns a queue entry to the pool, or frees it if the pool is full. */
+static void release_entry(queue_entry_t *entry)
+{
+	EnterCriticalSection(&pool_access);
+	if(pool_count < POOL_MAX_ENTRIES)
+	{
+		entry->next = pool_first;
+		pool_first = entry;
+		++pool_count;
+		entry = NULL;
+	}
+	LeaveCriticalSection(&pool_access);
+
+	free(entry);
+}
+
+/* Waits until the pacer has published all complete frames, so that the
+   encoder stays at most PACER_LOOKAHEAD ahead of real time. Returns non-zero
+   if the encoder should shut down. */
+static int wait_for_pacer()
+{
+	unsigned long wait;
+	unsigned __int64 start = server_time();
+	int result = 0;
+
+	while((wait = pacer_release()) != INFINITE)
+		if(WaitForSingleObject(shutdown_event, wait) == WAIT_OBJECT_0)
+		{
+			result = -1;
+			break;
+		}
+
+	counter_add(&encoder_counters.pace_time, server_time() - start);
+	return result;
+}
+
+/* Returns non-zero if the channels of 'count' stereo sample pairs are
+   effectively the same, i.e. the energy of their difference is at least
+   'ratio' below that of the signal. Samples are halved so that the sums of
+   squares fit in 32 bits per lane. */
+static int is_mono(const short *samples, unsigned count, double ratio)
+{
+	__int64 difference = 0, energy = 0, lanes[2];
+	__m128i a, b, d, e, sums_d, sums_e, zero, signs;
+	unsigned n = 0;
+	int l, r;
+
+	if(use_sse2)
+	{
+		zero   = _mm_setzero_si128();
+		signs  = _mm_set_epi16(-1, 1, -1, 1, -1, 1, -1, 1);
+		sums_d = sums_e = zero;
+		for(; n + 8 <= count; n += 8)
+		{
+			a = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(samples + 2*n)), 1);
+			b = _mm_srai_epi16(_mm_loadu_si128((const __m128i*)(samples + 2*n + 8)), 1);
+
+			// Left squared plus right squared, per pair
+			e = _mm_add_epi32(_mm_madd_epi16(a, a), _mm_madd_epi16(b, b));
+			// Left minus right, per pair, then squared
+			d = _mm_packs_epi32(_mm_madd_epi16(a, signs), _mm_madd_epi16(b, signs));
+			d = _mm_madd_epi16(d, d);
+
+			sums_e = _mm_add_epi64(sums_e, _mm_unpacklo_epi32(e, zero));
+			sums_e = _mm_add_epi64(sums_e, _mm_unpackhi_epi32(e, zero));
+			sums_d = _mm_add_epi64(sums_d, _mm_unpacklo_epi32(d, zero));
+			sums_d = _mm_add_epi64(sums_d, _mm_unpackhi_epi32(d, zero));
+		}
+		_mm_storeu_si128((__m128i*)lanes, sums_e);
+		energy = lanes[0] + lanes[1];
+		_mm_storeu_si128((__m128i*)lanes, sums_d);
+		difference = lanes[0] + lanes[1];
+	}
+
+	for(; n < count; ++n)
+	{
+		l = samples[2*n] >> 1;
+		r = samples[2*n + 1] >> 1;
+		energy     += l*l + r*r;
+		difference += (l - r)*(l - r);
+	}
+
+	return (double)difference * ratio <= (double)energy;
+}
+
+/* Returns non-zero if no sample of 'count' is louder than QUIET_PEAK. */
+static int is_quiet(const short *samples, unsigned count)
+{
+	__m128i x, high, low, loud;
+	unsigned n = 0;
+
+	if(use_sse2)
+	{
+		high = _mm_set1_epi16(QUIET_PEAK);
+		low  = _mm_set1_epi16(-QUIET_PEAK);
+		for(; n + 8 <= count; n += 8)
+		{
+			x = _mm_loadu_si128((const __m128i*)(samples + n));
+			loud = _mm_or_si128(_mm_cmpgt_epi16(x, high), _mm_cmplt_epi16(x, low));
+			if(_mm_movemask_epi8(loud) != 0)
+				return 0;
+		}
+	}
+
+	for(; n < count; ++n)
+		if(samples[n] > QUIET_PEAK || samples[n] < -QUIET_PEAK)
+			return 0;
+	return 1;
+}
+
+/* Copies 'size' bytes of samples to the input buffer, mixing stereo down to
+   mono if 'downmix' is set (writing half as many bytes). */
+static void copy_samples(char *dest, const char *src, unsigned size, int downmix)
+{
+	const short *in = (const short*)src;
+	short *out = (short*)dest;
+	unsigned n;
+
+	if(!downmix)
+		memcpy(dest, src, size);
+	else
+		for(n = 0; n < size/4; ++n)
+			out[n] = (short)((in[2*n] + in[2*n + 1]) >> 1);
+}
+
+/* Returns the next lower (direction < 0) or higher valid bitrate, or the
+   bitrate itself if there is none. */
+static short step_bitrate(short bitrate, int direction)
+{
+	int n;
+
+	for(n = 0; n < (int)NUM_BITRATES && bitrates[n] < bitrate; ++n) { }
+	if(direction < 0)
+		return (n > 0) ? bitrates[n - 1] : bitrate;
+	if(n < (int)NUM_BITRATES && bitrates[n] == bitrate)
+		++n;
+	return (n < (int)NUM_BITRATES) ? bitrates[n] : bitrate;
+}
+
+/* Starts the governor over with the configured settings. */
+static void reset_governor(const encoder_config_t *config)
+{
+	governor_preset  = config->preset;
+	if(governor_preset < ENCODER_PRESET_HIGH || governor_preset >= ENCODER_PRESETS)
+		governor_preset = ENCODER_PRESET_HIGH;
+	governor_bitrate = config->bitrate;
+	governor_start   = 0;
+	governor_headroom = 0;
+	governor_due     = 0;
+	governor_step_time = 0;
+}
+
+/* Watches the real-time factor of the encoder and the audio waiting in the
+   queue. Under pressure the preset is made faster (and, if allowed, the
+   bitrate lower) one step at a time; with ample headroom for a while the
+   settings are stepped back towards the configured ones. A step restarts the
+   encoder, which leaves a short gap in the audio; it is therefore taken
+   when the input just queued ('samples', 'count' interleaved samples) is
+   quiet, or after GOVERNOR_DEFER_MAX, and at most once per
+   GOVERNOR_STEP_MIN. Returns non-zero if the settings changed and the
+   encoder must be restarted. */
+static int govern( const encoder_config_t *config, unsigned sampling_rate, unsigned channels,
+                   const short *samples, unsigned count )
+{
+	unsigned __int64 now = server_time(), elapsed, audio, busy, paced, queued;
+	double rtf;
+	int changed = 0;
+
+	if(config->governor == ENCODER_GOVERNOR_OFF)
+		governor_due = 0;
+	if(governor_due != 0)
+	{
+		// Take the step decided at a quiet moment
+		if(!is_quiet(samples, count) && now - governor_due < GOVERNOR_DEFER_MAX)
+			return 0;
+		if(governor_next_preset > governor_preset || governor_next_bitrate < governor_bitrate)
+			counter_add(&encoder_counters.steps_down, 1);
+		else
+			counter_add(&encoder_counters.steps_up, 1);
+		governor_preset  = governor_next_preset;
+		governor_bitrate = governor_next_bitrate;
+		governor_due = 0;
+		governor_step_time = now;
+		return 1;
+	}
+	if(governor_start == 0 || config->governor == ENCODER_GOVERNOR_OFF)
+		goto restart;
+	if((elapsed = now - governor_start) < GOVERNOR_INTERVAL)
+		return 0;
+	if(governor_step_time != 0 && now - governor_step_time < GOVERNOR_STEP_MIN)
+		goto restart;  // let the last step take effect first
+	governor_next_preset  = governor_preset;
+	governor_next_bitrate = governor_bitrate;
+
+	audio  = encoder_counters.audio_time  - governor_audio_time;
+	busy   = encoder_counters.encode_time - governor_encode_time;
+	paced  = encoder_counters.pace_time   - governor_pace_time;
+	queued = (unsigned __int64)queue_bytes * 1000000 / (sampling_rate * channels * 2);
+	rtf    = (busy == 0) ? 0.0 : (double)(__int64)audio / (double)(__int64)busy;
+
+	// Queued audio only indicates pressure if the pacer did not hold the
+	// encoder back (i.e. the input is not simply faster than real time)
+	if( (busy > 0 && rtf < GOVERNOR_RTF_LOW) ||
+		(queued > GOVERNOR_QUEUE_MAX && paced < elapsed/10) )
+	{
+		governor_headroom = 0;
+		if(governor_preset < ENCODER_PRESETS - 1)
+		{
+			++governor_next_preset;
+			changed = 1;
+		}
+		else if( config->governor == ENCODER_GOVERNOR_BITRATE &&
+		         step_bitrate(governor_bitrate, -1) >= config->bitrate/2 &&
+		         step_bitrate(governor_bitrate, -1) != governor_bitrate )
+		{
+			governor_next_bitrate = step_bitrate(governor_bitrate, -1);
+			changed = 1;
+		}
+	}
+	else if(rtf > GOVERNOR_RTF_HIGH && queued <= GOVERNOR_QUEUE_MAX)
+	{
+		if(++governor_headroom >= GOVERNOR_HOLD)
+		{
+			governor_headroom = 0;
+			if(governor_bitrate < config->bitrate)
+			{
+				governor_next_bitrate = step_bitrate(governor_bitrate, 1);
+				changed = 1;
+			}
+			else if(governor_preset > config->preset)
+			{
+				--governor_next_preset;
+				changed = 1;
+			}
+		}
+	}
+	else
+		governor_headroom = 0;
+
+restart:
+	// Start a new interval
+	governor_start       = now;
+	governor_audio_time  = encoder_counters.audio_time;
+	governor_encode_time = encoder_counters.encode_time;
+	governor_pace_time   = encoder_counters.pace_time;
+	if(changed)
+		governor_due = now;
+	return 0;
+}
+
+/* Returns non-zero if no data is queued. */
+static int queue_empty()
+{
+	int empty;
+
+	EnterCriticalSection(&queue_access);
+	empty = (queue_first == NULL);
+	LeaveCriticalSection(&queue_access);
+	return empty;
+}
+
+/* Publishes silent frames in real time while no input arrives (e.g. while
+   the host is paused) and listeners are connected, so that their players do
+   not time out and reconnect all at once when playback resumes. Returns when
+   input is queued, at a frame boundary. */
+static void feed_silence()
+{
+	char frame[CODEC_MAX_FRAME_SIZE];
+	unsigned size;
+
+	if((size = pacer_silent_frame(frame)) == 0)
+		return;  // no stream format yet
+
+	trace_event(TRACE_SILENCE, size);
+	while(queue_empty() && server_get_connected_clients() > 0)
+	{
+		pacer_submit(frame, size, 0);
+		counter_add(&encoder_counters.silent_frames, 1);
+		if(wait_for_pacer() != 0)
+			break;  // shut down
+	}
+}
+
+/* Passes queued MP3 frames (see encoder_enqueue_encoded_data()) to the pacer
+   until raw data is queued next or the configuration changes. Returns
+   non-zero if the encoder should shut down. */
+static int pass_encoded()
+{
+	queue_entry_t *entry;
+	codec_format_t format;
+	int starved;
+
+	memset(&format, 0, sizeof(format));
+	format.codec = &codec_mp3;
+	pacer_set_format(&format);
+
+	while(1)
+	{
+		EnterCriticalSection(&queue_access);
+		while(queue_first == NULL)
+		{
+			// No data available; wait for event, and send silence if none
+			// arrives for a while
+			LeaveCriticalSection(&queue_access);
+			starved = WaitForSingleObject(queue_event, STARVATION_TIMEOUT) == WAIT_TIMEOUT &&
+			          server_get_connected_clients() > 0;
+			if(WaitForSingleObject(shutdown_event, 0) == WAIT_OBJECT_0)
+				return -1; // Shut down
+			if(starved)
+				feed_silence();
+			EnterCriticalSection(&queue_access);
+		}
+		entry = queue_first;
+		if(!entry->encoded || encoder_reconfigure)
+		{
+			LeaveCriticalSection(&queue_access);
+			return 0;
+		}
+		queue_first = entry->next;
+		--queue_depth;
+		queue_bytes -= entry->samples_size;
+		LeaveCriticalSection(&queue_access);
+		latency_add(&encoder_counters.latency_queue, server_time() - entry->timestamp);
+
+		pacer_submit( ((char*)entry) + sizeof(queue_entry_t), entry->samples_size,
+		              entry->timestamp );
+		release_entry(entry);
+		if(wait_for_pacer() != 0)
+			return -1;
+	}
+}
+
+/* Encodes a chunk of input data and passes the result to the pacer.
+   'timestamp' is the time the oldest input data was queued. Returns non-zero
+   if the encoder should shut down. */
+static int encode_chunk( const codec_t *codec, void *stream,
+                         char *input_buffer, unsigned input_size, char *output_buffer,
+                         unsigned channels, unsigned sampling_rate,
+                         unsigned __int64 timestamp )
+{
+	unsigned output_size = 0;
+	unsigned __int64 start, duration;
+	int result;
+
+	trace_event(TRACE_ENCODE_START, input_size);
+	start = server_time();
+	result = codec->encode(stream, input_buffer, input_size, output_buffer, &output_size);
+
+	duration = server_time() - start;
+	trace_event(TRACE_ENCODE_END, (result == 0) ? output_size : 0);
+	counter_add(&encoder_counters.encode_time, duration);
+	latency_add(&encoder_counters.latency_encode, duration);
+	counter_add( &encoder_counters.audio_time,
+	             (unsigned __int64)(input_size/2/channels) * 1000000 / sampling_rate );
+
+	if(result == 0 && output_size > 0)
+	{
+		counter_add(&encoder_counters.bytes_out, output_size);
+		pacer_submit(output_buffer, output_size, timestamp);
+	}
+
+	return wait_for_pacer();
+}
+
+/* Opens a stream of a backend, encoding on a pool of worker threads if the
+   configuration asks for it; 'codec' is then changed to codec_parallel,
+   which drives such streams. Returns NULL on failure. */
+static void *open_stream( const codec_t **codec, const encoder_config_t *config,
+                          const codec_settings_t *settings, codec_format_t *format,
+                          unsigned *input_size, unsigned *output_size )
+{
+	void *stream;
+
+	if(config->workers <= 1)
+		return (*codec)->open(settings, format, input_size, output_size);
+
+	if((stream = parallel_open( *codec, settings, config->workers, config->affinity,
+	                            config->priority, format, input_size, output_size )) != NULL)
+		*codec = &codec_parallel;
+	return stream;
+}
 
 
 static DWORD WINAPI run_encoder(LPVOID unused)
 {
 	unsigned sampling_rate = 44100, channels = 2;
+	unsigned encode_channels;	// channels encoded (1 if mixing stereo down)
+	unsigned ratio;				// input bytes per input buffer byte
 	unsigned input_buffer_size,  input_buffer_pos,
 		     output_buffer_size, output_buffer_pos;
 	char *input_buffer, *output_buffer;
-	BE_CONFIG config;
-	HBE_STREAM stream;
+	unsigned __int64 input_timestamp = 0;	// queue time of oldest input data
+	encoder_config_t current;
+	const codec_t *codec;
+	codec_settings_t settings;
+	codec_format_t format;
+	void *stream;
+	int starved;
+	int reset = 1;
+	int passthrough = 0;	// set while passing pre-encoded data through
+	int detect_mono;		// set if stereo input may be encoded as mono
+
+	trace_attach("encoder", TRACE_EVENTS_DEFAULT);
+	pacer_reset();
+	use_sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE);
 
 	while(WaitForSingleObject(shutdown_event, 0) != WAIT_OBJECT_0)
 	{
+		// Take the latest configuration
+		EnterCriticalSection(&queue_access);
+		memcpy(&current, &encoder_config, sizeof(current));
+		if(encoder_reconfigure)
+			reset = 1;
+		encoder_reconfigure = 0;
+		LeaveCriticalSection(&queue_access);
+
+		// Use the configured settings, unless the governor changed them
+		if(reset)
+			reset_governor(&current);
+		reset = 0;
+
+		// Pass pre-encoded data through, until raw data is queued again
+		if(passthrough)
+		{
+			if(pass_encoded() != 0)
+				break; // Shut down
+			passthrough = 0;
+			continue;
+		}
+
 		// Set correct configuration
-		memset(&config, 0, sizeof(config));
-		config.dwConfig = BE_CONFIG_LAME;
-		config.format.LHV1.dwStructVersion = CURRENT_STRUCT_VERSION;
-		config.format.LHV1.dwStructSize = CURRENT_STRUCT_SIZE;
-		config.format.LHV1.dwSampleRate = sampling_rate;
-		config.format.LHV1.dwReSampleRate = 0;
-		if(channels == 1)
-			config.format.LHV1.nMode = BE_MP3_MODE_MONO;
-		else
-			switch(encoder_config.channels)
-			{
-			default:
-			case CHANNELS_JOINT:	config.format.LHV1.nMode = BE_MP3_MODE_JSTEREO; break;
-			case CHANNELS_STEREO:	config.format.LHV1.nMode = BE_MP3_MODE_STEREO;  break;
-			}
-		config.format.LHV1.dwBitrate = encoder_config.bitrate;
-		config.format.LHV1.nPreset = LQP_HIGH_QUALITY;
-		config.format.LHV1.bCRC = TRUE;
-		config.format.LHV1.nVbrMethod = VBR_METHOD_NONE;
-		
-		// Initialize the stream
-		if( beInitStream( &config, &input_buffer_size, &output_buffer_size,
-			              &stream) != BE_ERR_SUCCESSFUL)
+		codec = codecs[ (current.codec >= 0 && current.codec < (short)NUM_CODECS) ?
+		                current.codec : ENCODER_CODEC_MP3 ];
+
+		// Stereo input whose channels are the same is mixed down and
+		// encoded as mono, by the MP3 backends (whose listeners can follow
+		// the change; those of WAV streams cannot)
+		detect_mono = current.mono_bitrate > 0 && channels == 2 &&
+		              (codec == &codec_mp3 || codec == &codec_mp3lite);
+		if(!detect_mono)
+		{
+			mono_input = 0;
+			mono_run = stereo_run = 0;
+			mono_switch_due = 0;
+		}
+		mono_bitrate = mono_input ? current.mono_bitrate : 0;
+		encode_channels = mono_input ? 1 : channels;
+		ratio = channels / encode_channels;
+
+		settings.sampling_rate = sampling_rate;
+		settings.channels = encode_channels;
+		settings.mode = current.channels;
+		settings.bitrate = mono_input ? current.mono_bitrate : governor_bitrate;
+		settings.preset = governor_preset;
+		settings.no_reservoir = 0;
+
+		// Initialize the stream; the built-in backends fall back to LAME for
+		// formats they do not support
+		stream = open_stream( &codec, &current, &settings, &format, &input_buffer_size,
+		                      &output_buffer_size );
+		backend_in_use = (current.codec >= 0 && current.codec < (short)NUM_CODECS) ?
+		                 current.codec : ENCODER_CODEC_MP3;
+		if(stream == NULL && codec != &codec_mp3)
+		{
+			codec = &codec_mp3;
+			backend_in_use = ENCODER_CODEC_MP3;
+			stream = open_stream( &codec, &current, &settings, &format, &input_buffer_size,
+			                      &output_buffer_size );
+		}
+		if(stream == NULL)
 		{
 			MessageBox(NULL, "Encoder initialization failed:\nunable to initialize audio stream.",
 				"Minicast", MB_OK | MB_ICONERROR);
 			return -1;
 		}
-		input_buffer_size *= 2; // 16-bit samples
+		pacer_set_format(&format);
 
 		// Allocate buffers
 		input_buffer = output_buffer = NULL;
@@ -98,28 +689,55 @@ static DWORD WINAPI run_encoder(LPVOID unused)
 				"Minicast", MB_OK | MB_ICONERROR);
 			free(input_buffer);
 			free(output_buffer);
-		 	beCloseStream(stream);
+			codec->close(stream);
 			return -1;
 		}
 
 		// Process queued data
 		input_buffer_pos = output_buffer_pos = 0;
+		starved = 0;
 		while(1) {
 			queue_entry_t *entry;
 			unsigned entry_pos;
+			const short *samples;
+			unsigned __int64 duration, now;
 
 			EnterCriticalSection(&queue_access);
-			while(queue_first == NULL)
+			while(queue_first == NULL && !starved)
 			{
 				// No data available; wait for event.
 				LeaveCriticalSection(&queue_access);
-				WaitForSingleObject(queue_event, INFINITE);
+				if( WaitForSingleObject(queue_event, STARVATION_TIMEOUT) == WAIT_TIMEOUT &&
+					encoder_counters.bytes_out > 0 && server_get_connected_clients() > 0 )
+					starved = 1;
 				if(WaitForSingleObject(shutdown_event, 0) == WAIT_OBJECT_0)
 					goto cleanup; // Shut down
 				EnterCriticalSection(&queue_access);
 			}
+			if(starved)
+			{
+				// Input stopped; finish the current frames, so that the
+				// silent frames that follow do not break the bit reservoir
+				LeaveCriticalSection(&queue_access);
+				break;
+			}
+			if(encoder_reconfigure)
+			{
+				// Configuration changed; finish the current frames and
+				// restart the encoder with the new configuration
+				LeaveCriticalSection(&queue_access);
+				break;
+			}
 			// Peek at first entry at the queue
 			entry = queue_first;
+			if(entry->encoded)
+			{
+				// Pre-encoded data; finish the current frames and pass the
+				// data through
+				passthrough = 1;
+				LeaveCriticalSection(&queue_access);
+				break;
+			}
 			if( entry->sampling_rate != sampling_rate ||
 				entry->channels != channels )
 			{
@@ -129,73 +747,254 @@ static DWORD WINAPI run_encoder(LPVOID unused)
 				LeaveCriticalSection(&queue_access);
 				break;
 			}
+			if(detect_mono)
+			{
+				// Compare the channels of new input, and decide to switch
+				// between mono and stereo after MONO_ENTER_TIME of mono
+				// input, or MONO_LEAVE_TIME of stereo input. Quiet input
+				// (which would count as mono) changes nothing. The switch
+				// restarts the encoder, which leaves a short gap in the
+				// stream; it is therefore made where the input is quiet, so
+				// the gap falls into silence. Switches to mono wait for
+				// that as long as it takes (the stream stays stereo) and
+				// are at least MONO_SWITCH_MIN after the last switch; the
+				// switch back to stereo waits at most MONO_LEAVE_DEFER_MAX,
+				// since stereo input mixed down loses more than a gap.
+				if(entry->mono < 0)
+				{
+					samples = (const short*)(((char*)entry) + sizeof(queue_entry_t));
+					duration = (unsigned __int64)(entry->samples_size/4) * 1000000 / sampling_rate;
+					entry->quiet = is_quiet(samples, entry->samples_size/2);
+					if(entry->quiet)
+						entry->mono = mono_input;
+					else if(is_mono( samples, entry->samples_size/4,
+					                 mono_input ? STEREO_RATIO : MONO_RATIO ))
+					{
+						entry->mono = 1;
+						mono_run += duration;
+						stereo_run = 0;
+					}
+					else
+					{
+						entry->mono = 0;
+						stereo_run += duration;
+						mono_run = 0;
+					}
+				}
+				now = server_time();
+				if( mono_input ? stereo_run < MONO_LEAVE_TIME :
+				                 mono_run < MONO_ENTER_TIME || ( mono_switch_time != 0 &&
+				                 now - mono_switch_time < MONO_SWITCH_MIN ) )
+					mono_switch_due = 0;
+				else if(mono_switch_due == 0)
+					mono_switch_due = now;
+				if( mono_switch_due != 0 && ( entry->quiet ||
+				    (mono_input && now - mono_switch_due >= MONO_LEAVE_DEFER_MAX) ) )
+				{
+					mono_input = !mono_input;
+					mono_run = stereo_run = 0;
+					mono_switch_due = 0;
+					mono_switch_time = now;
+					counter_add(&encoder_counters.mono_switches, 1);
+					LeaveCriticalSection(&queue_access);
+					break;
+				}
+			}
 			// Take entry off the queue
 			queue_first = entry->next;
+			--queue_depth;
+			queue_bytes -= entry->samples_size;
 			LeaveCriticalSection(&queue_access);
+			latency_add(&encoder_counters.latency_queue, server_time() - entry->timestamp);
 
 			// Add entry to input buffer
 			entry_pos = 0;
-			while(input_buffer_pos + entry->samples_size - entry_pos >= input_buffer_size)
+			while(input_buffer_pos + (entry->samples_size - entry_pos)/ratio >= input_buffer_size)
 			{
 				// Complete input buffer
-				memcpy( input_buffer + input_buffer_pos,
-					    ((char*)entry) + sizeof(queue_entry_t) + entry_pos,
-						input_buffer_size - input_buffer_pos );
-				entry_pos += input_buffer_size - input_buffer_pos;
+				if(input_buffer_pos == 0)
+					input_timestamp = entry->timestamp;
+				copy_samples( input_buffer + input_buffer_pos,
+				              ((char*)entry) + sizeof(queue_entry_t) + entry_pos,
+				              (input_buffer_size - input_buffer_pos)*ratio, ratio > 1 );
+				entry_pos += (input_buffer_size - input_buffer_pos)*ratio;
 
 				// Encode buffer and send it to the network server
-				if( beEncodeChunk( stream, input_buffer_size/2, (short*)input_buffer,
-						output_buffer, &output_buffer_pos ) == BE_ERR_SUCCESSFUL &&
-					output_buffer_pos > 0 )
+				if(encode_chunk( codec, stream, input_buffer, input_buffer_size,
+				                 output_buffer, encode_channels, sampling_rate,
+				                 input_timestamp ) != 0)
 				{
-					server_enqueue_encoded_data(output_buffer, output_buffer_pos);
+					release_entry(entry);
+					goto cleanup; // Shut down
 				}
 
 				input_buffer_pos = 0;
 			}
 
-			// Put remaining data in input buffer
-			input_buffer_pos = entry->samples_size - entry_pos;
-			memcpy( input_buffer, ((char*)entry) + sizeof(queue_entry_t) + entry_pos,
-				    input_buffer_pos );
+			// Append remaining data to input buffer
+			if(input_buffer_pos == 0)
+				input_timestamp = entry->timestamp;
+			copy_samples( input_buffer + input_buffer_pos,
+			              ((char*)entry) + sizeof(queue_entry_t) + entry_pos,
+			              entry->samples_size - entry_pos, ratio > 1 );
+			input_buffer_pos += (entry->samples_size - entry_pos)/ratio;
+
+			// Restart the encoder if the governor changed the settings (of
+			// LAME on the encoder thread; the other backends have none to
+			// trade, and worker threads take the load off a single processor)
+			if( codec == &codec_mp3 &&
+				govern( &current, sampling_rate, channels,
+				        (const short*)(((char*)entry) + sizeof(queue_entry_t)),
+				        entry->samples_size/2 ) )
+			{
+				release_entry(entry);
+				break;
+			}
+			release_entry(entry);
 		} 
 
 		// Complete partial input data
-		if( input_buffer_pos > 0 && 
-			beEncodeChunk( stream, input_buffer_pos/2, (short*)input_buffer,
-				output_buffer, &output_buffer_pos ) == BE_ERR_SUCCESSFUL &&
-			output_buffer_pos > 0 )
+		if(input_buffer_pos > 0)
 		{
-			server_enqueue_encoded_data(output_buffer, output_buffer_pos);
+			if(encode_chunk( codec, stream, input_buffer, input_buffer_pos,
+			                 output_buffer, encode_channels, sampling_rate,
+			                 input_timestamp ) != 0)
+				goto cleanup; // Shut down
 		}
 
 		// Complete ouput data
-		if( beDeinitStream(stream, output_buffer, &output_buffer_pos) ==
-				BE_ERR_SUCCESSFUL && output_buffer_pos > 0 )
+		if( codec->finish(stream, output_buffer, &output_buffer_pos) == 0 &&
+			output_buffer_pos > 0 )
 		{
-			server_enqueue_encoded_data(output_buffer, output_buffer_pos);
+			counter_add(&encoder_counters.bytes_out, output_buffer_pos);
+			pacer_submit(output_buffer, output_buffer_pos, input_timestamp);
 		}
+		if(wait_for_pacer() != 0)
+			goto cleanup; // Shut down
+		pacer_flush();
 
 		// Clean up
 	cleanup:
- 		beCloseStream(stream);
+		codec->close(stream);
 		free(input_buffer);
 		free(output_buffer);
+
+		if(starved)
+			feed_silence();
 	}
+
+	pacer_reset();
+	mono_bitrate = 0;
+	backend_in_use = -1;
+	trace_detach();
 	
 	return 0;
 }
 
+/* Waits up to 'timeout' milliseconds for an encoder thread told to exit to
+   do so, and releases it. Returns non-zero if it is still running. */
+static int join_encoding(DWORD timeout)
+{
+	if(encoder_thread == NULL)
+		return 0;
+	if(WaitForSingleObject(encoder_thread, timeout) != WAIT_OBJECT_0)
+		return -1;  // leave the encoder state to the running thread
+	ResetEvent(shutdown_event);
+
+	EnterCriticalSection(&queue_access);
+	encoder_cpu_time += thread_cpu_time(encoder_thread);
+	CloseHandle(encoder_thread);
+	encoder_thread = NULL;
+	encoder_stopping = 0;
+	LeaveCriticalSection(&queue_access);
+
+	return 0;
+}
+
+/* Tells the encoder thread, if it is running, to exit, discarding queued
+   data; does not wait for it. */
+static void request_stop()
+{
+	queue_entry_t *entry;
+
+	if(encoder_thread == NULL || encoder_stopping)
+		return;
+
+	// Discard data that was not encoded
+	EnterCriticalSection(&queue_access);
+	while((entry = queue_first) != NULL)
+	{
+		queue_first = entry->next;
+		release_entry(entry);
+	}
+	queue_depth = queue_bytes = 0;
+	encoder_stopping = 1;
+	LeaveCriticalSection(&queue_access);
+
+	// Set shutdown events
+	SetEvent(shutdown_event);
+	SetEvent(queue_event);
+}
+
+/* Starts the encoder thread, if it is not running. Fails if a thread told
+   to exit has not done so yet. */
+static int start_encoding()
+{
+	HANDLE thread;
+
+	if(encoder_thread != NULL && !encoder_stopping)
+		return 0;
+	if(join_encoding(0) != 0)
+		return -1;
+
+	if((thread = CreateThread(NULL, 0, run_encoder, NULL, CREATE_SUSPENDED, NULL)) == NULL)
+		return -1;
+	thread_set_scheduling(thread, encoder_config.affinity, encoder_config.priority);
+	ResumeThread(thread);
+
+	EnterCriticalSection(&queue_access);
+	encoder_thread = thread;
+	++encoder_starts;
+	LeaveCriticalSection(&queue_access);
+
+	return 0;
+}
+
+/* Stops the encoder thread, if it is running, discarding queued data, and
+   waits for it to exit. */
+static int stop_encoding()
+{
+	request_stop();
+	return join_encoding(SHUTDOWN_TIMEOUT);
+}
+
 int start_encoder_thread(const encoder_config_t *config)
 {
+	// A thread left running by a stop that timed out still uses the state
+	// (and its critical sections); finish that stop first
+	if(encoder_thread != NULL && stop_encoder_thread() != 0)
+		return -1;
+
 	memcpy(&encoder_config, config, sizeof(encoder_config));
 
 	// Initialize global variables
 	queue_first = queue_last = NULL;
-	shutdown_event = queue_event = NULL;
+	queue_depth = queue_bytes = 0;
+	encoder_reconfigure = 0;
+	backend_in_use = -1;
+	encoder_stopping = 0;
+	idle_policy  = config->idle_policy;
+	idle_timeout = config->idle_timeout;
+	idle_since   = 0;
+	passthrough_state.carry_size = 0;
+	reset_governor(config);
+	encoder_thread = shutdown_event = queue_event = NULL;
 
 	// Create synchronization objects
 	InitializeCriticalSection(&queue_access);
+	InitializeCriticalSection(&pool_access);
+	pool_first = NULL;
+	pool_count = 0;
 
 	if((shutdown_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
 		goto cleanup;
@@ -203,8 +1002,8 @@ int start_encoder_thread(const encoder_config_t *config)
 	if((queue_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
 		goto cleanup;
 
-	// Create encoder thread
-    if((encoder_thread = CreateThread(NULL, 0, run_encoder, NULL, 0, NULL)) == NULL)
+	// Create encoder thread now, or when the first listener connects
+	if(idle_policy == ENCODER_IDLE_WARM && start_encoding() != 0)
     {
         MessageBox(NULL, "Encoder initialization failed:\nunable to create encoder thread.",
             "Minicast", MB_OK | MB_ICONERROR);
@@ -215,62 +1014,135 @@ int start_encoder_thread(const encoder_config_t *config)
 
 cleanup:
 	CloseHandle(shutdown_event);
-	CloseHandle(encoder_thread);
+	CloseHandle(queue_event);
 	DeleteCriticalSection(&queue_access);	
+	DeleteCriticalSection(&pool_access);
 
 	return -1;
 }
 
+/* Returns non-zero if a configuration change affects the stream the encoder
+   has open, so that it must be restarted; a restart leaves a short gap in the
+   audio, so settings the backend in use ignores do not cause one. */
+static int stream_config_changed(const encoder_config_t *old_config, const encoder_config_t *config)
+{
+	short backend = backend_in_use;
+
+	if( config->codec != old_config->codec ||
+		(config->workers > 1 ? config->workers : 1) !=
+		(old_config->workers > 1 ? old_config->workers : 1) )
+		return 1;
+	if(backend == ENCODER_CODEC_PCM || backend == ENCODER_CODEC_ADPCM)
+		return 0;
+	if( config->bitrate  != old_config->bitrate  ||
+		config->channels != old_config->channels ||
+		config->mono_bitrate != old_config->mono_bitrate )
+		return 1;
+	return backend != ENCODER_CODEC_MP3_LITE &&
+	       ( config->preset   != old_config->preset ||
+	         config->governor != old_config->governor );
+}
+
+void encoder_update_config(const encoder_config_t *config)
+{
+	EnterCriticalSection(&queue_access);
+	if(stream_config_changed(&encoder_config, config))
+		encoder_reconfigure = 1;
+	memcpy(&encoder_config, config, sizeof(encoder_config));
+	LeaveCriticalSection(&queue_access);
+
+	idle_policy  = config->idle_policy;
+	idle_timeout = config->idle_timeout;
+	if(encoder_thread != NULL)
+		thread_set_scheduling(encoder_thread, config->affinity, config->priority);
+	if(idle_policy == ENCODER_IDLE_WARM)
+		start_encoding();
+}
+
 int stop_encoder_thread()
 {
-	// Set shutdown events and wait for thread to exit
-	SetEvent(shutdown_event);
-	SetEvent(queue_event);
-	WaitForSingleObject(encoder_thread, INFINITE);	
+	queue_entry_t *entry;
+
+	if(stop_encoding() != 0)
+		return -1;
+
+	// Free the pool
+	while((entry = pool_first) != NULL)
+	{
+		pool_first = entry->next;
+		free(entry);
+	}
+	pool_count = 0;
 	
 	// Clean up kernel objects
-	ResetEvent(shutdown_event);
 	CloseHandle(shutdown_event);
-	CloseHandle(encoder_thread);
+	CloseHandle(queue_event);
 	DeleteCriticalSection(&queue_access);
+	DeleteCriticalSection(&pool_access);
 
 	return 0;
 }
 
-int encoder_enqueue_raw_data( const short *samples, unsigned num_samples,
-							  unsigned channels, unsigned sampling_rate )
+/* Applies the idle policy to 'size' bytes of input: without listeners,
+   either keep encoding into the stream buffer (so listeners joining get a
+   burst of audio at once) or discard the data and stop the encoder thread.
+   Data may come from several host threads (and the mixer), so the idle
+   state and the encoder thread are changed under queue_access. Returns zero
+   if the data should be queued, positive if it should be discarded silently,
+   or negative if the encoder could not be started. */
+static int admit_data(unsigned __int64 now, unsigned size)
 {
-	int result;
-	unsigned samples_size;
-	queue_entry_t *entry;
+	unsigned clients = server_get_connected_clients();
+	int result = 0;
 
-	// Check if input data format is supported.
-	if(!( (channels == 1 || channels == 2) &&
-		  ( sampling_rate ==  8000 || sampling_rate == 11025 || sampling_rate == 12000 || 
-		    sampling_rate == 16000 || sampling_rate == 22050 || sampling_rate == 24000 ||
-			sampling_rate == 32000 || sampling_rate == 44100 || sampling_rate == 48000 ) ))
-		return -1;
+	EnterCriticalSection(&queue_access);
+	if(clients > 0)
+		idle_since = 0;
+	else if(idle_since == 0)
+		idle_since = now;
+	if( idle_since != 0 &&
+		( idle_policy == ENCODER_IDLE_STOP ||
+		  ( idle_policy == ENCODER_IDLE_TIMED &&
+		    now - idle_since >= (unsigned __int64)idle_timeout*1000000 ) ) )
+	{
+		// Runs on the host's audio thread: do not wait for the encoder
+		request_stop();
+		join_encoding(0);
+		result = 1;
+	}
+	else if(start_encoding() != 0)
+		result = -1;
+	LeaveCriticalSection(&queue_access);
 
-	// Do not encode data when no clients are connected.
-	if(server_get_connected_clients() == 0)
-		return 0;
+	if(result > 0)
+	{
+		counter_add_shared(&ingest_counters.idle, 1);
+		trace_event(TRACE_DROP, size);
+	}
+	else if(result < 0)
+	{
+		counter_add_shared(&ingest_counters.drops, 1);
+		trace_event(TRACE_DROP, size);
+	}
+	return result;
+}
 
-	result = 0;
-	samples_size = num_samples * channels * 2;
+/* Adds an entry to the encoder queue, or releases it if the queue is full. */
+static int append_entry(queue_entry_t *entry)
+{
+	int result = 0;
 
 	EnterCriticalSection(&queue_access);
-	if((entry  = (queue_entry_t*)malloc(sizeof(queue_entry_t) + samples_size)) == NULL)
+	if(queue_bytes + entry->samples_size > QUEUE_MAX_BYTES)
+	{
+		counter_add_shared(&ingest_counters.drops, 1);
+		trace_event(TRACE_DROP, entry->samples_size);
+		release_entry(entry);
 		result = -1;
+	}
 	else
 	{
-		// Copy data to queue entry
-		entry->samples_size = samples_size;
-		entry->channels = channels;
-		entry->sampling_rate = sampling_rate;
 		entry->next = NULL;
-		memcpy(((char*)entry) + sizeof(queue_entry_t), samples, samples_size);
-
-		// Add entry to the queue
 		if(!queue_first)
 			queue_first = queue_last = entry;
 		else
@@ -278,12 +1150,235 @@ int encoder_enqueue_raw_data( const short *samples, unsigned num_samples,
 			queue_last->next = entry;
 			queue_last = entry;
 		}
+		++queue_depth;
+		queue_bytes += entry->samples_size;
+		counter_add(&ingest_counters.blocks, 1);
+		if(!entry->encoded)
+			counter_add(&ingest_counters.bytes, entry->samples_size);
+		trace_event(TRACE_ENQUEUE, entry->samples_size);
 
 		// Signal that data is available
 		SetEvent(queue_event);
 	}
-
 	LeaveCriticalSection(&queue_access);
 
 	return result;
 }
+
+/* Checks the format of raw data and applies the idle policy to 'size' bytes
+   of it, then returns an entry to hold it, with *result set to zero.
+   Otherwise NULL is returned, and *result is positive if the data should be
+   discarded silently. */
+static queue_entry_t *new_raw_entry( unsigned size, unsigned channels,
+                                     unsigned sampling_rate, int *result )
+{
+	queue_entry_t *entry;
+
+	// Check if input data format is supported.
+	if(!( (channels == 1 || channels == 2) &&
+		  ( sampling_rate ==  8000 || sampling_rate == 11025 || sampling_rate == 12000 || 
+		    sampling_rate == 16000 || sampling_rate == 22050 || sampling_rate == 24000 ||
+			sampling_rate == 32000 || sampling_rate == 44100 || sampling_rate == 48000 ) ))
+	{
+		*result = -1;
+		return NULL;
+	}
+
+	if((*result = admit_data(server_time(), size)) != 0)
+		return NULL;
+
+	if((entry = acquire_entry(size)) == NULL)
+	{
+		counter_add_shared(&ingest_counters.drops, 1);
+		trace_event(TRACE_DROP, size);
+		*result = -1;
+		return NULL;
+	}
+
+	entry->samples_size = size;
+	entry->channels = channels;
+	entry->sampling_rate = sampling_rate;
+	entry->encoded = 0;
+	entry->mono = -1;
+	return entry;
+}
+
+int encoder_enqueue_raw_data( const short *samples, unsigned num_samples,
+							  unsigned channels, unsigned sampling_rate )
+{
+	int result;
+	queue_entry_t *entry;
+
+	if((entry = new_raw_entry(num_samples*channels*2, channels, sampling_rate, &result)) == NULL)
+		return (result > 0) ? 0 : -1;
+
+	// Copy data to queue entry
+	memcpy(((char*)entry) + sizeof(queue_entry_t), samples, entry->samples_size);
+	entry->timestamp = server_time();
+
+	return append_entry(entry);
+}
+
+int encoder_enqueue_raw_vector( const engine_block_t *blocks, unsigned count,
+                                unsigned channels, unsigned sampling_rate )
+{
+	int result;
+	unsigned size = 0, pos, n, block_size;
+	queue_entry_t *entry;
+
+	for(n = 0; n < count; ++n)
+		size += blocks[n].num_samples*channels*2;
+	if(size == 0)
+		return 0;
+	if((entry = new_raw_entry(size, channels, sampling_rate, &result)) == NULL)
+		return (result > 0) ? 0 : -1;
+
+	// Gather the blocks into a single queue entry
+	for(n = pos = 0; n < count; ++n)
+	{
+		block_size = blocks[n].num_samples*channels*2;
+		memcpy(((char*)entry) + sizeof(queue_entry_t) + pos, blocks[n].samples, block_size);
+		pos += block_size;
+	}
+	entry->timestamp = server_time();
+
+	return append_entry(entry);
+}
+
+short *encoder_acquire( unsigned num_samples, unsigned channels,
+                        unsigned sampling_rate, int *result )
+{
+	queue_entry_t *entry;
+
+	if(num_samples == 0)
+	{
+		*result = -1;
+		return NULL;
+	}
+	if((entry = new_raw_entry(num_samples*channels*2, channels, sampling_rate, result)) == NULL)
+		return NULL;
+	return (short*)(((char*)entry) + sizeof(queue_entry_t));
+}
+
+int encoder_commit(short *samples, unsigned num_samples)
+{
+	queue_entry_t *entry = (queue_entry_t*)(((char*)samples) - sizeof(queue_entry_t));
+	unsigned size = num_samples*entry->channels*2;
+
+	if(size == 0 || size > entry->samples_size)
+	{
+		// Nothing to queue (or more than was acquired); give the slot back
+		release_entry(entry);
+		return (size == 0) ? 0 : -1;
+	}
+
+	entry->samples_size = size;
+	entry->timestamp = server_time();
+	return append_entry(entry);
+}
+
+int encoder_enqueue_encoded_data(const char *data, unsigned length)
+{
+	int result;
+	unsigned __int64 now = server_time();
+	queue_entry_t *entry;
+	unsigned char *frames;
+	unsigned total, pos, out, discarded;
+	codec_frame_t frame, next;
+
+	if((result = admit_data(now, length)) != 0)
+	{
+		passthrough_state.carry_size = 0;
+		return (result > 0) ? 0 : -1;
+	}
+
+	// Join the partial frame left from the last call with the new data
+	total = passthrough_state.carry_size + length;
+	if((entry = acquire_entry(total)) == NULL)
+	{
+		counter_add_shared(&ingest_counters.drops, 1);
+		trace_event(TRACE_DROP, length);
+		return -1;
+	}
+	frames = ((unsigned char*)entry) + sizeof(queue_entry_t);
+	memcpy(frames, passthrough_state.carry, passthrough_state.carry_size);
+	memcpy(frames + passthrough_state.carry_size, data, length);
+
+	// Keep complete frames only, discarding anything between them (e.g.
+	// tags); a frame must be followed by another valid header if the data
+	// goes on, so that a false sync in the audio data is not taken.
+	pos = out = discarded = 0;
+	while(pos + 4 <= total)
+	{
+		if( mp3_parse_header(frames + pos, &frame) != 0 ||
+			( pos + frame.size + 4 <= total &&
+			  mp3_parse_header(frames + pos + frame.size, &next) != 0 ) )
+		{
+			++pos;
+			++discarded;
+			continue;
+		}
+		if(pos + frame.size > total)
+			break;  // incomplete frame
+		memmove(frames + out, frames + pos, frame.size);
+		out += frame.size;
+		pos += frame.size;
+	}
+	passthrough_state.carry_size = total - pos;
+	memcpy(passthrough_state.carry, frames + pos, passthrough_state.carry_size);
+	if(discarded != 0)
+		counter_add(&passthrough_counters.discarded, discarded);
+
+	if(out == 0)
+	{
+		release_entry(entry);
+		return 0;
+	}
+	counter_add(&passthrough_counters.bytes, out);
+
+	entry->samples_size = out;
+	entry->channels = 0;
+	entry->sampling_rate = 0;
+	entry->encoded = 1;
+	entry->mono = -1;
+	entry->timestamp = now;
+
+	return append_entry(entry);
+}
+
+void encoder_get_stats(engine_stats_t *stats)
+{
+	stats->queue_depth   = queue_depth;
+	stats->queue_bytes   = queue_bytes;
+	stats->ingest_blocks = counter_read(&ingest_counters.blocks);
+	stats->ingest_drops  = counter_read(&ingest_counters.drops);
+	stats->ingest_idle   = counter_read(&ingest_counters.idle);
+	stats->bytes_in      = counter_read(&ingest_counters.bytes);
+
+	stats->audio_time    = counter_read(&encoder_counters.audio_time);
+	stats->encode_time   = counter_read(&encoder_counters.encode_time);
+	stats->bytes_encoded = counter_read(&encoder_counters.bytes_out);
+	stats->pace_time     = counter_read(&encoder_counters.pace_time);
+	stats->silent_frames = counter_read(&encoder_counters.silent_frames);
+	stats->passthrough_bytes     = counter_read(&passthrough_counters.bytes);
+	stats->passthrough_discarded = counter_read(&passthrough_counters.discarded);
+	stats->encoder_preset  = governor_preset;
+	stats->encoder_bitrate = (mono_bitrate != 0) ? mono_bitrate : governor_bitrate;
+	stats->governor_steps_down = counter_read(&encoder_counters.steps_down);
+	stats->governor_steps_up   = counter_read(&encoder_counters.steps_up);
+	stats->encoder_mono  = (mono_bitrate != 0);
+	stats->mono_switches = counter_read(&encoder_counters.mono_switches);
+	pacer_get_stats(stats);
+	stats->realtime_factor = (stats->encode_time == 0) ? 0.0 :
+		(double)(__int64)stats->audio_time / (double)(__int64)stats->encode_time;
+	latency_merge(&stats->latency_queue,  &encoder_counters.latency_queue);
+	latency_merge(&stats->latency_encode, &encoder_counters.latency_encode);
+
+	EnterCriticalSection(&queue_access);
+	stats->encoder_running  = (encoder_thread != NULL && !encoder_stopping);
+	stats->encoder_starts   = encoder_starts;
+	stats->encoder_cpu_time = encoder_cpu_time;
+	if(encoder_thread != NULL)
+		stats->encoder_cpu_time += thread_cpu_time(encoder_thread);
+	LeaveCriticalSection(&queue_access);
+}
@@ -6,14 +6,41 @@
 
 // Function prototypes
 int engine_initialize(const engine_config_t *config, ENGINE_HANDLE *engine);
+int engine_initialize_handover( const engine_config_t *config,
+                                const char *pipe_name, ENGINE_HANDLE *engine );
 int engine_encode( ENGINE_HANDLE engine,
 				   const short *samples, unsigned num_samples,
 				   unsigned channels, unsigned sampling_rate );
+short *engine_acquire( ENGINE_HANDLE engine, unsigned num_samples,
+                       unsigned channels, unsigned sampling_rate, int *result );
+int engine_commit(ENGINE_HANDLE engine, short *samples, unsigned num_samples);
+int engine_encode_vector( ENGINE_HANDLE engine,
+                          const engine_block_t *blocks, unsigned count,
+                          unsigned channels, unsigned sampling_rate );
+int engine_submit_encoded(ENGINE_HANDLE engine, const char *data, unsigned length);
+int engine_mixer_start( ENGINE_HANDLE engine,
+                        unsigned sampling_rate, unsigned channels );
+int engine_mixer_stop(ENGINE_HANDLE engine);
+int engine_port_open(ENGINE_HANDLE engine, const char *name, unsigned tolerance);
+int engine_port_set_gain(ENGINE_HANDLE engine, int port, double gain);
+int engine_port_write( ENGINE_HANDLE engine, int port,
+                       const short *samples, unsigned num_samples,
+                       unsigned channels, unsigned sampling_rate );
+int engine_port_close(ENGINE_HANDLE engine, int port);
 void engine_get_default_config(engine_config_t *config);
 void engine_get_current_config(ENGINE_HANDLE engine, engine_config_t *config);
 int engine_set_current_config(ENGINE_HANDLE engine, engine_config_t *config);
 int engine_update_title(ENGINE_HANDLE engine, const char *title );
 unsigned engine_connections(ENGINE_HANDLE engine);
+int engine_get_stats(ENGINE_HANDLE engine, engine_stats_t *stats);
+unsigned engine_get_listener_stats( ENGINE_HANDLE engine,
+                                    engine_listener_stats_t *listeners,
+                                    unsigned max_listeners );
+unsigned engine_get_port_stats( ENGINE_HANDLE engine,
+                                engine_port_stats_t *ports, unsigned max_ports );
+int engine_trace_dump(ENGINE_HANDLE engine, const char *path);
+int engine_trace_dump_on_anomaly(ENGINE_HANDLE engine, const char *path);
+int engine_handover(ENGINE_HANDLE engine, const char *pipe_name, unsigned timeout);
 int engine_cleanup(ENGINE_HANDLE engine);
 
 // Default configuration
@@ -23,24 +50,68 @@ int engine_cleanup(ENGINE_HANDLE engine);
 #define DEFAULT_ADDRESS         (0)
 #define DEFAULT_PORT            (8000)
 #define DEFAULT_CONNECTIONLIMIT (5)
+#define DEFAULT_METADATAINTERVAL (16384)
+#define DEFAULT_BURSTSIZE       (65536)
+#define DEFAULT_IDLEPOLICY      (ENCODER_IDLE_STOP)
+#define DEFAULT_IDLETIMEOUT     (60)
+#define DEFAULT_PRESET          (ENCODER_PRESET_HIGH)
+#define DEFAULT_GOVERNOR        (ENCODER_GOVERNOR_PRESET)
+#define DEFAULT_ENCODERPRIORITY (ENGINE_PRIORITY_ABOVE_NORMAL)
+#define DEFAULT_SERVERPRIORITY  (ENGINE_PRIORITY_NORMAL)
+#define DEFAULT_CODEC           (ENCODER_CODEC_MP3)
+#define DEFAULT_WORKERS         (0)
+#define DEFAULT_MONOBITRATE     (0)
+#define DEFAULT_AFFINITY        (0)
+#define DEFAULT_LOWLATENCY      (0)
+#define DEFAULT_TIMESHIFT       (0)
+#define DEFAULT_HLSDURATION     (0)
+#define DEFAULT_ROTATETIME      (3600)
+#define DEFAULT_ROTATESIZE      (0)
+#define DEFAULT_RECORDPATH      ""
+
+// Max. milliseconds to wait for a busy handover pipe
+#define HANDOVER_CONNECT_TIMEOUT (5000)
 
 
 // Global variables
 static const engine_config_t default_config = {
-    { DEFAULT_BITRATE, DEFAULT_CHANNELS },
-    { DEFAULT_ADDRESS, DEFAULT_PORT, DEFAULT_CONNECTIONLIMIT, DEFAULT_STREAMNAME }
+    { DEFAULT_BITRATE, DEFAULT_CHANNELS, DEFAULT_IDLEPOLICY, DEFAULT_IDLETIMEOUT,
+      DEFAULT_PRESET, DEFAULT_GOVERNOR, DEFAULT_ENCODERPRIORITY, DEFAULT_CODEC,
+      DEFAULT_WORKERS, DEFAULT_MONOBITRATE, DEFAULT_AFFINITY },
+    { DEFAULT_ADDRESS, DEFAULT_PORT, DEFAULT_CONNECTIONLIMIT, DEFAULT_METADATAINTERVAL,
+      DEFAULT_BURSTSIZE, DEFAULT_SERVERPRIORITY, DEFAULT_AFFINITY, DEFAULT_LOWLATENCY,
+      DEFAULT_TIMESHIFT, DEFAULT_HLSDURATION,
+      DEFAULT_STREAMNAME },
+    { DEFAULT_ROTATETIME, DEFAULT_ROTATESIZE, DEFAULT_RECORDPATH }
 };
 
+static unsigned __int64 last_shutdown_time;	// duration of last shutdown
+
 static engine_config_t current_config = {
-    { DEFAULT_BITRATE, DEFAULT_CHANNELS },
-    { DEFAULT_ADDRESS, DEFAULT_PORT, DEFAULT_CONNECTIONLIMIT, DEFAULT_STREAMNAME }
+    { DEFAULT_BITRATE, DEFAULT_CHANNELS, DEFAULT_IDLEPOLICY, DEFAULT_IDLETIMEOUT,
+      DEFAULT_PRESET, DEFAULT_GOVERNOR, DEFAULT_ENCODERPRIORITY, DEFAULT_CODEC,
+      DEFAULT_WORKERS, DEFAULT_MONOBITRATE, DEFAULT_AFFINITY },
+    { DEFAULT_ADDRESS, DEFAULT_PORT, DEFAULT_CONNECTIONLIMIT, DEFAULT_METADATAINTERVAL,
+      DEFAULT_BURSTSIZE, DEFAULT_SERVERPRIORITY, DEFAULT_AFFINITY, DEFAULT_LOWLATENCY,
+      DEFAULT_TIMESHIFT, DEFAULT_HLSDURATION,
+      DEFAULT_STREAMNAME },
+    { DEFAULT_ROTATETIME, DEFAULT_ROTATESIZE, DEFAULT_RECORDPATH }
 };
 
+/* Gives the calling application thread a flight recorder ring, if it does not
+   have one yet. The application may call in from more than one thread. */
+static void trace_host_thread()
+{
+	if(!trace_attached())
+		trace_attach("host", TRACE_EVENTS_DEFAULT);
+}
+
 static void update_config(const engine_config_t *config)
 {
     memcpy(&current_config, config, sizeof(current_config));
 	current_config.network.stream_name[
 		sizeof(current_config.network.stream_name)-1 ] = '\0';
+	current_config.recorder.path[sizeof(current_config.recorder.path)-1] = '\0';
 }
 
 int engine_initialize(const engine_config_t *config, ENGINE_HANDLE *engine)
@@ -52,15 +123,70 @@ int engine_initialize(const engine_config_t *config, ENGINE_HANDLE *engine)
 
 	update_config(config);
 
+	trace_initialize();
+	trace_host_thread();
+
 	if(start_encoder_thread(&config->encoder) != 0)
+	{
+		trace_finalize();
 		return 1;
+	}
 
 	if(start_server_thread(&config->network) != 0)
 	{
 		stop_encoder_thread(); 
+		trace_finalize();
+		return 2;
+	}
+
+	// Recording is not essential to streaming; failures show in the stats
+	recorder_start(&config->recorder, config->network.affinity, config->network.priority);
+
+	mixer_initialize();
+	*engine = (engine_instance_t*)malloc(sizeof(engine_instance_t));
+
+	return 0;
+}
+
+int engine_initialize_handover( const engine_config_t *config,
+                                const char *pipe_name, ENGINE_HANDLE *engine )
+{
+	void *pipe;
+	int result;
+
+	if((pipe = handover_connect(pipe_name, HANDOVER_CONNECT_TIMEOUT)) == NULL)
+		return engine_initialize(config, engine);
+
+	if(!config)
+		config = &default_config;
+
+	*engine = 0;
+
+	update_config(config);
+
+	trace_initialize();
+	trace_host_thread();
+
+	// Take over the server first, so listeners are served from the buffer
+	// while the encoder starts
+	result = server_handover_receive(&config->network, pipe);
+	handover_close(pipe);
+	if(result != 0)
+	{
+		trace_finalize();
 		return 2;
 	}
 
+	if(start_encoder_thread(&config->encoder) != 0)
+	{
+		stop_server_thread();
+		trace_finalize();
+		return 1;
+	}
+
+	recorder_start(&config->recorder, config->network.affinity, config->network.priority);
+
+	mixer_initialize();
 	*engine = (engine_instance_t*)malloc(sizeof(engine_instance_t));
 
 	return 0;
@@ -70,9 +196,73 @@ int engine_encode( ENGINE_HANDLE engine,
 				   const short *samples, unsigned num_samples,
 				   unsigned channels, unsigned sampling_rate )
 {
+	trace_host_thread();
 	return encoder_enqueue_raw_data( samples, num_samples, channels, sampling_rate );
 }
 
+short *engine_acquire( ENGINE_HANDLE engine, unsigned num_samples,
+                       unsigned channels, unsigned sampling_rate, int *result )
+{
+	trace_host_thread();
+	return encoder_acquire(num_samples, channels, sampling_rate, result);
+}
+
+int engine_commit(ENGINE_HANDLE engine, short *samples, unsigned num_samples)
+{
+	trace_host_thread();
+	return encoder_commit(samples, num_samples);
+}
+
+int engine_encode_vector( ENGINE_HANDLE engine,
+                          const engine_block_t *blocks, unsigned count,
+                          unsigned channels, unsigned sampling_rate )
+{
+	trace_host_thread();
+	return encoder_enqueue_raw_vector(blocks, count, channels, sampling_rate);
+}
+
+int engine_submit_encoded(ENGINE_HANDLE engine, const char *data, unsigned length)
+{
+	trace_host_thread();
+	return encoder_enqueue_encoded_data(data, length);
+}
+
+int engine_mixer_start( ENGINE_HANDLE engine,
+                        unsigned sampling_rate, unsigned channels )
+{
+	trace_host_thread();
+	return mixer_start( sampling_rate, channels, current_config.encoder.affinity,
+	                    current_config.encoder.priority );
+}
+
+int engine_mixer_stop(ENGINE_HANDLE engine)
+{
+	return mixer_stop();
+}
+
+int engine_port_open(ENGINE_HANDLE engine, const char *name, unsigned tolerance)
+{
+	return mixer_port_open(name, tolerance);
+}
+
+int engine_port_set_gain(ENGINE_HANDLE engine, int port, double gain)
+{
+	return mixer_port_set_gain(port, gain);
+}
+
+int engine_port_write( ENGINE_HANDLE engine, int port,
+                       const short *samples, unsigned num_samples,
+                       unsigned channels, unsigned sampling_rate )
+{
+	trace_host_thread();
+	return mixer_port_write(port, samples, num_samples, channels, sampling_rate);
+}
+
+int engine_port_close(ENGINE_HANDLE engine, int port)
+{
+	return mixer_port_close(port);
+}
+
 void engine_get_default_config(engine_config_t *config)
 {
     memcpy(config, &default_config, sizeof(*config));
@@ -85,34 +275,77 @@ void engine_get_current_config(ENGINE_HANDLE engine, engine_config_t *config)
 
 int engine_set_current_config(ENGINE_HANDLE engine, engine_config_t *config)
 {
-	int restart_encoder =
-        config->encoder.bitrate  != current_config.encoder.bitrate  ||
-        config->encoder.channels != current_config.encoder.channels;
-    int restart_server =
-        config->network.address          != current_config.network.address ||
-        config->network.port             != current_config.network.port ||
-        config->network.connection_limit != current_config.network.connection_limit ||
-        config->network.stream_name      != current_config.network.stream_name;
+	int result = 0;
+	int update_encoder =
+        config->encoder.bitrate      != current_config.encoder.bitrate  ||
+        config->encoder.channels     != current_config.encoder.channels ||
+        config->encoder.idle_policy  != current_config.encoder.idle_policy ||
+        config->encoder.idle_timeout != current_config.encoder.idle_timeout ||
+        config->encoder.preset       != current_config.encoder.preset ||
+        config->encoder.governor     != current_config.encoder.governor ||
+        config->encoder.priority     != current_config.encoder.priority ||
+        config->encoder.codec        != current_config.encoder.codec ||
+        config->encoder.workers      != current_config.encoder.workers ||
+        config->encoder.mono_bitrate != current_config.encoder.mono_bitrate ||
+        config->encoder.affinity     != current_config.encoder.affinity;
+    int update_server =
+        config->network.address           != current_config.network.address ||
+        config->network.port              != current_config.network.port ||
+        config->network.connection_limit  != current_config.network.connection_limit ||
+        config->network.metadata_interval != current_config.network.metadata_interval ||
+        config->network.burst_size        != current_config.network.burst_size ||
+        config->network.priority          != current_config.network.priority ||
+        config->network.affinity          != current_config.network.affinity ||
+        config->network.low_latency       != current_config.network.low_latency ||
+        strncmp( config->network.stream_name, current_config.network.stream_name,
+                 sizeof(config->network.stream_name) ) != 0;
+    int update_recorder =
+        config->recorder.rotate_time != current_config.recorder.rotate_time ||
+        config->recorder.rotate_size != current_config.recorder.rotate_size ||
+        config->network.priority     != current_config.network.priority ||
+        config->network.affinity     != current_config.network.affinity ||
+        strncmp( config->recorder.path, current_config.recorder.path,
+                 sizeof(config->recorder.path) ) != 0;
 
-	// FIXME: return non-zero on error!
+	// The archive and the segmenter are opened with the server, and clients
+	// may be reading them; keep their sizes until the engine restarts
+	if( config->network.timeshift_size != current_config.network.timeshift_size ||
+		config->network.hls_duration   != current_config.network.hls_duration )
+	{
+		config->network.timeshift_size = current_config.network.timeshift_size;
+		config->network.hls_duration   = current_config.network.hls_duration;
+		result = -1;
+	}
 
-    if(restart_encoder)
-		stop_encoder_thread();
-    if(restart_server)
-        stop_server_thread();
+	trace_host_thread();
+	if(update_encoder || update_server || update_recorder)
+		trace_event( TRACE_RESTART,
+		             (update_encoder  ? TRACE_RESTART_ENCODER  : 0) |
+		             (update_server   ? TRACE_RESTART_SERVER   : 0) |
+		             (update_recorder ? TRACE_RESTART_RECORDER : 0) );
+
+    if(update_server && server_update_config(&config->network) != 0)
+	{
+		// Keep listening on the old address
+		config->network.address = current_config.network.address;
+		config->network.port    = current_config.network.port;
+		result = -1;
+	}
+    if(update_encoder)
+        encoder_update_config(&config->encoder);
+    if( update_recorder &&
+        recorder_update_config( &config->recorder, config->network.affinity,
+                                config->network.priority ) != 0 )
+        result = -1;
 
 	update_config(config);
-    
-    if(restart_server)
-        start_server_thread(&config->network);
-    if(restart_encoder)
-        start_encoder_thread(&config->encoder);
 
-	return 0;
+	return result;
 }
 
 int engine_update_title(ENGINE_HANDLE engine, const char *title)
 {
+	trace_host_thread();
 	server_update_title(title);
 	return 0;
 }
@@ -122,10 +355,103 @@ unsigned engine_connections(ENGINE_HANDLE engine)
 	return server_get_connected_clients();
 }
 
+int engine_get_stats(ENGINE_HANDLE engine, engine_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	encoder_get_stats(stats);
+	mixer_get_stats(stats);
+	server_get_stats(stats);
+	recorder_get_stats(stats);
+	stats->shutdown_time = last_shutdown_time;
+	return 0;
+}
+
+unsigned engine_get_listener_stats( ENGINE_HANDLE engine,
+                                    engine_listener_stats_t *listeners,
+                                    unsigned max_listeners )
+{
+	return server_get_listener_stats(listeners, max_listeners);
+}
+
+unsigned engine_get_port_stats( ENGINE_HANDLE engine,
+                                engine_port_stats_t *ports, unsigned max_ports )
+{
+	return mixer_get_port_stats(ports, max_ports);
+}
+
+int engine_trace_dump(ENGINE_HANDLE engine, const char *path)
+{
+	return trace_dump(path);
+}
+
+int engine_trace_dump_on_anomaly(ENGINE_HANDLE engine, const char *path)
+{
+	trace_set_anomaly_path(path);
+	return 0;
+}
+
+int engine_handover(ENGINE_HANDLE engine, const char *pipe_name, unsigned timeout)
+{
+	void *pipe;
+	unsigned long process_id;
+	int result = 0, handover;
+
+	if((pipe = handover_listen(pipe_name, timeout, &process_id)) == NULL)
+		return 1;  // nothing was stopped
+
+	// Stop mixing before the encoder, which the mixer feeds
+	if(mixer_stop() != 0)
+		result = -1;
+	else
+		mixer_finalize();
+	if(stop_encoder_thread() != 0)
+		result = -1;
+	if(recorder_stop() != 0)
+		result = -1;
+	if((handover = server_handover_send(pipe, process_id)) != 0)
+		result = -1;
+	handover_close(pipe);
+	if(handover > 0)
+	{
+		// The new process did not take over, and the server is still
+		// serving the listeners; start encoding again. The engine keeps
+		// running, so the handle stays valid.
+		start_encoder_thread(&current_config.encoder);
+		recorder_start( &current_config.recorder, current_config.network.affinity,
+		                current_config.network.priority );
+		mixer_initialize();
+		return 1;
+	}
+
+	// Handed over, or shut down part way; either way the engine is gone
+	if(result == 0)
+		trace_finalize();
+	free((void*)engine);
+
+	return result;
+}
+
 int engine_cleanup(ENGINE_HANDLE engine)
 {
-	stop_encoder_thread();
-	stop_server_thread();
+	unsigned __int64 start = server_time();
+	int result = 0;
+
+	if(mixer_stop() != 0)
+		result = -1;
+	else
+		mixer_finalize();
+	if(stop_encoder_thread() != 0)
+		result = -1;
+	if(recorder_stop() != 0)
+		result = -1;
+	if(stop_server_thread() != 0)
+		result = -1;
+	last_shutdown_time = server_time() - start;
+
+	// Threads that did not exit may still record events
+	if(result == 0)
+		trace_finalize();
 	free((void*)engine);
-	return 0;
+
+	return result;
 }
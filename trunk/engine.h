@@ -21,6 +21,63 @@ struct engine_instance_t;
 #define CHANNELS_STEREO (1)
 #define CHANNELS_JOINT  (2)
 
+// Constants to control what the encoder does while no listeners are connected.
+#define ENCODER_IDLE_STOP   (0)   /* discard audio; stop the encoder thread */
+#define ENCODER_IDLE_WARM   (1)   /* keep encoding into the stream buffer, so
+                                     listeners joining get a burst at once */
+#define ENCODER_IDLE_TIMED  (2)   /* keep encoding for idle_timeout seconds
+                                     after the last listener left, then stop */
+
+// Constants to select the encoder preset, trading quality for CPU time.
+#define ENCODER_PRESET_HIGH     (0)   /* best quality; most CPU time */
+#define ENCODER_PRESET_NORMAL   (1)
+#define ENCODER_PRESET_FAST     (2)
+#define ENCODER_PRESET_FASTEST  (3)   /* least CPU time */
+#define ENCODER_PRESETS         (4)
+
+// Constants to select the encoder backend.
+#define ENCODER_CODEC_MP3    (0)  /* MP3 through the LAME DLL */
+#define ENCODER_CODEC_PCM    (1)  /* uncompressed 16-bit PCM in WAV; no CPU
+                                     time, for fast local networks */
+#define ENCODER_CODEC_ADPCM  (2)  /* IMA ADPCM in WAV (4:1); little CPU time,
+                                     for local networks and monitoring */
+#define ENCODER_CODEC_MP3_LITE (3)  /* experimental: MP3 through the
+                                       built-in encoder, without a
+                                       psychoacoustic model; lower quality
+                                       than LAME, 32 to 48 kHz. Not yet
+                                       checked with a reference decoder,
+                                       and about 45 times real time per
+                                       128 kbps stereo stream, so it saves
+                                       CPU time only against LAME's slower
+                                       presets */
+
+// Constants to control what the encoder may change when it cannot keep up.
+// Each step restarts the encoder, which leaves a gap in the audio that
+// listeners can hear: the last frame of the old stream is padded with
+// silence, and the new stream starts with the encoder delay, together about
+// one to two frames (25 to 50 ms). Steps are therefore taken at quiet moments
+// of the input where possible (waiting at most 10 seconds for one), and at
+// most every 30 seconds.
+#define ENCODER_GOVERNOR_OFF     (0)  /* always use the configured settings */
+#define ENCODER_GOVERNOR_PRESET  (1)  /* step down to faster presets */
+#define ENCODER_GOVERNOR_BITRATE (2)  /* step down to faster presets, then
+                                         to lower bitrates (down to half) */
+
+// Constants to set thread priorities, relative to the priority class of the
+// process (as for SetThreadPriority()).
+#define ENGINE_PRIORITY_LOWEST        (-2)
+#define ENGINE_PRIORITY_BELOW_NORMAL  (-1)
+#define ENGINE_PRIORITY_NORMAL         (0)
+#define ENGINE_PRIORITY_ABOVE_NORMAL   (1)
+#define ENGINE_PRIORITY_HIGHEST        (2)
+#define ENGINE_PRIORITY_TIME_CRITICAL (15)  /* preempts all other threads of
+                                               the process; use with care */
+
+// Largest time-shift archive, in megabytes; it is mapped into the address
+// space of the process in one piece, which a 32-bit process rarely has room
+// for beyond a few hundred megabytes.
+#define ENGINE_MAX_TIMESHIFT (256)
+
 // Names used
 #define MINICAST_NAME      "Minicast"
 #define MINICAST_FULL_NAME "Minicast 1.5"
@@ -32,7 +89,33 @@ typedef struct encoder_config
     short
         bitrate,        /* 8, 16, 24, 32, 40, 48, 56, 64, 80, 96,
                            112, 128, 144, 160, 192, 224, 256, 320 */
-        channels;       /* 0 (mono), 1 (stereo), 2 (joint) */
+        channels,       /* 0 (mono), 1 (stereo), 2 (joint) */
+        idle_policy,    /* ENCODER_IDLE_STOP, _WARM or _TIMED */
+        idle_timeout,   /* in seconds, for ENCODER_IDLE_TIMED */
+        preset,         /* ENCODER_PRESET_HIGH to _FASTEST */
+        governor,       /* ENCODER_GOVERNOR_OFF, _PRESET or _BITRATE */
+        priority,       /* ENGINE_PRIORITY_* for the encoder thread */
+        codec,          /* ENCODER_CODEC_MP3, _PCM, _ADPCM or _MP3_LITE;
+                           bitrate applies to both MP3 backends, preset
+                           and governor to LAME only */
+        workers,        /* threads to encode segments of the stream on
+                           in parallel (up to 8), for streams one
+                           processor cannot encode in real time; 0 or 1
+                           for the encoder thread alone */
+        mono_bitrate;   /* bitrate to encode stereo input at while its
+                           channels are the same (as mono, for the MP3
+                           backends); 0 to always encode it as stereo.
+                           Switching restarts the encoder, which leaves a
+                           gap of a few tens of milliseconds, so it waits
+                           for quiet input to hide the gap in; the switch
+                           to mono follows 3 seconds of such input and
+                           comes at least 30 seconds after the last switch,
+                           the switch back follows 250 ms of stereo input
+                           (at the latest 10 seconds later, if the input
+                           is not quiet by then) */
+    unsigned long
+        affinity;       /* mask of processors the encoder thread may run
+                           on; 0 for any */
 } encoder_config_t;
 
 
@@ -43,19 +126,209 @@ typedef struct network_config
     unsigned short port;        /* in native order */
     unsigned short connection_limit;	/* maximum number of connected
 										   clients allowed */
+    unsigned short metadata_interval;	/* audio bytes between metadata
+										   packets sent to clients */
+    unsigned long  burst_size;			/* buffered audio bytes sent at once
+										   to clients joining (0 for none) */
+    short          priority;			/* ENGINE_PRIORITY_* for the server
+										   and client threads */
+    unsigned long  affinity;			/* mask of processors the server and
+										   client threads may run on; 0 for
+										   any */
+    short          low_latency;			/* 1 for live monitoring: clients
+										   start at the live position (no
+										   burst), frames are sent without
+										   delay (TCP_NODELAY) through a
+										   small socket send buffer, and
+										   clients more than 500 ms behind
+										   skip ahead */
+    unsigned short timeshift_size;		/* megabytes of the stream kept for
+										   listeners joining in the past
+										   ("/?offset=-<seconds>"), about a
+										   minute per megabyte at 128 kbps
+										   (up to ENGINE_MAX_TIMESHIFT, about
+										   4.5 hours at 128 kbps); 0 for
+										   none. Applies
+										   when the server starts */
+    unsigned short hls_duration;		/* seconds per segment of the HLS
+										   playlist served at /live.m3u8
+										   (MP3 streams only); 0 for none.
+										   Applies when the server starts */
     char           stream_name[64];		/* stream name */
 } network_config_t;
 
 
+// Configuration for recording the stream to disk.
+typedef struct recorder_config
+{
+    unsigned long  rotate_time;         /* seconds after which a new file is
+                                           started (at least 60); 0 for no
+                                           limit */
+    unsigned long  rotate_size;         /* megabytes after which a new file
+                                           is started; 0 for no limit */
+    char           path[260];           /* directory and file name prefix of
+                                           recordings (e.g. C:\Archive\show-),
+                                           to which the start time and an
+                                           extension are added; empty to not
+                                           record */
+} recorder_config_t;
+
+
 /* Engine configuration; consists of a stream name and configurations for the
-   data encoder and network server. */
+   data encoder, network server and recorder. */
 typedef struct engine_config
 {
-    encoder_config_t encoder;
-    network_config_t network;
+    encoder_config_t  encoder;
+    network_config_t  network;
+    recorder_config_t recorder;
 } engine_config_t;
 
 
+/* Latency histogram. Bucket 0 counts latencies below 1 microsecond and bucket
+   i > 0 counts latencies from 2^(i-1) up to 2^i microseconds; the last bucket
+   also counts everything longer. */
+#define LATENCY_BUCKETS (27)
+
+typedef struct engine_latency
+{
+    unsigned __int64 count;             /* number of measurements */
+    unsigned __int64 total;             /* sum of measured latencies */
+    unsigned __int64 buckets[LATENCY_BUCKETS];
+} engine_latency_t;
+
+
+/* Engine statistics. Byte and event counters are totals since the engine was
+   first initialized; times are in microseconds. */
+typedef struct engine_stats
+{
+    // Ingest (engine_encode)
+    unsigned         queue_depth;       /* raw data blocks waiting for the encoder */
+    unsigned         queue_bytes;       /* raw data bytes waiting for the encoder */
+    unsigned __int64 ingest_blocks;     /* blocks accepted for encoding */
+    unsigned __int64 ingest_drops;      /* blocks lost because the encoder
+                                           queue was full or the encoder
+                                           could not be started */
+    unsigned __int64 ingest_idle;       /* blocks discarded on purpose by the
+                                           idle policy while no listener was
+                                           connected */
+    unsigned __int64 bytes_in;          /* raw data bytes accepted */
+
+    // Encoder
+    double           realtime_factor;   /* audio time encoded per unit of time
+                                           spent encoding (0 if unknown) */
+    unsigned __int64 audio_time;        /* duration of audio encoded */
+    unsigned __int64 encode_time;       /* time spent encoding */
+    unsigned __int64 bytes_encoded;     /* encoded bytes produced */
+    unsigned         encoder_running;   /* 1 if the encoder thread is running */
+    unsigned __int64 encoder_starts;    /* times the encoder thread was started */
+    unsigned __int64 encoder_cpu_time;  /* CPU time used by the encoder thread */
+    unsigned __int64 pace_time;         /* time the encoder was held back to
+                                           publish frames in real time */
+    unsigned __int64 paced_frames;      /* encoded frames published */
+    unsigned __int64 pace_resyncs;      /* times the pacer clock restarted
+                                           because input fell behind */
+    unsigned __int64 pace_dropped;      /* encoded bytes dropped because they
+                                           were not at a frame boundary */
+    unsigned __int64 silent_frames;     /* silent frames sent to listeners
+                                           while no input arrived */
+    unsigned __int64 passthrough_bytes; /* MP3 bytes accepted from
+                                           engine_submit_encoded() */
+    unsigned __int64 passthrough_discarded; /* bytes discarded from it because
+                                           they were not part of a frame */
+    unsigned         encoder_preset;    /* preset in use (may be faster than
+                                           configured; see governor) */
+    unsigned         encoder_bitrate;   /* bitrate in use, in kbps */
+    unsigned __int64 governor_steps_down; /* times the governor lowered the
+                                           preset or bitrate under load */
+    unsigned __int64 governor_steps_up; /* times it raised them again */
+    unsigned         encoder_mono;      /* 1 while stereo input is encoded as
+                                           mono (see mono_bitrate) */
+    unsigned __int64 mono_switches;     /* times the encoder switched between
+                                           mono and stereo */
+
+    // Mixer (engine_mixer_start)
+    unsigned         mixer_running;     /* 1 if the mixer thread is running */
+    unsigned __int64 mixer_blocks;      /* blocks mixed */
+    unsigned __int64 mixer_cpu_time;    /* CPU time used by the mixer thread */
+
+    // Network server
+    unsigned         ring_size;         /* size of the stream buffer */
+    unsigned         ring_fill;         /* bytes of stream data buffered */
+    unsigned         listeners;         /* number of connected listeners */
+    unsigned __int64 bytes_out;         /* bytes sent to listeners */
+    unsigned __int64 overruns;          /* times a listener fell a full buffer behind */
+    unsigned __int64 handshakes;        /* HTTP requests answered */
+    unsigned __int64 rejects;           /* listeners refused because the server was full */
+    unsigned __int64 syscalls;          /* socket calls made (accept, recv, send) */
+    unsigned __int64 server_cpu_time;   /* CPU time used by the server thread */
+    unsigned __int64 clients_cpu_time;  /* CPU time used by client threads */
+    unsigned         timeshift_size;    /* size of the time-shift archive (0 if
+                                           there is none) */
+    unsigned         timeshift_fill;    /* bytes of stream data archived */
+    unsigned __int64 timeshift_time;    /* microseconds of the stream archived */
+    unsigned __int64 hls_segments;      /* HLS segments completed */
+    unsigned __int64 hls_requests;      /* HLS playlists and segments served */
+
+    // Recorder
+    unsigned         recorder_running;  /* 1 if the recorder thread is running */
+    unsigned __int64 recorder_bytes;    /* stream bytes recorded */
+    unsigned __int64 recorder_files;    /* files started */
+    unsigned __int64 recorder_dropped;  /* stream bytes lost because the disk
+                                           fell behind or a file could not be
+                                           written */
+    unsigned __int64 recorder_errors;   /* files that could not be created or
+                                           written */
+
+    // Latency per stage, from raw data entering engine_encode() to encoded
+    // data leaving the server in send()
+    engine_latency_t latency_queue;     /* waiting in the encoder queue */
+    engine_latency_t latency_encode;    /* encoding a chunk */
+    engine_latency_t latency_ring;      /* buffered until sent to a listener */
+    engine_latency_t latency_total;     /* engine_encode() to send() */
+    engine_latency_t latency_start;     /* listener connection to first audio sent */
+    engine_latency_t latency_mix;       /* mixing a block (wall time, including
+                                           waits for the ports and the encoder
+                                           queue; see mixer_cpu_time for the
+                                           CPU time) */
+
+    // Engine
+    unsigned __int64 shutdown_time;     /* duration of the last engine shutdown
+                                           in this process (e.g. before a
+                                           restart); 0 if none */
+} engine_stats_t;
+
+// Per-listener statistics.
+typedef struct engine_listener_stats
+{
+    unsigned long    address;           /* in native order */
+    unsigned __int64 connected_time;    /* time since the listener connected */
+    unsigned __int64 bytes_sent;        /* bytes sent to the listener */
+    unsigned         lag;               /* bytes behind the live stream position */
+    unsigned         overruns;          /* times the listener fell a full buffer behind */
+    unsigned __int64 latency;           /* mean time from engine_encode() to send() */
+    unsigned __int64 latency_last;      /* time from engine_encode() to send()
+                                           of the data sent last */
+    unsigned __int64 cpu_time;          /* CPU time used by the client thread */
+} engine_listener_stats_t;
+
+// Mixer input ports
+#define ENGINE_MAX_PORTS      (8)
+#define ENGINE_PORT_NAME_SIZE (32)
+
+// Per-port statistics.
+typedef struct engine_port_stats
+{
+    int              port;              /* as returned by engine_port_open() */
+    char             name[ENGINE_PORT_NAME_SIZE];
+    double           gain;              /* 1.0 for unity gain */
+    unsigned         buffered;          /* milliseconds of audio buffered */
+    unsigned __int64 samples_in;        /* samples (per channel) written */
+    unsigned __int64 underruns;         /* times the port ran dry while mixed */
+    unsigned __int64 overruns;          /* times audio was dropped because the
+                                           source ran ahead of the mixer */
+} engine_port_stats_t;
+
+
 /* Initializes the engine. 'config' must be a valid engine configuration,
    which may be obtained by calling engine_get_default_config() first.
 
@@ -66,6 +339,14 @@ typedef struct engine_config
    eventually. */
 int engine_initialize(const engine_config_t *config, ENGINE_HANDLE *engine);
 
+/* Initializes the engine like engine_initialize(), but first tries to take
+   over the listening socket, listener connections and stream buffer of an
+   engine in another process that is waiting in engine_handover() on the named
+   pipe 'pipe_name' (e.g. \\.\pipe\Minicast). If no engine is waiting,
+   the engine is initialized normally. */
+int engine_initialize_handover( const engine_config_t *config,
+                                const char *pipe_name, ENGINE_HANDLE *engine );
+
 /* Enqueues a block of raw audio data for processing and returns immediately.
    Samples should be 16-bit signed values. Returns zero if samples where
    succesfully queued. */
@@ -73,6 +354,78 @@ int engine_encode( ENGINE_HANDLE engine,
 				   const short *samples, unsigned num_samples,
 				   unsigned channels, unsigned sampling_rate );
 
+/* Returns a buffer for 'num_samples' samples of raw audio data in the given
+   format, to be filled in place and passed to engine_commit(), which
+   enqueues it without copying, and sets *result to zero. Otherwise NULL is
+   returned and the host should drop the data; *result is then positive if
+   the data is not wanted (no listeners under the idle policy), or negative
+   if it could not be queued (an unsupported format, no memory, or an
+   encoder thread that could not be started). Buffers come from a pool, so
+   steady streaming does not allocate memory. Every buffer returned must be
+   committed before engine_cleanup() is called. */
+short *engine_acquire( ENGINE_HANDLE engine, unsigned num_samples,
+                       unsigned channels, unsigned sampling_rate, int *result );
+
+/* Enqueues the first 'num_samples' samples (at most as many as acquired) of
+   a buffer returned by engine_acquire(). Committing zero samples gives the
+   buffer back unused. Returns zero if the samples were succesfully queued. */
+int engine_commit(ENGINE_HANDLE engine, short *samples, unsigned num_samples);
+
+// A block of raw audio data for engine_encode_vector()
+typedef struct engine_block
+{
+    const short *samples;
+    unsigned     num_samples;
+} engine_block_t;
+
+/* Enqueues 'count' blocks of raw audio data in the same format, like as many
+   calls to engine_encode() but as a single queue entry, for hosts that
+   deliver many small blocks. Returns zero if the blocks were succesfully
+   queued. */
+int engine_encode_vector( ENGINE_HANDLE engine,
+                          const engine_block_t *blocks, unsigned count,
+                          unsigned channels, unsigned sampling_rate );
+
+/* Enqueues a block of MPEG audio Layer III data (e.g. from an upstream
+   encoder or a file) to be published without re-encoding, and returns
+   immediately. The data need not be frame-aligned: frames split between
+   calls are joined, and data that is not part of a valid frame (such as
+   tags) is discarded. Frames are published in real time like encoded audio,
+   and raw data and MP3 data may be interleaved. Returns zero if the data was
+   succesfully queued. */
+int engine_submit_encoded(ENGINE_HANDLE engine, const char *data, unsigned length);
+
+/* Starts the mixer, which mixes the audio written to its input ports at the
+   given sampling rate and number of channels (as engine_encode() accepts) and
+   enqueues the mix for encoding in real time, every 10 milliseconds. The
+   mixer is the clock of the stream: sources that run slightly fast or slow
+   are absorbed by the buffering of their ports. engine_encode() should not
+   be called while the mixer is running. Returns zero if the mixer started. */
+int engine_mixer_start( ENGINE_HANDLE engine,
+                        unsigned sampling_rate, unsigned channels );
+
+/* Stops the mixer and closes all its ports. */
+int engine_mixer_stop(ENGINE_HANDLE engine);
+
+/* Opens a mixer input port named 'name', at unity gain, and returns its
+   number, or -1 if the mixer is not running or all ENGINE_MAX_PORTS ports
+   are open. 'tolerance' is the jitter and drift to absorb, in milliseconds
+   (20 to 2000): the port is mixed in once that much audio is buffered, and
+   audio is dropped when a source runs twice that far ahead. */
+int engine_port_open(ENGINE_HANDLE engine, const char *name, unsigned tolerance);
+
+/* Sets the gain of a port, from 0.0 (muted) to 4.0; 1.0 is unity gain. */
+int engine_port_set_gain(ENGINE_HANDLE engine, int port, double gain);
+
+/* Writes a block of raw audio data to a port, like engine_encode(). The
+   samples are converted to the mixer's sampling rate and channels. */
+int engine_port_write( ENGINE_HANDLE engine, int port,
+                       const short *samples, unsigned num_samples,
+                       unsigned channels, unsigned sampling_rate );
+
+/* Closes a port; audio still buffered in it is discarded. */
+int engine_port_close(ENGINE_HANDLE engine, int port);
+
 /* Returns the default engine configuration. */
 void engine_get_default_config(engine_config_t *config);
 
@@ -80,18 +433,79 @@ void engine_get_default_config(engine_config_t *config);
 void engine_get_current_config(ENGINE_HANDLE engine, engine_config_t *config);
 
 /* Updates the current engine configuration.
-   The engine must be initialized when calling this function. */
+   The engine must be initialized when calling this function.
+   Changes are applied without disconnecting listeners: the connection limit,
+   stream name and metadata interval take effect for new connections, and
+   encoder changes take effect at the next frame boundary. Only a change of
+   address or port opens a new listening socket; if that fails, the old one
+   is kept (and reported by engine_get_current_config()) and non-zero is
+   returned. The time-shift size and the HLS segment duration only apply
+   when the engine starts: a change of either is rejected, the old value is
+   kept (also in 'config') and non-zero is returned. */
 int engine_set_current_config(ENGINE_HANDLE engine, engine_config_t *config);
 
 /* Updates the title for the current audio stream. Note that this does not
    change the stream title, but only the title of the currently playing item.
-   The engine must be initialized when calling this function. */
+   The new title applies to the audio passed to engine_encode() after this
+   call: listeners receive it when they reach that audio in the stream, not
+   when it is submitted. The engine must be initialized when calling this
+   function. */
 int engine_update_title(ENGINE_HANDLE engine, const char *title );
 
 /* Returns the number of clients currently connected to the audio stream. */
 unsigned engine_connections(ENGINE_HANDLE engine);
 
-/* Shuts down the engine. */
+/* Takes a snapshot of the engine statistics. Counters are written with plain
+   stores by the threads that own them (a few counters of rare events that
+   several threads update with an interlocked add), and read with single
+   64-bit loads that neither lock nor write, so the snapshot is not atomic as
+   a whole and values may be slightly stale. */
+int engine_get_stats(ENGINE_HANDLE engine, engine_stats_t *stats);
+
+/* Fills 'listeners' with statistics for at most 'max_listeners' connected
+   listeners, and returns the number of entries filled. */
+unsigned engine_get_listener_stats( ENGINE_HANDLE engine,
+                                    engine_listener_stats_t *listeners,
+                                    unsigned max_listeners );
+
+/* Fills 'ports' with statistics for at most 'max_ports' open mixer ports,
+   and returns the number of entries filled. */
+unsigned engine_get_port_stats( ENGINE_HANDLE engine,
+                                engine_port_stats_t *ports, unsigned max_ports );
+
+/* Writes the most recent events recorded by the engine threads (the flight
+   recorder) to a file; see trace.h for the file format. */
+int engine_trace_dump(ENGINE_HANDLE engine, const char *path);
+
+/* Sets the path prefix of dumps written automatically when an anomaly (such as
+   a listener falling behind the stream buffer) is detected. Dump files are
+   numbered sequentially and written at most once every 10 seconds. NULL
+   disables automatic dumps (the default). */
+int engine_trace_dump_on_anomaly(ENGINE_HANDLE engine, const char *path);
+
+/* Hands the engine over to a new process (e.g. an upgraded version of the
+   application) without disconnecting listeners. Waits at most 'timeout'
+   milliseconds for the new process to call engine_initialize_handover() with
+   the same pipe name. The listening socket, the listener connections (with
+   their stream positions and metadata state) and the stream buffer are then
+   passed on, and listeners hear the buffered stream while the new process
+   starts encoding. Returns:
+     0  if the handover succeeded; the engine is shut down as by
+        engine_cleanup() and the handle must not be used afterwards.
+     1  if no new process connected in time, or the state could not be sent
+        or was not acknowledged; the engine keeps running and serving its
+        listeners, and the handle stays valid, though a mixer that was
+        started must be started again.
+     -1 if the engine failed part way (a thread did not stop in time, or the
+        server could not resume serving); it is shut down as by
+        engine_cleanup(), possibly with resources left unreleased, and the
+        handle must not be used afterwards. */
+int engine_handover(ENGINE_HANDLE engine, const char *pipe_name, unsigned timeout);
+
+/* Shuts down the engine. Blocked network I/O is cancelled and every thread
+   is given a bounded time to exit; if a thread does not exit in time,
+   non-zero is returned and its resources are not released. The duration of
+   the shutdown is reported in engine_stats_t.shutdown_time. */
 int engine_cleanup(ENGINE_HANDLE engine);
 
 #endif //ndef ENGINE_H_INCLUDED
@@ -7,6 +7,12 @@
 // Include public API declarations
 #include "engine.h"
 
+// Include flight recorder declarations
+#include "trace.h"
+
+// Include compiler intrinsics (for the counter functions below)
+#include <intrin.h>
+
 
 // Engine state
 typedef struct engine_instance
@@ -16,19 +22,308 @@ typedef struct engine_instance
 } engine_instance_t;
 
 
+/* Statistics counters are written by a single thread each; structures holding
+   them are aligned to a cache line of their own so that maintaining them does
+   not cause cache line sharing between threads. */
+#define CACHE_LINE_SIZE (64)
+#define CACHE_ALIGN __declspec(align(CACHE_LINE_SIZE))
+
+/* Counters are 64-bit and are read by other threads while being written. On
+   32-bit x86 a plain 64-bit access is two 32-bit accesses, so a reader could
+   see half of an update; counters are therefore only accessed with these
+   functions. Each counter is written by the thread that owns it with plain
+   stores, and both the store and the reads move the 8 bytes at once through
+   the FPU (fild/fistp, exact for any 64-bit integer), which the processor
+   does in a single access for aligned quadwords; no locked instruction is
+   used, so readers do not take the counter's cache line from its writer. */
+static __inline void counter_move(volatile unsigned __int64 *dest, const volatile unsigned __int64 *src)
+{
+#if defined(_M_IX86)
+	__asm
+	{
+		mov		eax, src
+		mov		edx, dest
+		fild	qword ptr [eax]
+		fistp	qword ptr [edx]
+	}
+#else
+	*dest = *src;
+#endif
+}
+
+static __inline void counter_add(volatile unsigned __int64 *counter, unsigned __int64 value)
+{
+	value += *counter;  // only this thread writes it
+	counter_move(counter, &value);
+}
+
+static __inline void counter_set(volatile unsigned __int64 *counter, unsigned __int64 value)
+{
+	counter_move(counter, &value);
+}
+
+static __inline unsigned __int64 counter_read(const volatile unsigned __int64 *counter)
+{
+	unsigned __int64 value;
+
+	counter_move(&value, counter);
+	return value;
+}
+
+/* Adds to a counter that several threads write, such as one counting
+   connections or ingest calls from any thread; uses an 8-byte compare-exchange
+   (cmpxchg8b), so it is kept off the paths run for each block or send. */
+static __inline void counter_add_shared(volatile unsigned __int64 *counter, unsigned __int64 value)
+{
+	__int64 old;
+
+	do
+		old = (__int64)counter_read(counter);
+	while(_InterlockedCompareExchange64((volatile __int64*)counter, old + (__int64)value, old) != old);
+}
+
+// Records a latency measurement (in microseconds) in a histogram.
+static __inline void latency_add(volatile engine_latency_t *latency, unsigned __int64 value)
+{
+	unsigned bucket = 0;
+	unsigned __int64 rest = value;
+
+	while(rest != 0 && bucket < LATENCY_BUCKETS - 1)
+	{
+		rest >>= 1;
+		++bucket;
+	}
+	counter_add(&latency->count, 1);
+	counter_add(&latency->total, value);
+	counter_add(&latency->buckets[bucket], 1);
+}
+
+// Adds the measurements of one histogram to another (not shared).
+static __inline void latency_merge(engine_latency_t *dest, const volatile engine_latency_t *src)
+{
+	unsigned n;
+
+	dest->count += counter_read(&src->count);
+	dest->total += counter_read(&src->total);
+	for(n = 0; n < LATENCY_BUCKETS; ++n)
+		dest->buckets[n] += counter_read(&src->buckets[n]);
+}
+
+
+// Max. milliseconds to wait for the threads of a component to exit when
+// stopping it; blocked I/O is cancelled so that this is rarely reached.
+#define SHUTDOWN_TIMEOUT (2000)
+
+
+// Thread helper functions (threads are Windows handles)
+int thread_set_scheduling(void *thread, unsigned long affinity, int priority);
+unsigned __int64 thread_cpu_time(void *thread);
+
+
 // Encoder specific functions
 int start_encoder_thread(const encoder_config_t *config);
 int stop_encoder_thread();
+void encoder_update_config(const encoder_config_t *config);
 int encoder_enqueue_raw_data( const short *samples, unsigned num_samples,
 	                          unsigned channels, unsigned sampling_rate );
+int encoder_enqueue_raw_vector( const engine_block_t *blocks, unsigned count,
+                                unsigned channels, unsigned sampling_rate );
+short *encoder_acquire( unsigned num_samples, unsigned channels,
+                        unsigned sampling_rate, int *result );
+int encoder_commit(short *samples, unsigned num_samples);
+int encoder_enqueue_encoded_data(const char *data, unsigned length);
+void encoder_get_stats(engine_stats_t *stats);
+
+// Mixer functions (implemented in mixer.c)
+int mixer_initialize();
+void mixer_finalize();
+int mixer_start( unsigned sampling_rate, unsigned channels,
+                 unsigned long affinity, int priority );
+int mixer_stop();
+int mixer_port_open(const char *name, unsigned tolerance);
+int mixer_port_set_gain(int port, double gain);
+int mixer_port_write( int port, const short *samples, unsigned num_samples,
+                      unsigned channels, unsigned sampling_rate );
+int mixer_port_close(int port);
+void mixer_get_stats(engine_stats_t *stats);
+unsigned mixer_get_port_stats(engine_port_stats_t *ports, unsigned max_ports);
+
+
+// Encoded frame, as described by a codec's frame parser
+typedef struct codec_frame
+{
+	unsigned size;				// frame size in bytes, including any header
+	unsigned bitrate;			// in kbps (0 if not applicable)
+	unsigned sampling_rate;
+	unsigned samples;			// samples per channel
+	unsigned channels;
+} codec_frame_t;
+
+// Stream format produced by an encoder backend
+typedef struct codec_format
+{
+	const struct codec *codec;
+	unsigned sampling_rate, channels;
+	unsigned frame_size;		// bytes per frame, for codecs whose frames
+	unsigned frame_samples;		// carry no header (samples per channel)
+} codec_format_t;
+
+// Settings an encoder backend is opened with
+typedef struct codec_settings
+{
+	unsigned sampling_rate, channels;	// of the input data
+	short mode;							// CHANNELS_* for stereo input
+	short bitrate, preset;
+	int no_reservoir;					// set if frames may not borrow bits
+										// from the frames before them
+} codec_settings_t;
+
+/* Encoder backend. The encoder thread drives the stream functions; the frame
+   functions let the pacer and server find frame boundaries and durations,
+   build silence and start new listeners, without knowing the codec. */
+typedef struct codec
+{
+	const char *name;
+	const char *content_type;
+
+	// Opens a stream and fills 'format', the input chunk size and the max.
+	// output size per chunk (in bytes); returns NULL on failure
+	void *(*open)( const codec_settings_t *settings, codec_format_t *format,
+	               unsigned *input_size, unsigned *output_size );
+	// Encodes a chunk of at most the input chunk size; returns non-zero on failure
+	int (*encode)( void *stream, const char *input, unsigned input_size,
+	               char *output, unsigned *output_size );
+	// Returns the data held back at the end of the stream
+	int (*finish)(void *stream, char *output, unsigned *output_size);
+	void (*close)(void *stream);
+
+	// Builds the header sent to each listener before the first frame;
+	// returns its size (0 if none)
+	unsigned (*stream_header)(const codec_format_t *format, char *header);
+	// Parses the frame starting at 'data' (at least 4 bytes); returns non-zero
+	// if it is not at a frame boundary
+	int (*parse_frame)( const codec_format_t *format, const unsigned char *data,
+	                    codec_frame_t *frame );
+	// Returns the offset of the first frame boundary in the data
+	unsigned (*find_sync)(const unsigned char *data, unsigned length);
+	// Builds a silent frame like the one whose first bytes are 'header';
+	// returns its size
+	unsigned (*silent_frame)( const codec_format_t *format, const unsigned char *header,
+	                          char *frame );
+} codec_t;
+
+#define CODEC_MAX_FRAME_SIZE  (4608)	// 1152 samples of 16-bit stereo PCM
+#define CODEC_MAX_HEADER_SIZE (64)
+
+extern const codec_t codec_mp3;		// see codec_mp3.c
+extern const codec_t codec_pcm;		// see codec_wav.c
+extern const codec_t codec_adpcm;
+extern const codec_t codec_mp3lite;	// see codec_mp3lite.c
+
+// Segment-parallel encoding: opens a stream of a backend that encodes on a
+// pool of worker threads, driven through codec_parallel (see parallel.c)
+#define PARALLEL_MAX_WORKERS (8)
+void *parallel_open( const codec_t *codec, const codec_settings_t *settings,
+                     unsigned workers, unsigned long affinity, int priority,
+                     codec_format_t *format, unsigned *input_size,
+                     unsigned *output_size );
+extern const codec_t codec_parallel;
+
+
+// Pacer functions (releases encoded frames at the stream's real-time rate)
+#define PACER_LOOKAHEAD (250000)	// max. microseconds published ahead of real time
+void pacer_reset();
+void pacer_set_format(const codec_format_t *format);
+void pacer_submit(const char *data, unsigned length, unsigned __int64 timestamp);
+unsigned long pacer_release();
+void pacer_flush();
+unsigned pacer_silent_frame(char *frame);
+void pacer_get_stats(engine_stats_t *stats);
+
+
+// MPEG audio Layer III frame functions
+#define MP3_MAX_FRAME_SIZE (1441)	// 320 kbps at 32 kHz, with padding
+
+int mp3_parse_header(const unsigned char *data, codec_frame_t *frame);
+unsigned mp3_find_sync(const unsigned char *data, unsigned length);
+unsigned mp3_silent_frame(const unsigned char *header, char *frame);
 
 
 // Server specific functions
+#define METADATA_TITLE_SIZE (4065)  // max. title size (including terminator)
+#define METADATA_SIZE       (4081)  // max. size of a metadata packet
 int start_server_thread(const network_config_t *config);
 int stop_server_thread();
+int server_update_config(const network_config_t *config);
+int server_handover_send(void *pipe, unsigned long process_id);
+int server_handover_receive(const network_config_t *config, void *pipe);
 void server_update_title(const char *title);
 unsigned server_get_connected_clients();
-void server_enqueue_encoded_data(const char *data, unsigned length);
+void server_enqueue_encoded_data( const char *data, unsigned length,
+                                  unsigned __int64 timestamp );
+void server_set_format(const char *content_type, const char *header, unsigned header_size);
+unsigned __int64 server_time();
+void server_get_stats(engine_stats_t *stats);
+unsigned server_get_listener_stats( engine_listener_stats_t *listeners,
+                                    unsigned max_listeners );
+void server_get_names( char *stream_name, unsigned stream_name_size,
+                       char *title, unsigned title_size );
+int server_get_title_at(unsigned __int64 position, char *title, unsigned title_size);
+void server_get_format( char *content_type, unsigned content_type_size, char *header,
+                        unsigned *header_size, unsigned __int64 *position );
+unsigned __int64 server_stream_position();
+unsigned server_read_stream( unsigned __int64 *position, char *data, unsigned size,
+                             int *block_end, unsigned __int64 *buffered );
+
+
+// Time-shift archive functions (implemented in archive.c)
+int archive_open(unsigned long size);
+void archive_close();
+int archive_enabled();
+void archive_write( unsigned __int64 position, const char *data, unsigned length,
+                    unsigned __int64 time );
+int archive_read(unsigned __int64 position, char *data, unsigned *length);
+unsigned __int64 archive_seek(unsigned __int64 time);
+unsigned __int64 archive_limit(unsigned __int64 time);
+void archive_add_title(unsigned __int64 position, const char *packet);
+const char *archive_find_title(unsigned __int64 position);
+void archive_get_stats(engine_stats_t *stats);
+
+
+// HLS segmenter functions (implemented in hls.c)
+int hls_open(unsigned duration);
+void hls_close();
+void hls_set_format(const char *content_type);
+void hls_write(unsigned __int64 position, const char *data, unsigned length);
+char *hls_get_page( const char *resource, const char **content_type,
+                    unsigned *length, unsigned *max_age );
+void hls_get_stats(engine_stats_t *stats);
+int hls_handover_send(void *pipe);
+int hls_handover_receive(void *pipe);
+
+
+// Recorder functions (implemented in recorder.c)
+int recorder_start( const recorder_config_t *config,
+                    unsigned long affinity, int priority );
+int recorder_stop();
+int recorder_update_config( const recorder_config_t *config,
+                            unsigned long affinity, int priority );
+void recorder_get_stats(engine_stats_t *stats);
+
+
+// Handover transport functions (pipes are Windows handles)
+void *handover_listen(const char *pipe_name, unsigned timeout, unsigned long *process_id);
+void *handover_connect(const char *pipe_name, unsigned timeout);
+int handover_read(void *pipe, void *data, unsigned size);
+int handover_write(void *pipe, const void *data, unsigned size);
+void handover_close(void *pipe);
+
+
+// Status page specific functions
+int status_initialize();
+void status_finalize();
+char *status_get_page( const char *resource, const char **content_type,
+                       unsigned *length );
 
 
 #endif //ndef ENGINE_INTERNAL_H_INCLUDED
@@ -0,0 +1,162 @@
+/* Contains the named pipe transport used to hand a running engine over to
+   another process (see engine_handover()). */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <string.h>
+
+
+// Definitions
+#define HANDOVER_PIPE_BUFFER	(65536)	// size of the pipe buffers
+#define HANDOVER_IO_TIMEOUT		(10000)	// max. milliseconds per transfer
+
+
+// Function prototypes
+void *handover_listen(const char *pipe_name, unsigned timeout, unsigned long *process_id);
+void *handover_connect(const char *pipe_name, unsigned timeout);
+int handover_read(void *pipe, void *data, unsigned size);
+int handover_write(void *pipe, const void *data, unsigned size);
+void handover_close(void *pipe);
+
+
+/* Reads or writes exactly 'size' bytes. Pipes are opened for overlapped I/O
+   so that a peer that stops responding cannot block the engine forever. */
+static int transfer(HANDLE pipe, char *data, unsigned size, int write)
+{
+	OVERLAPPED overlapped;
+	DWORD count;
+	BOOL done;
+	int result = 0;
+
+	memset(&overlapped, 0, sizeof(overlapped));
+	if((overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+		return -1;
+
+	while(size > 0)
+	{
+		ResetEvent(overlapped.hEvent);
+		done = write ? WriteFile(pipe, data, size, &count, &overlapped)
+		             : ReadFile (pipe, data, size, &count, &overlapped);
+		if(!done)
+		{
+			if( GetLastError() != ERROR_IO_PENDING ||
+				WaitForSingleObject(overlapped.hEvent, HANDOVER_IO_TIMEOUT) != WAIT_OBJECT_0 )
+			{
+				CancelIo(pipe);
+				result = -1;
+				break;
+			}
+			if(!GetOverlappedResult(pipe, &overlapped, &count, FALSE))
+			{
+				result = -1;
+				break;
+			}
+		}
+		if(count == 0)
+		{
+			result = -1;
+			break;
+		}
+		data += count;
+		size -= count;
+	}
+
+	CloseHandle(overlapped.hEvent);
+	return result;
+}
+
+/* Creates the pipe and waits at most 'timeout' milliseconds for the new
+   process to connect and identify itself. Returns NULL on failure. */
+void *handover_listen(const char *pipe_name, unsigned timeout, unsigned long *process_id)
+{
+	HANDLE pipe;
+	OVERLAPPED overlapped;
+	DWORD size, pid;
+	int connected = 0;
+
+	if((pipe = CreateNamedPipe( pipe_name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+	                            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1,
+	                            HANDOVER_PIPE_BUFFER, HANDOVER_PIPE_BUFFER, 0, NULL ))
+		== INVALID_HANDLE_VALUE)
+		return NULL;
+
+	memset(&overlapped, 0, sizeof(overlapped));
+	if((overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+	{
+		CloseHandle(pipe);
+		return NULL;
+	}
+
+	if(ConnectNamedPipe(pipe, &overlapped))
+		connected = 1;
+	else
+		switch(GetLastError())
+		{
+		case ERROR_PIPE_CONNECTED:
+			connected = 1;
+			break;
+
+		case ERROR_IO_PENDING:
+			if( WaitForSingleObject(overlapped.hEvent, timeout) == WAIT_OBJECT_0 &&
+				GetOverlappedResult(pipe, &overlapped, &size, FALSE) )
+				connected = 1;
+			else
+				CancelIo(pipe);
+			break;
+		}
+	CloseHandle(overlapped.hEvent);
+
+	if(!connected || transfer(pipe, (char*)&pid, sizeof(pid), 0) != 0)
+	{
+		CloseHandle(pipe);
+		return NULL;
+	}
+
+	*process_id = pid;
+	return pipe;
+}
+
+/* Connects to the pipe of an engine waiting to hand over and identifies the
+   calling process. Returns NULL if no engine is waiting. */
+void *handover_connect(const char *pipe_name, unsigned timeout)
+{
+	HANDLE pipe;
+	DWORD pid = GetCurrentProcessId();
+
+	if(!WaitNamedPipe(pipe_name, timeout))
+		return NULL;
+
+	if((pipe = CreateFile( pipe_name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+	                       OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL ))
+		== INVALID_HANDLE_VALUE)
+		return NULL;
+
+	if(transfer(pipe, (char*)&pid, sizeof(pid), 1) != 0)
+	{
+		CloseHandle(pipe);
+		return NULL;
+	}
+
+	return pipe;
+}
+
+int handover_read(void *pipe, void *data, unsigned size)
+{
+	return transfer((HANDLE)pipe, (char*)data, size, 0);
+}
+
+int handover_write(void *pipe, const void *data, unsigned size)
+{
+	return transfer((HANDLE)pipe, (char*)data, size, 1);
+}
+
+void handover_close(void *pipe)
+{
+	FlushFileBuffers((HANDLE)pipe);
+	CloseHandle((HANDLE)pipe);
+}
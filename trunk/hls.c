@@ -0,0 +1,459 @@
+/* Contains the implementation of the Minicast HLS segmenter, which also
+   offers the stream as HTTP Live Streaming packed audio, so that caching
+   proxies and CDNs can carry listeners instead of the server.
+
+   The server passes each published block of an MP3 stream to the segmenter,
+   which cuts the stream at frame boundaries into segments of hls_duration
+   seconds. Each segment starts with an ID3 tag holding the timestamp of its
+   first sample (as HLS requires of packed audio) and the title that applies
+   there. The last HLS_SEGMENTS segments are kept in memory, and the playlist
+   /live.m3u8 lists the newest HLS_PLAYLIST of them as /live-<n>.mp3.
+   Segment numbers count from the time the server started, so that a segment
+   URL never names different data: segments may be cached for as long as they
+   are kept, and the playlist for half a segment. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+// Definitions
+#define HLS_SEGMENTS		(10)	// segments kept
+#define HLS_PLAYLIST		(6)		// newest segments listed in the playlist
+#define HLS_TAG_SIZE		(4224)	// max. size of the ID3 tag of a segment
+#define HLS_ENTRY_SIZE		(64)	// max. size of a playlist entry
+#define HLS_TIMESTAMP_OWNER	"com.apple.streaming.transportStreamTimestamp"
+
+// Function prototypes
+
+// API functions
+int hls_open(unsigned duration);
+void hls_close();
+void hls_set_format(const char *content_type);
+void hls_write(unsigned __int64 position, const char *data, unsigned length);
+char *hls_get_page( const char *resource, const char **content_type,
+                    unsigned *length, unsigned *max_age );
+void hls_get_stats(engine_stats_t *stats);
+int hls_handover_send(void *pipe);
+int hls_handover_receive(void *pipe);
+
+
+// Completed segment
+typedef struct hls_segment
+{
+	unsigned long sequence;		// segment number
+	unsigned long samples;		// duration
+	unsigned long sampling_rate;
+	int discontinuity;			// set if it does not continue the previous
+								// segment
+	char *data;					// ID3 tag and frames
+	unsigned size;
+} hls_segment_t;
+
+// Segmenter state sent to the new process on handover, followed by the
+// hls_segment_t and data of each segment kept, oldest first
+typedef struct hls_handover
+{
+	unsigned long segments_count, sequence_base, discontinuity_sequence;
+	unsigned long num_segments;
+	unsigned __int64 timestamp;
+	int stream_mp3;
+} hls_handover_t;
+
+
+// Global variables
+static CRITICAL_SECTION hls_access;		// controls access to the segments
+static unsigned hls_duration;			// seconds per segment; 0 if disabled
+static hls_segment_t segments[HLS_SEGMENTS];	// ring of completed segments
+static unsigned long segments_count;	// segments completed
+static unsigned long sequence_base;		// number of the first segment
+static unsigned long discontinuity_sequence;	// discontinuities that left
+												// the playlist
+static CACHE_ALIGN unsigned __int64 volatile request_count;
+
+// Segment being built, owned by the publishing thread
+static int stream_mp3;					// set while the stream is MP3
+static char *current;					// ID3 tag and frames so far; NULL if
+										// no segment is being built
+static unsigned current_size, current_capacity;
+static unsigned long current_samples, current_rate;
+static int current_discontinuity;
+static unsigned frame_remaining;		// bytes of a frame continued from the
+										// previous block
+static unsigned __int64 timestamp;		// 90 kHz time of the next segment
+
+
+/* Opens the segmenter for segments of 'duration' seconds (0 to disable). */
+int hls_open(unsigned duration)
+{
+	InitializeCriticalSection(&hls_access);
+	hls_duration = duration;
+	memset(segments, 0, sizeof(segments));
+	segments_count = 0;
+	sequence_base = (unsigned long)time(NULL);
+	discontinuity_sequence = 0;
+	request_count = 0;
+	stream_mp3 = 0;
+	current = NULL;
+	current_size = current_capacity = 0;
+	current_samples = current_rate = 0;
+	current_discontinuity = 0;
+	frame_remaining = 0;
+	timestamp = 0;
+	return 0;
+}
+
+void hls_close()
+{
+	unsigned n;
+
+	for(n = 0; n < HLS_SEGMENTS; ++n)
+		free(segments[n].data);
+	memset(segments, 0, sizeof(segments));
+	free(current);
+	current = NULL;
+	hls_duration = 0;
+	DeleteCriticalSection(&hls_access);
+}
+
+/* Stores 'value' as a 28-bit ID3 "syncsafe" integer. */
+static unsigned char *put_syncsafe(unsigned char *p, unsigned value)
+{
+	p[0] = (unsigned char)((value >> 21) & 0x7F);
+	p[1] = (unsigned char)((value >> 14) & 0x7F);
+	p[2] = (unsigned char)((value >>  7) & 0x7F);
+	p[3] = (unsigned char)( value        & 0x7F);
+	return p + 4;
+}
+
+/* Builds the ID3v2.4 tag a segment starts with: the MPEG-2 timestamp of its
+   first sample (PRIV) and the title (TIT2). Returns the size of the tag. */
+static unsigned build_tag(char *tag, const char *title)
+{
+	unsigned char *p = (unsigned char*)tag + 10;
+	unsigned length, n;
+
+	memcpy(p, "PRIV", 4);
+	p = put_syncsafe(p + 4, sizeof(HLS_TIMESTAMP_OWNER) + 8);
+	*p++ = 0; *p++ = 0;
+	memcpy(p, HLS_TIMESTAMP_OWNER, sizeof(HLS_TIMESTAMP_OWNER));
+	p += sizeof(HLS_TIMESTAMP_OWNER);
+	for(n = 0; n < 8; ++n)
+		*p++ = (unsigned char)((timestamp & 0x1FFFFFFFF) >> (56 - 8*n));
+
+	if((length = (unsigned)strlen(title)) > 0)
+	{
+		memcpy(p, "TIT2", 4);
+		p = put_syncsafe(p + 4, 1 + length);
+		*p++ = 0; *p++ = 0;
+		*p++ = 0;  // ISO-8859-1
+		memcpy(p, title, length);
+		p += length;
+	}
+
+	length = (unsigned)(p - (unsigned char*)tag);
+	memcpy(tag, "ID3\x04\x00\x00", 6);
+	put_syncsafe((unsigned char*)tag + 6, length - 10);
+	return length;
+}
+
+/* Appends data to the segment being built; drops the segment if memory runs
+   out. */
+static void append(const char *data, unsigned length)
+{
+	char *grown;
+
+	if(current == NULL)
+		return;
+	if(current_size + length > current_capacity)
+	{
+		if((grown = (char*)realloc(current, 2*(current_size + length))) == NULL)
+		{
+			free(current);
+			current = NULL;
+			current_discontinuity = 1;
+			return;
+		}
+		current = grown;
+		current_capacity = 2*(current_size + length);
+	}
+	memcpy(current + current_size, data, length);
+	current_size += length;
+}
+
+/* Starts a segment with the frame at stream position 'position'. */
+static void start_segment(unsigned __int64 position, unsigned long sampling_rate)
+{
+	char title[METADATA_TITLE_SIZE], tag[HLS_TAG_SIZE];
+
+	// Room for the segment at 320 kbps
+	current_capacity = HLS_TAG_SIZE + hls_duration * 40000;
+	if((current = (char*)malloc(current_capacity)) == NULL)
+	{
+		current_discontinuity = 1;
+		return;
+	}
+	server_get_title_at(position, title, sizeof(title));
+	current_size = build_tag(tag, title);
+	memcpy(current, tag, current_size);
+	current_samples = 0;
+	current_rate = sampling_rate;
+}
+
+/* Completes the segment being built and publishes it. */
+static void finish_segment()
+{
+	hls_segment_t *segment;
+	unsigned long leaving;
+
+	EnterCriticalSection(&hls_access);
+	if(segments_count >= HLS_PLAYLIST)
+	{
+		// The oldest segment listed leaves the playlist
+		leaving = segments_count - HLS_PLAYLIST;
+		if(segments[leaving % HLS_SEGMENTS].discontinuity)
+			++discontinuity_sequence;
+	}
+	segment = &segments[segments_count % HLS_SEGMENTS];
+	free(segment->data);
+	segment->sequence = sequence_base + segments_count;
+	segment->samples = current_samples;
+	segment->sampling_rate = current_rate;
+	segment->discontinuity = current_discontinuity && segments_count > 0;
+	segment->data = current;
+	segment->size = current_size;
+	++segments_count;
+	LeaveCriticalSection(&hls_access);
+
+	timestamp += (unsigned __int64)current_samples * 90000 / current_rate;
+	current = NULL;
+	current_discontinuity = 0;
+}
+
+/* Starts segmenting anew when the stream format changes; only MP3 streams
+   are segmented. Called by the publishing thread. */
+void hls_set_format(const char *content_type)
+{
+	if(hls_duration == 0)
+		return;
+	free(current);
+	current = NULL;
+	frame_remaining = 0;
+	current_discontinuity = 1;
+	stream_mp3 = (strcmp(content_type, "audio/mpeg") == 0);
+}
+
+/* Adds a published block at stream position 'position' to the segments.
+   Called by the publishing thread. */
+void hls_write(unsigned __int64 position, const char *data, unsigned length)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	codec_frame_t frame;
+	unsigned pos = 0, part;
+
+	if(hls_duration == 0 || !stream_mp3)
+		return;
+
+	while(pos < length)
+	{
+		// Rest of a frame that started in the previous block
+		if(frame_remaining > 0)
+		{
+			part = (frame_remaining < length - pos) ? frame_remaining : length - pos;
+			append(data + pos, part);
+			frame_remaining -= part;
+			pos += part;
+			continue;
+		}
+
+		if(length - pos < 4 || mp3_parse_header(p + pos, &frame) != 0)
+		{
+			// Not at a frame; go on at the next one
+			pos += mp3_find_sync(p + pos, length - pos);
+			continue;
+		}
+
+		// Cut the segment before this frame once it is long enough, or if
+		// the sampling rate changes
+		if(current != NULL && frame.sampling_rate != current_rate)
+		{
+			finish_segment();
+			current_discontinuity = 1;
+		}
+		else
+		if(current != NULL && current_samples >= hls_duration * current_rate)
+			finish_segment();
+		if(current == NULL)
+			start_segment(position + pos, frame.sampling_rate);
+
+		part = (frame.size < length - pos) ? frame.size : length - pos;
+		append(data + pos, part);
+		current_samples += frame.samples;
+		frame_remaining = frame.size - part;
+		pos += part;
+	}
+}
+
+/* Renders the playlist. Must be called with hls_access held. */
+static char *render_playlist(unsigned *length)
+{
+	char *text, *p;
+	unsigned long first, n;
+	hls_segment_t *segment;
+
+	if((text = (char*)malloc(256 + HLS_PLAYLIST*HLS_ENTRY_SIZE)) == NULL)
+		return NULL;
+
+	first = (segments_count > HLS_PLAYLIST) ? segments_count - HLS_PLAYLIST : 0;
+	p = text + sprintf( text, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%u\n"
+	                    "#EXT-X-MEDIA-SEQUENCE:%lu\n#EXT-X-DISCONTINUITY-SEQUENCE:%lu\n",
+	                    hls_duration + 1, sequence_base + first, discontinuity_sequence );
+	for(n = first; n < segments_count; ++n)
+	{
+		segment = &segments[n % HLS_SEGMENTS];
+		if(segment->discontinuity)
+			p += sprintf(p, "#EXT-X-DISCONTINUITY\n");
+		p += sprintf( p, "#EXTINF:%.3f,\nlive-%lu.mp3\n",
+		              (double)segment->samples / segment->sampling_rate, segment->sequence );
+	}
+	*length = (unsigned)(p - text);
+	return text;
+}
+
+/* Returns a copy of the HLS resource requested (the playlist or a segment)
+   and how long it may be cached, in seconds; or NULL if there is no such
+   resource. The caller must free the result. */
+char *hls_get_page( const char *resource, const char **content_type,
+                    unsigned *length, unsigned *max_age )
+{
+	unsigned long sequence, n;
+	int end = 0;
+	char *result = NULL;
+	hls_segment_t *segment;
+
+	if(hls_duration == 0)
+		return NULL;
+
+	EnterCriticalSection(&hls_access);
+	if(segments_count == 0)
+		;  // nothing to offer yet
+	else
+	if(strcmp(resource, "/live.m3u8") == 0)
+	{
+		if((result = render_playlist(length)) != NULL)
+		{
+			*content_type = "application/vnd.apple.mpegurl";
+			*max_age = (hls_duration > 1) ? hls_duration / 2 : 1;
+		}
+	}
+	else
+	if( sscanf(resource, "/live-%lu.mp3%n", &sequence, &end) == 1 && resource[end] == '\0' &&
+		(n = sequence - sequence_base) < segments_count &&
+		n + HLS_SEGMENTS >= segments_count )
+	{
+		segment = &segments[n % HLS_SEGMENTS];
+		if((result = (char*)malloc(segment->size)) != NULL)
+		{
+			memcpy(result, segment->data, segment->size);
+			*length = segment->size;
+			*content_type = "audio/mpeg";
+			*max_age = HLS_SEGMENTS * hls_duration;
+		}
+	}
+	LeaveCriticalSection(&hls_access);
+
+	if(result != NULL)
+		counter_add_shared(&request_count, 1);
+	return result;
+}
+
+/* Sends the segments kept over a handover pipe, so that the new process
+   goes on with the same segment numbers and listeners of the playlist do
+   not lose their place. Nothing may be published while handing over. */
+int hls_handover_send(void *pipe)
+{
+	hls_handover_t state;
+	hls_segment_t *segment;
+	unsigned long n;
+
+	memset(&state, 0, sizeof(state));
+	state.segments_count         = segments_count;
+	state.sequence_base          = sequence_base;
+	state.discontinuity_sequence = discontinuity_sequence;
+	state.num_segments = (segments_count < HLS_SEGMENTS) ? segments_count : HLS_SEGMENTS;
+	state.timestamp  = timestamp;
+	state.stream_mp3 = stream_mp3;
+	if(hls_duration == 0)
+		state.num_segments = 0;
+	if(handover_write(pipe, &state, sizeof(state)) != 0)
+		return -1;
+	for(n = segments_count - state.num_segments; n < segments_count; ++n)
+	{
+		segment = &segments[n % HLS_SEGMENTS];
+		if( handover_write(pipe, segment, sizeof(*segment)) != 0 ||
+			(segment->size > 0 && handover_write(pipe, segment->data, segment->size) != 0) )
+			return -1;
+	}
+	return 0;
+}
+
+/* Receives the segments sent by hls_handover_send(); the segment being built
+   by the old process is lost, so the next one starts a discontinuity. */
+int hls_handover_receive(void *pipe)
+{
+	hls_handover_t state;
+	hls_segment_t record, *segment;
+	unsigned long n;
+	char *data;
+
+	if( handover_read(pipe, &state, sizeof(state)) != 0 ||
+		state.num_segments > HLS_SEGMENTS || state.num_segments > state.segments_count )
+		return -1;
+	for(n = state.segments_count - state.num_segments; n < state.segments_count; ++n)
+	{
+		if(handover_read(pipe, &record, sizeof(record)) != 0)
+			return -1;
+		if((data = (char*)malloc(record.size + 1)) == NULL)
+			return -1;
+		if(record.size > 0 && handover_read(pipe, data, record.size) != 0)
+		{
+			free(data);
+			return -1;
+		}
+		if(hls_duration == 0)
+		{
+			free(data);  // segmenting is disabled here
+			continue;
+		}
+		segment = &segments[n % HLS_SEGMENTS];
+		free(segment->data);
+		*segment = record;
+		segment->data = data;
+	}
+	if(hls_duration == 0)
+		return 0;
+
+	EnterCriticalSection(&hls_access);
+	segments_count         = state.segments_count;
+	sequence_base          = state.sequence_base;
+	discontinuity_sequence = state.discontinuity_sequence;
+	LeaveCriticalSection(&hls_access);
+	timestamp  = state.timestamp;
+	stream_mp3 = state.stream_mp3;
+	current_discontinuity = 1;
+	return 0;
+}
+
+void hls_get_stats(engine_stats_t *stats)
+{
+	stats->hls_segments = segments_count;
+	stats->hls_requests = counter_read(&request_count);
+}
@@ -0,0 +1,535 @@
+/* Contains the implementation of the Minicast mixer, which mixes audio from
+   several named input ports (e.g. a microphone, jingles and a player) into
+   the stream, in place of a single source calling engine_encode().
+
+   Each port converts what is written to it to the mixer's sampling rate and
+   channels (by linear interpolation) and buffers it, so that the jitter and
+   clock drift of its source are absorbed: the mixer thread takes a block
+   from every port each MIXER_BLOCK_TIME of real time, applies the port's
+   gain and adds the blocks with saturation (with SSE2 where the processor
+   has it), and queues the mix for the encoder. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <string.h>
+#include <malloc.h>
+#include <emmintrin.h>
+
+
+// Definitions
+#define MIXER_BLOCK_TIME	(10000)		// microseconds per mixed block
+#define MIXER_BLOCK_MAX		(480 * 2)	// max. samples per block (48 kHz stereo)
+#define MIXER_RESYNC		(200000)	// microseconds behind the mixer clock
+										// after which it starts over
+#define MIXER_GAIN_ONE		(4096)		// gain of 1.0 (Q12)
+#define TOLERANCE_MIN		(20)		// min. and max. buffering of a port, in
+#define TOLERANCE_MAX		(2000)		// milliseconds
+
+// Function prototypes
+
+// API functions
+int mixer_initialize();
+void mixer_finalize();
+int mixer_start( unsigned sampling_rate, unsigned channels,
+                 unsigned long affinity, int priority );
+int mixer_stop();
+int mixer_port_open(const char *name, unsigned tolerance);
+int mixer_port_set_gain(int port, double gain);
+int mixer_port_write( int port, const short *samples, unsigned num_samples,
+                      unsigned channels, unsigned sampling_rate );
+int mixer_port_close(int port);
+void mixer_get_stats(engine_stats_t *stats);
+unsigned mixer_get_port_stats(engine_port_stats_t *ports, unsigned max_ports);
+
+// Thread function
+static DWORD WINAPI run_mixer(LPVOID unused);
+
+
+// Input port
+typedef struct mixer_port {
+	int open;
+	char name[ENGINE_PORT_NAME_SIZE];
+	int gain;						// Q12
+	short *ring;					// converted audio, in mixer frames
+	unsigned ring_frames, read_pos, fill;
+	unsigned tolerance;				// frames buffered before the port is
+									// mixed in, after opening or running dry
+	int primed;						// set while the port is mixed in
+	unsigned __int64 samples_in, underruns, overruns;
+
+	// Sampling rate conversion state, owned by the writing thread
+	unsigned rate;					// of the last samples written
+	unsigned phase;					// position between input frames (Q16)
+	int last[2];					// last input frame, in mixer channels
+} mixer_port_t;
+
+// Statistics counters written by the mixer thread
+typedef struct mixer_counters {
+	unsigned __int64 blocks;
+	engine_latency_t latency_mix;
+} mixer_counters_t;
+
+
+// Global variables
+static HANDLE mixer_thread,
+              mixer_shutdown_event;	// set when the mixer should shut down
+static CRITICAL_SECTION mixer_access;	// controls access to the ports
+static unsigned mixer_rate, mixer_channels, block_frames;
+static int use_sse2;
+
+static mixer_port_t ports[ENGINE_MAX_PORTS];	// protected by mixer_access
+static short port_blocks[ENGINE_MAX_PORTS][MIXER_BLOCK_MAX];	// owned by
+static int port_gains[ENGINE_MAX_PORTS];						// the mixer
+																// thread
+static CACHE_ALIGN mixer_counters_t volatile mixer_counters;
+
+// Sampling rates the mixer runs at and ports accept (those of engine_encode())
+static const unsigned sampling_rates[9] = {
+	8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+
+
+/* Returns non-zero if the mixer supports the given format. */
+static int valid_format(unsigned channels, unsigned sampling_rate)
+{
+	unsigned n;
+
+	if(channels != 1 && channels != 2)
+		return 0;
+	for(n = 0; n < sizeof(sampling_rates)/sizeof(sampling_rates[0]); ++n)
+		if(sampling_rates[n] == sampling_rate)
+			return 1;
+	return 0;
+}
+
+/* Returns sample 'n' of channel 'c' of the input, mapped to the mixer's
+   channels (stereo is mixed down for a mono mixer, mono is doubled). */
+static __inline int input_sample( const short *samples, unsigned n, unsigned c,
+                                  unsigned channels )
+{
+	if(channels == 1)
+		return samples[n];
+	if(mixer_channels == 1)
+		return (samples[2*n] + samples[2*n + 1]) >> 1;
+	return samples[2*n + c];
+}
+
+/* Converts 'count' input frames to the mixer's sampling rate and channels,
+   by linear interpolation, and returns the number of frames written. */
+static unsigned convert( mixer_port_t *port, const short *samples, unsigned count,
+                         unsigned channels, unsigned sampling_rate, short *out )
+{
+	unsigned step, frames = 0, n, c;
+	int a, b, fraction;
+
+	if(sampling_rate != port->rate)
+	{
+		port->rate = sampling_rate;
+		port->phase = 0;
+		port->last[0] = port->last[1] = 0;
+	}
+	step = (unsigned)(((unsigned __int64)sampling_rate << 16) / mixer_rate);
+
+	// Positions count from the last frame of the previous call (0), which
+	// the first frame of this one (1) follows
+	while((n = port->phase >> 16) < count)
+	{
+		fraction = (port->phase & 0xFFFF) >> 1;
+		for(c = 0; c < mixer_channels; ++c)
+		{
+			a = (n == 0) ? port->last[c] : input_sample(samples, n - 1, c, channels);
+			b = input_sample(samples, n, c, channels);
+			*out++ = (short)(a + (((b - a) * fraction) >> 15));
+		}
+		++frames;
+		port->phase += step;
+	}
+	port->phase -= count << 16;
+	if(count > 0)
+		for(c = 0; c < mixer_channels; ++c)
+			port->last[c] = input_sample(samples, count - 1, c, channels);
+
+	return frames;
+}
+
+/* Adds 'count' samples, scaled by 'gain' (Q12), to 'mix', saturating both
+   the scaled samples and the sums to 16 bits. */
+static void mix_scalar(short *mix, const short *samples, unsigned count, int gain)
+{
+	unsigned n;
+	int value;
+
+	for(n = 0; n < count; ++n)
+	{
+		value = (samples[n] * gain) >> 12;
+		value = (value > 32767) ? 32767 : (value < -32768) ? -32768 : value;
+		value += mix[n];
+		mix[n] = (short)((value > 32767) ? 32767 : (value < -32768) ? -32768 : value);
+	}
+}
+
+static void mix_sse2(short *mix, const short *samples, unsigned count, int gain)
+{
+	__m128i x, g = _mm_set1_epi16((short)gain), low, high;
+	unsigned n;
+
+	for(n = 0; n + 8 <= count; n += 8)
+	{
+		x    = _mm_loadu_si128((const __m128i*)(samples + n));
+		low  = _mm_mullo_epi16(x, g);
+		high = _mm_mulhi_epi16(x, g);
+		x = _mm_packs_epi32( _mm_srai_epi32(_mm_unpacklo_epi16(low, high), 12),
+		                     _mm_srai_epi32(_mm_unpackhi_epi16(low, high), 12) );
+		_mm_storeu_si128( (__m128i*)(mix + n),
+		                  _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(mix + n)), x) );
+	}
+	mix_scalar(mix + n, samples + n, count - n, gain);
+}
+
+/* Takes a block from every open port, mixes the blocks and queues the mix
+   for the encoder. */
+static void mix_block()
+{
+	short *mix;
+	unsigned __int64 start = server_time();
+	unsigned samples = block_frames * mixer_channels, n, taken, first;
+	int active[ENGINE_MAX_PORTS], any = 0, result;
+	mixer_port_t *port;
+
+	// Copy the blocks out while holding the lock, and mix them after
+	EnterCriticalSection(&mixer_access);
+	for(n = 0; n < ENGINE_MAX_PORTS; ++n)
+	{
+		port = &ports[n];
+		active[n] = 0;
+		if(!port->open)
+			continue;
+		any = 1;
+
+		// Wait for a port to fill up to its tolerance before mixing it in
+		// (again), so that jitter does not make it run dry at once
+		if(!port->primed && port->fill >= port->tolerance)
+			port->primed = 1;
+		if(!port->primed)
+			continue;
+
+		taken = (port->fill < block_frames) ? port->fill : block_frames;
+		if(taken < block_frames)
+		{
+			++port->underruns;
+			port->primed = 0;
+		}
+		first = port->ring_frames - port->read_pos;
+		if(first > taken)
+			first = taken;
+		memcpy( port_blocks[n], port->ring + port->read_pos * mixer_channels,
+		        first * mixer_channels * sizeof(short) );
+		memcpy( port_blocks[n] + first * mixer_channels, port->ring,
+		        (taken - first) * mixer_channels * sizeof(short) );
+		memset( port_blocks[n] + taken * mixer_channels, 0,
+		        (block_frames - taken) * mixer_channels * sizeof(short) );
+		port->read_pos = (port->read_pos + taken) % port->ring_frames;
+		port->fill -= taken;
+		port_gains[n] = port->gain;
+		active[n] = 1;
+	}
+	LeaveCriticalSection(&mixer_access);
+
+	if(!any)
+		return;  // nothing to mix; the encoder sends silence if need be
+
+	// Mix straight into a queue entry
+	if((mix = encoder_acquire(block_frames, mixer_channels, mixer_rate, &result)) == NULL)
+		return;  // not wanted (no listeners), or dropped and counted
+	memset(mix, 0, samples * sizeof(short));
+	for(n = 0; n < ENGINE_MAX_PORTS; ++n)
+		if(active[n])
+		{
+			if(use_sse2)
+				mix_sse2(mix, port_blocks[n], samples, port_gains[n]);
+			else
+				mix_scalar(mix, port_blocks[n], samples, port_gains[n]);
+		}
+
+	// Wall time per block; the CPU time is the mixer thread's (see
+	// mixer_get_stats()), since the thread times are too coarse for a block
+	counter_add(&mixer_counters.blocks, 1);
+	latency_add(&mixer_counters.latency_mix, server_time() - start);
+	encoder_commit(mix, block_frames);
+}
+
+static DWORD WINAPI run_mixer(LPVOID unused)
+{
+	unsigned __int64 start = server_time(), mixed = 0, due, now;
+
+	trace_attach("mixer", TRACE_EVENTS_DEFAULT);
+
+	while(WaitForSingleObject(mixer_shutdown_event, 0) != WAIT_OBJECT_0)
+	{
+		// Mix a block each MIXER_BLOCK_TIME, by the count of frames mixed
+		// (blocks need not last a whole number of microseconds)
+		due = start + mixed * 1000000 / mixer_rate;
+		now = server_time();
+		if(now < due)
+		{
+			WaitForSingleObject(mixer_shutdown_event, (DWORD)((due - now + 999) / 1000));
+			continue;
+		}
+		if(now - due > MIXER_RESYNC)
+		{
+			// Fell far behind (e.g. the system was suspended); start over
+			start = now;
+			mixed = 0;
+		}
+
+		mix_block();
+		mixed += block_frames;
+	}
+
+	trace_detach();
+	return 0;
+}
+
+int mixer_initialize()
+{
+	// A thread left running by a stop that timed out still uses the ports
+	// and mixer_access, which was therefore not deleted; finish that stop
+	if(mixer_thread != NULL)
+		return mixer_stop();
+
+	memset(ports, 0, sizeof(ports));
+	mixer_thread = mixer_shutdown_event = NULL;
+	InitializeCriticalSection(&mixer_access);
+	return 0;
+}
+
+void mixer_finalize()
+{
+	if(mixer_stop() == 0)
+		DeleteCriticalSection(&mixer_access);
+}
+
+/* Starts the mixer thread, mixing at 'sampling_rate' and 'channels'. */
+int mixer_start( unsigned sampling_rate, unsigned channels,
+                 unsigned long affinity, int priority )
+{
+	HANDLE thread;
+
+	if(mixer_thread != NULL || !valid_format(channels, sampling_rate))
+		return -1;
+
+	mixer_rate = sampling_rate;
+	mixer_channels = channels;
+	block_frames = (unsigned)((unsigned __int64)sampling_rate * MIXER_BLOCK_TIME / 1000000);
+	use_sse2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE);
+
+	if((mixer_shutdown_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+		return -1;
+	if((thread = CreateThread(NULL, 0, run_mixer, NULL, CREATE_SUSPENDED, NULL)) == NULL)
+	{
+		CloseHandle(mixer_shutdown_event);
+		mixer_shutdown_event = NULL;
+		return -1;
+	}
+	thread_set_scheduling(thread, affinity, priority);
+	ResumeThread(thread);
+	mixer_thread = thread;
+
+	return 0;
+}
+
+/* Stops the mixer thread, if it is running, and closes all ports. */
+int mixer_stop()
+{
+	int n;
+
+	if(mixer_thread == NULL)
+		return 0;
+
+	SetEvent(mixer_shutdown_event);
+	if(WaitForSingleObject(mixer_thread, SHUTDOWN_TIMEOUT) != WAIT_OBJECT_0)
+		return -1;  // leave the mixer state to the running thread
+	CloseHandle(mixer_thread);
+	CloseHandle(mixer_shutdown_event);
+	mixer_thread = mixer_shutdown_event = NULL;
+
+	for(n = 0; n < ENGINE_MAX_PORTS; ++n)
+		mixer_port_close(n);
+	return 0;
+}
+
+int mixer_port_open(const char *name, unsigned tolerance)
+{
+	mixer_port_t *port;
+	short *ring;
+	unsigned frames;
+	int n;
+
+	if(mixer_thread == NULL)
+		return -1;
+
+	// Buffer up to twice the tolerance, plus a block
+	if(tolerance < TOLERANCE_MIN)
+		tolerance = TOLERANCE_MIN;
+	if(tolerance > TOLERANCE_MAX)
+		tolerance = TOLERANCE_MAX;
+	tolerance = tolerance * mixer_rate / 1000;
+	frames = 2*tolerance + block_frames;
+	if((ring = (short*)malloc(frames * mixer_channels * sizeof(short))) == NULL)
+		return -1;
+
+	EnterCriticalSection(&mixer_access);
+	for(n = 0; n < ENGINE_MAX_PORTS && ports[n].open; ++n) { }
+	if(n == ENGINE_MAX_PORTS)
+	{
+		LeaveCriticalSection(&mixer_access);
+		free(ring);
+		return -1;
+	}
+	port = &ports[n];
+	memset(port, 0, sizeof(*port));
+	strncpy(port->name, name ? name : "", sizeof(port->name) - 1);
+	port->gain = MIXER_GAIN_ONE;
+	port->ring = ring;
+	port->ring_frames = frames;
+	port->tolerance = tolerance;
+	port->open = 1;
+	LeaveCriticalSection(&mixer_access);
+
+	return n;
+}
+
+int mixer_port_set_gain(int port, double gain)
+{
+	int result = -1;
+
+	if(port < 0 || port >= ENGINE_MAX_PORTS)
+		return -1;
+	if(gain < 0.0)
+		gain = 0.0;
+	if(gain > 4.0)
+		gain = 4.0;
+
+	EnterCriticalSection(&mixer_access);
+	if(ports[port].open)
+	{
+		ports[port].gain = (int)(gain * MIXER_GAIN_ONE + 0.5);
+		result = 0;
+	}
+	LeaveCriticalSection(&mixer_access);
+	return result;
+}
+
+int mixer_port_write( int port, const short *samples, unsigned num_samples,
+                      unsigned channels, unsigned sampling_rate )
+{
+	mixer_port_t *p;
+	short *converted, *start;
+	unsigned frames, free_frames, write_pos, first;
+
+	if( port < 0 || port >= ENGINE_MAX_PORTS || !ports[port].open ||
+		!valid_format(channels, sampling_rate) )
+		return -1;
+	p = &ports[port];
+
+	// Convert outside the lock; the conversion state belongs to the writer
+	frames = (unsigned)((unsigned __int64)num_samples * mixer_rate / sampling_rate) + 2;
+	if((converted = (short*)malloc(frames * mixer_channels * sizeof(short))) == NULL)
+		return -1;
+	frames = convert(p, samples, num_samples, channels, sampling_rate, converted);
+	start = converted;
+
+	// The port may have been closed (and its ring freed) meanwhile
+	EnterCriticalSection(&mixer_access);
+	if(!p->open)
+	{
+		LeaveCriticalSection(&mixer_access);
+		free(start);
+		return -1;
+	}
+	if(frames > p->ring_frames)
+	{
+		// Keep the newest part of an oversized block
+		converted += (frames - p->ring_frames) * mixer_channels;
+		frames = p->ring_frames;
+	}
+	free_frames = p->ring_frames - p->fill;
+	if(frames > free_frames)
+	{
+		// The source runs ahead of the mixer by more than its tolerance;
+		// drop the oldest audio, back to the tolerance
+		unsigned drop = p->fill + frames - p->tolerance;
+		if(drop > p->fill)
+			drop = p->fill;
+		p->read_pos = (p->read_pos + drop) % p->ring_frames;
+		p->fill -= drop;
+		++p->overruns;
+	}
+	write_pos = (p->read_pos + p->fill) % p->ring_frames;
+	first = p->ring_frames - write_pos;
+	if(first > frames)
+		first = frames;
+	memcpy( p->ring + write_pos * mixer_channels, converted,
+	        first * mixer_channels * sizeof(short) );
+	memcpy( p->ring, converted + first * mixer_channels,
+	        (frames - first) * mixer_channels * sizeof(short) );
+	p->fill += frames;
+	p->samples_in += num_samples;
+	LeaveCriticalSection(&mixer_access);
+
+	free(start);
+	return 0;
+}
+
+int mixer_port_close(int port)
+{
+	short *ring;
+
+	if(port < 0 || port >= ENGINE_MAX_PORTS)
+		return -1;
+
+	EnterCriticalSection(&mixer_access);
+	ring = ports[port].open ? ports[port].ring : NULL;
+	ports[port].open = 0;
+	ports[port].ring = NULL;
+	LeaveCriticalSection(&mixer_access);
+
+	free(ring);
+	return 0;
+}
+
+void mixer_get_stats(engine_stats_t *stats)
+{
+	stats->mixer_running  = (mixer_thread != NULL);
+	stats->mixer_blocks   = counter_read(&mixer_counters.blocks);
+	stats->mixer_cpu_time = thread_cpu_time(mixer_thread);
+	latency_merge(&stats->latency_mix, &mixer_counters.latency_mix);
+}
+
+unsigned mixer_get_port_stats(engine_port_stats_t *stats, unsigned max_ports)
+{
+	unsigned count = 0;
+	int n;
+
+	EnterCriticalSection(&mixer_access);
+	for(n = 0; n < ENGINE_MAX_PORTS && count < max_ports; ++n)
+	{
+		if(!ports[n].open)
+			continue;
+		stats[count].port = n;
+		memcpy(stats[count].name, ports[n].name, sizeof(stats[count].name));
+		stats[count].gain       = (double)ports[n].gain / MIXER_GAIN_ONE;
+		stats[count].buffered   = (unsigned)((unsigned __int64)ports[n].fill * 1000 / mixer_rate);
+		stats[count].samples_in = ports[n].samples_in;
+		stats[count].underruns  = ports[n].underruns;
+		stats[count].overruns   = ports[n].overruns;
+		++count;
+	}
+	LeaveCriticalSection(&mixer_access);
+
+	return count;
+}
@@ -0,0 +1,93 @@
+/* Contains functions to parse MPEG audio Layer III frame headers. */
+
+#include "engine_internal.h"
+
+// Include standard library headers
+#include <string.h>
+
+
+// Function prototypes
+int mp3_parse_header(const unsigned char *data, codec_frame_t *frame);
+unsigned mp3_find_sync(const unsigned char *data, unsigned length);
+unsigned mp3_silent_frame(const unsigned char *header, char *frame);
+
+
+// Bit rates (in kbps) by bit rate index, for MPEG-1 and MPEG-2/2.5
+static const unsigned short bitrates[2][15] = {
+	{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+	{ 0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160 } };
+
+// Sampling rates by sampling rate index, for MPEG-1, MPEG-2 and MPEG-2.5
+static const unsigned short sampling_rates[3][3] = {
+	{ 44100, 48000, 32000 },
+	{ 22050, 24000, 16000 },
+	{ 11025, 12000,  8000 } };
+
+
+/* Parses the 4-byte frame header at 'data'. Returns zero and fills 'frame' if
+   it is a valid Layer III header; free format frames are not supported. */
+int mp3_parse_header(const unsigned char *data, codec_frame_t *frame)
+{
+	unsigned version, bitrate_index, sampling_index, mpeg1;
+
+	if(data[0] != 0xFF || (data[1] & 0xE0) != 0xE0)
+		return -1;  // no frame sync
+
+	switch((data[1] >> 3) & 3)
+	{
+	case 3:  version = 0; break;	// MPEG-1
+	case 2:  version = 1; break;	// MPEG-2
+	case 0:  version = 2; break;	// MPEG-2.5
+	default: return -1;
+	}
+	if(((data[1] >> 1) & 3) != 1)
+		return -1;  // not Layer III
+
+	bitrate_index  = data[2] >> 4;
+	sampling_index = (data[2] >> 2) & 3;
+	if(bitrate_index == 0 || bitrate_index == 15 || sampling_index == 3)
+		return -1;
+
+	mpeg1 = (version == 0);
+	frame->bitrate       = bitrates[mpeg1 ? 0 : 1][bitrate_index];
+	frame->sampling_rate = sampling_rates[version][sampling_index];
+	frame->samples       = mpeg1 ? 1152 : 576;
+	frame->channels      = ((data[3] >> 6) == 3) ? 1 : 2;
+	frame->size          = (mpeg1 ? 144000 : 72000) * frame->bitrate /
+	                       frame->sampling_rate + ((data[2] >> 1) & 1);
+	return 0;
+}
+
+/* Returns the offset of the first valid frame header in 'data', or 'length'
+   if there is none. Headers that do not fit entirely are not considered. */
+unsigned mp3_find_sync(const unsigned char *data, unsigned length)
+{
+	codec_frame_t frame;
+	unsigned pos;
+
+	for(pos = 0; pos + 4 <= length; ++pos)
+		if(data[pos] == 0xFF && mp3_parse_header(data + pos, &frame) == 0)
+			return pos;
+	return length;
+}
+
+/* Builds a silent frame in the format given by the frame header 'header',
+   without CRC or padding. All side information is zero, so the frame has no
+   main data and does not use the bit reservoir. 'frame' must hold
+   MP3_MAX_FRAME_SIZE bytes. Returns the frame size, or 0 if the header is
+   not valid. */
+unsigned mp3_silent_frame(const unsigned char *header, char *frame)
+{
+	unsigned char *data = (unsigned char*)frame;
+	codec_frame_t info;
+
+	data[0] = header[0];
+	data[1] = header[1] | 1;	// no CRC
+	data[2] = header[2] & ~2;	// no padding
+	data[3] = header[3];
+	if(mp3_parse_header(data, &info) != 0)
+		return 0;
+
+	memset(data + 4, 0, info.size - 4);
+	return info.size;
+}
@@ -0,0 +1,259 @@
+/* Contains the implementation of the Minicast pacer, which sits between the
+   encoder and the stream buffer. Hosts may deliver audio faster than real time
+   (e.g. when pre-buffering or playing from a file); the pacer publishes
+   encoded frames against a clock running at the stream's nominal rate, at
+   most PACER_LOOKAHEAD ahead of it, so that the stream buffer fills smoothly
+   and listeners are not lapped by a burst of input. Frame boundaries and
+   durations come from the codec of the stream format set.
+
+   The pacer is used by the encoder thread only. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <string.h>
+
+
+// Definitions
+#define PACER_BUFFER_SIZE	(65536)	// max. encoded bytes held back
+#define PACER_CHUNKS		   (64)	// max. chunks held back with their own
+									// queue time
+
+
+// Function prototypes
+void pacer_reset();
+void pacer_set_format(const codec_format_t *format);
+void pacer_submit(const char *data, unsigned length, unsigned __int64 timestamp);
+unsigned long pacer_release();
+void pacer_flush();
+unsigned pacer_silent_frame(char *frame);
+void pacer_get_stats(engine_stats_t *stats);
+
+
+// Statistics counters written by the encoder thread
+typedef struct pacer_counters {
+	unsigned __int64 frames, resyncs, dropped;
+} pacer_counters_t;
+
+// Data submitted at once, held back
+typedef struct pacer_chunk {
+	unsigned end;					// offset in pacer_buffer after the data
+	unsigned __int64 timestamp;		// time the data were queued
+} pacer_chunk_t;
+
+
+// Global variables
+static char pacer_buffer[PACER_BUFFER_SIZE];	// encoded data not yet published
+static unsigned pacer_size;
+static pacer_chunk_t pacer_chunks[PACER_CHUNKS];	// chunks in pacer_buffer
+static unsigned pacer_chunks_count;
+static unsigned __int64 pacer_start;			// time the clock started (0 if it
+												// has not)
+static unsigned __int64 pacer_samples;			// samples published since then
+static unsigned pacer_sampling_rate;
+static unsigned char pacer_header[4];			// header of the last frame published
+static int pacer_header_valid;
+static codec_format_t pacer_format;				// format of the data submitted
+static int pacer_format_pending;				// set until the server has the format
+static CACHE_ALIGN pacer_counters_t volatile pacer_counters;
+
+
+/* Discards data held back and stops the clock. */
+void pacer_reset()
+{
+	pacer_size  = 0;
+	pacer_chunks_count = 0;
+	pacer_start = 0;
+	pacer_header_valid = 0;
+	memset(&pacer_format, 0, sizeof(pacer_format));
+	pacer_format.codec = &codec_mp3;
+	pacer_format_pending = 0;
+}
+
+/* Passes data to the server, telling it the stream format first if that
+   changed. The server is told lazily, since the encoder may open a stream
+   before the server runs. */
+static void publish(const char *data, unsigned length, unsigned __int64 timestamp)
+{
+	char header[CODEC_MAX_HEADER_SIZE];
+
+	if(pacer_format_pending)
+	{
+		server_set_format( pacer_format.codec->content_type, header,
+		                   pacer_format.codec->stream_header(&pacer_format, header) );
+		pacer_format_pending = 0;
+	}
+	server_enqueue_encoded_data(data, length, timestamp);
+}
+
+/* Returns the queue time of the data held back at offset 'pos'. */
+static unsigned __int64 timestamp_at(unsigned pos)
+{
+	unsigned n;
+
+	for(n = 0; n + 1 < pacer_chunks_count; ++n)
+		if(pacer_chunks[n].end > pos)
+			break;
+	return pacer_chunks[n].timestamp;
+}
+
+/* Removes the first 'length' bytes held back. */
+static void discard(unsigned length)
+{
+	unsigned n, kept = 0;
+
+	memmove(pacer_buffer, pacer_buffer + length, pacer_size - length);
+	pacer_size -= length;
+	for(n = 0; n < pacer_chunks_count; ++n)
+		if(pacer_chunks[n].end > length)
+		{
+			pacer_chunks[kept].end = pacer_chunks[n].end - length;
+			pacer_chunks[kept].timestamp = pacer_chunks[n].timestamp;
+			++kept;
+		}
+	pacer_chunks_count = kept;
+}
+
+/* Sets the format of the data submitted next, publishing the data held back
+   in the previous format. */
+void pacer_set_format(const codec_format_t *format)
+{
+	pacer_flush();
+	if( format->codec != pacer_format.codec ||
+		format->sampling_rate != pacer_format.sampling_rate ||
+		format->channels != pacer_format.channels ||
+		format->frame_size != pacer_format.frame_size )
+	{
+		pacer_format_pending = 1;
+		pacer_header_valid = 0;
+	}
+	memcpy(&pacer_format, format, sizeof(pacer_format));
+}
+
+/* Adds encoded data and publishes the frames that are due. */
+void pacer_submit(const char *data, unsigned length, unsigned __int64 timestamp)
+{
+	if(pacer_size + length > PACER_BUFFER_SIZE)
+	{
+		// Should not happen, since the encoder waits for the pacer after
+		// each chunk; publish everything rather than lose data.
+		pacer_flush();
+		if(length > PACER_BUFFER_SIZE)
+		{
+			publish(data, length, timestamp);
+			return;
+		}
+	}
+
+	memcpy(pacer_buffer + pacer_size, data, length);
+	pacer_size += length;
+	if(pacer_chunks_count < PACER_CHUNKS)
+		pacer_chunks[pacer_chunks_count++].timestamp = timestamp;
+	pacer_chunks[pacer_chunks_count - 1].end = pacer_size;  // else merged
+
+	pacer_release();
+}
+
+/* Publishes the complete frames that are due, each block of them with the
+   queue time of its frames. Returns the number of milliseconds until the
+   next complete frame is due, or INFINITE if no complete frame is held back. */
+unsigned long pacer_release()
+{
+	unsigned __int64 now = server_time(), due;
+	unsigned pos = 0, run = 0, sync, skip;
+	codec_frame_t frame;
+	unsigned long wait = INFINITE;
+
+	while(pos + 4 <= pacer_size)
+	{
+		if(pacer_format.codec->parse_frame( &pacer_format,
+		                                    (unsigned char*)pacer_buffer + pos, &frame ) != 0)
+		{
+			// Not at a frame boundary; the data up to the next one cannot be
+			// paced and would garble the stream, so drop them, keeping bytes
+			// that may start a header not yet complete
+			sync = pacer_format.codec->find_sync( (unsigned char*)pacer_buffer + pos + 1,
+			                                      pacer_size - pos - 1 );
+			skip = (pos + 1 + sync == pacer_size) ? pacer_size - 3 - pos : 1 + sync;
+			if(pos > run)
+				publish(pacer_buffer + run, pos - run, timestamp_at(run));
+			counter_add(&pacer_counters.dropped, skip);
+			pos = run = pos + skip;
+			continue;
+		}
+		if(pos + frame.size > pacer_size)
+			break;  // incomplete frame
+
+		if(frame.sampling_rate != pacer_sampling_rate)
+		{
+			// Continue the clock at the new rate
+			if(pacer_start != 0)
+				pacer_start += pacer_samples * 1000000 / pacer_sampling_rate;
+			pacer_samples = 0;
+			pacer_sampling_rate = frame.sampling_rate;
+		}
+		// Restart the clock if the input fell behind real time, so that
+		// the lost time is not made up with a burst later
+		due = pacer_start + pacer_samples * 1000000 / pacer_sampling_rate;
+		if(due + PACER_LOOKAHEAD < now)
+		{
+			if(pacer_start != 0)
+				counter_add(&pacer_counters.resyncs, 1);
+			pacer_start = due = now;
+			pacer_samples = 0;
+		}
+		if(due > now + PACER_LOOKAHEAD)
+		{
+			wait = (unsigned long)((due - PACER_LOOKAHEAD - now + 999)/1000);
+			break;
+		}
+
+		// Frames queued at another time start a block of their own
+		if(pos > run && timestamp_at(pos) != timestamp_at(run))
+		{
+			publish(pacer_buffer + run, pos - run, timestamp_at(run));
+			run = pos;
+		}
+		pacer_samples += frame.samples;
+		memcpy(pacer_header, pacer_buffer + pos, sizeof(pacer_header));
+		pacer_header_valid = 1;
+		counter_add(&pacer_counters.frames, 1);
+		pos += frame.size;
+	}
+
+	if(pos > run)
+		publish(pacer_buffer + run, pos - run, timestamp_at(run));
+	if(pos > 0)
+		discard(pos);
+
+	return wait;
+}
+
+/* Publishes all data held back, e.g. at the end of a stream. */
+void pacer_flush()
+{
+	if(pacer_size > 0)
+		publish(pacer_buffer, pacer_size, timestamp_at(0));
+	pacer_size = 0;
+	pacer_chunks_count = 0;
+}
+
+/* Builds a silent frame in the format of the last frame published; 'frame'
+   must hold CODEC_MAX_FRAME_SIZE bytes. Returns 0 if no frame was published
+   in the current format yet. */
+unsigned pacer_silent_frame(char *frame)
+{
+	return pacer_header_valid ?
+		pacer_format.codec->silent_frame(&pacer_format, pacer_header, frame) : 0;
+}
+
+void pacer_get_stats(engine_stats_t *stats)
+{
+	stats->paced_frames = counter_read(&pacer_counters.frames);
+	stats->pace_resyncs = counter_read(&pacer_counters.resyncs);
+	stats->pace_dropped = counter_read(&pacer_counters.dropped);
+}
@@ -0,0 +1,369 @@
+/* Contains the segment-parallel encoder, which spreads the encoding of one
+   stream over several threads, for streams that one processor cannot encode
+   in real time.
+
+   The input is cut into segments of SEGMENT_FRAMES frames, each of which a
+   worker thread encodes with a stream of its own. The worker starts
+   SEGMENT_PREROLL frames early, so that the state of the encoder has settled
+   when the segment starts, and runs SEGMENT_POSTROLL frames on, so that the
+   frames the encoder delay holds back are complete; the frames of both are
+   dropped. Since every stream of a backend has the same delay, the frames
+   kept line up with those of a single stream and join without a gap.
+
+   Frames must not borrow bits from the frames before them (see
+   codec_settings_t), as those are dropped at the start of a segment. The
+   output lags the input by about a segment, plus the time to encode one. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <string.h>
+#include <malloc.h>
+
+
+// Definitions
+#define SEGMENT_FRAMES		(32)	// frames kept per segment (about 0.8 s at
+									// 44.1 kHz)
+#define SEGMENT_PREROLL		(3)		// frames encoded before a segment
+#define SEGMENT_POSTROLL	(2)		// frames encoded after a segment
+#define SEGMENT_CHUNKS		(SEGMENT_PREROLL + SEGMENT_FRAMES + SEGMENT_POSTROLL)
+#define MAX_SEGMENTS		(PARALLEL_MAX_WORKERS + 1)
+
+
+// Segment of the stream, encoded by one worker
+typedef struct segment
+{
+	char *input;				// pre-roll, frames and post-roll
+	unsigned input_size;
+	unsigned preroll;			// frames of pre-roll (fewer at the start)
+	int last;					// set at the end of the stream, to keep the
+								// frames the encoder holds back
+	char *output;				// everything encoded; the frames kept are
+	unsigned output_size,		// at kept_start
+	         kept_start, kept_size;
+	int done, result;			// protected by the stream's access lock
+} segment_t;
+
+// Stream state
+typedef struct parallel_stream
+{
+	const codec_t *codec;		// the backend
+	codec_settings_t settings;
+	unsigned chunk_size,		// input bytes per frame of the backend
+	         chunk_output_size,	// max. output bytes per frame
+	         chunk_samples,		// samples per channel per frame
+	         output_capacity;	// of each segment
+
+	char *audio;				// input not yet dispatched, from the start
+	unsigned audio_size,		// of the pre-roll of the next segment
+	         audio_preroll;
+
+	segment_t segments[MAX_SEGMENTS];	// ring, in stream order
+	unsigned num_segments;
+	unsigned next_dispatch, next_collect;	// owned by the encoder thread
+	unsigned next_work;			// protected by access
+
+	HANDLE threads[PARALLEL_MAX_WORKERS];
+	unsigned workers;
+	HANDLE work_semaphore,		// counts segments dispatched to workers
+	       done_event;			// set when a worker has finished a segment
+	CRITICAL_SECTION access;
+	int volatile shutdown;
+} parallel_stream_t;
+
+
+/* Encodes a segment with a stream of its own and finds the frames to keep.
+   Returns non-zero on failure. */
+static int encode_segment(parallel_stream_t *stream, segment_t *segment)
+{
+	const codec_t *codec = stream->codec;
+	codec_format_t format;
+	codec_frame_t frame;
+	void *handle;
+	unsigned input_size, output_size, size, pos, skip, keep;
+	int result = 0;
+
+	segment->output_size = segment->kept_start = segment->kept_size = 0;
+	if((handle = codec->open(&stream->settings, &format, &input_size, &output_size)) == NULL)
+		return -1;
+
+	for(pos = 0; pos < segment->input_size && result == 0; pos += input_size)
+	{
+		size = 0;
+		result = codec->encode( handle, segment->input + pos,
+		                        (segment->input_size - pos < input_size) ?
+		                        segment->input_size - pos : input_size,
+		                        segment->output + segment->output_size, &size );
+		segment->output_size += size;
+	}
+	if(result == 0)
+	{
+		size = 0;
+		result = codec->finish(handle, segment->output + segment->output_size, &size);
+		segment->output_size += size;
+	}
+	codec->close(handle);
+	if(result != 0)
+		return result;
+
+	// Drop the frames of the pre-roll, and those after the segment unless it
+	// ends the stream (where all is kept, including a partial frame)
+	skip = segment->preroll * stream->chunk_samples;
+	keep = SEGMENT_FRAMES * stream->chunk_samples;
+	pos = 0;
+	while( pos < segment->output_size && (keep > 0 || segment->last) &&
+	       format.codec->parse_frame( &format, (unsigned char*)segment->output + pos,
+	                                  &frame ) == 0 &&
+	       pos + frame.size <= segment->output_size )
+	{
+		if(skip > 0)
+		{
+			skip = (frame.samples < skip) ? skip - frame.samples : 0;
+			segment->kept_start = pos + frame.size;
+		}
+		else
+			keep = (frame.samples < keep) ? keep - frame.samples : 0;
+		pos += frame.size;
+	}
+	if(segment->last)
+		pos = segment->output_size;
+	segment->kept_size = (pos > segment->kept_start) ? pos - segment->kept_start : 0;
+	return 0;
+}
+
+static DWORD WINAPI run_worker(LPVOID param)
+{
+	parallel_stream_t *stream = (parallel_stream_t*)param;
+	segment_t *segment;
+	int result;
+
+	while( WaitForSingleObject(stream->work_semaphore, INFINITE) == WAIT_OBJECT_0 &&
+	       !stream->shutdown )
+	{
+		// Take the oldest segment no worker has taken yet
+		EnterCriticalSection(&stream->access);
+		segment = &stream->segments[stream->next_work++ % stream->num_segments];
+		LeaveCriticalSection(&stream->access);
+
+		result = encode_segment(stream, segment);
+
+		EnterCriticalSection(&stream->access);
+		segment->result = result;
+		segment->done = 1;
+		LeaveCriticalSection(&stream->access);
+		SetEvent(stream->done_event);
+	}
+
+	return 0;
+}
+
+/* Hands the buffered input to a worker as the next segment, and keeps its
+   end as the pre-roll of the one after. A segment must be free. */
+static void dispatch(parallel_stream_t *stream, int last)
+{
+	segment_t *segment = &stream->segments[stream->next_dispatch % stream->num_segments];
+	unsigned rest = (SEGMENT_PREROLL + SEGMENT_POSTROLL) * stream->chunk_size;
+
+	memcpy(segment->input, stream->audio, stream->audio_size);
+	segment->input_size = stream->audio_size;
+	segment->preroll = stream->audio_preroll;
+	segment->last = last;
+	segment->done = 0;
+	++stream->next_dispatch;
+	ReleaseSemaphore(stream->work_semaphore, 1, NULL);
+
+	if(stream->audio_size < rest)
+		rest = stream->audio_size;
+	memmove(stream->audio, stream->audio + stream->audio_size - rest, rest);
+	stream->audio_size = rest;
+	stream->audio_preroll = (rest < SEGMENT_PREROLL * stream->chunk_size) ?
+	                        rest / stream->chunk_size : SEGMENT_PREROLL;
+}
+
+/* Appends the frames of finished segments to 'output', in stream order,
+   waiting for the oldest segment first if 'wait' is set. Returns non-zero
+   if a segment could not be encoded. */
+static int collect(parallel_stream_t *stream, char *output, unsigned *output_size, int wait)
+{
+	segment_t *segment;
+	int done, result = 0;
+
+	while(stream->next_collect != stream->next_dispatch)
+	{
+		segment = &stream->segments[stream->next_collect % stream->num_segments];
+		EnterCriticalSection(&stream->access);
+		done = segment->done;
+		LeaveCriticalSection(&stream->access);
+		if(!done)
+		{
+			if(!wait)
+				break;
+			WaitForSingleObject(stream->done_event, INFINITE);
+			continue;
+		}
+		wait = 0;
+
+		if(segment->result != 0)
+			result = -1;
+		else
+		{
+			memcpy( output + *output_size, segment->output + segment->kept_start,
+			        segment->kept_size );
+			*output_size += segment->kept_size;
+		}
+		++stream->next_collect;
+	}
+
+	return result;
+}
+
+static int parallel_encode( void *handle, const char *input, unsigned input_size,
+                            char *output, unsigned *output_size )
+{
+	parallel_stream_t *stream = (parallel_stream_t*)handle;
+	int result = 0;
+
+	*output_size = 0;
+	memcpy(stream->audio + stream->audio_size, input, input_size);
+	stream->audio_size += input_size;
+
+	if( stream->audio_size >= (stream->audio_preroll + SEGMENT_FRAMES + SEGMENT_POSTROLL) *
+	                          stream->chunk_size )
+	{
+		// Wait for a free segment if all are in use
+		if(stream->next_dispatch - stream->next_collect == stream->num_segments)
+			result = collect(stream, output, output_size, 1);
+		dispatch(stream, 0);
+	}
+
+	if(collect(stream, output, output_size, 0) != 0)
+		result = -1;
+	return result;
+}
+
+static int parallel_finish(void *handle, char *output, unsigned *output_size)
+{
+	parallel_stream_t *stream = (parallel_stream_t*)handle;
+	int result = 0;
+
+	// The rest of the input ends the stream
+	*output_size = 0;
+	if(stream->audio_size > stream->audio_preroll * stream->chunk_size)
+	{
+		if(stream->next_dispatch - stream->next_collect == stream->num_segments)
+			result = collect(stream, output, output_size, 1);
+		dispatch(stream, 1);
+	}
+
+	while(stream->next_collect != stream->next_dispatch)
+		if(collect(stream, output, output_size, 1) != 0)
+			result = -1;
+	return result;
+}
+
+static void parallel_close(void *handle)
+{
+	parallel_stream_t *stream = (parallel_stream_t*)handle;
+	unsigned n;
+
+	// Stop the workers; segments still being encoded are abandoned
+	stream->shutdown = 1;
+	if(stream->workers > 0)
+	{
+		ReleaseSemaphore(stream->work_semaphore, stream->workers, NULL);
+		WaitForMultipleObjects(stream->workers, stream->threads, TRUE, INFINITE);
+	}
+	for(n = 0; n < stream->workers; ++n)
+		CloseHandle(stream->threads[n]);
+
+	for(n = 0; n < MAX_SEGMENTS; ++n)
+	{
+		free(stream->segments[n].input);
+		free(stream->segments[n].output);
+	}
+	free(stream->audio);
+	if(stream->work_semaphore != NULL)
+		CloseHandle(stream->work_semaphore);
+	if(stream->done_event != NULL)
+		CloseHandle(stream->done_event);
+	DeleteCriticalSection(&stream->access);
+	free(stream);
+}
+
+/* Opens a stream of 'codec' that encodes on 'workers' threads (2 to
+   PARALLEL_MAX_WORKERS), scheduled like the encoder thread. Returns NULL if
+   the backend cannot be opened with these settings, or on lack of
+   resources. */
+void *parallel_open( const codec_t *codec, const codec_settings_t *settings,
+                     unsigned workers, unsigned long affinity, int priority,
+                     codec_format_t *format, unsigned *input_size,
+                     unsigned *output_size )
+{
+	parallel_stream_t *stream;
+	void *probe;
+	HANDLE thread;
+	unsigned n;
+
+	if((stream = (parallel_stream_t*)malloc(sizeof(parallel_stream_t))) == NULL)
+		return NULL;
+	memset(stream, 0, sizeof(*stream));
+	InitializeCriticalSection(&stream->access);
+
+	// Open a stream once to learn the format and buffer sizes
+	stream->codec = codec;
+	memcpy(&stream->settings, settings, sizeof(stream->settings));
+	stream->settings.no_reservoir = 1;
+	if((probe = codec->open( &stream->settings, format, &stream->chunk_size,
+	                         &stream->chunk_output_size )) == NULL)
+		goto cleanup;
+	codec->close(probe);
+	stream->chunk_samples = stream->chunk_size / (2 * settings->channels);
+	stream->output_capacity = (SEGMENT_CHUNKS + 1) * stream->chunk_output_size;
+
+	if(workers < 2)
+		workers = 2;
+	if(workers > PARALLEL_MAX_WORKERS)
+		workers = PARALLEL_MAX_WORKERS;
+	stream->num_segments = workers + 1;	// one more keeps all workers busy
+										// while the oldest is collected
+
+	// Allocate buffers
+	if((stream->audio = (char*)malloc(SEGMENT_CHUNKS * stream->chunk_size)) == NULL)
+		goto cleanup;
+	for(n = 0; n < stream->num_segments; ++n)
+		if( (stream->segments[n].input  = (char*)malloc(SEGMENT_CHUNKS * stream->chunk_size)) == NULL ||
+			(stream->segments[n].output = (char*)malloc(stream->output_capacity)) == NULL )
+			goto cleanup;
+
+	// Start the workers
+	if( (stream->work_semaphore = CreateSemaphore(NULL, 0, MAX_SEGMENTS + PARALLEL_MAX_WORKERS, NULL)) == NULL ||
+		(stream->done_event = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL )
+		goto cleanup;
+	for(n = 0; n < workers; ++n)
+	{
+		if((thread = CreateThread(NULL, 0, run_worker, stream, CREATE_SUSPENDED, NULL)) == NULL)
+			goto cleanup;
+		thread_set_scheduling(thread, affinity, priority);
+		ResumeThread(thread);
+		stream->threads[stream->workers++] = thread;
+	}
+
+	// The encoder thread may collect every segment at once
+	*input_size  = stream->chunk_size;
+	*output_size = stream->num_segments * stream->output_capacity;
+	return stream;
+
+cleanup:
+	parallel_close(stream);
+	return NULL;
+}
+
+// The frame functions are those of the backend, which the stream format names
+const codec_t codec_parallel = {
+	"parallel", NULL,
+	NULL, parallel_encode, parallel_finish, parallel_close,
+	NULL, NULL, NULL, NULL };
@@ -0,0 +1,481 @@
+/* Contains the implementation of the Minicast recorder, which archives the
+   stream to disk as it is published. The recorder thread reads the stream
+   buffer like a listener and gathers the data in large sector-aligned
+   batches, which are written unbuffered by overlapped I/O, so that several
+   writes may be in flight while reading goes on. A disk that falls behind
+   only costs the recording the data it misses: the encoder and listeners
+   never wait for the recorder.
+
+   A new file is started at a block boundary once the file has been recorded
+   for rotate_time or reaches rotate_size, and when the stream format
+   changes. Each file has an index next to it (with the extension .idx): a
+   text file with a line "<offset>\t<milliseconds>" about every second, the
+   offset in the file of a block start and the time into the recording at
+   which the block was published, and a line
+   "<offset>\t<milliseconds>\t<title>" wherever the title changes. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <stdio.h>
+#include <string.h>
+
+
+// Definitions
+#define BATCH_SIZE		(262144)	// bytes written at once
+#define BATCH_COUNT		(8)			// batches; up to 2 MB is held while the
+									// disk is behind
+#define SECTOR_SIZE		(4096)		// alignment of unbuffered writes
+#define RECORDER_POLL	(100)		// milliseconds between reads of the
+									// stream buffer
+#define RECORDER_RETRY	(5000000)	// microseconds between attempts to create
+									// a file after a failure
+#define INDEX_INTERVAL	(1000000)	// microseconds between index lines
+#define INDEX_BUFFER_SIZE	(8192)	// index text gathered before writing
+#define ROTATE_TIME_MIN	(60)		// seconds
+
+// Function prototypes
+
+// API functions
+int recorder_start( const recorder_config_t *config,
+                    unsigned long affinity, int priority );
+int recorder_stop();
+int recorder_update_config( const recorder_config_t *config,
+                            unsigned long affinity, int priority );
+void recorder_get_stats(engine_stats_t *stats);
+
+// Thread function
+static DWORD WINAPI run_recorder(LPVOID unused);
+
+
+// Data written to the file at once
+typedef struct batch {
+	OVERLAPPED overlapped;
+	char *data;					// BATCH_SIZE bytes, aligned for unbuffered
+								// writes
+	unsigned size;				// bytes filled
+	int pending;				// set while the batch is being written
+} batch_t;
+
+// Statistics counters written by the recorder thread
+typedef struct recorder_counters {
+	unsigned __int64 bytes, files, dropped, errors;
+} recorder_counters_t;
+
+
+// Global variables
+static HANDLE recorder_thread,
+              recorder_shutdown_event;	// set when the recorder should shut down
+static recorder_config_t recorder_config;
+
+// Recording state, owned by the recorder thread
+static batch_t batches[BATCH_COUNT];
+static unsigned batch_current;			// batch being filled
+static HANDLE file = INVALID_HANDLE_VALUE, index_file = INVALID_HANDLE_VALUE;
+static int file_failed;					// set when a write failed
+static unsigned __int64 file_offset;	// file offset of the batch being filled
+static unsigned __int64 file_size;		// bytes recorded to the file
+static unsigned __int64 file_opened;	// time the file was started
+static unsigned __int64 file_origin;	// time the first block in the file was
+										// published (0 until then)
+static unsigned __int64 last_index;		// publication time of the block
+										// indexed last
+static char file_content_type[32];		// stream format of the file
+static char file_header[CODEC_MAX_HEADER_SIZE];
+static unsigned file_header_size;
+static char last_title[METADATA_TITLE_SIZE];	// title indexed last
+static char index_text[INDEX_BUFFER_SIZE];		// index text not yet written
+static unsigned index_size;
+
+static CACHE_ALIGN recorder_counters_t volatile recorder_counters;
+
+
+/* Marks the batches whose writes have completed as free, waiting for all of
+   them if 'wait' is set. */
+static void reap_batches(int wait)
+{
+	DWORD written;
+	unsigned n;
+
+	for(n = 0; n < BATCH_COUNT; ++n)
+	{
+		if(!batches[n].pending)
+			continue;
+		if(!GetOverlappedResult(file, &batches[n].overlapped, &written, wait))
+		{
+			if(GetLastError() == ERROR_IO_INCOMPLETE)
+				continue;
+			file_failed = 1;
+		}
+		batches[n].pending = 0;
+	}
+}
+
+/* Starts writing the batch being filled, padded to whole sectors, and moves
+   on to the next one. */
+static void issue_batch()
+{
+	batch_t *batch = &batches[batch_current];
+	unsigned size = (batch->size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+
+	memset(batch->data + batch->size, 0, size - batch->size);
+	batch->overlapped.Offset     = (DWORD)file_offset;
+	batch->overlapped.OffsetHigh = (DWORD)(file_offset >> 32);
+	ResetEvent(batch->overlapped.hEvent);
+	if( WriteFile(file, batch->data, size, NULL, &batch->overlapped) ||
+		GetLastError() == ERROR_IO_PENDING )
+		batch->pending = 1;
+	else
+		file_failed = 1;
+
+	batch->size = 0;
+	file_offset += size;
+	batch_current = (batch_current + 1) % BATCH_COUNT;
+}
+
+/* Returns the room left in the batch being filled, or 0 if it is still
+   being written (i.e. all batches are). */
+static unsigned batch_room()
+{
+	return batches[batch_current].pending ? 0 : BATCH_SIZE - batches[batch_current].size;
+}
+
+static void flush_index()
+{
+	DWORD written;
+
+	if(index_size > 0 && !WriteFile(index_file, index_text, index_size, &written, NULL))
+		file_failed = 1;
+	index_size = 0;
+}
+
+/* Indexes the block starting at the end of the file, at stream position
+   'position', published at 'buffered'. */
+static void index_block(unsigned __int64 position, unsigned __int64 buffered)
+{
+	char title[METADATA_TITLE_SIZE];
+	unsigned n;
+	int changed;
+
+	if(file_origin == 0)
+		file_origin = buffered;
+
+	server_get_title_at(position, title, sizeof(title));
+	for(n = 0; title[n] != '\0'; ++n)
+		if((unsigned char)title[n] < 0x20)
+			title[n] = ' ';  // keep lines intact
+	changed = strcmp(title, last_title) != 0;
+	if(!changed && last_index != 0 && buffered - last_index < INDEX_INTERVAL)
+		return;
+
+	if(index_size + 48 + strlen(title) > INDEX_BUFFER_SIZE)
+		flush_index();
+	if(changed)
+	{
+		index_size += sprintf( index_text + index_size, "%I64u\t%I64u\t%s\r\n", file_size,
+		                       (buffered - file_origin)/1000, title );
+		strcpy(last_title, title);
+	}
+	else
+		index_size += sprintf( index_text + index_size, "%I64u\t%I64u\r\n", file_size,
+		                       (buffered - file_origin)/1000 );
+	last_index = buffered;
+}
+
+/* Starts a new file and its index, named after the current time. Returns
+   non-zero if they could not be created. */
+static int open_file()
+{
+	char name[sizeof(recorder_config.path) + 32];
+	const char *extension;
+	unsigned __int64 format_position;
+	SYSTEMTIME now;
+	int length, n;
+
+	server_get_format( file_content_type, sizeof(file_content_type), file_header,
+	                   &file_header_size, &format_position );
+	if(strcmp(file_content_type, "audio/mpeg") == 0)
+		extension = "mp3";
+	else if(strcmp(file_content_type, "audio/wav") == 0)
+		extension = "wav";
+	else
+		extension = "dat";
+
+	GetLocalTime(&now);
+	length = sprintf( name, "%s%04u%02u%02u-%02u%02u%02u", recorder_config.path,
+	                  now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute,
+	                  now.wSecond );
+
+	// Never overwrite a recording; number files started in the same second
+	for(n = 1; n < 100; ++n)
+	{
+		if(n == 1)
+			sprintf(name + length, ".%s", extension);
+		else
+			sprintf(name + length, "-%d.%s", n, extension);
+		file = CreateFile( name, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW,
+		                   FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL );
+		if(file != INVALID_HANDLE_VALUE || GetLastError() != ERROR_FILE_EXISTS)
+			break;
+	}
+	if(file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	strcpy(strrchr(name, '.') + 1, "idx");
+	index_file = CreateFile( name, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+	                         FILE_ATTRIBUTE_NORMAL, NULL );
+	if(index_file == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		return -1;
+	}
+
+	file_failed = 0;
+	file_offset = 0;
+	file_opened = server_time();
+	file_origin = last_index = 0;
+	last_title[0] = '\0';
+	index_size = 0;
+
+	// Start with the stream header (e.g. of a WAV stream)
+	memcpy(batches[batch_current].data, file_header, file_header_size);
+	batches[batch_current].size = file_size = file_header_size;
+
+	counter_add(&recorder_counters.files, 1);
+	return 0;
+}
+
+/* Writes what is left of the file and its index, and closes them. */
+static void close_file()
+{
+	LONG high;
+
+	if(file == INVALID_HANDLE_VALUE)
+		return;
+
+	if(batches[batch_current].size > 0)
+		issue_batch();
+	reap_batches(1);
+	flush_index();
+
+	// Cut off the padding of the last batch
+	high = (LONG)(file_size >> 32);
+	if( ( SetFilePointer(file, (LONG)file_size, &high, FILE_BEGIN) == INVALID_SET_FILE_POINTER &&
+	      GetLastError() != NO_ERROR ) || !SetEndOfFile(file) )
+		file_failed = 1;
+
+	CloseHandle(file);
+	CloseHandle(index_file);
+	file = index_file = INVALID_HANDLE_VALUE;
+}
+
+/* Returns non-zero if the file should be closed before the block at stream
+   position 'position', which is the last one in the buffer or older. */
+static int rotation_due(unsigned __int64 position, unsigned __int64 now)
+{
+	char content_type[sizeof(file_content_type)], header[CODEC_MAX_HEADER_SIZE];
+	unsigned header_size;
+	unsigned __int64 format_position;
+	unsigned long rotate_time = recorder_config.rotate_time;
+
+	if(rotate_time != 0 && rotate_time < ROTATE_TIME_MIN)
+		rotate_time = ROTATE_TIME_MIN;
+	if(rotate_time != 0 && now - file_opened >= (unsigned __int64)rotate_time*1000000)
+		return 1;
+	if( recorder_config.rotate_size != 0 &&
+		file_size >= (unsigned __int64)recorder_config.rotate_size << 20 )
+		return 1;
+
+	// Keep each file in a single format
+	server_get_format(content_type, sizeof(content_type), header, &header_size, &format_position);
+	return position >= format_position &&
+		( strcmp(content_type, file_content_type) != 0 || header_size != file_header_size ||
+		  memcmp(header, file_header, header_size) != 0 );
+}
+
+static DWORD WINAPI run_recorder(LPVOID unused)
+{
+	unsigned __int64 position = server_stream_position(), live, start, buffered, now,
+	                 retry = 0;
+	unsigned room, length;
+	int block_start = 1, block_end, shutdown;
+	batch_t *batch;
+
+	trace_attach("recorder", TRACE_EVENTS_DEFAULT);
+
+	do
+	{
+		shutdown = WaitForSingleObject(recorder_shutdown_event, RECORDER_POLL) == WAIT_OBJECT_0;
+		reap_batches(0);
+		now = server_time();
+
+		if(file_failed)
+		{
+			counter_add(&recorder_counters.errors, 1);
+			close_file();
+		}
+
+		// Record the data published since the last poll, as far as there is
+		// room for it
+		while(1)
+		{
+			live = server_stream_position();
+			if(block_start && position != live)
+			{
+				if(file != INVALID_HANDLE_VALUE && rotation_due(position, now))
+					close_file();
+				if(file == INVALID_HANDLE_VALUE && now >= retry && open_file() != 0)
+				{
+					counter_add(&recorder_counters.errors, 1);
+					retry = now + RECORDER_RETRY;
+				}
+			}
+			if(file == INVALID_HANDLE_VALUE)
+			{
+				// Not recording
+				counter_add(&recorder_counters.dropped, live - position);
+				position = live;
+				block_start = 1;
+				break;
+			}
+			if((room = batch_room()) == 0)
+				break;  // the disk is behind; wait for a batch to be written
+
+			batch = &batches[batch_current];
+			start = position;
+			length = server_read_stream( &position, batch->data + batch->size, room,
+			                             &block_end, &buffered );
+			if(length == 0)
+				break;
+			if(position - length != start)
+			{
+				// Fell a full stream buffer behind; resumed at a block start
+				counter_add(&recorder_counters.dropped, position - length - start);
+				trace_event(TRACE_OVERRUN, (unsigned long)(position - length - start));
+				block_start = 1;
+			}
+			if(block_start)
+				index_block(position - length, buffered);
+
+			batch->size += length;
+			file_size += length;
+			counter_add(&recorder_counters.bytes, length);
+			if(batch->size == BATCH_SIZE)
+				issue_batch();
+			block_start = block_end;
+		}
+	} while(!shutdown);
+
+	close_file();
+	trace_detach();
+	return 0;
+}
+
+/* Starts the recorder thread, unless no path is configured. */
+int recorder_start( const recorder_config_t *config,
+                    unsigned long affinity, int priority )
+{
+	HANDLE thread;
+	unsigned n;
+
+	// A thread left running by a stop that timed out still uses the
+	// batches; finish that stop first
+	if(recorder_thread != NULL && recorder_stop() != 0)
+		return -1;
+
+	memcpy(&recorder_config, config, sizeof(recorder_config));
+	recorder_config.path[sizeof(recorder_config.path) - 1] = '\0';
+	if(recorder_config.path[0] == '\0')
+		return 0;
+
+	// Allocate page-aligned batches
+	memset(batches, 0, sizeof(batches));
+	batch_current = 0;
+	file = index_file = INVALID_HANDLE_VALUE;
+	for(n = 0; n < BATCH_COUNT; ++n)
+		if( (batches[n].data = (char*)VirtualAlloc( NULL, BATCH_SIZE, MEM_COMMIT,
+		                                            PAGE_READWRITE )) == NULL ||
+			(batches[n].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL )
+			goto cleanup;
+
+	if((recorder_shutdown_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+		goto cleanup;
+	if((thread = CreateThread(NULL, 0, run_recorder, NULL, CREATE_SUSPENDED, NULL)) == NULL)
+		goto cleanup;
+	thread_set_scheduling(thread, affinity, priority);
+	ResumeThread(thread);
+	recorder_thread = thread;
+
+	return 0;
+
+cleanup:
+	if(recorder_shutdown_event != NULL)
+		CloseHandle(recorder_shutdown_event);
+	recorder_shutdown_event = NULL;
+	for(n = 0; n < BATCH_COUNT; ++n)
+	{
+		if(batches[n].data != NULL)
+			VirtualFree(batches[n].data, 0, MEM_RELEASE);
+		if(batches[n].overlapped.hEvent != NULL)
+			CloseHandle(batches[n].overlapped.hEvent);
+	}
+	memset(batches, 0, sizeof(batches));
+	return -1;
+}
+
+/* Stops the recorder thread, if it is running, after it has recorded the
+   data published so far. */
+int recorder_stop()
+{
+	unsigned n;
+
+	if(recorder_thread == NULL)
+		return 0;
+
+	SetEvent(recorder_shutdown_event);
+	if(WaitForSingleObject(recorder_thread, SHUTDOWN_TIMEOUT) != WAIT_OBJECT_0)
+		return -1;  // leave the recorder state to the running thread
+	CloseHandle(recorder_thread);
+	CloseHandle(recorder_shutdown_event);
+	recorder_thread = recorder_shutdown_event = NULL;
+
+	for(n = 0; n < BATCH_COUNT; ++n)
+	{
+		VirtualFree(batches[n].data, 0, MEM_RELEASE);
+		CloseHandle(batches[n].overlapped.hEvent);
+	}
+	memset(batches, 0, sizeof(batches));
+	return 0;
+}
+
+/* Restarts the recorder (starting new files) if its configuration changed. */
+int recorder_update_config( const recorder_config_t *config,
+                            unsigned long affinity, int priority )
+{
+	if( config->rotate_time == recorder_config.rotate_time &&
+		config->rotate_size == recorder_config.rotate_size &&
+		strncmp(config->path, recorder_config.path, sizeof(config->path)) == 0 )
+	{
+		if(recorder_thread != NULL)
+			thread_set_scheduling(recorder_thread, affinity, priority);
+		return 0;
+	}
+
+	if(recorder_stop() != 0)
+		return -1;
+	return recorder_start(config, affinity, priority);
+}
+
+void recorder_get_stats(engine_stats_t *stats)
+{
+	stats->recorder_running = (recorder_thread != NULL);
+	stats->recorder_bytes   = counter_read(&recorder_counters.bytes);
+	stats->recorder_files   = counter_read(&recorder_counters.files);
+	stats->recorder_dropped = counter_read(&recorder_counters.dropped);
+	stats->recorder_errors  = counter_read(&recorder_counters.errors);
+}
@@ -1,11 +1,7 @@
 /* Contains the implementation of the Minicast network server. */
 
 #include "engine_internal.h"
-
-// Include Windows headers
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <winsock2.h>
+#include "server_io.h"
 
 // Include standard library headers
 #include <ctype.h>
@@ -15,88 +11,433 @@
 
 
 // Definitions
-#define METADATA_SIZE			  (4081)	// max length of metadata packet;
-#define METADATA_INTERVAL		 (16384)	//  16 kb ==  1 second @ 128 kbps
+#define METADATA_INTERVAL		 (16384)	//  16 kb ==  1 second @ 128 kbps (default)
 #define BUFFER_SIZE             (131072)	// 128 kb == 16 seconds @ 128 kbp;
+#define SEND_BUFFER_SIZE		 (16384)	// max. audio bytes sent per call
+#define STREAM_MARKS			  (1024)	// number of timestamped buffer positions
+#define TITLE_MARKS				    (16)	// number of title changes kept
+#define LOW_LATENCY_SEND_BUFFER	  (4096)	// socket send buffer in low-latency mode
+#define LOW_LATENCY_MAX_DELAY	(500000)	// max. microseconds a client may fall
+											// behind in low-latency mode
+#define BURST_MAX_GAP		   (1000000)	// max. microseconds between blocks
+											// sent at once to a joining client
+#define TIMESHIFT_LEAD		   (2000000)	// microseconds a time-shifted client
+											// is sent ahead of real time
+#define TIMESHIFT_MAX_OFFSET	 (86400)	// max. seconds a client may ask to
+											// start back; more than is archived
+#define TITLE_PENDING	  (~(ULONGLONG)0)	// position of a title not yet placed
+#define ACCEPT_RETRY				(1000)	// milliseconds to wait before retrying
+											// after waiting for connections failed
+#define WRITABLE_POLL				 (100)	// max. milliseconds a client thread
+											// waits for room in its socket
+											// before checking for shutdown
+#define HANDOVER_MAGIC		(0x564F484D)	// "MHOV"
+#define HANDOVER_VERSION			 (3)
 
 
 // Function prototypes 
 int start_server_thread(const network_config_t *config);
 int stop_server_thread();
+int server_update_config(const network_config_t *config);
+int server_handover_send(void *pipe, unsigned long process_id);
+int server_handover_receive(const network_config_t *config, void *pipe);
 void server_update_title(const char *title);
 unsigned server_get_connected_clients();
-void server_enqueue_encoded_data(const char *data, unsigned length);
+void server_enqueue_encoded_data( const char *data, unsigned length,
+                                  unsigned __int64 timestamp );
+void server_set_format(const char *content_type, const char *header, unsigned header_size);
+unsigned __int64 server_time();
+void server_get_stats(engine_stats_t *stats);
+unsigned server_get_listener_stats( engine_listener_stats_t *listeners,
+                                    unsigned max_listeners );
+void server_get_names( char *stream_name, unsigned stream_name_size,
+                       char *title, unsigned title_size );
+int server_get_title_at(unsigned __int64 position, char *title, unsigned title_size);
+void server_get_format( char *content_type, unsigned content_type_size, char *header,
+                        unsigned *header_size, unsigned __int64 *position );
+unsigned __int64 server_stream_position();
+unsigned server_read_stream( unsigned __int64 *position, char *data, unsigned size,
+                             int *block_end, unsigned __int64 *buffered );
+
+void server_set_io(const server_io_t *io);
+int server_initialize(const network_config_t *config);
+void server_finalize();
+struct client *server_client_open(SOCKET socket, unsigned long address);
+int server_client_pump(struct client *client);
+void server_client_close(struct client *client);
 
 static DWORD WINAPI run_server(LPVOID unused);
-static DWORD WINAPI run_client(LPVOID client_socket);
+static DWORD WINAPI run_client(LPVOID worker);
+static ULONGLONG burst_start(unsigned long burst);
+static int reclaim_server();
+
+
+// Statistics counters written by a client's own thread
+typedef struct client_counters
+{
+	ULONGLONG bytes_sent, overruns, syscalls;
+	ULONGLONG latency_last;
+	engine_latency_t latency_ring, latency_total, latency_start;
+} client_counters_t;
+
+// Timestamps of a block of data in the stream buffer
+typedef struct stream_mark
+{
+	ULONGLONG end;		// stream position following the block
+	ULONGLONG queued;	// time the raw data was queued for encoding (0 if unknown)
+	ULONGLONG buffered;	// time the block was added to the buffer
+} stream_mark_t;
+
+// Title change, kept until the stream buffer has moved past it
+typedef struct title_mark
+{
+	ULONGLONG time;		// time the title was submitted
+	ULONGLONG position;	// stream position from which it applies; TITLE_PENDING
+						// until the audio queued after 'time' is buffered
+	char packet[METADATA_SIZE];
+} title_mark_t;
+
+// Per-connection state
+typedef struct client
+{
+	struct client *prev, *next;			// list of registered clients
+	SOCKET    socket;
+	HANDLE    thread;					// thread serving the client, if any
+	unsigned long address;				// client address in native order
+	ULONGLONG connect_time;				// time of connection
+	int       metadata;					// indicates if the client wants metadata
+	int       started;					// set once audio has been sent
+	int       low_latency;				// set if joined in low-latency mode
+	int       resync;					// set after skipping ahead, until the
+										// position is at a frame boundary
+	int volatile format_changed;		// set once the stream format changed
+	ULONGLONG format_end;				// from the one the client was sent, at
+										// this position
+	ULONGLONG shift;					// microseconds behind the live stream
+										// for time-shifted listening; 0 live
+	unsigned  metadata_interval;		// audio bytes between metadata packets
+	ULONGLONG position;					// stream position of next byte to send
+	unsigned  bytes_before_metadata;	// audio bytes left until next metadata
+	int       metadata_due;				// set if a metadata packet is to be
+										// sent before the next audio
+	HANDLE    wake;						// set when data has been published
+	char      last_metadata[METADATA_SIZE];	// holds last metadata packet sent
+	char      pending[METADATA_SIZE];	// metadata packet currently being sent
+	unsigned  pending_size, pending_pos;
+	CACHE_ALIGN client_counters_t volatile counters;
+} client_t;
+
+// Client thread; kept until the thread has exited, so that shutdown can
+// cancel its blocked I/O and wait for it
+typedef struct worker
+{
+	struct worker *next;
+	HANDLE    thread;
+	DWORD     thread_id;
+	SOCKET    socket;
+	int       cancelled;			// set once shutdown has cancelled the
+									// connection
+	client_t *client;				// client taken over from another process
+} worker_t;
+
+// Server state sent to the new process on handover, followed by the stream
+// buffer, the stream and title marks, a handover_client_t for each client and
+// the HLS segments (see hls_handover_send())
+typedef struct handover_header
+{
+	unsigned long magic, version, buffer_size, num_clients;
+	ULONGLONG buffer_total;
+	unsigned stream_marks_count, title_marks_count, title_marks_placed;
+	char title[METADATA_TITLE_SIZE];
+	char content_type[32];
+	char stream_header[CODEC_MAX_HEADER_SIZE];
+	unsigned stream_header_size;
+	ULONGLONG stream_format_position;
+	WSAPROTOCOL_INFO server_socket;
+} handover_header_t;
+
+typedef struct handover_client
+{
+	WSAPROTOCOL_INFO socket;
+	unsigned long address;
+	ULONGLONG connect_time, position, shift;
+	int metadata, metadata_due, low_latency, resync, format_changed;
+	ULONGLONG format_end;
+	unsigned metadata_interval, bytes_before_metadata;
+	char last_metadata[METADATA_SIZE], pending[METADATA_SIZE];
+	unsigned pending_size, pending_pos;
+} handover_client_t;
 
 
 // Global variables
-static network_config_t server_config;
-static SOCKET server_socket;
+static network_config_t server_config;	// protected by metadata_access (stream
+										// name, metadata interval) and
+										// clients_access (connection limit)
+static CRITICAL_SECTION listen_access;	// protects server_socket
+static SOCKET server_socket;			// listening socket; replaced by
+										// server_update_config, closed by
+										// the server thread once it has
+										// switched to the new one
 static HANDLE server_thread, shutdown_event;
+static HANDLE accept_wake;				// wakes the server thread waiting for
+										// connections (auto-reset)
+static SOCKET accepting_socket;			// socket the server thread waits on
+static worker_t *workers_first;			// client threads; protected by clients_access
+static int volatile handing_over;		// set while stopping for a handover
 
 static CRITICAL_SECTION metadata_access;
-static char volatile metadata_packet[METADATA_SIZE];
-static unsigned volatile metadata_size;
+static char current_title[METADATA_TITLE_SIZE];
+static title_mark_t title_marks[TITLE_MARKS];	// ring of recent title changes
+static unsigned volatile title_marks_count;		// number of titles submitted
+static unsigned volatile title_marks_placed;		// number of titles placed
+static char stream_content_type[32] = "audio/mpeg";	// of the encoded stream
+static char stream_header[CODEC_MAX_HEADER_SIZE];	// sent to listeners first
+static unsigned stream_header_size;
+static ULONGLONG stream_format_position;	// from which the format applies
 
 static CRITICAL_SECTION clients_access;
 static unsigned volatile clients_size;
+static client_t *clients_first;			// registered clients
+static client_counters_t departed;		// totals of unregistered clients
+static ULONGLONG departed_cpu_time;		// CPU time of their threads
+
+// Statistics counters updated by any thread with counter_add_shared() (on
+// their own cache lines)
+static CACHE_ALIGN ULONGLONG volatile handshake_count;
+static CACHE_ALIGN ULONGLONG volatile reject_count;
+
+// Statistics counters written by the server thread
+static CACHE_ALIGN ULONGLONG volatile accept_count;
 
 static CRITICAL_SECTION buffer_access;
-static HANDLE buffer_semaphore;
-static unsigned volatile server_buffer_pos;
+static ULONGLONG volatile server_buffer_total;	// total number of bytes buffered
 static volatile char server_buffer[BUFFER_SIZE];
+static stream_mark_t stream_marks[STREAM_MARKS];	// ring of recent blocks
+static unsigned stream_marks_count;				// number of blocks added
 
 
-int start_server_thread(const network_config_t *config)
+// Default I/O primitives (Winsock and the performance counter)
+static SOCKET default_socket(int family, int type, int protocol)
 {
-	struct sockaddr_in server_addr;
-	const int true = 1;
+	return socket(family, type, protocol);
+}
+
+static int default_bind(SOCKET socket, const struct sockaddr *addr, int addr_len)
+{
+	return bind(socket, addr, addr_len);
+}
+
+static int default_listen(SOCKET socket, int backlog)
+{
+	return listen(socket, backlog);
+}
+
+static SOCKET default_accept(SOCKET socket, struct sockaddr *addr, int *addr_len)
+{
+	return accept(socket, addr, addr_len);
+}
+
+static int default_getpeername(SOCKET socket, struct sockaddr *addr, int *addr_len)
+{
+	return getpeername(socket, addr, addr_len);
+}
+
+static int default_recv(SOCKET socket, char *buffer, int length, int flags)
+{
+	return recv(socket, buffer, length, flags);
+}
+
+static int default_send(SOCKET socket, const char *buffer, int length, int flags)
+{
+	int sent = send(socket, buffer, length, flags);
+
+	if(sent == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+		return 0;
+	return sent;
+}
+
+static int default_wait_acceptable(SOCKET socket, HANDLE wake)
+{
+	WSAEVENT event;
+	HANDLE events[2];
+	u_long blocking = 0;
+	DWORD result;
+
+	if((event = WSACreateEvent()) == WSA_INVALID_EVENT)
+		return SOCKET_ERROR;
+	if(WSAEventSelect(socket, event, FD_ACCEPT) != 0)
+	{
+		WSACloseEvent(event);
+		return SOCKET_ERROR;
+	}
+	events[0] = wake;
+	events[1] = event;
+	result = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+
+	// Accepted sockets inherit the event selection and non-blocking mode
+	WSAEventSelect(socket, NULL, 0);
+	ioctlsocket(socket, FIONBIO, &blocking);
+	WSACloseEvent(event);
+
+	if(result == WAIT_OBJECT_0 + 1)
+		return 1;
+	return (result == WAIT_OBJECT_0) ? 0 : SOCKET_ERROR;
+}
+
+static int default_wait_writable(SOCKET socket, unsigned long timeout)
+{
+	fd_set writable;
+	struct timeval time;
+
+	FD_ZERO(&writable);
+	FD_SET(socket, &writable);
+	time.tv_sec  = timeout / 1000;
+	time.tv_usec = (timeout % 1000) * 1000;
+	return select(0, NULL, &writable, NULL, &time);
+}
+
+static int default_shutdown(SOCKET socket, int how)
+{
+	return shutdown(socket, how);
+}
+
+static int default_setsockopt(SOCKET socket, int level, int name, const char *value, int length)
+{
+	return setsockopt(socket, level, name, value, length);
+}
+
+static int default_close(SOCKET socket)
+{
+	return closesocket(socket);
+}
+
+static ULONGLONG default_now(void)
+{
+	static LONGLONG frequency = 0;
+	LARGE_INTEGER counter;
+
+	if(frequency == 0)
+	{
+		LARGE_INTEGER value;
+		QueryPerformanceFrequency(&value);
+		frequency = value.QuadPart;
+	}
+	QueryPerformanceCounter(&counter);
+	return (ULONGLONG)( (counter.QuadPart / frequency) * 1000000 +
+		                (counter.QuadPart % frequency) * 1000000 / frequency );
+}
+
+static const server_io_t default_io = {
+	default_socket, default_bind, default_listen, default_accept, default_getpeername,
+	default_recv, default_send, default_wait_acceptable, default_wait_writable,
+	default_shutdown, default_setsockopt, default_close, default_now };
+
+static const server_io_t *io = &default_io;
+
 
+void server_set_io(const server_io_t *new_io)
+{
+	io = new_io ? new_io : &default_io;
+}
+
+int server_initialize(const network_config_t *config)
+{
 	// Initialize global variables
 	memcpy(&server_config, config, sizeof(server_config));
-	metadata_size = 0;
-	clients_size = 0;
-	server_socket = INVALID_SOCKET;
+	if(server_config.metadata_interval == 0)
+		server_config.metadata_interval = METADATA_INTERVAL;
+	server_socket = accepting_socket = INVALID_SOCKET;
 	server_thread = NULL;
-	shutdown_event = NULL;
-	buffer_semaphore = NULL;
-	server_buffer_pos = 0;
+	workers_first = NULL;
+	handing_over = 0;
+	current_title[0] = '\0';
+	title_marks_count = title_marks_placed = 0;
+	clients_size = 0;
+	clients_first = NULL;
+	shutdown_event = accept_wake = NULL;
+	server_buffer_total = 0;
+	stream_marks_count = 0;
 
 	// Initialize synchronization objects
 	InitializeCriticalSection(&metadata_access);
 	InitializeCriticalSection(&clients_access);
 	InitializeCriticalSection(&buffer_access);
-	if((buffer_semaphore = CreateSemaphore(NULL, 0, config->connection_limit, NULL)) == NULL)
+	InitializeCriticalSection(&listen_access);
+	if((shutdown_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
 		goto cleanup;
+	if((accept_wake = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+		goto cleanup;
+	status_initialize();
+	archive_open(server_config.timeshift_size);
+	hls_open(server_config.hls_duration);
+
+	return 0;
+
+cleanup:
+	if(shutdown_event != NULL)
+		CloseHandle(shutdown_event);
+	DeleteCriticalSection(&metadata_access);
+	DeleteCriticalSection(&clients_access);
+	DeleteCriticalSection(&buffer_access);
+	DeleteCriticalSection(&listen_access);
+	return -1;
+}
+
+void server_finalize()
+{
+	hls_close();
+	archive_close();
+	status_finalize();
+	CloseHandle(shutdown_event);
+	CloseHandle(accept_wake);
+	DeleteCriticalSection(&metadata_access);
+	DeleteCriticalSection(&clients_access);
+	DeleteCriticalSection(&buffer_access);
+	DeleteCriticalSection(&listen_access);
+}
+
+/* Creates a listening socket bound to the configured address and port.
+   Returns INVALID_SOCKET on failure. */
+static SOCKET open_server_socket(const network_config_t *config)
+{
+	SOCKET listen_socket;
+	struct sockaddr_in server_addr;
+	const int true = 1;
 
 	// Initialize server socket
-    if((server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
+    if((listen_socket = io->socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
     {
         MessageBox(NULL, "Server initialization failed:\nunable to create server socket.",
             "Minicast", MB_OK | MB_ICONERROR);
-		goto cleanup;
+		return INVALID_SOCKET;
     }    
 
     // HACK: allows the server socket to be bound immediately to a port that has just been closed.
-    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&true, sizeof(true));
+    io->setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&true, sizeof(true));
 
 	// Bind server socket
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(config->address);
     server_addr.sin_port = htons(config->port);
-    if( bind( server_socket, (const struct sockaddr*)&server_addr,
-			  sizeof(server_addr)) == SOCKET_ERROR ||
-        listen(server_socket, SOMAXCONN) == SOCKET_ERROR )
+    if( io->bind( listen_socket, (const struct sockaddr*)&server_addr,
+			      sizeof(server_addr)) == SOCKET_ERROR ||
+        io->listen(listen_socket, SOMAXCONN) == SOCKET_ERROR )
     {
         MessageBox(NULL, "Server initialization failed:\n"
             "unable to bind server socket to TCP port.", "Minicast", MB_OK | MB_ICONERROR);
-		goto cleanup;
+		io->close(listen_socket);
+		return INVALID_SOCKET;
     }
 
-	// Initialize synchronization objects
-	if((shutdown_event = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+	return listen_socket;
+}
+
+int start_server_thread(const network_config_t *config)
+{
+	if(reclaim_server() != 0 || server_initialize(config) != 0)
+		return -1;
+
+	if((server_socket = open_server_socket(config)) == INVALID_SOCKET)
 		goto cleanup;
 
 	// Initialize thread
@@ -106,172 +447,678 @@ int start_server_thread(const network_config_t *config)
             "Minicast", MB_OK | MB_ICONERROR);
 		goto cleanup;
     }
+	thread_set_scheduling(server_thread, config->affinity, config->priority);
 
 	return 0;
 
 cleanup:
 	if(server_socket != INVALID_SOCKET)
-		closesocket(server_socket);
+		io->close(server_socket);
 	if(server_thread != NULL)
 		CloseHandle(server_thread);
-	if(shutdown_event != NULL)
-		CloseHandle(shutdown_event);
-	if(buffer_semaphore != NULL)
-		CloseHandle(buffer_semaphore);
-	DeleteCriticalSection(&metadata_access);
-	DeleteCriticalSection(&clients_access);
-	DeleteCriticalSection(&buffer_access);
+	server_finalize();
 	return -1;
 }
 
+/* Frees the entries of client threads that have exited.
+   Must be called with clients_access held. */
+static void reap_workers()
+{
+	worker_t **p = &workers_first, *worker;
+
+	while((worker = *p) != NULL)
+	{
+		if(WaitForSingleObject(worker->thread, 0) == WAIT_OBJECT_0)
+		{
+			*p = worker->next;
+			CloseHandle(worker->thread);
+			free(worker);
+		}
+		else
+			p = &worker->next;
+	}
+}
+
+/* Starts a thread serving 'socket' ('client' is NULL for new connections, or
+   a client taken over from another process). */
+static int start_worker(SOCKET socket, client_t *client)
+{
+	worker_t *worker;
+
+	if((worker = (worker_t*)malloc(sizeof(worker_t))) == NULL)
+		return -1;
+	worker->socket = socket;
+	worker->cancelled = 0;
+	worker->client = client;
+
+	EnterCriticalSection(&clients_access);
+	reap_workers();
+	if((worker->thread = CreateThread( NULL, 0, run_client, worker, CREATE_SUSPENDED,
+	                                   &worker->thread_id )) != NULL)
+	{
+		thread_set_scheduling( worker->thread, server_config.affinity,
+		                       server_config.priority );
+		ResumeThread(worker->thread);
+		worker->next = workers_first;
+		workers_first = worker;
+	}
+	LeaveCriticalSection(&clients_access);
+
+	if(worker->thread == NULL)
+	{
+		free(worker);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the entry of the calling client thread, or NULL if the caller is
+   not a client thread. Must be called with clients_access held. */
+static worker_t *current_worker()
+{
+	worker_t *worker;
+	DWORD thread_id = GetCurrentThreadId();
+
+	for(worker = workers_first; worker != NULL; worker = worker->next)
+		if(worker->thread_id == thread_id)
+			return worker;
+	return NULL;
+}
+
+/* Waits until all client threads (woken by shutdown_event) have exited or
+   the server time 'deadline' has passed. If 'cancel' is set, their
+   connections are shut down first, so that threads blocked in send() or
+   recv() return; each thread closes its own socket, as closing it here could
+   hand the handle to a new socket while the thread still uses it. Returns
+   the number of threads still running. */
+static unsigned join_workers(ULONGLONG deadline, int cancel)
+{
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	worker_t *worker;
+	unsigned count, waiting;
+	ULONGLONG now;
+
+	while(1)
+	{
+		EnterCriticalSection(&clients_access);
+		reap_workers();
+		count = waiting = 0;
+		for(worker = workers_first; worker != NULL; worker = worker->next)
+		{
+			if(cancel && !worker->cancelled)
+			{
+				worker->cancelled = 1;
+				io->shutdown(worker->socket, SD_BOTH);
+			}
+			if(waiting < MAXIMUM_WAIT_OBJECTS)
+				threads[waiting++] = worker->thread;
+			++count;
+		}
+		LeaveCriticalSection(&clients_access);
+
+		now = io->now();
+		if(count == 0 || now >= deadline)
+			return count;
+		WaitForMultipleObjects( waiting, threads, TRUE,
+		                        (DWORD)((deadline - now + 999)/1000) );
+	}
+}
+
 int stop_server_thread()
 {
+	ULONGLONG deadline = io->now() + (ULONGLONG)SHUTDOWN_TIMEOUT*1000;
+
 	SetEvent(shutdown_event);
 
 	// Make the server thread shutdown
-	closesocket(server_socket);
-	WaitForSingleObject(server_thread, INFINITE);
+	SetEvent(accept_wake);
+	if(WaitForSingleObject(server_thread, SHUTDOWN_TIMEOUT) != WAIT_OBJECT_0)
+		return -1;  // leave the server state to the running thread
+	if(server_socket != INVALID_SOCKET)
+		io->close(server_socket);
+	server_socket = INVALID_SOCKET;
 
-	// Make the client threads shutdown
-	EnterCriticalSection(&clients_access);
-	ReleaseSemaphore(buffer_semaphore, server_config.connection_limit, NULL);
-	LeaveCriticalSection(&clients_access);
-	while(server_get_connected_clients() > 0)
-		Sleep(100);
+	// Make the client threads shutdown, cancelling blocked I/O
+	if(join_workers(deadline, 1) > 0)
+		return -1;
 	ResetEvent(shutdown_event);
 
 	// Clean up synchronization objects
-	CloseHandle(shutdown_event);
 	CloseHandle(server_thread);
-	CloseHandle(buffer_semaphore);
-	DeleteCriticalSection(&metadata_access);
-	DeleteCriticalSection(&clients_access);
-	DeleteCriticalSection(&buffer_access);
+	server_thread = NULL;
+	server_finalize();
 
 	return 0;
 }
 
-void server_update_title(const char *title)
+/* Completes a stop that timed out, once the threads it left running have
+   exited. Returns non-zero while any is still running: the server state,
+   including its critical sections, is then still in use and must not be
+   initialized again. */
+static int reclaim_server()
 {
-	EnterCriticalSection(&metadata_access);
-	memset((char*)metadata_packet, 0, METADATA_SIZE);
-	sprintf((char*)metadata_packet + 1, "StreamTitle='%.4064s';", title);
-	*metadata_packet = (char)(unsigned char)
-		((strlen((char*)metadata_packet + 1) + 16)/16);
-	LeaveCriticalSection(&metadata_access);
-}
+	client_t *client, *next;
 
-unsigned server_get_connected_clients()
-{
-	unsigned result;
-	EnterCriticalSection(&clients_access);
-	result = clients_size;
-	LeaveCriticalSection(&clients_access);
-	return result;
-}
+	if(server_thread == NULL)
+		return 0;
+	if( WaitForSingleObject(server_thread, 0) != WAIT_OBJECT_0 ||
+		join_workers(io->now(), 1) > 0 )
+		return -1;
 
-void server_enqueue_encoded_data(const char *data, unsigned length)
-{
-	while(length > BUFFER_SIZE)
+	// Close what the stop did not get to, e.g. clients left registered for
+	// a handover that timed out
+	for(client = clients_first; client != NULL; client = next)
 	{
-		data   += BUFFER_SIZE;
-		length -= BUFFER_SIZE;
+		next = client->next;
+		server_client_close(client);
 	}
+	if(server_socket != INVALID_SOCKET)
+		io->close(server_socket);
+	server_socket = INVALID_SOCKET;
+	CloseHandle(server_thread);
+	server_thread = NULL;
+	server_finalize();
+	return 0;
+}
 
-	EnterCriticalSection(&buffer_access);
-	if(server_buffer_pos + length <= BUFFER_SIZE)
-	{
-		memcpy((char*)server_buffer + server_buffer_pos, data, length);
-		server_buffer_pos += length;
-	}
-	else
+int server_update_config(const network_config_t *config)
+{
+	int result = 0;
+
+	// Open a socket for the new address before giving up the old one. The
+	// server thread is woken to pick up the new socket.
+	if( server_thread != NULL &&
+		( config->address != server_config.address ||
+		  config->port    != server_config.port ) )
 	{
-		unsigned first_part_size  = BUFFER_SIZE - server_buffer_pos,
-				 second_part_size = length - first_part_size;
-		memcpy((char*)server_buffer + server_buffer_pos, data, first_part_size);
-		memcpy((char*)server_buffer, data + first_part_size, second_part_size);
-		server_buffer_pos = second_part_size;
+		SOCKET listen_socket = open_server_socket(config), old_socket;
+		if(listen_socket == INVALID_SOCKET)
+			result = -1;
+		else
+		{
+			// The server thread closes the socket it waits on once woken;
+			// a socket replaced before it got there is closed here
+			EnterCriticalSection(&listen_access);
+			old_socket = server_socket;
+			server_socket = listen_socket;
+			if(old_socket != accepting_socket)
+				io->close(old_socket);
+			LeaveCriticalSection(&listen_access);
+			SetEvent(accept_wake);
+			server_config.address = config->address;
+			server_config.port    = config->port;
+		}
 	}
-	LeaveCriticalSection(&buffer_access);
 
+	// Connected clients keep their limit, name and interval; new clients get
+	// the new ones. Scheduling applies to all threads right away.
 	EnterCriticalSection(&clients_access);
-	ReleaseSemaphore(buffer_semaphore, server_config.connection_limit, NULL);
+	server_config.connection_limit = config->connection_limit;
+	if( config->priority != server_config.priority ||
+		config->affinity != server_config.affinity )
+	{
+		worker_t *worker;
+
+		server_config.priority = config->priority;
+		server_config.affinity = config->affinity;
+		if(server_thread != NULL)
+			thread_set_scheduling(server_thread, config->affinity, config->priority);
+		for(worker = workers_first; worker != NULL; worker = worker->next)
+			thread_set_scheduling(worker->thread, config->affinity, config->priority);
+	}
 	LeaveCriticalSection(&clients_access);
+
+	EnterCriticalSection(&metadata_access);
+	memcpy(server_config.stream_name, config->stream_name, sizeof(server_config.stream_name));
+	server_config.stream_name[sizeof(server_config.stream_name) - 1] = '\0';
+	server_config.metadata_interval =
+		(config->metadata_interval != 0) ? config->metadata_interval : METADATA_INTERVAL;
+	server_config.burst_size  = config->burst_size;
+	server_config.low_latency = config->low_latency;
+	LeaveCriticalSection(&metadata_access);
+
+	return result;
 }
 
-static DWORD WINAPI run_server(LPVOID unused)
+/* Submits a new title. It is sent to each client only once the client has
+   reached the audio queued for encoding after this call, so that the title
+   changes together with the audio however much of it is buffered. */
+void server_update_title(const char *title)
 {
-	while(1)
-	{
-		struct sockaddr client_addr;
-		int client_addr_len = sizeof(client_addr);
-		SOCKET client_socket = accept(server_socket, &client_addr, &client_addr_len);
+	char packet[METADATA_SIZE];
+	title_mark_t *mark;
 
-		if(client_socket == INVALID_SOCKET)
+	memset(packet, 0, METADATA_SIZE);
+	sprintf(packet + 1, "StreamTitle='%.4064s';", title);
+	*packet = (char)(unsigned char)((strlen(packet + 1) + 16)/16);
+
+	EnterCriticalSection(&metadata_access);
+	strncpy(current_title, title, sizeof(current_title) - 1);
+	current_title[sizeof(current_title) - 1] = '\0';
+
+	// Ignore titles that do not change the latest one submitted
+	if( title_marks_count == 0 ||
+		memcmp( title_marks[(title_marks_count - 1) % TITLE_MARKS].packet,
+		        packet, METADATA_SIZE ) != 0 )
+	{
+		trace_event(TRACE_METADATA, (unsigned long)strlen(title));
+		if(title_marks_count - title_marks_placed == TITLE_MARKS)
 		{
-			if(WaitForSingleObject(shutdown_event, 0) == WAIT_OBJECT_0)
-				break;
+			// All titles kept are waiting for audio; replace the latest,
+			// which now waits for the audio queued after this call
+			mark = &title_marks[(title_marks_count - 1) % TITLE_MARKS];
+			mark->time = server_time();
 		}
 		else
 		{
-			HANDLE client_thread = CreateThread(
-				NULL, 0, run_client, (LPVOID)client_socket, 0, NULL );
-			if(client_thread == NULL)
-				closesocket(client_socket);
-			else
-				CloseHandle(client_thread);
+			mark = &title_marks[title_marks_count % TITLE_MARKS];
+			mark->time     = server_time();
+			mark->position = TITLE_PENDING;
+			++title_marks_count;
 		}
+		memcpy(mark->packet, packet, METADATA_SIZE);
 	}
-
-	return 0;
+	LeaveCriticalSection(&metadata_access);
 }
 
-static DWORD WINAPI run_client(LPVOID client_socket)
+/* Places titles submitted before the raw data of a block was queued at the
+   start of that block. */
+static void place_titles(ULONGLONG position, ULONGLONG queued)
 {
-	// FIXME: reading/writing should time out!
+	title_mark_t *mark;
 
-	SOCKET socket = (SOCKET)client_socket;
-	char buffer[8192],		// HTTP request buffer
-		 *line, *eol,		// used for parsing request buffer
-		 resource[64],		// requested HTTP resource
-		 response[256];		// HTTP response buffer
-	int metadata = 0,		// indicates if the client wants metadata
-		streaming = 0;		// indicates if the client wants audio data
-	char last_metadata[METADATA_SIZE] = { 0 };	// holds last metadata packet sent
-	int buffer_size = 0, received;
+	if(queued == 0 || title_marks_placed == title_marks_count)
+		return;
 
-	// Read request (into fixed-size buffer)
-	while((received = recv( socket, buffer + buffer_size,
-		                    sizeof(buffer) - buffer_size - 1, 0 )) >= 0)
+	EnterCriticalSection(&metadata_access);
+	while(title_marks_placed != title_marks_count)
 	{
-		buffer_size += received;
-		buffer[buffer_size] = '\0';
-
-		if(strstr(buffer, "\r\n\r\n") != NULL)
+		mark = &title_marks[title_marks_placed % TITLE_MARKS];
+		if(mark->time > queued)
 			break;
+		mark->position = position;
+		archive_add_title(position, mark->packet);
+		++title_marks_placed;
+	}
+	LeaveCriticalSection(&metadata_access);
+}
 
-		if(received == 0)
-		{
-			// shutdown occured before request was completed.
-			received = SOCKET_ERROR;
+/* Returns the metadata packet that applies at a stream position, or NULL if
+   no title has been placed. Must be called with metadata_access held. */
+static const char *find_title(ULONGLONG position)
+{
+	unsigned first, n;
+	const char *packet;
+
+	first = (title_marks_count > TITLE_MARKS) ? title_marks_count - TITLE_MARKS : 0;
+	if(title_marks_placed <= first)
+		return NULL;
+
+	// Take the latest title placed at or before the position, or the oldest
+	// one kept if the position is older than that
+	for(n = title_marks_placed - 1; n > first; --n)
+		if(title_marks[n % TITLE_MARKS].position <= position)
 			break;
-		}
-	}
+	if( title_marks[n % TITLE_MARKS].position > position &&
+		(packet = archive_find_title(position)) != NULL )
+		return packet;  // time-shifted listener, further back
+	return title_marks[n % TITLE_MARKS].packet;
+}
 
-	// Socket prematurely closed.
-	if(received == SOCKET_ERROR)
-		return 0;
+void server_get_names( char *stream_name, unsigned stream_name_size,
+                       char *title, unsigned title_size )
+{
+	EnterCriticalSection(&metadata_access);
+	strncpy(stream_name, server_config.stream_name, stream_name_size - 1);
+	stream_name[stream_name_size - 1] = '\0';
+	strncpy(title, current_title, title_size - 1);
+	title[title_size - 1] = '\0';
+	LeaveCriticalSection(&metadata_access);
+}
 
-	// Parse HTTP request and formulate response
-	line = buffer; eol = strstr(line, "\r\n"); *eol = '\0';
-	if(sscanf(line, "GET %64s", resource) < 1)
-	{
-		// Unsupported HTTP method used
-		strcpy(response, "HTTP/1.0 501 Not Implemented\r\n\r\n");
-	}	
-	else
+/* Sets the content type of the stream and the header each listener gets
+   before the first frame (e.g. a WAV header); applies to listeners joining
+   from now on. Listeners that were sent another content type or header
+   cannot follow the change; they are disconnected once they reach it, so
+   that their players reconnect and get the new one. */
+void server_set_format(const char *content_type, const char *header, unsigned header_size)
+{
+	client_t *client;
+	int changed;
+
+	if(header_size > sizeof(stream_header))
+		header_size = 0;
+
+	EnterCriticalSection(&metadata_access);
+	changed = strncmp(content_type, stream_content_type, sizeof(stream_content_type) - 1) != 0 ||
+	          header_size != stream_header_size ||
+	          memcmp(header, stream_header, header_size) != 0;
+	strncpy(stream_content_type, content_type, sizeof(stream_content_type) - 1);
+	stream_content_type[sizeof(stream_content_type) - 1] = '\0';
+	memcpy(stream_header, header, header_size);
+	stream_header_size = header_size;
+	stream_format_position = server_buffer_total;  // written by the caller only
+	if(changed)
 	{
-		if(strcmp(resource, "/") != 0)
+		EnterCriticalSection(&clients_access);
+		for(client = clients_first; client != NULL; client = client->next)
+			if(!client->format_changed)
+			{
+				client->format_end = stream_format_position;
+				client->format_changed = 1;
+			}
+		LeaveCriticalSection(&clients_access);
+	}
+	LeaveCriticalSection(&metadata_access);
+	hls_set_format(content_type);
+}
+
+/* Gets the content type and header of the stream, and the stream position
+   from which they apply; 'header' must hold CODEC_MAX_HEADER_SIZE bytes. */
+void server_get_format( char *content_type, unsigned content_type_size, char *header,
+                        unsigned *header_size, unsigned __int64 *position )
+{
+	EnterCriticalSection(&metadata_access);
+	strncpy(content_type, stream_content_type, content_type_size - 1);
+	content_type[content_type_size - 1] = '\0';
+	memcpy(header, stream_header, stream_header_size);
+	*header_size = stream_header_size;
+	*position = stream_format_position;
+	LeaveCriticalSection(&metadata_access);
+}
+
+/* Gets the title that applies at a stream position. Returns zero if no title
+   has been placed, in which case 'title' is set empty. */
+int server_get_title_at(unsigned __int64 position, char *title, unsigned title_size)
+{
+	const char *packet;
+	unsigned length;
+	int result = -1;
+
+	title[0] = '\0';
+	EnterCriticalSection(&metadata_access);
+	if((packet = find_title(position)) != NULL)
+	{
+		// Take the title out of "StreamTitle='...';"
+		packet += 1 + 13;
+		length = (unsigned)strlen(packet);
+		length = (length >= 2) ? length - 2 : 0;
+		if(length > title_size - 1)
+			length = title_size - 1;
+		memcpy(title, packet, length);
+		title[length] = '\0';
+		result = 0;
+	}
+	LeaveCriticalSection(&metadata_access);
+
+	return result;
+}
+
+unsigned server_get_connected_clients()
+{
+	return clients_size;
+}
+
+void server_enqueue_encoded_data( const char *data, unsigned length,
+                                  unsigned __int64 timestamp )
+{
+	stream_mark_t *mark;
+	client_t *client;
+	unsigned pos;
+	ULONGLONG start, buffered;
+
+	while(length > BUFFER_SIZE)
+	{
+		data   += BUFFER_SIZE;
+		length -= BUFFER_SIZE;
+	}
+
+	EnterCriticalSection(&buffer_access);
+	start = server_buffer_total;
+	pos = (unsigned)(server_buffer_total % BUFFER_SIZE);
+	if(pos + length <= BUFFER_SIZE)
+	{
+		memcpy((char*)server_buffer + pos, data, length);
+	}
+	else
+	{
+		unsigned first_part_size  = BUFFER_SIZE - pos,
+				 second_part_size = length - first_part_size;
+		memcpy((char*)server_buffer + pos, data, first_part_size);
+		memcpy((char*)server_buffer, data + first_part_size, second_part_size);
+	}
+	server_buffer_total += length;
+
+	// Remember when this block was produced
+	mark = &stream_marks[stream_marks_count++ % STREAM_MARKS];
+	mark->end      = server_buffer_total;
+	mark->queued   = timestamp;
+	mark->buffered = buffered = io->now();
+	LeaveCriticalSection(&buffer_access);
+	trace_event(TRACE_PUBLISH, length);
+	archive_write(start, data, length, buffered);
+	place_titles(start, timestamp);
+	hls_write(start, data, length);
+
+	// Wake each client; an event stays set until its thread waits again, so
+	// a client busy sending does not miss the block
+	EnterCriticalSection(&clients_access);
+	for(client = clients_first; client != NULL; client = client->next)
+		SetEvent(client->wake);
+	LeaveCriticalSection(&clients_access);
+}
+
+unsigned __int64 server_time()
+{
+	return io->now();
+}
+
+void server_get_stats(engine_stats_t *stats)
+{
+	client_t *client;
+	ULONGLONG total;
+
+	EnterCriticalSection(&buffer_access);
+	total = server_buffer_total;
+	LeaveCriticalSection(&buffer_access);
+
+	stats->ring_size  = BUFFER_SIZE;
+	stats->ring_fill  = (total < BUFFER_SIZE) ? (unsigned)total : BUFFER_SIZE;
+	stats->handshakes = counter_read(&handshake_count);
+	stats->rejects    = counter_read(&reject_count);
+
+	// Sum the counters of connected and departed clients
+	EnterCriticalSection(&clients_access);
+	stats->listeners = clients_size;
+	stats->bytes_out = departed.bytes_sent;
+	stats->overruns  = departed.overruns;
+	stats->syscalls  = departed.syscalls + counter_read(&accept_count);
+	stats->server_cpu_time  = thread_cpu_time(server_thread);
+	stats->clients_cpu_time = departed_cpu_time;
+	archive_get_stats(stats);
+	hls_get_stats(stats);
+	latency_merge(&stats->latency_ring,  &departed.latency_ring);
+	latency_merge(&stats->latency_total, &departed.latency_total);
+	latency_merge(&stats->latency_start, &departed.latency_start);
+	for(client = clients_first; client != NULL; client = client->next)
+	{
+		stats->bytes_out += counter_read(&client->counters.bytes_sent);
+		stats->overruns  += counter_read(&client->counters.overruns);
+		stats->syscalls  += counter_read(&client->counters.syscalls);
+		stats->clients_cpu_time += thread_cpu_time(client->thread);
+		latency_merge(&stats->latency_ring,  &client->counters.latency_ring);
+		latency_merge(&stats->latency_total, &client->counters.latency_total);
+		latency_merge(&stats->latency_start, &client->counters.latency_start);
+	}
+	LeaveCriticalSection(&clients_access);
+}
+
+unsigned server_get_listener_stats( engine_listener_stats_t *listeners,
+                                    unsigned max_listeners )
+{
+	client_t *client;
+	ULONGLONG total, now = io->now();
+	unsigned n = 0;
+
+	EnterCriticalSection(&buffer_access);
+	total = server_buffer_total;
+	LeaveCriticalSection(&buffer_access);
+
+	EnterCriticalSection(&clients_access);
+	for( client = clients_first; client != NULL && n < max_listeners;
+	     client = client->next, ++n )
+	{
+		ULONGLONG position = client->position,
+		          count = counter_read(&client->counters.latency_total.count);
+		listeners[n].address        = client->address;
+		listeners[n].connected_time = now - client->connect_time;
+		listeners[n].bytes_sent     = counter_read(&client->counters.bytes_sent);
+		listeners[n].lag            = (position < total) ? (unsigned)(total - position) : 0;
+		listeners[n].overruns       = (unsigned)counter_read(&client->counters.overruns);
+		listeners[n].latency        = (count == 0) ? 0 :
+			counter_read(&client->counters.latency_total.total) / count;
+		listeners[n].latency_last   = counter_read(&client->counters.latency_last);
+		listeners[n].cpu_time       = thread_cpu_time(client->thread);
+	}
+	LeaveCriticalSection(&clients_access);
+
+	return n;
+}
+
+static DWORD WINAPI run_server(LPVOID unused)
+{
+	EnterCriticalSection(&listen_access);
+	accepting_socket = server_socket;
+	LeaveCriticalSection(&listen_access);
+
+	while(1)
+	{
+		struct sockaddr client_addr;
+		int client_addr_len = sizeof(client_addr), ready;
+		SOCKET client_socket;
+
+		ready = io->wait_acceptable(accepting_socket, accept_wake);
+		if(WaitForSingleObject(shutdown_event, 0) == WAIT_OBJECT_0)
+			break;
+
+		// Switch to a socket installed by server_update_config
+		EnterCriticalSection(&listen_access);
+		if(server_socket != accepting_socket)
+		{
+			io->close(accepting_socket);
+			accepting_socket = server_socket;
+			LeaveCriticalSection(&listen_access);
+			continue;
+		}
+		LeaveCriticalSection(&listen_access);
+
+		if(ready < 0)
+			WaitForSingleObject(accept_wake, ACCEPT_RETRY);
+		if(ready <= 0)
+			continue;
+
+		client_socket = io->accept(accepting_socket, &client_addr, &client_addr_len);
+		counter_add(&accept_count, 1);
+		if(client_socket != INVALID_SOCKET && start_worker(client_socket, NULL) != 0)
+			io->close(client_socket);
+	}
+
+	// A socket replaced while shutting down is closed with the current one
+	EnterCriticalSection(&listen_access);
+	if(server_socket != accepting_socket)
+		io->close(accepting_socket);
+	accepting_socket = INVALID_SOCKET;
+	LeaveCriticalSection(&listen_access);
+
+	return 0;
+}
+
+// Sends a block of data, retrying after partial sends. Returns non-zero on error.
+static int send_all(client_t *client, const char *data, unsigned length)
+{
+	while(length > 0)
+	{
+		int sent = io->send(client->socket, data, length, 0);
+		counter_add(&client->counters.syscalls, 1);
+		if(sent <= 0)
+			return -1;
+		data   += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+/* Reads the HTTP request of a client and sends the response. Returns non-zero
+   if the client has been registered for streaming. */
+static int handle_request(client_t *client)
+{
+	// FIXME: reading/writing should time out!
+
+	char buffer[8192],		// HTTP request buffer
+		 *line, *eol,		// used for parsing request buffer
+		 resource[64],		// requested HTTP resource
+		 response[256];		// HTTP response buffer
+	int streaming = 0;		// indicates if the client wants audio data
+	unsigned long burst_size = 0;	// audio bytes to send at once
+	ULONGLONG format_position = 0;	// from which the header sent applies
+	char *body = NULL;		// response body (for status pages)
+	unsigned body_size = 0, max_age;
+	const char *content_type;
+	char header[CODEC_MAX_HEADER_SIZE];	// stream header (for streaming clients)
+	unsigned header_size = 0;
+	int buffer_size = 0, received;
+
+	// Read request (into fixed-size buffer)
+	while((received = io->recv( client->socket, buffer + buffer_size,
+		                        sizeof(buffer) - buffer_size - 1, 0 )) >= 0)
+	{
+		counter_add(&client->counters.syscalls, 1);
+		buffer_size += received;
+		buffer[buffer_size] = '\0';
+
+		if(strstr(buffer, "\r\n\r\n") != NULL)
+			break;
+
+		if(received == 0)
+		{
+			// shutdown occured before request was completed.
+			received = SOCKET_ERROR;
+			break;
+		}
+	}
+
+	// Socket prematurely closed.
+	if(received == SOCKET_ERROR)
+		return 0;
+
+	// Parse HTTP request and formulate response
+	line = buffer; eol = strstr(line, "\r\n"); *eol = '\0';
+	if(sscanf(line, "GET %63s", resource) < 1)
+	{
+		// Unsupported HTTP method used
+		strcpy(response, "HTTP/1.0 501 Not Implemented\r\n\r\n");
+	}	
+	else
+	{
+		if((body = status_get_page(resource, &content_type, &body_size)) != NULL)
+		{
+			// Status page requested; served without taking a listener slot
+			sprintf( response, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+				"Content-Length: %u\r\nCache-Control: no-cache\r\n\r\n",
+				content_type, body_size );
+		}
+		else
+		if((body = hls_get_page(resource, &content_type, &body_size, &max_age)) != NULL)
+		{
+			// HLS playlist or segment; cacheable, so that proxies in front of
+			// the server can serve the listeners
+			sprintf( response, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n"
+				"Content-Length: %u\r\nCache-Control: public, max-age=%u\r\n"
+				"Access-Control-Allow-Origin: *\r\n\r\n",
+				content_type, body_size, max_age );
+		}
+		else
+		if(strcmp(resource, "/") != 0 && strncmp(resource, "/?", 2) != 0)
 		{
 			// Unknown resource requested
 			strcpy(response, "HTTP/1.0 404 Not Found\r\n\r\n");
@@ -284,17 +1131,48 @@ static DWORD WINAPI run_client(LPVOID client_socket)
 			{
 				++clients_size;
 				streaming = 1;
+				if((client->next = clients_first) != NULL)
+					clients_first->prev = client;
+				clients_first = client;
 			}
 			LeaveCriticalSection(&clients_access);
 
 			if(!streaming)
 			{
 				// Server is full.
+				counter_add_shared(&reject_count, 1);
 				sprintf(response, "ICY 503 Service Unavailable\015\012\015\012");
 			}
 			else
 			{
-				sprintf(response, "ICY 200 OK\r\nicy-name: %s\r\n", server_config.stream_name);
+				EnterCriticalSection(&metadata_access);
+				sprintf( response, "ICY 200 OK\r\nicy-name: %s\r\nContent-Type: %s\r\n",
+				         server_config.stream_name, stream_content_type );
+				memcpy(header, stream_header, stream_header_size);
+				header_size = stream_header_size;
+				format_position = stream_format_position;
+				client->format_changed = 0;  // since registered; it gets this one
+				client->metadata_interval = server_config.metadata_interval;
+				burst_size = server_config.burst_size;
+				client->low_latency = server_config.low_latency;
+				LeaveCriticalSection(&metadata_access);
+
+				// Parse the query: "offset=-<seconds>" starts that far back
+				// in the time-shift archive; offsets further back than it can
+				// hold (down to LONG_MIN, which cannot be negated) start at
+				// the oldest data
+				{
+					const char *query;
+					long offset;
+					if( (query = strstr(resource, "offset=")) != NULL &&
+						sscanf(query + 7, "%ld", &offset) == 1 && offset < 0 &&
+						!client->low_latency && archive_enabled() )
+					{
+						if(offset < -TIMESHIFT_MAX_OFFSET)
+							offset = -TIMESHIFT_MAX_OFFSET;
+						client->shift = (ULONGLONG)-offset * 1000000;
+					}
+				}
 
 				// Parse HTTP headers
 				while(1)
@@ -318,16 +1196,16 @@ static DWORD WINAPI run_client(LPVOID client_socket)
 					{
 						int i;
 						if(sscanf(value, "%d", &i) == 1)
-							metadata = i;
+							client->metadata = i;
 					}
 
 				}
 
 				// Add metadata interval header to response
-				if(metadata)
+				if(client->metadata)
 				{
-					sprintf( response + strlen(response), "icy-metaint: %d\r\n",
-							METADATA_INTERVAL );
+					sprintf( response + strlen(response), "icy-metaint: %u\r\n",
+							client->metadata_interval );
 				}
 			
 				strcat(response, "\r\n");
@@ -336,99 +1214,865 @@ static DWORD WINAPI run_client(LPVOID client_socket)
 	}
 
 	// Disable further reading.
-	shutdown(socket, SD_RECEIVE);
+	io->shutdown(client->socket, SD_RECEIVE);
 
 	// Send HTTP response
-	send(socket, response, (int)strlen(response), 0);
+	send_all(client, response, (unsigned)strlen(response));
+	if(body != NULL)
+	{
+		send_all(client, body, body_size);
+		free(body);
+	}
+	counter_add_shared(&handshake_count, 1);
 
 	if(streaming)
 	{
-		unsigned bytes_before_metadata = METADATA_INTERVAL;
-		unsigned client_buffer_pos;
-		char client_buffer[BUFFER_SIZE];
+		// Send each frame at once, and keep data in the stream buffer
+		// rather than in the socket, so that a slow client is detected
+		if(client->low_latency)
+		{
+			int nodelay = 1, send_buffer = LOW_LATENCY_SEND_BUFFER;
+
+			io->setsockopt( client->socket, IPPROTO_TCP, TCP_NODELAY,
+			                (const char*)&nodelay, sizeof(nodelay) );
+			io->setsockopt( client->socket, SOL_SOCKET, SO_SNDBUF,
+			                (const char*)&send_buffer, sizeof(send_buffer) );
+			burst_size = 0;
+		}
 
 		// Set client position
-		EnterCriticalSection(&buffer_access);
-		client_buffer_pos = server_buffer_pos;
+		if(client->shift != 0)
+		{
+			ULONGLONG now = io->now();
+			client->position = archive_seek((now > client->shift) ? now - client->shift : 0);
+			if(client->position < format_position)
+				client->position = format_position;
+		}
+		else
+		{
+			EnterCriticalSection(&buffer_access);
+			client->position = burst_start(burst_size);
+			if(client->position < format_position)
+				client->position = format_position;
+			client->resync = 1;  // the first data sent must start a frame
+			LeaveCriticalSection(&buffer_access);
+		}
+		client->bytes_before_metadata = client->metadata_interval;
+
+		// Send the stream header; it counts as audio data between metadata
+		if(header_size > 0 && header_size < client->bytes_before_metadata)
+		{
+			send_all(client, header, header_size);
+			client->bytes_before_metadata -= header_size;
+		}
+	}
+
+	return streaming;
+}
+
+/* Returns the timestamps of the block containing stream position 'position',
+   or NULL if it is past the live position or older than the marks kept. Once
+   the ring has been lapped, the start of the oldest block kept is unknown, so
+   positions in it are treated as too old. Must be called with buffer_access
+   held. */
+static const stream_mark_t *find_stream_mark(ULONGLONG position)
+{
+	unsigned first, lo, hi;
+
+	first = (stream_marks_count > STREAM_MARKS) ? stream_marks_count - STREAM_MARKS + 1 : 0;
+	if(first > 0 && position < stream_marks[(first - 1) % STREAM_MARKS].end)
+		return NULL;
+	lo = first;
+	hi = stream_marks_count;
+	while(lo < hi)
+	{
+		unsigned mid = lo + (hi - lo)/2;
+		if(stream_marks[mid % STREAM_MARKS].end > position)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (lo < stream_marks_count) ? &stream_marks[lo % STREAM_MARKS] : NULL;
+}
+
+/* Returns 'start' moved forward to the start of a block, or to the oldest
+   block boundary known if it is older than the marks kept. Must be called
+   with buffer_access held. */
+static ULONGLONG align_to_block(ULONGLONG start)
+{
+	const stream_mark_t *mark;
+
+	if(start == 0 || start >= server_buffer_total)
+		return start;
+	if((mark = find_stream_mark(start - 1)) != NULL)
+		return mark->end;
+	return stream_marks[(stream_marks_count - STREAM_MARKS) % STREAM_MARKS].end;
+}
+
+/* Moves 'position' forward to the first frame boundary of an MP3 stream;
+   blocks of pre-encoded data passed through need not start at one. Returns
+   non-zero if none is buffered yet, leaving bytes that may start a header
+   not yet complete. Other streams are taken to be at a boundary. Must be
+   called with buffer_access held. */
+static int align_to_frame(ULONGLONG *position)
+{
+	unsigned char data[MP3_MAX_FRAME_SIZE + 3];
+	unsigned length, pos, sync;
+
+	if(strcmp(stream_content_type, "audio/mpeg") != 0)
+		return 0;
+	if(server_buffer_total - *position < sizeof(data))
+		length = (unsigned)(server_buffer_total - *position);
+	else
+		length = sizeof(data);
+
+	pos = (unsigned)(*position % BUFFER_SIZE);
+	if(pos + length <= BUFFER_SIZE)
+		memcpy(data, (char*)server_buffer + pos, length);
+	else
+	{
+		memcpy(data, (char*)server_buffer + pos, BUFFER_SIZE - pos);
+		memcpy(data + BUFFER_SIZE - pos, (char*)server_buffer, length - (BUFFER_SIZE - pos));
+	}
+
+	if((sync = mp3_find_sync(data, length)) == length)
+	{
+		*position += (length > 3) ? length - 3 : 0;
+		return -1;
+	}
+	*position += sync;
+	return 0;
+}
+
+/* Returns the position at which a client joining the stream starts: at most
+   'burst' bytes before the live position, at the start of a block. Only
+   audio published without a break up to now is sent at once; after a pause
+   in the input or an idle stop of the encoder, the audio buffered before it
+   is stale. Must be called with buffer_access held. */
+static ULONGLONG burst_start(unsigned long burst)
+{
+	ULONGLONG start = server_buffer_total, now = io->now(), block_start;
+	const stream_mark_t *mark;
+	unsigned oldest, n;
+
+	// Leave room so that the client is not lapped right away
+	if(burst > BUFFER_SIZE/2)
+		burst = BUFFER_SIZE/2;
+	if( stream_marks_count == 0 ||
+		now - stream_marks[(stream_marks_count - 1) % STREAM_MARKS].buffered > BURST_MAX_GAP )
+		return start;
+
+	// Take whole blocks, newest first, back to the first break
+	oldest = (stream_marks_count > STREAM_MARKS) ? stream_marks_count - STREAM_MARKS + 1 : 0;
+	for(n = stream_marks_count; n-- > oldest; )
+	{
+		mark = &stream_marks[n % STREAM_MARKS];
+		block_start = (n > 0) ? stream_marks[(n - 1) % STREAM_MARKS].end : 0;
+		if(server_buffer_total - block_start > burst)
+			break;
+		start = block_start;
+		if(n > 0 && mark->buffered - stream_marks[(n - 1) % STREAM_MARKS].buffered > BURST_MAX_GAP)
+			break;
+	}
+	return start;
+}
+
+/* Returns the live stream position, which is at the end of a block. */
+unsigned __int64 server_stream_position()
+{
+	ULONGLONG total;
+
+	EnterCriticalSection(&buffer_access);
+	total = server_buffer_total;
+	LeaveCriticalSection(&buffer_access);
+	return total;
+}
+
+/* Copies stream data from '*position' to 'data', at most 'size' bytes and not
+   past the end of the block containing it, and advances *position. Sets
+   *block_end if the end of the block was reached, and *buffered to the time
+   the block was buffered. If the data at *position has been overwritten, or
+   its block is older than the marks kept, *position first moves to the start
+   of the oldest block known. Returns the number of bytes copied (0 if there
+   is no data past *position). */
+unsigned server_read_stream( unsigned __int64 *position, char *data, unsigned size,
+                             int *block_end, unsigned __int64 *buffered )
+{
+	const stream_mark_t *mark;
+	unsigned pos, length;
+
+	EnterCriticalSection(&buffer_access);
+	if(server_buffer_total - *position > BUFFER_SIZE)
+		*position = align_to_block(server_buffer_total - BUFFER_SIZE);
+	else
+	if(*position < server_buffer_total && find_stream_mark(*position) == NULL)
+		*position = align_to_block(*position);
+	if((mark = find_stream_mark(*position)) == NULL)
+	{
 		LeaveCriticalSection(&buffer_access);
+		return 0;
+	}
 
-		while(1)
+	length = (unsigned)(mark->end - *position);
+	if(length > size)
+		length = size;
+	pos = (unsigned)(*position % BUFFER_SIZE);
+	if(pos + length <= BUFFER_SIZE)
+		memcpy(data, (char*)server_buffer + pos, length);
+	else
+	{
+		memcpy(data, (char*)server_buffer + pos, BUFFER_SIZE - pos);
+		memcpy(data + BUFFER_SIZE - pos, (char*)server_buffer, length - (BUFFER_SIZE - pos));
+	}
+	*position += length;
+	*block_end = (*position == mark->end);
+	*buffered  = mark->buffered;
+	LeaveCriticalSection(&buffer_access);
+
+	return length;
+}
+
+/* Prepares the metadata packet to be sent to the client next; an empty packet
+   if the title at the client's stream position has not changed since the
+   last one sent. */
+static void prepare_metadata(client_t *client)
+{
+	const char *packet;
+
+	EnterCriticalSection(&metadata_access);
+	packet = find_title(client->position);
+	if(packet == NULL || memcmp(packet, client->last_metadata, METADATA_SIZE) == 0)
+	{
+		// Metadata unchanged; send empty metadata packet
+		client->pending[0] = 0;
+		client->pending_size = 1;
+	}
+	else
+	{
+		// Send updated metadata packet
+		memcpy(client->last_metadata, packet, METADATA_SIZE);
+		client->pending_size = 1 + 16*(unsigned char)*client->last_metadata;
+		memcpy(client->pending, client->last_metadata, client->pending_size);
+	}
+	LeaveCriticalSection(&metadata_access);
+	client->pending_pos = 0;
+}
+
+/* Accounts for 'sent' audio bytes sent to a client, and notes when the next
+   metadata packet is due. The packet is prepared once the audio following it
+   is available, so that a client at the live position gets a title placed at
+   the next block with that block. */
+static void advance_client(client_t *client, unsigned sent)
+{
+	if(!client->started)
+	{
+		latency_add(&client->counters.latency_start, io->now() - client->connect_time);
+		client->started = 1;
+	}
+
+	counter_add(&client->counters.bytes_sent, sent);
+	client->position += sent;
+	client->bytes_before_metadata -= sent;
+	if(client->bytes_before_metadata == 0)
+	{
+		client->metadata_due = client->metadata;
+		client->bytes_before_metadata = client->metadata_interval;
+	}
+}
+
+/* Sends data up to stream position 'limit' to a time-shifted client that is
+   behind the stream buffer, from the archive through the client's 'buffer' of
+   SEND_BUFFER_SIZE bytes. Returns -1 if the connection failed, 0 if the
+   client should wait for data, 1 if it should wait for room in its socket, or
+   2 if it may go on. */
+static int send_archived(client_t *client, ULONGLONG limit, char *buffer)
+{
+	unsigned length;
+	ULONGLONG position;
+	int sent;
+
+	if(limit <= client->position)
+		return 0;
+	if(client->metadata_due)
+	{
+		client->metadata_due = 0;
+		prepare_metadata(client);
+		return 2;
+	}
+	length = SEND_BUFFER_SIZE;
+	if(length > limit - client->position)
+		length = (unsigned)(limit - client->position);
+	if(length > client->bytes_before_metadata)
+		length = client->bytes_before_metadata;
+
+	if(archive_read(client->position, buffer, &length) != 0)
+	{
+		// Overwritten; resume at the oldest block archived, or live if the
+		// archive has nothing older
+		position = archive_seek(0);
+		if(position <= client->position)
+			position = server_stream_position();
+		trace_event(TRACE_OVERRUN, (unsigned long)(position - client->position));
+		trace_anomaly(TRACE_OVERRUN);
+		client->position = position;
+		counter_add(&client->counters.overruns, 1);
+		return 2;
+	}
+
+	sent = io->send(client->socket, buffer, length, 0);
+	counter_add(&client->counters.syscalls, 1);
+	if(sent < 0)
+		return -1;
+	if(sent == 0)
+		return 1;
+	trace_event(TRACE_SEND, sent);
+	advance_client(client, sent);
+
+	// Socket did not accept all data; try again once it has room
+	return ((unsigned)sent < length) ? 1 : 2;
+}
+
+struct client *server_client_open(SOCKET socket, unsigned long address)
+{
+	client_t *client;
+
+	if((client = (client_t*)_aligned_malloc(sizeof(client_t), CACHE_LINE_SIZE)) == NULL)
+	{
+		io->close(socket);
+		return NULL;
+	}
+	memset(client, 0, sizeof(client_t));
+	client->socket = socket;
+	client->address = address;
+	client->connect_time = io->now();
+
+	if( (client->wake = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ||
+		!handle_request(client) )
+	{
+		EnterCriticalSection(&clients_access);
+		departed.syscalls += client->counters.syscalls;
+		LeaveCriticalSection(&clients_access);
+		io->close(socket);
+		if(client->wake != NULL)
+			CloseHandle(client->wake);
+		_aligned_free(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+int server_client_pump(struct client *client)
+{
+	char buffer[SEND_BUFFER_SIZE];
+	unsigned bytes_available, pos;
+	int sent;
+	const stream_mark_t *mark;
+	ULONGLONG queued, buffered, now, skipped, limit, end;
+
+	while(1)
+	{
+		// Finish sending the current metadata packet first
+		if(client->pending_pos < client->pending_size)
 		{
-			unsigned bytes_available;
+			sent = io->send( client->socket, client->pending + client->pending_pos,
+				             client->pending_size - client->pending_pos, 0 );
+			counter_add(&client->counters.syscalls, 1);
+			if(sent < 0)
+				return -1;
+			client->pending_pos += sent;
+			counter_add(&client->counters.bytes_sent, sent);
+			if(client->pending_pos < client->pending_size)
+				return 1;
+			continue;
+		}
 
-			// Wait for data to become available
-			EnterCriticalSection(&buffer_access);
-			while(server_buffer_pos == client_buffer_pos)
+		// A client that was sent another format is closed where it changes
+		limit = ~(ULONGLONG)0;
+		if(client->format_changed)
+		{
+			if(client->position >= client->format_end)
+				return -1;
+			limit = client->format_end;
+		}
+
+		// A time-shifted client is sent the stream as it was published
+		// 'shift' ago (from the start, if that is longer than the server
+		// has been running), from the archive until it is within the stream
+		// buffer
+		if(client->shift != 0)
+		{
+			now = io->now();
+			end = archive_limit( ((now > client->shift) ? now - client->shift : 0) +
+			                     TIMESHIFT_LEAD );
+			if(end < limit)
+				limit = end;
+			if(server_stream_position() - client->position > BUFFER_SIZE)
 			{
-				LeaveCriticalSection(&buffer_access);
-				WaitForSingleObject(buffer_semaphore, INFINITE);
-				if(WaitForSingleObject(shutdown_event, 0) == WAIT_OBJECT_0)
-					goto cleanup;
-				EnterCriticalSection(&buffer_access);
+				if((sent = send_archived(client, limit, buffer)) != 2)
+					return sent;
+				continue;
 			}
+		}
 
-			// Calculate the number of bytes to copy
-			bytes_available = ((server_buffer_pos - client_buffer_pos) + BUFFER_SIZE)
-				% BUFFER_SIZE;
-			if(bytes_available > bytes_before_metadata)
-				bytes_available = bytes_before_metadata;
+		EnterCriticalSection(&buffer_access);
 
-			if(client_buffer_pos + bytes_available <= BUFFER_SIZE)
-			{
-				// Copy a single chunk of data
-				memcpy( client_buffer, (char*)server_buffer + client_buffer_pos,
-					    bytes_available );
-			}
-			else
+		// Skip ahead if the buffer has been overwritten since the last send,
+		// or in low-latency mode, if the data is too old. The latter keeps a
+		// low-latency client within LOW_LATENCY_MAX_DELAY (8 KB at 128 kbps)
+		// of the live position; the rest of the shared buffer serves other
+		// clients and the handover, and its size adds no delay, so that mode
+		// needs no smaller ring of its own.
+		skipped = 0;
+		if( server_buffer_total - client->position > BUFFER_SIZE ||
+			( client->low_latency && server_buffer_total != client->position &&
+			  ( (mark = find_stream_mark(client->position)) == NULL ||
+			    io->now() - mark->buffered > LOW_LATENCY_MAX_DELAY ) ) )
+		{
+			skipped = server_buffer_total - client->position;
+			client->position = server_buffer_total;
+			client->resync = 1;
+			counter_add(&client->counters.overruns, 1);
+		}
+		if(client->resync && align_to_frame(&client->position) == 0)
+			client->resync = 0;
+
+		// Calculate the number of bytes to copy
+		end = (server_buffer_total < limit) ? server_buffer_total : limit;
+		bytes_available = (end > client->position && !client->resync) ?
+		                  (unsigned)(end - client->position) : 0;
+		if(bytes_available == 0)
+		{
+			LeaveCriticalSection(&buffer_access);
+			if(skipped != 0)
 			{
-				// Copy a two chunks of data
-				unsigned first_part_size  = BUFFER_SIZE - client_buffer_pos,
-					     second_part_size = bytes_available - first_part_size;
-				memcpy( client_buffer, (char*)server_buffer + client_buffer_pos,
-					    first_part_size );
-				memcpy( client_buffer + first_part_size, (char*)server_buffer,
-					    second_part_size);
+				trace_event(TRACE_OVERRUN, (unsigned long)skipped);
+				trace_anomaly(TRACE_OVERRUN);
 			}
+			return 0;
+		}
+		if(client->metadata_due)
+		{
 			LeaveCriticalSection(&buffer_access);
+			client->metadata_due = 0;
+			prepare_metadata(client);
+			continue;
+		}
+		if(bytes_available > client->bytes_before_metadata)
+			bytes_available = client->bytes_before_metadata;
+		if(bytes_available > SEND_BUFFER_SIZE)
+			bytes_available = SEND_BUFFER_SIZE;
 
-			// Send data packet
-			if(send(socket, client_buffer, bytes_available, 0) <= 0)
-				break;
+		pos = (unsigned)(client->position % BUFFER_SIZE);
+		if(pos + bytes_available <= BUFFER_SIZE)
+		{
+			// Copy a single chunk of data
+			memcpy(buffer, (char*)server_buffer + pos, bytes_available);
+		}
+		else
+		{
+			// Copy a two chunks of data
+			unsigned first_part_size  = BUFFER_SIZE - pos,
+				     second_part_size = bytes_available - first_part_size;
+			memcpy(buffer, (char*)server_buffer + pos, first_part_size);
+			memcpy(buffer + first_part_size, (char*)server_buffer, second_part_size);
+		}
+		mark = find_stream_mark(client->position);
+		queued   = mark ? mark->queued   : 0;
+		buffered = mark ? mark->buffered : 0;
+		LeaveCriticalSection(&buffer_access);
+
+		// Send data packet
+		sent = io->send(client->socket, buffer, bytes_available, 0);
+		counter_add(&client->counters.syscalls, 1);
+		if(sent < 0)
+			return -1;
+		if(sent == 0)
+			return 1;
+		trace_event(TRACE_SEND, sent);
+
+		// Record latency of the oldest data sent; time-shifted data is late
+		// on purpose
+		now = io->now();
+		if(buffered != 0 && client->shift == 0)
+			latency_add(&client->counters.latency_ring, now - buffered);
+		if(queued != 0 && client->shift == 0)
+		{
+			latency_add(&client->counters.latency_total, now - queued);
+			counter_set(&client->counters.latency_last, now - queued);
+		}
+		advance_client(client, sent);
 
-			client_buffer_pos = (client_buffer_pos + bytes_available) % BUFFER_SIZE;
-			bytes_before_metadata -= bytes_available;
-			if(bytes_before_metadata == 0)
+		// Socket did not accept all data; try again once it has room
+		if((unsigned)sent < bytes_available)
+			return 1;
+	}
+}
+
+void server_client_close(struct client *client)
+{
+	// Unregister client
+	EnterCriticalSection(&clients_access);
+	--clients_size;
+	if(client->prev != NULL)
+		client->prev->next = client->next;
+	else
+		clients_first = client->next;
+	if(client->next != NULL)
+		client->next->prev = client->prev;
+	departed.bytes_sent += client->counters.bytes_sent;
+	departed.overruns   += client->counters.overruns;
+	departed.syscalls   += client->counters.syscalls;
+	departed_cpu_time   += thread_cpu_time(client->thread);
+	latency_merge(&departed.latency_ring,  &client->counters.latency_ring);
+	latency_merge(&departed.latency_total, &client->counters.latency_total);
+	latency_merge(&departed.latency_start, &client->counters.latency_start);
+	LeaveCriticalSection(&clients_access);
+
+	io->close(client->socket);
+	CloseHandle(client->wake);
+	_aligned_free(client);
+}
+
+/* Streams to a registered client until it disconnects or the server shuts
+   down. During a handover, connected clients are left registered. */
+static void serve_client(client_t *client)
+{
+	worker_t *worker;
+	int state, failed, cancelled;
+
+	while((state = server_client_pump(client)) >= 0)
+	{
+		if(state > 0)
+		{
+			// Wait for room in the socket, rather than for the next block,
+			// to send the rest
+			if(io->wait_writable(client->socket, WRITABLE_POLL) < 0)
 			{
-				EnterCriticalSection(&metadata_access);
-				if(memcmp( (char*)metadata_packet,
-					       last_metadata, METADATA_SIZE ) == 0)
-				{
-					// Metadata unchanged; send empy metadata packet
-					static const char empty_metadata_packet[1] = { 0 };
-					LeaveCriticalSection(&metadata_access);
-					send(socket, empty_metadata_packet, sizeof(empty_metadata_packet), 0);
-				}
-				else
-				{
-					// Send updated metadata packet
-					memcpy(last_metadata, (char*)metadata_packet, METADATA_SIZE);
-					LeaveCriticalSection(&metadata_access);
-					send(socket, last_metadata, 1 + 16*((int)*last_metadata), 0);
-				}
-				bytes_before_metadata = METADATA_INTERVAL;
+				state = -1;
+				break;
 			}
 		}
-	cleanup:
+		else
+		{
+			// Wait for data to become available
+			HANDLE events[2];
+			events[0] = client->wake;
+			events[1] = shutdown_event;
+			WaitForMultipleObjects(2, events, FALSE, INFINITE);
+		}
+		if(WaitForSingleObject(shutdown_event, 0) == WAIT_OBJECT_0)
+			break;
+		trace_event(TRACE_CLIENT_WAKE, 0);
+	}
+	failed = (state < 0);
 
-		// Unregister client
-		EnterCriticalSection(&clients_access);
-		--clients_size;
-		LeaveCriticalSection(&clients_access);
+	EnterCriticalSection(&clients_access);
+	cancelled = (worker = current_worker()) != NULL && worker->cancelled;
+	LeaveCriticalSection(&clients_access);
+
+	if(failed || cancelled || !handing_over)
+		server_client_close(client);
+}
+
+static DWORD WINAPI run_client(LPVOID param)
+{
+	worker_t *worker = (worker_t*)param;
+	client_t *client = worker->client;
+	struct sockaddr_in addr;
+	int addr_len = sizeof(addr);
+
+	trace_attach("client", TRACE_EVENTS_CLIENT);
 
+	if(client == NULL)
+	{
+		if(io->getpeername(worker->socket, (struct sockaddr*)&addr, &addr_len) != 0)
+			addr.sin_addr.s_addr = 0;
+		client = server_client_open(worker->socket, ntohl(addr.sin_addr.s_addr));
+	}
+	if(client != NULL)
+	{
+		client->thread = worker->thread;
+		serve_client(client);
 	}
 
-	closesocket(socket);
+	trace_detach();
 
 	return 0;
 }
 
+/* Restarts a thread for each client and then the server thread after a
+   handover the new process did not acknowledge. Returns non-zero if the
+   server could not be restarted; no thread has been started then. */
+static int resume_serving()
+{
+	client_t *client, **clients = NULL;
+	unsigned n, num_clients = 0;
+
+	handing_over = 0;
+	ResetEvent(shutdown_event);
+
+	// Take the clients first; a restarted thread may close its client
+	EnterCriticalSection(&clients_access);
+	if(clients_size > 0 && (clients = (client_t**)malloc(clients_size*sizeof(client_t*))) == NULL)
+	{
+		LeaveCriticalSection(&clients_access);
+		return -1;
+	}
+	for(client = clients_first; client != NULL; client = client->next)
+		clients[num_clients++] = client;
+	LeaveCriticalSection(&clients_access);
+
+	// Accept connections only once the clients are served again
+	CloseHandle(server_thread);
+	if((server_thread = CreateThread(NULL, 0, run_server, NULL, CREATE_SUSPENDED, NULL)) == NULL)
+	{
+		free(clients);
+		return -1;
+	}
+	for(n = 0; n < num_clients; ++n)
+		if(start_worker(clients[n]->socket, clients[n]) != 0)
+			server_client_close(clients[n]);
+	free(clients);
+	thread_set_scheduling(server_thread, server_config.affinity, server_config.priority);
+	ResumeThread(server_thread);
+	return 0;
+}
+
+/* Stops the server and sends its state to the process 'process_id' over
+   'pipe'. Client connections stay open until the new process has taken them
+   over. Returns 0 once it has (the server is then stopped), 1 if the state
+   could not be sent or was not acknowledged and the server is serving again,
+   or -1 if the server had to be stopped. */
+int server_handover_send(void *pipe, unsigned long process_id)
+{
+	handover_header_t header;
+	handover_client_t *records = NULL;
+	client_t *client, *next;
+	unsigned n;
+	char ack = 0;
+	int result = -1;
+
+	memset(&header, 0, sizeof(header));
+	header.magic       = HANDOVER_MAGIC;
+	header.version     = HANDOVER_VERSION;
+	header.buffer_size = BUFFER_SIZE;
+	EnterCriticalSection(&listen_access);
+	result = WSADuplicateSocket(server_socket, process_id, &header.server_socket);
+	LeaveCriticalSection(&listen_access);
+	if(result != 0)
+		return 1;  // nothing was stopped yet
+	result = -1;
+
+	// Stop accepting connections and stop the client threads, leaving their
+	// connections open. Clients still blocked in send() at the deadline are
+	// disconnected.
+	handing_over = 1;
+	SetEvent(shutdown_event);
+	SetEvent(accept_wake);
+	if(WaitForSingleObject(server_thread, SHUTDOWN_TIMEOUT) != WAIT_OBJECT_0)
+		return -1;
+	if( join_workers(io->now() + (ULONGLONG)SHUTDOWN_TIMEOUT*1000/2, 0) > 0 &&
+		join_workers(io->now() + (ULONGLONG)SHUTDOWN_TIMEOUT*1000/2, 1) > 0 )
+		return -1;
+
+	// Describe the stream and the remaining clients; nothing is published
+	// while handing over, so the state need not be locked
+	header.buffer_total = server_buffer_total;
+	header.stream_marks_count = stream_marks_count;
+	header.title_marks_count  = title_marks_count;
+	header.title_marks_placed = title_marks_placed;
+	strncpy(header.title, current_title, sizeof(header.title) - 1);
+	strncpy(header.content_type, stream_content_type, sizeof(header.content_type) - 1);
+	memcpy(header.stream_header, stream_header, stream_header_size);
+	header.stream_header_size     = stream_header_size;
+	header.stream_format_position = stream_format_position;
+	if( clients_size > 0 &&
+		(records = (handover_client_t*)malloc(clients_size*sizeof(handover_client_t))) == NULL )
+		goto cleanup;
+	for(client = clients_first; client != NULL; client = client->next)
+	{
+		handover_client_t *record = &records[header.num_clients];
+		memset(record, 0, sizeof(*record));
+		if(WSADuplicateSocket(client->socket, process_id, &record->socket) != 0)
+			continue;
+		record->address               = client->address;
+		record->connect_time          = client->connect_time;
+		record->position              = client->position;
+		record->shift                 = client->shift;
+		record->low_latency           = client->low_latency;
+		record->resync                = client->resync;
+		record->format_changed        = client->format_changed;
+		record->format_end            = client->format_end;
+		record->metadata              = client->metadata;
+		record->metadata_due          = client->metadata_due;
+		record->metadata_interval     = client->metadata_interval;
+		record->bytes_before_metadata = client->bytes_before_metadata;
+		record->pending_size          = client->pending_size;
+		record->pending_pos           = client->pending_pos;
+		memcpy(record->last_metadata, client->last_metadata, METADATA_SIZE);
+		memcpy(record->pending, client->pending, METADATA_SIZE);
+		++header.num_clients;
+	}
+
+	// Send the state and wait until the new process has opened the sockets
+	if( handover_write(pipe, &header, sizeof(header)) == 0 &&
+		handover_write(pipe, (const char*)server_buffer, BUFFER_SIZE) == 0 &&
+		handover_write(pipe, stream_marks, sizeof(stream_marks)) == 0 &&
+		handover_write(pipe, title_marks, sizeof(title_marks)) == 0 )
+	{
+		for(n = 0; n < header.num_clients; ++n)
+			if(handover_write(pipe, &records[n], sizeof(handover_client_t)) != 0)
+				break;
+		if( n == header.num_clients && hls_handover_send(pipe) == 0 &&
+			handover_read(pipe, &ack, sizeof(ack)) == 0 && ack == 1 )
+			result = 0;
+	}
+
+	// Without the acknowledgement the new process has not taken over the
+	// connections; go on serving them
+	if(result != 0 && resume_serving() == 0)
+	{
+		free(records);
+		return 1;
+	}
+
+cleanup:
+	// Release our handles; connections taken over remain open
+	free(records);
+	for(client = clients_first; client != NULL; client = next)
+	{
+		next = client->next;
+		server_client_close(client);
+	}
+	io->close(server_socket);
+	server_socket = INVALID_SOCKET;
+	CloseHandle(server_thread);
+	server_thread = NULL;
+	server_finalize();
+
+	return result;
+}
+
+/* Starts the server with the state received from an engine handing over
+   through 'pipe'. */
+int server_handover_receive(const network_config_t *config, void *pipe)
+{
+	handover_header_t header;
+	handover_client_t record;
+	client_t *client, **clients = NULL;
+	unsigned n, num_clients = 0;
+	const char ack = 1;
+	SOCKET client_socket;
+
+	if(reclaim_server() != 0 || server_initialize(config) != 0)
+		return -1;
+
+	// Restore the stream
+	if( handover_read(pipe, &header, sizeof(header)) != 0 ||
+		header.magic != HANDOVER_MAGIC || header.version != HANDOVER_VERSION ||
+		header.buffer_size != BUFFER_SIZE ||
+		header.stream_header_size > sizeof(stream_header) ||
+		handover_read(pipe, (char*)server_buffer, BUFFER_SIZE) != 0 ||
+		handover_read(pipe, stream_marks, sizeof(stream_marks)) != 0 ||
+		handover_read(pipe, title_marks, sizeof(title_marks)) != 0 )
+		goto cleanup;
+	server_buffer_total = header.buffer_total;
+	stream_marks_count  = header.stream_marks_count;
+
+	// Restore the titles, including those still waiting for their audio
+	header.title[sizeof(header.title) - 1] = '\0';
+	strncpy(current_title, header.title, sizeof(current_title) - 1);
+	title_marks_count  = header.title_marks_count;
+	title_marks_placed = header.title_marks_placed;
+
+	// Restore the stream format, e.g. the WAV header new listeners get
+	header.content_type[sizeof(header.content_type) - 1] = '\0';
+	strcpy(stream_content_type, header.content_type);
+	memcpy(stream_header, header.stream_header, header.stream_header_size);
+	stream_header_size     = header.stream_header_size;
+	stream_format_position = header.stream_format_position;
+	hls_set_format(stream_content_type);
+
+	if((server_socket = WSASocket( FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+	                               FROM_PROTOCOL_INFO, &header.server_socket, 0, 0 ))
+		== INVALID_SOCKET)
+		goto cleanup;
+
+	// Restore the clients
+	if( header.num_clients > 0 &&
+		(clients = (client_t**)malloc(header.num_clients*sizeof(client_t*))) == NULL )
+		goto cleanup;
+	for(n = 0; n < header.num_clients; ++n)
+	{
+		if(handover_read(pipe, &record, sizeof(record)) != 0)
+			goto cleanup;
+		if((client_socket = WSASocket( FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+		                               FROM_PROTOCOL_INFO, &record.socket, 0, 0 )) == INVALID_SOCKET)
+			continue;
+		if((client = (client_t*)_aligned_malloc(sizeof(client_t), CACHE_LINE_SIZE)) == NULL)
+		{
+			io->close(client_socket);
+			continue;
+		}
+		memset(client, 0, sizeof(client_t));
+		if((client->wake = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+		{
+			io->close(client_socket);
+			_aligned_free(client);
+			continue;
+		}
+		client->socket                = client_socket;
+		client->address               = record.address;
+		client->connect_time          = record.connect_time;
+		client->position              = record.position;
+		client->shift                 = record.shift;
+		client->low_latency           = record.low_latency;
+		client->resync                = record.resync;
+		client->format_changed        = record.format_changed;
+		client->format_end            = record.format_end;
+		client->metadata              = record.metadata;
+		client->metadata_due          = record.metadata_due;
+		client->metadata_interval     = record.metadata_interval;
+		client->bytes_before_metadata = record.bytes_before_metadata;
+		client->pending_size          = record.pending_size;
+		client->pending_pos           = record.pending_pos;
+		client->started               = 1;
+		memcpy(client->last_metadata, record.last_metadata, METADATA_SIZE);
+		memcpy(client->pending, record.pending, METADATA_SIZE);
+
+		EnterCriticalSection(&clients_access);
+		++clients_size;
+		if((client->next = clients_first) != NULL)
+			clients_first->prev = client;
+		clients_first = client;
+		LeaveCriticalSection(&clients_access);
+		clients[num_clients++] = client;
+	}
+	if( hls_handover_receive(pipe) != 0 ||
+		handover_write(pipe, &ack, sizeof(ack)) != 0 )
+		goto cleanup;
+
+	// Start serving
+    if((server_thread = CreateThread(NULL, 0, run_server, NULL, 0, NULL)) == NULL)
+    {
+        MessageBox(NULL, "Server initialization failed:\nunable to create server thread.",
+            "Minicast", MB_OK | MB_ICONERROR);
+		goto cleanup;
+    }
+	for(n = 0; n < num_clients; ++n)
+		if(start_worker(clients[n]->socket, clients[n]) != 0)
+			server_client_close(clients[n]);
+	free(clients);
+
+	return 0;
+
+cleanup:
+	for(n = 0; n < num_clients; ++n)
+		server_client_close(clients[n]);
+	free(clients);
+	if(server_socket != INVALID_SOCKET)
+		io->close(server_socket);
+	server_finalize();
+	return -1;
+}
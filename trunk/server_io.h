@@ -0,0 +1,77 @@
+#ifndef SERVER_IO_H_INCLUDED
+#define SERVER_IO_H_INCLUDED
+
+/* This header file declares the seam between the Minicast network server and
+   the operating system. By default the server talks to Winsock and reads the
+   performance counter, but a driver (e.g. a network simulator running on a
+   virtual clock) may install its own primitives and run connections itself,
+   without the accept and client threads.
+
+   A simulation typically calls server_set_io() and server_initialize(), then
+   opens connections with server_client_open() on fake sockets, feeds data with
+   server_enqueue_encoded_data() and calls server_client_pump() whenever a
+   simulated client can accept more data. See tools/netsim.c. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+
+
+// Socket and clock primitives used by the server.
+typedef struct server_io
+{
+	SOCKET (*socket)(int family, int type, int protocol);
+	int (*bind)(SOCKET socket, const struct sockaddr *addr, int addr_len);
+	int (*listen)(SOCKET socket, int backlog);
+	SOCKET (*accept)(SOCKET socket, struct sockaddr *addr, int *addr_len);
+	int (*getpeername)(SOCKET socket, struct sockaddr *addr, int *addr_len);
+	int (*recv)(SOCKET socket, char *buffer, int length, int flags);
+	/* Returns the number of bytes accepted, 0 if a non-blocking socket has no
+	   room, or SOCKET_ERROR. */
+	int (*send)(SOCKET socket, const char *buffer, int length, int flags);
+	/* Waits until a connection can be accepted on the listening socket or
+	   'wake' is set. Returns a positive value if a connection is pending, 0
+	   if woken, or SOCKET_ERROR. */
+	int (*wait_acceptable)(SOCKET socket, HANDLE wake);
+	/* Waits at most 'timeout' milliseconds for room to send. Returns a
+	   positive value once there is room, 0 on timeout, or SOCKET_ERROR. */
+	int (*wait_writable)(SOCKET socket, unsigned long timeout);
+	int (*shutdown)(SOCKET socket, int how);
+	int (*setsockopt)(SOCKET socket, int level, int name, const char *value, int length);
+	int (*close)(SOCKET socket);
+	ULONGLONG (*now)(void);		/* monotonic time in microseconds */
+} server_io_t;
+
+// Opaque per-connection state.
+struct client;
+
+
+/* Installs the primitives used by the server; NULL restores the default
+   Winsock implementation. Must be called while the server is stopped. */
+void server_set_io(const server_io_t *io);
+
+/* Initializes and releases the server state (buffer, metadata, client
+   registry) without creating the listening socket or any threads. */
+int server_initialize(const network_config_t *config);
+void server_finalize();
+
+/* Reads the HTTP request from 'socket' (connected from 'address', in native
+   order) and sends the response. Returns the connection state if the client
+   was registered for streaming; otherwise the socket is closed and NULL is
+   returned. */
+struct client *server_client_open(SOCKET socket, unsigned long address);
+
+/* Sends as much buffered audio (and metadata) as the socket accepts.
+   Returns 0 once the client has been sent all data available (call again
+   when more is published), 1 if the socket did not accept all of it (call
+   again once it is writable), or -1 once the connection has failed and
+   should be closed. */
+int server_client_pump(struct client *client);
+
+/* Unregisters the client, closes its socket and frees its state. */
+void server_client_close(struct client *client);
+
+#endif //ndef SERVER_IO_H_INCLUDED
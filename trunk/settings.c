@@ -26,6 +26,24 @@ int read_config (engine_config_t *config)
             == ERROR_SUCCESS) config->encoder.bitrate  = (short)dw;
         size = sizeof(dw); if(RegQueryValueEx(key, "Channels", NULL, NULL, &dw, &size)
             == ERROR_SUCCESS) config->encoder.channels = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Idle Policy",  NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.idle_policy  = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Idle Timeout", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.idle_timeout = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Preset",   NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.preset   = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Governor", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.governor = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Priority", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.priority = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Codec",    NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.codec    = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Workers",  NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.workers  = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "MonoBitrate", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.mono_bitrate = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Affinity", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->encoder.affinity = (unsigned long)dw;
         RegCloseKey(key);
     }
     
@@ -38,6 +56,34 @@ int read_config (engine_config_t *config)
             == ERROR_SUCCESS) config->network.port             = (unsigned short)dw;
         size = sizeof(dw); if(RegQueryValueEx(key, "Connection Limit", NULL, NULL, &dw, &size)
             == ERROR_SUCCESS) config->network.connection_limit = (unsigned short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Metadata Interval", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.metadata_interval = (unsigned short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Burst Size", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.burst_size = (unsigned long)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Priority", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.priority = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Affinity", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.affinity = (unsigned long)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Low Latency", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.low_latency = (short)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Timeshift Size", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.timeshift_size =
+            (unsigned short)((dw > ENGINE_MAX_TIMESHIFT) ? ENGINE_MAX_TIMESHIFT : dw);
+        size = sizeof(dw); if(RegQueryValueEx(key, "HLS Duration", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->network.hls_duration = (unsigned short)dw;
+        RegCloseKey(key);
+    }
+
+    if(RegOpenKeyEx( HKEY_CURRENT_USER, TEXT("SOFTWARE\\Minicast\\Recorder"), 0, KEY_READ, &key )
+        == ERROR_SUCCESS)
+    {
+        size = sizeof(dw); if(RegQueryValueEx(key, "Rotate Time", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->recorder.rotate_time = (unsigned long)dw;
+        size = sizeof(dw); if(RegQueryValueEx(key, "Rotate Size", NULL, NULL, &dw, &size)
+            == ERROR_SUCCESS) config->recorder.rotate_size = (unsigned long)dw;
+        size = sizeof(config->recorder.path); RegQueryValueEx( key, "Path",
+            NULL, NULL, config->recorder.path, &size );
+        config->recorder.path[sizeof(config->recorder.path)-1] = '\0';
         RegCloseKey(key);
     }
         
@@ -62,6 +108,15 @@ int write_config(engine_config_t *config)
     {
         dw = config->encoder.bitrate;  RegSetValueEx( key, "Bitrate",  0, REG_DWORD, &dw, sizeof(dw) );
         dw = config->encoder.channels; RegSetValueEx( key, "Channels", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.idle_policy;  RegSetValueEx( key, "Idle Policy",  0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.idle_timeout; RegSetValueEx( key, "Idle Timeout", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.preset;   RegSetValueEx( key, "Preset",   0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.governor; RegSetValueEx( key, "Governor", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.priority; RegSetValueEx( key, "Priority", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.codec;    RegSetValueEx( key, "Codec",    0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.workers;  RegSetValueEx( key, "Workers",  0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.mono_bitrate; RegSetValueEx( key, "MonoBitrate", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->encoder.affinity; RegSetValueEx( key, "Affinity", 0, REG_DWORD, &dw, sizeof(dw) );
         RegCloseKey(key);
     }
     
@@ -72,6 +127,30 @@ int write_config(engine_config_t *config)
         dw = config->network.port;    RegSetValueEx( key, "Port",    0, REG_DWORD, &dw, sizeof(dw) );
         dw = config->network.connection_limit; RegSetValueEx(
             key, "Connection Limit", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.metadata_interval; RegSetValueEx(
+            key, "Metadata Interval", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.burst_size; RegSetValueEx(
+            key, "Burst Size", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.priority; RegSetValueEx( key, "Priority", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.affinity; RegSetValueEx( key, "Affinity", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.low_latency; RegSetValueEx(
+            key, "Low Latency", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.timeshift_size; RegSetValueEx(
+            key, "Timeshift Size", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->network.hls_duration; RegSetValueEx(
+            key, "HLS Duration", 0, REG_DWORD, &dw, sizeof(dw) );
+        RegCloseKey(key);
+    }
+
+    if(RegCreateKeyEx(HKEY_CURRENT_USER, TEXT("SOFTWARE\\Minicast\\Recorder"), 0, NULL,
+        REG_OPTION_NON_VOLATILE, KEY_WRITE, NULL, &key, NULL) == ERROR_SUCCESS)
+    {
+        dw = config->recorder.rotate_time; RegSetValueEx(
+            key, "Rotate Time", 0, REG_DWORD, &dw, sizeof(dw) );
+        dw = config->recorder.rotate_size; RegSetValueEx(
+            key, "Rotate Size", 0, REG_DWORD, &dw, sizeof(dw) );
+        RegSetValueEx( key, "Path", 0, REG_SZ,
+            config->recorder.path, strlen(config->recorder.path) + 1 );
         RegCloseKey(key);
     }
     
@@ -0,0 +1,552 @@
+/* Contains the implementation of the Minicast status pages; a JSON document
+   and a Prometheus text exposition of the engine statistics, the listener
+   table and the current title. Pages are rendered at most once per refresh
+   interval and served from the cache, so monitoring requests do not add work
+   to the streaming threads. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Include standard library headers
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+#include <malloc.h>
+
+
+// Definitions
+#define STATUS_REFRESH_INTERVAL	(1000000)	// 1 second
+#define MAX_LISTENERS			   (1000)	// max. listeners listed
+
+
+// Function prototypes
+int status_initialize();
+void status_finalize();
+char *status_get_page( const char *resource, const char **content_type,
+                       unsigned *length );
+
+
+// Growable text buffer
+typedef struct text
+{
+	char *data;
+	unsigned size, capacity;
+} text_t;
+
+// Status pages
+typedef enum { PAGE_JSON, PAGE_PROMETHEUS, PAGE_COUNT } page_t;
+
+static const struct {
+	const char *resource, *content_type;
+} pages[PAGE_COUNT] = {
+	{ "/status.json", "application/json; charset=utf-8" },
+	{ "/metrics",     "text/plain; version=0.0.4; charset=utf-8" } };
+
+
+// Global variables
+static CRITICAL_SECTION status_access;
+static text_t cached_pages[PAGE_COUNT];
+static unsigned __int64 cached_time;
+static int cached_valid;
+
+
+static void text_append(text_t *text, const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	while(1)
+	{
+		if(text->capacity - text->size > 1)
+		{
+			va_start(args, format);
+			length = _vsnprintf( text->data + text->size,
+			                     text->capacity - text->size - 1, format, args );
+			va_end(args);
+			if(length >= 0 && (unsigned)length < text->capacity - text->size - 1)
+			{
+				text->size += length;
+				return;
+			}
+		}
+
+		// Grow buffer and try again
+		{
+			unsigned capacity = text->capacity ? 2*text->capacity : 4096;
+			char *data = (char*)realloc(text->data, capacity);
+			if(data == NULL)
+				return;
+			text->data = data;
+			text->capacity = capacity;
+		}
+	}
+}
+
+/* Converts a string in the ANSI code page (as titles and names are passed to
+   the engine) to UTF-8, which both page formats require; returns NULL on
+   failure. The result must be freed by the caller. */
+static char *to_utf8(const char *string)
+{
+	WCHAR *wide;
+	char *result = NULL;
+	int length, size;
+
+	if((length = MultiByteToWideChar(CP_ACP, 0, string, -1, NULL, 0)) <= 0)
+		return NULL;
+	if((wide = (WCHAR*)malloc(length*sizeof(WCHAR))) == NULL)
+		return NULL;
+	if(MultiByteToWideChar(CP_ACP, 0, string, -1, wide, length) <= 0)
+		goto cleanup;
+	if((size = WideCharToMultiByte(CP_UTF8, 0, wide, length, NULL, 0, NULL, NULL)) <= 0)
+		goto cleanup;
+	if((result = (char*)malloc(size)) == NULL)
+		goto cleanup;
+	if(WideCharToMultiByte(CP_UTF8, 0, wide, length, result, size, NULL, NULL) <= 0)
+	{
+		free(result);
+		result = NULL;
+	}
+
+cleanup:
+	free(wide);
+	return result;
+}
+
+// Appends a string as the contents of a JSON string literal.
+static void text_append_json(text_t *text, const char *string)
+{
+	char *utf8 = to_utf8(string);
+	const char *p;
+
+	for(p = (utf8 != NULL) ? utf8 : string; *p; ++p)
+	{
+		unsigned char c = (unsigned char)*p;
+		if(c == '"' || c == '\\')
+			text_append(text, "\\%c", c);
+		else
+		if(c == '\n')
+			text_append(text, "\\n");
+		else
+		if(c < 0x20)
+			text_append(text, "\\u%04x", c);
+		else
+		if(c < 0x80 || utf8 != NULL)
+			text_append(text, "%c", c);
+		else
+			text_append(text, "?");		// not convertible; keep the output valid
+	}
+	free(utf8);
+}
+
+// Appends a string as a Prometheus label value; the exposition format only
+// escapes backslash, double quote and line feed.
+static void text_append_label(text_t *text, const char *string)
+{
+	char *utf8 = to_utf8(string);
+	const char *p;
+
+	for(p = (utf8 != NULL) ? utf8 : string; *p; ++p)
+	{
+		unsigned char c = (unsigned char)*p;
+		if(c == '"' || c == '\\')
+			text_append(text, "\\%c", c);
+		else
+		if(c == '\n')
+			text_append(text, "\\n");
+		else
+		if(c < 0x80 || utf8 != NULL)
+			text_append(text, "%c", c);
+		else
+			text_append(text, "?");
+	}
+	free(utf8);
+}
+
+// Latency histograms reported, by stage name
+#define LATENCY_STAGES (6)
+static const char *latency_stages[LATENCY_STAGES] =
+	{ "queue", "encode", "ring", "total", "start", "mix" };
+
+static void get_latencies(const engine_stats_t *stats, const engine_latency_t *latencies[LATENCY_STAGES])
+{
+	latencies[0] = &stats->latency_queue;
+	latencies[1] = &stats->latency_encode;
+	latencies[2] = &stats->latency_ring;
+	latencies[3] = &stats->latency_total;
+	latencies[4] = &stats->latency_start;
+	latencies[5] = &stats->latency_mix;
+}
+
+static void render_json( text_t *text, const engine_stats_t *stats, const char *name,
+                         const char *title, const engine_listener_stats_t *listeners,
+                         unsigned num_listeners )
+{
+	const engine_latency_t *latencies[LATENCY_STAGES];
+	unsigned n;
+
+	text_append(text, "{\n  \"name\": \"");
+	text_append_json(text, name);
+	text_append(text, "\",\n  \"title\": \"");
+	text_append_json(text, title);
+	text_append(text, "\",\n");
+	text_append( text,
+		"  \"ingest\": { \"queue_depth\": %u, \"queue_bytes\": %u, \"blocks\": %I64u, "
+		"\"drops\": %I64u, \"idle_discards\": %I64u, \"bytes\": %I64u, "
+		"\"passthrough_bytes\": %I64u, \"passthrough_discarded\": %I64u },\n",
+		stats->queue_depth, stats->queue_bytes, stats->ingest_blocks,
+		stats->ingest_drops, stats->ingest_idle, stats->bytes_in, stats->passthrough_bytes,
+		stats->passthrough_discarded );
+	text_append( text,
+		"  \"encoder\": { \"realtime_factor\": %.3f, \"audio_time_us\": %I64u, "
+		"\"encode_time_us\": %I64u, \"bytes\": %I64u, \"running\": %s, "
+		"\"starts\": %I64u, \"cpu_time_us\": %I64u, \"pace_time_us\": %I64u, "
+		"\"paced_frames\": %I64u, \"pace_resyncs\": %I64u, \"pace_dropped_bytes\": %I64u, "
+		"\"silent_frames\": %I64u, "
+		"\"preset\": %u, \"bitrate\": %u, \"governor_steps_down\": %I64u, "
+		"\"governor_steps_up\": %I64u, \"mono\": %s, \"mono_switches\": %I64u },\n",
+		stats->realtime_factor, stats->audio_time, stats->encode_time,
+		stats->bytes_encoded, stats->encoder_running ? "true" : "false",
+		stats->encoder_starts, stats->encoder_cpu_time, stats->pace_time,
+		stats->paced_frames, stats->pace_resyncs, stats->pace_dropped, stats->silent_frames,
+		stats->encoder_preset, stats->encoder_bitrate, stats->governor_steps_down,
+		stats->governor_steps_up, stats->encoder_mono ? "true" : "false",
+		stats->mono_switches );
+	text_append( text,
+		"  \"mixer\": { \"running\": %s, \"blocks\": %I64u, \"cpu_time_us\": %I64u },\n",
+		stats->mixer_running ? "true" : "false", stats->mixer_blocks,
+		stats->mixer_cpu_time );
+	text_append( text,
+		"  \"server\": { \"ring_size\": %u, \"ring_fill\": %u, \"listeners\": %u, "
+		"\"bytes_out\": %I64u, \"overruns\": %I64u, \"handshakes\": %I64u, "
+		"\"rejects\": %I64u, \"syscalls\": %I64u, \"server_cpu_time_us\": %I64u, "
+		"\"clients_cpu_time_us\": %I64u },\n",
+		stats->ring_size, stats->ring_fill, stats->listeners, stats->bytes_out,
+		stats->overruns, stats->handshakes, stats->rejects, stats->syscalls,
+		stats->server_cpu_time, stats->clients_cpu_time );
+	text_append( text,
+		"  \"timeshift\": { \"size\": %u, \"fill\": %u, \"time_us\": %I64u },\n",
+		stats->timeshift_size, stats->timeshift_fill, stats->timeshift_time );
+	text_append( text, "  \"hls\": { \"segments\": %I64u, \"requests\": %I64u },\n",
+		stats->hls_segments, stats->hls_requests );
+	text_append( text,
+		"  \"recorder\": { \"running\": %s, \"bytes\": %I64u, \"files\": %I64u, "
+		"\"dropped\": %I64u, \"errors\": %I64u },\n",
+		stats->recorder_running ? "true" : "false", stats->recorder_bytes,
+		stats->recorder_files, stats->recorder_dropped, stats->recorder_errors );
+	text_append( text, "  \"engine\": { \"shutdown_time_us\": %I64u },\n",
+		stats->shutdown_time );
+
+	get_latencies(stats, latencies);
+	text_append(text, "  \"latency\": {");
+	for(n = 0; n < LATENCY_STAGES; ++n)
+	{
+		unsigned b;
+		text_append( text, "%s\n    \"%s\": { \"count\": %I64u, \"mean_us\": %I64u, \"buckets\": [",
+			n ? "," : "", latency_stages[n], latencies[n]->count,
+			latencies[n]->count ? latencies[n]->total/latencies[n]->count : 0 );
+		for(b = 0; b < LATENCY_BUCKETS; ++b)
+			text_append(text, "%s%I64u", b ? ", " : "", latencies[n]->buckets[b]);
+		text_append(text, "] }");
+	}
+	text_append(text, "\n  },\n");
+
+	text_append(text, "  \"listeners\": [");
+	for(n = 0; n < num_listeners; ++n)
+	{
+		const engine_listener_stats_t *l = &listeners[n];
+		text_append( text,
+			"%s\n    { \"address\": \"%u.%u.%u.%u\", \"connected_us\": %I64u, "
+			"\"bytes_sent\": %I64u, \"lag\": %u, \"overruns\": %u, \"latency_us\": %I64u, "
+			"\"latency_last_us\": %I64u, \"cpu_time_us\": %I64u }",
+			n ? "," : "",
+			(unsigned)(l->address >> 24) & 255, (unsigned)(l->address >> 16) & 255,
+			(unsigned)(l->address >>  8) & 255, (unsigned)(l->address      ) & 255,
+			l->connected_time, l->bytes_sent, l->lag, l->overruns, l->latency,
+			l->latency_last, l->cpu_time );
+	}
+	text_append(text, "%s]\n}\n", num_listeners ? "\n  " : "");
+}
+
+static void render_metric( text_t *text, const char *name, const char *type,
+                           const char *help, const char *format, ... )
+{
+	char value[64];
+	va_list args;
+
+	va_start(args, format);
+	_vsnprintf(value, sizeof(value) - 1, format, args);
+	value[sizeof(value) - 1] = '\0';
+	va_end(args);
+
+	text_append( text, "# HELP minicast_%s %s\n# TYPE minicast_%s %s\nminicast_%s %s\n",
+	             name, help, name, type, name, value );
+}
+
+static void render_prometheus( text_t *text, const engine_stats_t *stats,
+                               const char *name, const char *title,
+                               const engine_listener_stats_t *listeners,
+                               unsigned num_listeners )
+{
+	const engine_latency_t *latencies[LATENCY_STAGES];
+	unsigned n;
+
+	text_append(text, "# HELP minicast_stream_info Stream name and current title.\n"
+	                  "# TYPE minicast_stream_info gauge\nminicast_stream_info{name=\"");
+	text_append_label(text, name);
+	text_append(text, "\",title=\"");
+	text_append_label(text, title);
+	text_append(text, "\"} 1\n");
+
+	render_metric( text, "ingest_queue_depth", "gauge",
+		"Raw data blocks waiting for the encoder.", "%u", stats->queue_depth );
+	render_metric( text, "ingest_queue_bytes", "gauge",
+		"Raw data bytes waiting for the encoder.", "%u", stats->queue_bytes );
+	render_metric( text, "ingest_blocks_total", "counter",
+		"Raw data blocks accepted for encoding.", "%I64u", stats->ingest_blocks );
+	render_metric( text, "ingest_drops_total", "counter",
+		"Raw data blocks lost because the encoder queue was full.", "%I64u",
+		stats->ingest_drops );
+	render_metric( text, "ingest_idle_discards_total", "counter",
+		"Raw data blocks discarded while idle without listeners.", "%I64u",
+		stats->ingest_idle );
+	render_metric( text, "ingest_bytes_total", "counter",
+		"Raw data bytes accepted for encoding.", "%I64u", stats->bytes_in );
+	render_metric( text, "ingest_passthrough_bytes_total", "counter",
+		"MP3 bytes accepted for publishing without encoding.", "%I64u",
+		stats->passthrough_bytes );
+	render_metric( text, "ingest_passthrough_discarded_bytes_total", "counter",
+		"Submitted MP3 bytes discarded because they were not part of a frame.", "%I64u",
+		stats->passthrough_discarded );
+	render_metric( text, "encoder_realtime_factor", "gauge",
+		"Audio time encoded per unit of time spent encoding.", "%.3f",
+		stats->realtime_factor );
+	render_metric( text, "encoder_audio_seconds_total", "counter",
+		"Duration of audio encoded.", "%.6f", (double)(__int64)stats->audio_time/1e6 );
+	render_metric( text, "encoder_busy_seconds_total", "counter",
+		"Time spent encoding.", "%.6f", (double)(__int64)stats->encode_time/1e6 );
+	render_metric( text, "encoder_bytes_total", "counter",
+		"Encoded bytes produced.", "%I64u", stats->bytes_encoded );
+	render_metric( text, "encoder_running", "gauge",
+		"1 if the encoder thread is running.", "%u", stats->encoder_running );
+	render_metric( text, "encoder_starts_total", "counter",
+		"Times the encoder thread was started.", "%I64u", stats->encoder_starts );
+	render_metric( text, "encoder_cpu_seconds_total", "counter",
+		"CPU time used by the encoder thread.", "%.6f",
+		(double)(__int64)stats->encoder_cpu_time/1e6 );
+	render_metric( text, "encoder_pace_seconds_total", "counter",
+		"Time the encoder was held back to publish frames in real time.", "%.6f",
+		(double)(__int64)stats->pace_time/1e6 );
+	render_metric( text, "pacer_frames_total", "counter",
+		"Encoded frames published.", "%I64u", stats->paced_frames );
+	render_metric( text, "pacer_resyncs_total", "counter",
+		"Times the pacer clock restarted because input fell behind.", "%I64u",
+		stats->pace_resyncs );
+	render_metric( text, "pacer_dropped_bytes_total", "counter",
+		"Encoded bytes dropped because they were not at a frame boundary.", "%I64u",
+		stats->pace_dropped );
+	render_metric( text, "encoder_silent_frames_total", "counter",
+		"Silent frames sent to listeners while no input arrived.", "%I64u",
+		stats->silent_frames );
+	render_metric( text, "encoder_preset", "gauge",
+		"Encoder preset in use (0 is the best quality).", "%u", stats->encoder_preset );
+	render_metric( text, "encoder_bitrate_kbps", "gauge",
+		"Encoder bitrate in use.", "%u", stats->encoder_bitrate );
+	render_metric( text, "governor_steps_down_total", "counter",
+		"Times the encoder settings were lowered under load.", "%I64u",
+		stats->governor_steps_down );
+	render_metric( text, "governor_steps_up_total", "counter",
+		"Times the encoder settings were raised again.", "%I64u",
+		stats->governor_steps_up );
+	render_metric( text, "encoder_mono", "gauge",
+		"1 while stereo input is encoded as mono.", "%u", stats->encoder_mono );
+	render_metric( text, "encoder_mono_switches_total", "counter",
+		"Times the encoder switched between mono and stereo.", "%I64u",
+		stats->mono_switches );
+	render_metric( text, "mixer_running", "gauge",
+		"1 if the mixer thread is running.", "%u", stats->mixer_running );
+	render_metric( text, "mixer_blocks_total", "counter",
+		"Blocks mixed.", "%I64u", stats->mixer_blocks );
+	render_metric( text, "mixer_cpu_seconds_total", "counter",
+		"CPU time used by the mixer thread.", "%.6f",
+		(double)(__int64)stats->mixer_cpu_time/1e6 );
+	render_metric( text, "ring_size_bytes", "gauge",
+		"Size of the stream buffer.", "%u", stats->ring_size );
+	render_metric( text, "ring_fill_bytes", "gauge",
+		"Stream data buffered.", "%u", stats->ring_fill );
+	render_metric( text, "listeners", "gauge",
+		"Connected listeners.", "%u", stats->listeners );
+	render_metric( text, "sent_bytes_total", "counter",
+		"Bytes sent to listeners.", "%I64u", stats->bytes_out );
+	render_metric( text, "overruns_total", "counter",
+		"Times a listener fell a full buffer behind.", "%I64u", stats->overruns );
+	render_metric( text, "handshakes_total", "counter",
+		"HTTP requests answered.", "%I64u", stats->handshakes );
+	render_metric( text, "rejects_total", "counter",
+		"Listeners refused because the server was full.", "%I64u", stats->rejects );
+	render_metric( text, "syscalls_total", "counter",
+		"Socket calls made.", "%I64u", stats->syscalls );
+	render_metric( text, "server_cpu_seconds_total", "counter",
+		"CPU time used by the server thread.", "%.6f",
+		(double)(__int64)stats->server_cpu_time/1e6 );
+	render_metric( text, "clients_cpu_seconds_total", "counter",
+		"CPU time used by client threads.", "%.6f",
+		(double)(__int64)stats->clients_cpu_time/1e6 );
+	render_metric( text, "timeshift_size_bytes", "gauge",
+		"Size of the time-shift archive.", "%u", stats->timeshift_size );
+	render_metric( text, "timeshift_fill_bytes", "gauge",
+		"Stream data held for time-shifted listening.", "%u", stats->timeshift_fill );
+	render_metric( text, "timeshift_seconds", "gauge",
+		"Duration of the stream held for time-shifted listening.", "%.6f",
+		(double)(__int64)stats->timeshift_time/1e6 );
+	render_metric( text, "hls_segments_total", "counter",
+		"HLS segments completed.", "%I64u", stats->hls_segments );
+	render_metric( text, "hls_requests_total", "counter",
+		"HLS playlists and segments served.", "%I64u", stats->hls_requests );
+	render_metric( text, "recorder_running", "gauge",
+		"1 if the recorder thread is running.", "%u", stats->recorder_running );
+	render_metric( text, "recorder_bytes_total", "counter",
+		"Stream bytes recorded.", "%I64u", stats->recorder_bytes );
+	render_metric( text, "recorder_files_total", "counter",
+		"Recording files started.", "%I64u", stats->recorder_files );
+	render_metric( text, "recorder_dropped_bytes_total", "counter",
+		"Stream bytes lost because the disk fell behind or a file could not be written.",
+		"%I64u", stats->recorder_dropped );
+	render_metric( text, "recorder_errors_total", "counter",
+		"Recording files that could not be created or written.", "%I64u",
+		stats->recorder_errors );
+	render_metric( text, "shutdown_seconds", "gauge",
+		"Duration of the last engine shutdown.", "%.6f",
+		(double)(__int64)stats->shutdown_time/1e6 );
+
+	// Latency histograms, with bucket bounds in seconds
+	get_latencies(stats, latencies);
+	text_append(text, "# HELP minicast_latency_seconds Latency per processing stage.\n"
+	                  "# TYPE minicast_latency_seconds histogram\n");
+	for(n = 0; n < LATENCY_STAGES; ++n)
+	{
+		unsigned __int64 cumulative = 0;
+		unsigned b;
+		for(b = 0; b < LATENCY_BUCKETS; ++b)
+		{
+			cumulative += latencies[n]->buckets[b];
+			if(b < LATENCY_BUCKETS - 1)
+				text_append( text, "minicast_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %I64u\n",
+				             latency_stages[n], (double)((__int64)1 << b)/1e6, cumulative );
+			else
+				text_append( text, "minicast_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %I64u\n",
+				             latency_stages[n], cumulative );
+		}
+		text_append( text, "minicast_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+		                   "minicast_latency_seconds_count{stage=\"%s\"} %I64u\n",
+		             latency_stages[n], (double)(__int64)latencies[n]->total/1e6,
+		             latency_stages[n], latencies[n]->count );
+	}
+
+	text_append(text, "# HELP minicast_listener_lag_bytes Bytes behind the live stream.\n"
+	                  "# TYPE minicast_listener_lag_bytes gauge\n");
+	for(n = 0; n < num_listeners; ++n)
+	{
+		const engine_listener_stats_t *l = &listeners[n];
+		text_append( text, "minicast_listener_lag_bytes{listener=\"%u\",address=\"%u.%u.%u.%u\"} %u\n",
+			n, (unsigned)(l->address >> 24) & 255, (unsigned)(l->address >> 16) & 255,
+			(unsigned)(l->address >> 8) & 255, (unsigned)l->address & 255, l->lag );
+	}
+	text_append(text, "# HELP minicast_listener_sent_bytes Bytes sent to the listener.\n"
+	                  "# TYPE minicast_listener_sent_bytes counter\n");
+	for(n = 0; n < num_listeners; ++n)
+	{
+		const engine_listener_stats_t *l = &listeners[n];
+		text_append( text, "minicast_listener_sent_bytes{listener=\"%u\",address=\"%u.%u.%u.%u\"} %I64u\n",
+			n, (unsigned)(l->address >> 24) & 255, (unsigned)(l->address >> 16) & 255,
+			(unsigned)(l->address >> 8) & 255, (unsigned)l->address & 255, l->bytes_sent );
+	}
+	text_append(text, "# HELP minicast_listener_overruns_total Times the listener fell a full buffer behind.\n"
+	                  "# TYPE minicast_listener_overruns_total counter\n");
+	for(n = 0; n < num_listeners; ++n)
+	{
+		const engine_listener_stats_t *l = &listeners[n];
+		text_append( text, "minicast_listener_overruns_total{listener=\"%u\",address=\"%u.%u.%u.%u\"} %u\n",
+			n, (unsigned)(l->address >> 24) & 255, (unsigned)(l->address >> 16) & 255,
+			(unsigned)(l->address >> 8) & 255, (unsigned)l->address & 255, l->overruns );
+	}
+}
+
+// Re-renders all status pages from a fresh snapshot of the statistics.
+static void refresh_pages()
+{
+	engine_stats_t stats;
+	engine_listener_stats_t *listeners;
+	unsigned num_listeners = 0, n;
+	char name[64], title[METADATA_TITLE_SIZE];
+
+	memset(&stats, 0, sizeof(stats));
+	encoder_get_stats(&stats);
+	mixer_get_stats(&stats);
+	server_get_stats(&stats);
+	recorder_get_stats(&stats);
+	server_get_names(name, sizeof(name), title, sizeof(title));
+	listeners = (engine_listener_stats_t*)malloc(MAX_LISTENERS*sizeof(*listeners));
+	if(listeners != NULL)
+		num_listeners = server_get_listener_stats(listeners, MAX_LISTENERS);
+
+	for(n = 0; n < PAGE_COUNT; ++n)
+		cached_pages[n].size = 0;
+	render_json( &cached_pages[PAGE_JSON], &stats, name, title,
+	             listeners, num_listeners );
+	render_prometheus( &cached_pages[PAGE_PROMETHEUS], &stats, name, title,
+	                   listeners, num_listeners );
+
+	free(listeners);
+}
+
+int status_initialize()
+{
+	InitializeCriticalSection(&status_access);
+	memset(cached_pages, 0, sizeof(cached_pages));
+	cached_valid = 0;
+	return 0;
+}
+
+void status_finalize()
+{
+	unsigned n;
+
+	for(n = 0; n < PAGE_COUNT; ++n)
+		free(cached_pages[n].data);
+	memset(cached_pages, 0, sizeof(cached_pages));
+	DeleteCriticalSection(&status_access);
+}
+
+char *status_get_page( const char *resource, const char **content_type,
+                       unsigned *length )
+{
+	unsigned n;
+	char *result = NULL;
+
+	for(n = 0; n < PAGE_COUNT; ++n)
+		if(strcmp(resource, pages[n].resource) == 0)
+			break;
+	if(n == PAGE_COUNT)
+		return NULL;
+
+	EnterCriticalSection(&status_access);
+	if(!cached_valid || server_time() - cached_time >= STATUS_REFRESH_INTERVAL)
+	{
+		refresh_pages();
+		cached_time = server_time();
+		cached_valid = 1;
+	}
+	if((result = (char*)malloc(cached_pages[n].size + 1)) != NULL)
+	{
+		memcpy(result, cached_pages[n].data, cached_pages[n].size);
+		result[cached_pages[n].size] = '\0';
+		*length = cached_pages[n].size;
+		*content_type = pages[n].content_type;
+	}
+	LeaveCriticalSection(&status_access);
+
+	return result;
+}
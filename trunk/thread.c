@@ -0,0 +1,47 @@
+/* Contains helper functions for the threads of the Minicast engine. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+
+// Function prototypes
+int thread_set_scheduling(void *thread, unsigned long affinity, int priority);
+unsigned __int64 thread_cpu_time(void *thread);
+
+
+/* Restricts a thread to the processors in 'affinity' (0 for any processor
+   of the process) and sets its priority, relative to the priority class of
+   the process. Returns non-zero if either could not be applied. */
+int thread_set_scheduling(void *thread, unsigned long affinity, int priority)
+{
+	DWORD_PTR process_mask, system_mask;
+	int result = 0;
+
+	if(!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+		return -1;
+	if(affinity != 0 && (affinity & process_mask) != 0)
+		process_mask &= affinity;
+	else if(affinity != 0)
+		result = -1;  // none of the processors is available; allow all
+	if(!SetThreadAffinityMask((HANDLE)thread, process_mask))
+		result = -1;
+
+	if(!SetThreadPriority((HANDLE)thread, priority))
+		result = -1;
+
+	return result;
+}
+
+/* Returns the CPU time used by a thread, in microseconds. */
+unsigned __int64 thread_cpu_time(void *thread)
+{
+	FILETIME creation, exit, kernel, user;
+
+	if(thread == NULL || !GetThreadTimes((HANDLE)thread, &creation, &exit, &kernel, &user))
+		return 0;
+	return ( ((unsigned __int64)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+	         ((unsigned __int64)user.dwHighDateTime   << 32 | user.dwLowDateTime) ) / 10;
+}
@@ -0,0 +1,1033 @@
+/* Simulates listeners of the Minicast server on a virtual network, to check
+   how the server copes with fast, lossy, slow and stalling connections. The
+   server runs on its I/O seam (see server_io.h) without sockets or threads:
+   each connection is a fake socket whose send buffer drains at the rate of a
+   network profile, and time is a virtual clock advanced in steps of 10 ms, so
+   that a run is much faster than real time and the same each time.
+
+   The stream is made of 384-byte MPEG frames (128 kbps at 48 kHz), each of
+   which carries its own stream position and the time it was published. Each
+   simulated listener parses what it is sent, so it can tell where it was sent
+   the stream with gaps, how long after publication each frame reached it,
+   and check that each title it gets in the metadata is the one submitted for
+   the audio at that point.
+
+   Usage: netsim [-l <listeners>] [-t <seconds>] [<seed> [low]]
+
+   -l sets the number of listeners (40 by default) and -t the seconds of
+   streaming simulated (360 by default, at least 60). With 'low', the server
+   runs in low-latency mode, and the stream is published in blocks that end
+   at arbitrary points within a frame, as pre-encoded data passed through may
+   be; listeners that keep up must then get each frame within LATENCY_TARGET
+   on average.
+
+   The scenario is a table of steps scaled to the listeners and the duration
+   (see make_scenario()); the exit status is non-zero if any of its checks
+   fail. The default run takes about a second; "netsim -l 2000 -t 3600" runs
+   an hour of streaming to 2000 listeners in about 5 minutes (9 with 'low').
+   This tool is built separately from the plug-in, together with the server
+   sources, e.g.:
+     cl netsim.c ..\server.c ..\status.c ..\archive.c ..\hls.c ..\trace.c
+        ..\thread.c ..\handover.c ..\mp3.c ws2_32.lib user32.lib   (Visual C++)
+     gcc -O2 -o netsim netsim.c ../server.c ../status.c ../archive.c ../hls.c
+        ../trace.c ../thread.c ../handover.c ../mp3.c -lws2_32   (MinGW) */
+
+#include "../server_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+// Definitions
+#define TICK				 (10000)	// microseconds per simulation step
+#define FRAME_SIZE			   (384)	// bytes per frame (128 kbps at 48 kHz)
+#define FRAME_DURATION		 (24000)	// microseconds per frame
+#define POSITION_SIZE		    (10)	// bytes of the position in a frame
+#define TIME_SIZE			    (10)	// bytes of the publication time
+#define LATENCY_TARGET		(200000)	// max. average microseconds from
+										// publication to a listener in
+										// low-latency mode
+#define LOW_LATENCY_SKIP	(500000)	// microseconds behind after which the
+										// server skips a listener ahead in
+										// low-latency mode
+#define LOW_LATENCY_BUFFER	  (4096)	// bytes of a socket send buffer in
+										// low-latency mode
+#define TITLE_INTERVAL	  (20000000)	// microseconds between title changes
+#define SEND_BUFFER			 (65536)	// bytes of a socket send buffer
+#define RTO_MIN				(200000)	// microseconds a loss stalls a
+										// connection, besides a round trip
+#define DEFAULT_LISTENERS	    (40)
+#define DEFAULT_DURATION	   (360)	// seconds
+#define MIN_DURATION		    (60)	// seconds; fits the stall and the
+										// storm of the scenario
+#define MAX_CHECKS			    (16)	// metadata packets awaiting a check
+#define SOCKET_BASE			  (1000)	// fake socket of connection 0
+#define NEVER		   (~(ULONGLONG)0)
+
+// Network profile of a listener
+typedef struct profile
+{
+	const char *name;
+	unsigned long bandwidth;	// bytes per second
+	unsigned long rtt;			// round trip time in microseconds
+	unsigned long window;		// bytes in flight per round trip
+	unsigned long loss;			// chance per step (in 1/100000) of a loss,
+								// which stalls the connection for a
+								// retransmission timeout
+	int slow;					// set if slower than the stream
+} profile_t;
+
+static const profile_t profiles[] = {
+	{ "lan",    12500000,   1000, 65536,   0, 0 },
+	{ "dsl",      250000,  40000, 65536,  50, 0 },
+	{ "mobile",   125000, 120000, 32768, 500, 0 },
+	{ "slow",      12000, 200000, 16384, 100, 1 }	// 96 kbps
+};
+#define PROFILES (sizeof(profiles)/sizeof(profiles[0]))
+
+// Step of the scenario
+enum { STEP_JOIN, STEP_STALL, STEP_STORM, STEP_END };
+
+typedef struct step
+{
+	unsigned long time;			// milliseconds from the start
+	int type;
+	unsigned long arg1, arg2;
+} step_t;
+
+#define SCENARIO_STEPS (7)
+
+// Simulated listener
+typedef struct listener
+{
+	const profile_t *profile;
+	int connection;				// index of its connection; -1 if none
+	ULONGLONG join_time;		// time it connects next; NEVER if not
+	ULONGLONG hangup_time;		// time it hangs up; NEVER if not
+	ULONGLONG stall_start, stall_end;	// scripted stall
+	int stalled;				// set if it has stalled
+	ULONGLONG last_frame;		// time it last got a whole frame header
+	ULONGLONG latency_total, latency_max;	// from publication to receipt,
+	unsigned long latency_count;			// of whole frames
+	unsigned long connections, frames, gaps, truncated, errors;
+	unsigned long checks, mismatches, unchecked;
+	ULONGLONG longest_block;	// longest time its connection moved no data
+								// although there was some to move
+} listener_t;
+
+// Metadata packet awaiting the position of the audio following it
+typedef struct check
+{
+	ULONGLONG index;			// audio byte index of the audio following it
+	int title;
+} check_t;
+
+// Simulated connection: the socket on the server side, and the parser of
+// the listener
+typedef struct connection
+{
+	int used;
+	int listener;
+	struct client *client;		// server state while registered
+	int closed;					// set once the server has closed the socket
+	int hung_up;				// set once the listener has hung up
+	unsigned request_pos;
+	ULONGLONG idle_position;	// stream position when the server last had
+								// nothing to send; NEVER if it had
+	unsigned char *buffer;		// send buffer (ring of SEND_BUFFER bytes),
+								// kept while the slot is free
+	unsigned capacity, start, size;
+	ULONGLONG blocked_until;	// end of a retransmission timeout
+	ULONGLONG blocked_since;	// time it last moved data; NEVER if it has
+								// had none to move since
+
+	// Listener side
+	int state;					// see STATE_*
+	char response[1024];
+	unsigned response_size;
+	unsigned metaint, audio_left, metadata_left, metadata_size;
+	char metadata[METADATA_SIZE];
+	int title;					// title last received; 0 for none
+	ULONGLONG audio_count;		// audio bytes received
+	unsigned long sync;			// last four audio bytes
+	int in_frame, position_known, previous_known;
+	int cut;					// set if the frame's header bytes were cut
+								// off by the next frame
+	int skipped;				// set if the frame follows a gap
+	ULONGLONG frame_start;		// audio byte index of the current frame
+	ULONGLONG frame_position, previous_position;
+	ULONGLONG frame_time, frame_latency;
+	check_t checks[MAX_CHECKS];
+	unsigned num_checks;
+} connection_t;
+
+enum { STATE_RESPONSE, STATE_AUDIO, STATE_LENGTH, STATE_METADATA, STATE_DONE };
+
+
+// Global variables
+static ULONGLONG sim_now;
+static unsigned long seed = 1;
+static step_t scenario[SCENARIO_STEPS];
+static connection_t *connections;
+static unsigned connections_size;
+static listener_t *listeners;
+static unsigned listeners_size, listeners_count;
+static ULONGLONG *title_positions;	// stream positions from which
+static int *title_numbers;			// the titles apply
+static unsigned titles_size, titles_count;
+static int title_pending;		// title submitted but not placed yet
+static int low_latency;			// set to run in low-latency mode
+static unsigned long connections_opened, rejects;
+
+static const char request[] = "GET / HTTP/1.0\r\nIcy-MetaData: 1\r\n\r\n";
+
+
+// Returns a pseudo-random number below 100000
+static unsigned long next_random()
+{
+	seed = (seed * 1103515245 + 12345) & 0xFFFFFFFF;
+	return (seed >> 8) % 100000;
+}
+
+static connection_t *find_connection(SOCKET socket)
+{
+	if(socket < SOCKET_BASE || socket >= SOCKET_BASE + connections_size)
+		return NULL;
+	return &connections[socket - SOCKET_BASE];
+}
+
+
+// I/O primitives of the simulated network
+static SOCKET sim_socket(int family, int type, int protocol)
+{
+	return SOCKET_BASE + connections_size;
+}
+
+static int sim_bind(SOCKET socket, const struct sockaddr *addr, int addr_len)
+{
+	return 0;
+}
+
+static int sim_listen(SOCKET socket, int backlog)
+{
+	return 0;
+}
+
+static SOCKET sim_accept(SOCKET socket, struct sockaddr *addr, int *addr_len)
+{
+	return INVALID_SOCKET;  // connections are opened by the driver
+}
+
+static int sim_getpeername(SOCKET socket, struct sockaddr *addr, int *addr_len)
+{
+	connection_t *c = find_connection(socket);
+	struct sockaddr_in *addr_in = (struct sockaddr_in*)addr;
+
+	if(c == NULL || *addr_len < (int)sizeof(*addr_in))
+		return SOCKET_ERROR;
+	memset(addr_in, 0, sizeof(*addr_in));
+	addr_in->sin_family = AF_INET;
+	addr_in->sin_addr.s_addr = htonl(0x0A000000 + c->listener);
+	return 0;
+}
+
+static int sim_recv(SOCKET socket, char *buffer, int length, int flags)
+{
+	connection_t *c = find_connection(socket);
+	int size;
+
+	if(c == NULL || c->hung_up)
+		return SOCKET_ERROR;
+	size = (int)(sizeof(request) - 1 - c->request_pos);
+	if(size > length)
+		size = length;
+	memcpy(buffer, request + c->request_pos, size);
+	c->request_pos += size;
+	return size;
+}
+
+static int sim_send(SOCKET socket, const char *buffer, int length, int flags)
+{
+	connection_t *c = find_connection(socket);
+	unsigned room, pos, part;
+
+	if(c == NULL || c->closed || c->hung_up)
+		return SOCKET_ERROR;
+	room = c->capacity - c->size;
+	if((unsigned)length > room)
+		length = (int)room;
+	pos = (c->start + c->size) % c->capacity;
+	part = c->capacity - pos;
+	if(part > (unsigned)length)
+		part = (unsigned)length;
+	memcpy(c->buffer + pos, buffer, part);
+	memcpy(c->buffer, buffer + part, length - part);
+	c->size += length;
+	return length;
+}
+
+static int sim_wait_acceptable(SOCKET socket, HANDLE wake)
+{
+	return SOCKET_ERROR;  // there is no accept thread
+}
+
+static int sim_wait_writable(SOCKET socket, unsigned long timeout)
+{
+	connection_t *c = find_connection(socket);
+
+	if(c == NULL || c->closed || c->hung_up)
+		return SOCKET_ERROR;
+	return (c->size < c->capacity) ? 1 : 0;
+}
+
+static int sim_shutdown(SOCKET socket, int how)
+{
+	return 0;
+}
+
+static int sim_setsockopt(SOCKET socket, int level, int name, const char *value, int length)
+{
+	connection_t *c = find_connection(socket);
+
+	if(c != NULL && level == SOL_SOCKET && name == SO_SNDBUF && length == sizeof(int))
+	{
+		c->capacity = *(const int*)value;
+		if(c->capacity < 1 || c->capacity > SEND_BUFFER)
+			c->capacity = SEND_BUFFER;
+	}
+	return 0;
+}
+
+static int sim_close(SOCKET socket)
+{
+	connection_t *c = find_connection(socket);
+
+	if(c != NULL)
+		c->closed = 1;
+	return 0;
+}
+
+static ULONGLONG sim_time(void)
+{
+	return sim_now;
+}
+
+static const server_io_t sim_io = {
+	sim_socket, sim_bind, sim_listen, sim_accept, sim_getpeername,
+	sim_recv, sim_send, sim_wait_acceptable, sim_wait_writable,
+	sim_shutdown, sim_setsockopt, sim_close, sim_time };
+
+
+// The server's status pages report engine statistics; there is no engine
+void encoder_get_stats(engine_stats_t *stats) {}
+void mixer_get_stats(engine_stats_t *stats) {}
+void recorder_get_stats(engine_stats_t *stats) {}
+
+
+// Returns the number of the title submitted for a stream position
+static int expected_title(ULONGLONG position)
+{
+	unsigned n = titles_count;
+
+	while(n > 0 && title_positions[n - 1] > position)
+		--n;
+	return (n > 0) ? title_numbers[n - 1] : 0;
+}
+
+/* Checks the metadata packets followed by audio before audio byte 'limit'
+   against the titles submitted, given the audio byte index and stream
+   position of the frame that audio is in ('known' is zero if its position is
+   not known). A packet sent just before the server skipped ahead gave the
+   title of the audio it was sent for, which was then overwritten; it can
+   only be corrected by the next packet, so it is not checked. */
+static void resolve_checks( connection_t *c, ULONGLONG limit, ULONGLONG start,
+                            ULONGLONG position, int known )
+{
+	listener_t *l = &listeners[c->listener];
+	unsigned n = 0, m;
+
+	while(n < c->num_checks && c->checks[n].index < limit)
+	{
+		// The packet gives the title of the audio following it
+		if(!known || (c->skipped && c->checks[n].index == start))
+			++l->unchecked;
+		else
+		{
+			++l->checks;
+			if(c->checks[n].title != expected_title(position + (c->checks[n].index - start)))
+				++l->mismatches;
+		}
+		++n;
+	}
+	for(m = n; m < c->num_checks; ++m)
+		c->checks[m - n] = c->checks[m];
+	c->num_checks -= n;
+}
+
+// Parses an audio byte received by a listener
+static void receive_audio(connection_t *c, unsigned char byte)
+{
+	listener_t *l = &listeners[c->listener];
+	ULONGLONG index = c->audio_count++, start, offset;
+
+	c->sync = ((c->sync << 8) | byte) & 0xFFFFFFFF;
+	if(c->sync == 0xFFFB9464)
+	{
+		// A frame starts with the last four bytes; finish the previous one
+		start = c->audio_count - 4;
+		if(!c->in_frame)
+		{
+			if(start != 0)
+				++l->errors;  // data before the first frame
+		}
+		else if(start - c->frame_start < FRAME_SIZE)
+			++l->truncated;
+		else if(start - c->frame_start > FRAME_SIZE + 3)
+			++l->errors;
+		else if(start - c->frame_start > FRAME_SIZE)
+		{
+			// The first bytes of a frame were sent before the client was
+			// skipped ahead; they run into the one before
+			++l->truncated;
+		}
+		else if(c->frame_latency != NEVER)
+		{
+			l->latency_total += c->frame_latency;
+			++l->latency_count;
+			if(c->frame_latency > l->latency_max)
+				l->latency_max = c->frame_latency;
+		}
+		resolve_checks(c, start, c->frame_start, c->frame_position, c->position_known);
+		if(c->in_frame && c->position_known)
+		{
+			c->previous_position = c->frame_position;
+			c->previous_known = 1;
+		}
+		c->in_frame = 1;
+		c->position_known = 0;
+		c->cut = 0;
+		c->skipped = 0;
+		c->frame_start = start;
+		c->frame_position = 0;
+		c->frame_time = 0;
+		c->frame_latency = NEVER;
+		return;
+	}
+	if(!c->in_frame)
+		return;
+
+	// Take the stream position from the bytes after the header; they are
+	// below 0x80, so a byte that is not is the start of the next frame,
+	// sent after the rest of this one was skipped
+	offset = index - c->frame_start;
+	if(offset >= 4 && offset < 4 + POSITION_SIZE + TIME_SIZE && (byte & 0x80))
+		c->cut = 1;
+	if(offset >= 4 && offset < 4 + POSITION_SIZE)
+		c->frame_position |= (ULONGLONG)(byte & 0x7F) << (7*(offset - 4));
+	if(offset == 3 + POSITION_SIZE && !c->cut)
+	{
+		c->position_known = 1;
+		++l->frames;
+		l->last_frame = sim_now;
+		if(c->previous_known)
+		{
+			if(c->frame_position > c->previous_position + FRAME_SIZE)
+			{
+				++l->gaps;
+				c->skipped = 1;
+			}
+			else if(c->frame_position < c->previous_position + FRAME_SIZE)
+				++l->errors;
+		}
+	}
+
+	// Take the publication time from the bytes after that
+	if(offset >= 4 + POSITION_SIZE && offset < 4 + POSITION_SIZE + TIME_SIZE)
+		c->frame_time |= (ULONGLONG)(byte & 0x7F) << (7*(offset - 4 - POSITION_SIZE));
+	if(offset == 3 + POSITION_SIZE + TIME_SIZE && !c->cut)
+		c->frame_latency = sim_now - c->frame_time;  // counted once it is whole
+}
+
+/* Returns how many of 'length' audio bytes received by a listener can be
+   passed over at once, without parsing each: those in the payload of a
+   frame before the next byte that may start a frame header. */
+static unsigned skip_payload(connection_t *c, const unsigned char *data, unsigned length)
+{
+	const unsigned char *next;
+	unsigned n;
+
+	// A header that started in the bytes before would be completed by these
+	if( !c->in_frame || c->audio_count - c->frame_start < 4 + POSITION_SIZE + TIME_SIZE ||
+		(c->sync & 0xFF) == 0xFF || (c->sync & 0xFF00) == 0xFF00 ||
+		(c->sync & 0xFF0000) == 0xFF0000 )
+		return 0;
+	if((next = (const unsigned char*)memchr(data, 0xFF, length)) != NULL)
+		length = (unsigned)(next - data);
+	for(n = (length > 4) ? length - 4 : 0; n < length; ++n)
+		c->sync = ((c->sync << 8) | data[n]) & 0xFFFFFFFF;
+	c->audio_count += length;
+	return length;
+}
+
+// Handles a metadata packet received by a listener
+static void receive_metadata(connection_t *c)
+{
+	listener_t *l = &listeners[c->listener];
+	int title;
+
+	if(c->metadata_size > 0)
+	{
+		c->metadata[c->metadata_size - 1] = '\0';
+		if(sscanf(c->metadata, "StreamTitle='Title %d';", &title) == 1)
+			c->title = title;
+		else
+			++l->errors;
+	}
+	if(c->num_checks == MAX_CHECKS)
+	{
+		resolve_checks(c, c->checks[0].index, 0, 0, 0);
+		++l->errors;
+	}
+	c->checks[c->num_checks].index = c->audio_count;
+	c->checks[c->num_checks].title = c->title;
+	++c->num_checks;
+}
+
+// Parses data received by a listener
+static void receive(connection_t *c, const unsigned char *data, unsigned length)
+{
+	listener_t *l = &listeners[c->listener];
+	const char *value;
+	unsigned n;
+
+	while(length > 0)
+	{
+		switch(c->state)
+		{
+		case STATE_RESPONSE:
+			if(c->response_size < sizeof(c->response) - 1)
+				c->response[c->response_size++] = *data;
+			c->response[c->response_size] = '\0';
+			++data; --length;
+			if(strstr(c->response, "\r\n\r\n") == NULL)
+				break;
+			if(strncmp(c->response, "ICY 200 OK\r\n", 12) != 0)
+			{
+				++rejects;
+				c->state = STATE_DONE;
+				break;
+			}
+			if( (value = strstr(c->response, "icy-metaint: ")) == NULL ||
+				sscanf(value + 13, "%u", &c->metaint) != 1 || c->metaint == 0 )
+			{
+				++l->errors;
+				c->state = STATE_DONE;
+				break;
+			}
+			c->audio_left = c->metaint;
+			c->state = STATE_AUDIO;
+			break;
+
+		case STATE_AUDIO:
+			n = skip_payload(c, data, (length < c->audio_left) ? length : c->audio_left);
+			if(n == 0)
+			{
+				receive_audio(c, *data);
+				n = 1;
+			}
+			data += n; length -= n;
+			if((c->audio_left -= n) == 0)
+				c->state = STATE_LENGTH;
+			break;
+
+		case STATE_LENGTH:
+			c->metadata_left = 16 * *data;
+			c->metadata_size = 0;
+			++data; --length;
+			if(c->metadata_left > 0)
+			{
+				c->state = STATE_METADATA;
+				break;
+			}
+			receive_metadata(c);
+			c->audio_left = c->metaint;
+			c->state = STATE_AUDIO;
+			break;
+
+		case STATE_METADATA:
+			c->metadata[c->metadata_size++] = (char)*data;
+			++data; --length;
+			if(--c->metadata_left > 0)
+				break;
+			receive_metadata(c);
+			c->audio_left = c->metaint;
+			c->state = STATE_AUDIO;
+			break;
+
+		default:
+			return;
+		}
+	}
+}
+
+
+// Connects a listener to the server
+static void connect_listener(int id)
+{
+	listener_t *l = &listeners[id];
+	connection_t *c;
+	unsigned n;
+
+	unsigned char *buffer;
+
+	for(n = 0; n < connections_size && connections[n].used; ++n)
+		;
+	if(n == connections_size)
+	{
+		++l->errors;
+		return;
+	}
+
+	c = &connections[n];
+	if((buffer = c->buffer) == NULL && (buffer = (unsigned char*)malloc(SEND_BUFFER)) == NULL)
+	{
+		++l->errors;
+		return;
+	}
+	memset(c, 0, sizeof(*c));
+	c->buffer = buffer;
+	c->used = 1;
+	c->idle_position = NEVER;
+	c->blocked_since = NEVER;
+	c->listener = id;
+	c->capacity = SEND_BUFFER;
+	l->connection = n;
+	++l->connections;
+	++connections_opened;
+	c->client = server_client_open(SOCKET_BASE + n, 0x0A000000 + id);
+}
+
+// Moves a connection's data across the network for a step
+static void transfer(connection_t *c)
+{
+	listener_t *l = &listeners[c->listener];
+	const profile_t *profile = l->profile;
+	unsigned long rate;
+	unsigned length;
+
+	if(c->hung_up || c->size == 0)
+	{
+		c->blocked_since = NEVER;
+		return;
+	}
+	if(c->blocked_since == NEVER)
+		c->blocked_since = sim_now;
+	if(sim_now < c->blocked_until)
+		return;
+	if(sim_now >= l->stall_start && sim_now < l->stall_end)
+		return;
+	if(next_random() < profile->loss)
+	{
+		c->blocked_until = sim_now + RTO_MIN + profile->rtt;
+		return;
+	}
+	if(sim_now - c->blocked_since > l->longest_block)
+		l->longest_block = sim_now - c->blocked_since;
+	c->blocked_since = NEVER;
+
+	rate = profile->bandwidth;
+	if(rate > (ULONGLONG)profile->window * 1000000 / profile->rtt)
+		rate = (unsigned long)((ULONGLONG)profile->window * 1000000 / profile->rtt);
+	length = (unsigned)((ULONGLONG)rate * TICK / 1000000);
+	if(length > c->size)
+		length = c->size;
+	while(length > 0)
+	{
+		unsigned part = c->capacity - c->start;
+		if(part > length)
+			part = length;
+		receive(c, c->buffer + c->start, part);
+		c->start = (c->start + part) % c->capacity;
+		c->size -= part;
+		length  -= part;
+	}
+}
+
+/* Publishes the frames due by now in a single block. In low-latency mode,
+   the block ends at an arbitrary point of the last frame, whose rest is
+   published with the next block. */
+static void publish()
+{
+	static ULONGLONG frames_published;
+	static unsigned char rest[FRAME_SIZE];
+	static unsigned rest_size;
+	unsigned char block[FRAME_SIZE * 3], *frame;
+	unsigned size, n, cut;
+	ULONGLONG position = server_stream_position();
+
+	memcpy(block, rest, rest_size);
+	size = rest_size;
+	while( frames_published * FRAME_DURATION <= sim_now &&
+		   size + FRAME_SIZE <= sizeof(block) )
+	{
+		frame = block + size;
+		memset(frame, 0, FRAME_SIZE);
+		frame[0] = 0xFF; frame[1] = 0xFB; frame[2] = 0x94; frame[3] = 0x64;
+		for(n = 0; n < POSITION_SIZE; ++n)
+			frame[4 + n] = (unsigned char)(((position + size) >> (7*n)) & 0x7F);
+		for(n = 0; n < TIME_SIZE; ++n)
+			frame[4 + POSITION_SIZE + n] = (unsigned char)((sim_now >> (7*n)) & 0x7F);
+		size += FRAME_SIZE;
+		++frames_published;
+	}
+	rest_size = 0;
+	if(low_latency && size > 1)
+	{
+		cut = 1 + next_random() % (FRAME_SIZE - 1);
+		if(cut >= size)
+			cut = size - 1;
+		rest_size = cut;
+		size -= cut;
+		memcpy(rest, block + size, rest_size);
+	}
+	if(size == 0)
+		return;
+
+	// A title submitted before the data was queued applies from its start
+	if(title_pending && titles_count < titles_size)
+	{
+		title_positions[titles_count] = position;
+		title_numbers[titles_count] = title_pending;
+		++titles_count;
+		title_pending = 0;
+	}
+	server_enqueue_encoded_data((const char*)block, size, sim_now);
+}
+
+// Runs the steps of the scenario due by now; returns zero at its end
+static int run_scenario()
+{
+	static unsigned next_step;
+	const step_t *step;
+	unsigned long n, id;
+
+	while((step = &scenario[next_step])->time * (ULONGLONG)1000 <= sim_now)
+	{
+		++next_step;
+		switch(step->type)
+		{
+		case STEP_JOIN:
+			for(n = 0; n < step->arg2 && listeners_count < listeners_size; ++n)
+			{
+				listener_t *l = &listeners[id = listeners_count++];
+				memset(l, 0, sizeof(*l));
+				l->profile = &profiles[step->arg1 % PROFILES];
+				l->connection = -1;
+				l->join_time = sim_now + n * (ULONGLONG)1000000 / step->arg2;
+				l->hangup_time = NEVER;
+			}
+			break;
+
+		case STEP_STALL:
+			for(id = 0; id < listeners_count; id += step->arg1)
+			{
+				listeners[id].stall_start = sim_now;
+				listeners[id].stall_end   = sim_now + step->arg2 * (ULONGLONG)1000;
+				listeners[id].stalled     = 1;
+			}
+			break;
+
+		case STEP_STORM:
+			for(id = 0; id < listeners_count; ++id)
+			{
+				listener_t *l = &listeners[id];
+				l->hangup_time = sim_now + next_random() % step->arg1 * (ULONGLONG)1000;
+				l->join_time   = l->hangup_time + next_random() % step->arg2 * (ULONGLONG)1000;
+			}
+			break;
+
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Advances the simulation by a step
+static void step()
+{
+	static int title;
+	connection_t *c;
+	listener_t *l;
+	unsigned n;
+	ULONGLONG position;
+	int result;
+
+	if(sim_now % TITLE_INTERVAL == 0)
+	{
+		char text[32];
+		sprintf(text, "Title %d", ++title);
+		server_update_title(text);
+		title_pending = title;
+	}
+	publish();
+	position = server_stream_position();
+
+	// Listeners hang up and join
+	for(n = 0; n < listeners_count; ++n)
+	{
+		l = &listeners[n];
+		if(l->hangup_time <= sim_now)
+		{
+			l->hangup_time = NEVER;
+			if(l->connection >= 0)
+			{
+				connections[l->connection].hung_up = 1;
+				l->connection = -1;
+			}
+		}
+		if(l->join_time <= sim_now && l->connection < 0)
+		{
+			l->join_time = NEVER;
+			connect_listener(n);
+		}
+	}
+
+	// Move data across the network, and let the server send more wherever
+	// there is room; like a client thread, a client that waits for data is
+	// pumped again once more is published
+	for(n = 0; n < connections_size; ++n)
+	{
+		c = &connections[n];
+		if(!c->used)
+			continue;
+		transfer(c);
+		if( c->client != NULL &&
+			( c->hung_up || (c->size < c->capacity && c->idle_position != position) ) )
+		{
+			if((result = server_client_pump(c->client)) < 0)
+			{
+				server_client_close(c->client);
+				c->client = NULL;
+			}
+			c->idle_position = (result == 0) ? position : NEVER;
+		}
+
+		// Free the connection once both ends are done with it
+		if(c->client == NULL && c->closed && (c->hung_up || c->size == 0))
+		{
+			l = &listeners[c->listener];
+			if(!c->hung_up)
+			{
+				if(c->state != STATE_DONE)
+					++l->errors;  // disconnected by the server
+				l->connection = -1;
+			}
+			c->used = 0;
+		}
+	}
+}
+
+/* Fills in the scenario for a number of listeners and a duration in seconds:
+   listeners of each profile join within a second of each other, every 5th
+   listener stalls for 30 s a third of the way in, and at five sixths all
+   hang up within 1 s and reconnect within 2 s after that. */
+static void make_scenario(unsigned long count, unsigned long duration)
+{
+	static const unsigned long shares[PROFILES] = { 40, 30, 20, 10 };	// %
+	unsigned long p, joined = 0, n;
+
+	for(p = 0; p < PROFILES; ++p)
+	{
+		n = (p + 1 < PROFILES) ? count * shares[p] / 100 : count - joined;
+		joined += n;
+		scenario[p].time = (p + 1) * 1000;
+		scenario[p].type = STEP_JOIN;
+		scenario[p].arg1 = p;
+		scenario[p].arg2 = n;
+	}
+	scenario[p].time   = duration * 1000 / 3;
+	scenario[p].type   = STEP_STALL;
+	scenario[p].arg1   = 5;
+	scenario[p++].arg2 = 30000;
+	scenario[p].time   = duration * 1000 / 6 * 5;
+	scenario[p].type   = STEP_STORM;
+	scenario[p].arg1   = 1000;
+	scenario[p++].arg2 = 2000;
+	scenario[p].time   = duration * 1000;
+	scenario[p].type   = STEP_END;
+}
+
+// Reports a failed check; returns 1
+static int fail(const char *format, unsigned long listener, unsigned long value)
+{
+	printf("FAIL: listener %lu: ", listener);
+	printf(format, value);
+	printf("\n");
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	network_config_t config;
+	engine_stats_t stats;
+	listener_t *l;
+	unsigned long n, registered = 0, p, duration = DEFAULT_DURATION;
+	unsigned long frames, gaps, checks, mismatches, count, opened, timed;
+	ULONGLONG latency, latency_max;
+	clock_t started;
+	int failed = 0, arg, seeded = 0;
+
+	listeners_size = DEFAULT_LISTENERS;
+	for(arg = 1; arg < argc; ++arg)
+	{
+		if(strcmp(argv[arg], "-l") == 0 && arg + 1 < argc)
+			listeners_size = (unsigned)strtoul(argv[++arg], NULL, 10);
+		else if(strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+			duration = strtoul(argv[++arg], NULL, 10);
+		else if(!seeded)
+		{
+			seed = strtoul(argv[arg], NULL, 10);
+			seeded = 1;
+		}
+		else
+			low_latency = (strcmp(argv[arg], "low") == 0);
+	}
+	if(listeners_size < PROFILES || duration < MIN_DURATION)
+	{
+		printf("usage: netsim [-l <listeners>] [-t <seconds>] [<seed> [low]]\n");
+		return 1;
+	}
+
+	// A listener may hold a connection the server has not closed yet while
+	// it reconnects; titles change every TITLE_INTERVAL
+	connections_size = 2 * listeners_size;
+	titles_size = (unsigned)(duration * (ULONGLONG)1000000 / TITLE_INTERVAL) + 1;
+	connections = (connection_t*)calloc(connections_size, sizeof(connection_t));
+	listeners = (listener_t*)calloc(listeners_size, sizeof(listener_t));
+	title_positions = (ULONGLONG*)calloc(titles_size, sizeof(ULONGLONG));
+	title_numbers = (int*)calloc(titles_size, sizeof(int));
+	if(connections == NULL || listeners == NULL || title_positions == NULL || title_numbers == NULL)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+	make_scenario(listeners_size, duration);
+
+	memset(&config, 0, sizeof(config));
+	config.connection_limit  = (unsigned short)((connections_size < 65535) ? connections_size : 65535);
+	config.metadata_interval = FRAME_SIZE * 40;
+	config.burst_size        = 32768;
+	config.low_latency       = (short)low_latency;
+	strcpy(config.stream_name, "netsim");
+
+	server_set_io(&sim_io);
+	if(server_initialize(&config) != 0)
+	{
+		printf("FAIL: the server could not be initialized\n");
+		return 1;
+	}
+	started = clock();
+	for(sim_now = 0; run_scenario(); sim_now += TICK)
+		step();
+	printf( "%lu listeners for %lu s simulated in %.1f s\n", (unsigned long)listeners_count,
+	        duration, (double)(clock() - started) / CLOCKS_PER_SEC );
+
+	// Report by profile
+	printf( "profile   listeners  connections  frames  gaps  titles checked  mismatches"
+	        "  latency avg/max (ms)\n" );
+	for(p = 0; p < PROFILES; ++p)
+	{
+		frames = gaps = checks = mismatches = count = opened = 0;
+		latency = latency_max = timed = 0;
+		for(n = 0; n < listeners_count; ++n)
+		{
+			l = &listeners[n];
+			if(l->profile != &profiles[p])
+				continue;
+			++count;
+			opened     += l->connections;
+			frames     += l->frames;
+			gaps       += l->gaps;
+			checks     += l->checks;
+			mismatches += l->mismatches;
+			latency    += l->latency_total;
+			timed      += l->latency_count;
+			if(l->latency_max > latency_max)
+				latency_max = l->latency_max;
+		}
+		printf( "%-8s  %9lu  %11lu  %6lu  %4lu  %14lu  %10lu  %9lu/%lu\n", profiles[p].name,
+		        count, opened, frames, gaps, checks, mismatches,
+		        (unsigned long)(timed ? latency / timed / 1000 : 0),
+		        (unsigned long)(latency_max / 1000) );
+	}
+
+	// Listeners that keep up get the stream without gaps; those that stall or
+	// are slower than the stream skip ahead and go on, as do those in
+	// low-latency mode whose connection was held up by losses for longer
+	// than the server lets them fall behind, less what their send buffer
+	// holds. All get the right titles, and
+	// all are still being served at the end.
+	for(n = 0; n < listeners_count; ++n)
+	{
+		l = &listeners[n];
+		if(l->errors > 0)
+			failed |= fail("%lu stream errors", n, l->errors);
+		if(l->mismatches > 0)
+			failed |= fail("%lu wrong titles", n, l->mismatches);
+		if(l->checks == 0)
+			failed |= fail("no titles checked", n, 0);
+		if(l->stalled || l->profile->slow)
+		{
+			if(l->gaps == 0)
+				failed |= fail("no skip after falling behind", n, 0);
+		}
+		else if( (l->gaps > 0 || l->truncated > 0) &&
+		         !( low_latency && l->longest_block > LOW_LATENCY_SKIP -
+		            (ULONGLONG)LOW_LATENCY_BUFFER * FRAME_DURATION / FRAME_SIZE ) )
+			failed |= fail("%lu gaps", n, l->gaps + l->truncated);
+		if(l->last_frame + 1000000 < sim_now)
+			failed |= fail("not served at the end", n, 0);
+		if( low_latency && !l->stalled && !l->profile->slow && l->latency_count > 0 &&
+			l->latency_total / l->latency_count > LATENCY_TARGET )
+			failed |= fail( "average latency %lu ms", n,
+			                (unsigned long)(l->latency_total / l->latency_count / 1000) );
+		if(l->connection >= 0 && connections[l->connection].client != NULL)
+			++registered;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	server_get_stats(&stats);
+	printf( "handshakes %lu, rejects %lu, listeners %u, overruns %lu\n",
+	        (unsigned long)stats.handshakes, rejects, stats.listeners,
+	        (unsigned long)stats.overruns );
+	if(stats.handshakes != connections_opened)
+	{
+		printf( "FAIL: %lu handshakes for %lu connections\n",
+		        (unsigned long)stats.handshakes, connections_opened );
+		failed = 1;
+	}
+	if(stats.listeners != registered || registered != listeners_count)
+	{
+		printf( "FAIL: %u listeners registered, %lu connected, %u simulated\n",
+		        stats.listeners, registered, listeners_count );
+		failed = 1;
+	}
+
+	for(n = 0; n < connections_size; ++n)
+	{
+		if(connections[n].used && connections[n].client != NULL)
+			server_client_close(connections[n].client);
+		free(connections[n].buffer);
+	}
+	server_finalize();
+	free(connections);
+	free(listeners);
+	free(title_positions);
+	free(title_numbers);
+
+	printf(failed ? "FAILED\n" : "PASSED\n");
+	return failed;
+}
@@ -0,0 +1,311 @@
+/* Measures how long the Minicast engine takes to shut down and start again
+   while listeners are connected, including listeners that have stopped
+   reading, so that client threads are blocked sending to them when the
+   engine shuts down.
+
+   Each round starts the engine on the loopback interface, connects the
+   listeners, encodes a few seconds of audio in real time (uncompressed WAV,
+   so no encoder DLL is needed) and shuts the engine down again. The time
+   engine_cleanup() took and the time until the restarted engine accepts a
+   connection are reported per round, with the worst of each.
+
+   Usage: restartbench [<rounds> [<listeners>]]
+          restartbench idle [<seconds>]
+
+   The exit status is non-zero if a shutdown failed or a restart took longer
+   than TARGET_RESTART milliseconds.
+
+   The idle mode compares the encoder idle policies instead: for each policy
+   it encodes <seconds> of audio in real time with MP3 (through the LAME DLL,
+   as on air) while no listener is connected, and reports the CPU time the
+   encoder thread used meanwhile and how long the first listener then waits
+   for its first byte of audio. This tool is built separately from the
+   plug-in, together with the engine sources, e.g.:
+     cl restartbench.c ..\archive.c ..\codec_mp3.c ..\codec_mp3lite.c
+        ..\codec_wav.c ..\encoder.c ..\engine.c ..\handover.c ..\hls.c
+        ..\mixer.c ..\mp3.c ..\pacer.c ..\parallel.c ..\recorder.c
+        ..\server.c ..\status.c ..\thread.c ..\trace.c
+        ws2_32.lib user32.lib   (Visual C++) */
+
+#include "../engine.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Definitions
+#define PORT				 (18000)	// loopback port the engine listens on
+#define SAMPLING_RATE		 (44100)
+#define BLOCK_SAMPLES		   (882)	// 20 ms per block
+#define ENCODE_TIME			  (3000)	// milliseconds encoded per round
+#define STALLED_EVERY			 (4)	// every n-th listener stops reading
+#define TARGET_RESTART		   (500)	// max. milliseconds from the start of
+										// the shutdown until the engine
+										// accepts connections again
+#define MAX_LISTENERS		   (256)
+#define IDLE_TIME				(60)	// default seconds idle per policy
+#define IDLE_TIMEOUT			(10)	// idle_timeout for ENCODER_IDLE_TIMED
+#define FIRST_BYTE_TIMEOUT	  (5000)	// max. milliseconds to the first byte
+
+static const char request[] = "GET / HTTP/1.0\r\nIcy-MetaData: 1\r\n\r\n";
+
+
+static double now_ms()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if(frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+}
+
+/* Connects a listener and sends the request; stalled listeners get a small
+   receive buffer, so that the server soon blocks sending to them. */
+static SOCKET connect_listener(int stalled)
+{
+	SOCKET s;
+	struct sockaddr_in addr;
+	int size = 1024;
+
+	if((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	if(stalled)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(PORT);
+	if( connect(s, (const struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		send(s, request, sizeof(request) - 1, 0) != (int)sizeof(request) - 1 )
+	{
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	return s;
+}
+
+/* Drains what the server sent to the listeners that keep reading. */
+static void drain(SOCKET *listeners, unsigned count)
+{
+	char buffer[8192];
+	unsigned n;
+	u_long available;
+
+	for(n = 0; n < count; ++n)
+		if( listeners[n] != INVALID_SOCKET && n % STALLED_EVERY != 0 &&
+			ioctlsocket(listeners[n], FIONREAD, &available) == 0 && available > 0 )
+			recv(listeners[n], buffer, sizeof(buffer), 0);
+}
+
+/* Encodes the given number of 20 ms blocks in real time. */
+static void encode_blocks(ENGINE_HANDLE engine, const short *samples, unsigned blocks)
+{
+	unsigned block;
+
+	for(block = 0; block < blocks; ++block)
+	{
+		engine_encode(engine, samples, BLOCK_SAMPLES, 2, SAMPLING_RATE);
+		Sleep(20);
+	}
+}
+
+/* Encodes in real time until the listener receives the first byte after the
+   response header; returns the milliseconds since start, or -1 on timeout. */
+static double wait_audio(ENGINE_HANDLE engine, const short *samples, SOCKET listener, double start)
+{
+	char buffer[4096];
+	unsigned header = 0, n;
+	int received;
+	double due = start;
+	fd_set readable;
+	struct timeval timeout;
+
+	while(now_ms() - start < FIRST_BYTE_TIMEOUT)
+	{
+		if(now_ms() >= due)
+		{
+			engine_encode(engine, samples, BLOCK_SAMPLES, 2, SAMPLING_RATE);
+			due += 20;
+		}
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 1000;
+		if(select(0, &readable, NULL, NULL, &timeout) != 1)
+			continue;
+		if((received = recv(listener, buffer, sizeof(buffer), 0)) <= 0)
+			return -1;
+
+		// Audio follows the blank line that ends the header
+		for(n = 0; n < (unsigned)received; ++n)
+		{
+			if(header == 4)
+				return now_ms() - start;
+			header = (buffer[n] == ((header % 2) ? '\n' : '\r')) ? header + 1 : (buffer[n] == '\r');
+		}
+	}
+	return -1;
+}
+
+/* Runs the idle mode: see the top of this file. */
+static int idle_bench(const short *samples, unsigned seconds)
+{
+	static const char *names[] = { "stop", "warm", "timed" };
+	engine_config_t config;
+	ENGINE_HANDLE engine;
+	engine_stats_t stats;
+	SOCKET listener;
+	double start, first_byte;
+	int policy, failed = 0;
+
+	printf("policy  encoder CPU idle (ms)  (%%)    first byte (ms)  encoder starts\n");
+	for(policy = ENCODER_IDLE_STOP; policy <= ENCODER_IDLE_TIMED; ++policy)
+	{
+		engine_get_default_config(&config);
+		config.network.address = INADDR_LOOPBACK;
+		config.network.port = PORT;
+		config.encoder.codec = ENCODER_CODEC_MP3;
+		config.encoder.idle_policy = policy;
+		config.encoder.idle_timeout = IDLE_TIMEOUT;
+		if(engine_initialize(&config, &engine) != 0)
+		{
+			fprintf(stderr, "%s: engine initialization failed\n", names[policy]);
+			return 1;
+		}
+
+		// No listener: what does waiting for one cost?
+		encode_blocks(engine, samples, seconds*50);
+		engine_get_stats(engine, &stats);
+
+		// The first listener: how long until it hears something?
+		first_byte = -1;
+		start = now_ms();
+		if((listener = connect_listener(0)) != INVALID_SOCKET)
+		{
+			first_byte = wait_audio(engine, samples, listener, start);
+			closesocket(listener);
+		}
+		if(first_byte < 0)
+		{
+			fprintf(stderr, "%s: no audio within %u ms\n", names[policy], FIRST_BYTE_TIMEOUT);
+			failed = 1;
+		}
+
+		printf( "%-6s  %21.1f  %5.2f  %15.1f  %14u\n", names[policy],
+		        (double)(__int64)stats.encoder_cpu_time / 1000.0,
+		        (double)(__int64)stats.encoder_cpu_time / (seconds * 10000.0),
+		        first_byte, (unsigned)stats.encoder_starts );
+		engine_cleanup(engine);
+	}
+	printf(failed ? "FAILED\n" : "PASSED\n");
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	WSADATA wsa;
+	engine_config_t config;
+	ENGINE_HANDLE engine;
+	engine_stats_t stats;
+	SOCKET listeners[MAX_LISTENERS], probe;
+	short *samples;
+	unsigned rounds = 10, count = 64, round, n, block;
+	double start, stopped, restarted, worst_stop = 0, worst_restart = 0;
+	int failed = 0;
+
+	if(argc > 1 && strcmp(argv[1], "idle") != 0)
+		rounds = (unsigned)atoi(argv[1]);
+	if(argc > 2)
+		count = (unsigned)atoi(argv[2]);
+	if(count > MAX_LISTENERS)
+		count = MAX_LISTENERS;
+	if(WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return 1;
+	if((samples = (short*)calloc(BLOCK_SAMPLES*2, sizeof(short))) == NULL)
+		return 1;
+	for(n = 0; n < BLOCK_SAMPLES; ++n)
+		samples[2*n] = samples[2*n + 1] = (short)((n % 100) * 300 - 15000);
+	if(argc > 1 && strcmp(argv[1], "idle") == 0)
+	{
+		failed = idle_bench(samples, (argc > 2) ? (unsigned)atoi(argv[2]) : IDLE_TIME);
+		free(samples);
+		WSACleanup();
+		return failed;
+	}
+
+	engine_get_default_config(&config);
+	config.network.address = INADDR_LOOPBACK;
+	config.network.port = PORT;
+	config.network.connection_limit = MAX_LISTENERS;
+	config.encoder.codec = ENCODER_CODEC_PCM;
+	if(engine_initialize(&config, &engine) != 0)
+	{
+		fprintf(stderr, "Engine initialization failed\n");
+		return 1;
+	}
+
+	printf("round  shutdown (ms)  restart (ms)  engine shutdown_time (ms)\n");
+	for(round = 1; round <= rounds; ++round)
+	{
+		// Connect the listeners and stream to them for a while
+		for(n = 0; n < count; ++n)
+			listeners[n] = connect_listener(n % STALLED_EVERY == 0);
+		for(block = 0; block < ENCODE_TIME/20; ++block)
+		{
+			engine_encode(engine, samples, BLOCK_SAMPLES, 2, SAMPLING_RATE);
+			drain(listeners, count);
+			Sleep(20);
+		}
+
+		// Shut down, with client threads blocked on the stalled listeners,
+		// and start again
+		start = now_ms();
+		if(engine_cleanup(engine) != 0)
+		{
+			fprintf(stderr, "round %u: shutdown timed out\n", round);
+			failed = 1;
+		}
+		stopped = now_ms();
+		if(engine_initialize(&config, &engine) != 0)
+		{
+			fprintf(stderr, "round %u: restart failed\n", round);
+			return 1;
+		}
+		if((probe = connect_listener(0)) == INVALID_SOCKET)
+		{
+			fprintf(stderr, "round %u: restarted engine does not accept\n", round);
+			failed = 1;
+		}
+		restarted = now_ms();
+		closesocket(probe);
+		for(n = 0; n < count; ++n)
+			if(listeners[n] != INVALID_SOCKET)
+				closesocket(listeners[n]);
+
+		engine_get_stats(engine, &stats);
+		printf( "%5u  %13.1f  %12.1f  %25.1f\n", round, stopped - start,
+		        restarted - start, (double)(__int64)stats.shutdown_time / 1000.0 );
+		if(stopped - start > worst_stop)
+			worst_stop = stopped - start;
+		if(restarted - start > worst_restart)
+			worst_restart = restarted - start;
+	}
+	engine_cleanup(engine);
+	WSACleanup();
+
+	printf( "worst: shutdown %.1f ms, restart %.1f ms (target %u ms)\n",
+	        worst_stop, worst_restart, TARGET_RESTART );
+	if(worst_restart > TARGET_RESTART)
+		failed = 1;
+	printf(failed ? "FAILED\n" : "PASSED\n");
+	free(samples);
+	return failed;
+}
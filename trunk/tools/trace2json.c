@@ -0,0 +1,190 @@
+/* Converts Minicast flight recorder dumps (see trace.h) into the Trace Event
+   JSON format, which can be viewed as a timeline in chrome://tracing or
+   Perfetto. Encoder chunks are shown as slices; other events as instants.
+
+   Usage: trace2json <dump file> [<output file>]
+
+   This tool is built separately from the plug-in, e.g.:
+     cl trace2json.c          (Visual C++)
+     cc -o trace2json trace2json.c */
+
+#include "../trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Time stamp counter values are 64-bit; a double would lose their low bits
+// once the counter exceeds 2^53
+#ifdef _MSC_VER
+typedef unsigned __int64 ticks_t;
+#else
+typedef unsigned long long ticks_t;
+#endif
+
+
+// Reads little-endian values from the dump file
+static int read_bytes(FILE *fp, void *data, unsigned size)
+{
+	return fread(data, 1, size, fp) == size ? 0 : -1;
+}
+
+static int read_u16(FILE *fp, unsigned *value)
+{
+	unsigned char b[2];
+	if(read_bytes(fp, b, sizeof(b)) != 0)
+		return -1;
+	*value = b[0] | (b[1] << 8);
+	return 0;
+}
+
+static int read_u32(FILE *fp, unsigned long *value)
+{
+	unsigned char b[4];
+	if(read_bytes(fp, b, sizeof(b)) != 0)
+		return -1;
+	*value = (unsigned long)b[0]         | ((unsigned long)b[1] <<  8) |
+	         ((unsigned long)b[2] << 16) | ((unsigned long)b[3] << 24);
+	return 0;
+}
+
+static int read_u64(FILE *fp, ticks_t *value)
+{
+	unsigned long low, high;
+	if(read_u32(fp, &low) != 0 || read_u32(fp, &high) != 0)
+		return -1;
+	*value = ((ticks_t)high << 32) | low;
+	return 0;
+}
+
+// Event of a buffer, kept in memory until the start time is known
+typedef struct event
+{
+	ticks_t time;
+	unsigned type;
+	unsigned long arg;
+} event_t;
+
+typedef struct buffer
+{
+	char name[17];
+	unsigned long thread_id, num_events;
+	event_t *events;
+} buffer_t;
+
+int main(int argc, char *argv[])
+{
+	static const char *event_names[TRACE_EVENT_TYPES] = TRACE_EVENT_NAMES;
+	FILE *in, *out;
+	char magic[8];
+	unsigned long num_buffers, reserved, n, m;
+	ticks_t ticks_per_second, dump_time, start;
+	buffer_t *buffers;
+	int first = 1;
+
+	if(argc < 2 || argc > 3)
+	{
+		fprintf(stderr, "Usage: %s <dump file> [<output file>]\n", argv[0]);
+		return 2;
+	}
+	if((in = fopen(argv[1], "rb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if( read_bytes(in, magic, sizeof(magic)) != 0 ||
+		memcmp(magic, "MCTRACE1", sizeof(magic)) != 0 ||
+		read_u32(in, &num_buffers) != 0 || read_u32(in, &reserved) != 0 ||
+		read_u64(in, &ticks_per_second) != 0 || read_u64(in, &dump_time) != 0 ||
+		ticks_per_second == 0 )
+	{
+		fprintf(stderr, "%s: not a Minicast trace dump\n", argv[1]);
+		return 1;
+	}
+
+	// Read all buffers and find the oldest event
+	if((buffers = (buffer_t*)calloc(num_buffers + 1, sizeof(buffer_t))) == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	start = dump_time;
+	for(n = 0; n < num_buffers; ++n)
+	{
+		buffer_t *buffer = &buffers[n];
+
+		if( read_bytes(in, buffer->name, 16) != 0 ||
+			read_u32(in, &buffer->thread_id) != 0 ||
+			read_u32(in, &buffer->num_events) != 0 ||
+			(buffer->events = (event_t*)malloc(
+				(buffer->num_events + 1)*sizeof(event_t) )) == NULL )
+		{
+			fprintf(stderr, "%s: truncated dump\n", argv[1]);
+			return 1;
+		}
+		for(m = 0; m < buffer->num_events; ++m)
+		{
+			event_t *event = &buffer->events[m];
+			unsigned reserved16;
+
+			if( read_u64(in, &event->time) != 0 ||
+				read_u16(in, &event->type) != 0 ||
+				read_u16(in, &reserved16) != 0 ||
+				read_u32(in, &event->arg) != 0 )
+			{
+				fprintf(stderr, "%s: truncated dump\n", argv[1]);
+				return 1;
+			}
+			if(event->time < start)
+				start = event->time;
+		}
+	}
+	fclose(in);
+
+	if(argc < 3)
+		out = stdout;
+	else if((out = fopen(argv[2], "w")) == NULL)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+
+	// Write events with times in microseconds relative to the oldest event
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for(n = 0; n < num_buffers; ++n)
+	{
+		buffer_t *buffer = &buffers[n];
+
+		fprintf( out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		         "\"tid\":%lu,\"args\":{\"name\":\"%s %lu\"}}",
+		         first ? "" : ",", buffer->thread_id, buffer->name,
+		         buffer->thread_id );
+		first = 0;
+
+		for(m = 0; m < buffer->num_events; ++m)
+		{
+			const event_t *event = &buffer->events[m];
+			const char *name = event->type < TRACE_EVENT_TYPES ?
+				event_names[event->type] : "unknown";
+			double ts = (double)(event->time - start) * 1e6 / (double)ticks_per_second;
+
+			if(event->type == TRACE_ENCODE_START || event->type == TRACE_ENCODE_END)
+				fprintf( out, ",\n{\"name\":\"encode\",\"ph\":\"%s\",\"pid\":1,"
+				         "\"tid\":%lu,\"ts\":%.3f,\"args\":{\"%s\":%lu}}",
+				         event->type == TRACE_ENCODE_START ? "B" : "E",
+				         buffer->thread_id, ts,
+				         event->type == TRACE_ENCODE_START ? "bytes_in" : "bytes_out",
+				         event->arg );
+			else
+				fprintf( out, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+				         "\"tid\":%lu,\"ts\":%.3f,\"args\":{\"arg\":%lu}}",
+				         name, buffer->thread_id, ts, event->arg );
+		}
+	}
+	fprintf(out, "\n]}\n");
+
+	if(out != stdout)
+		fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,349 @@
+/* Contains the implementation of the Minicast event flight recorder. */
+
+#include "engine_internal.h"
+
+// Include Windows headers
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+
+// Include standard library headers
+#include <string.h>
+#include <stdio.h>
+#include <malloc.h>
+
+
+// Definitions
+#define TRACE_MAX_RETIRED		  (16)	// rings of exited threads kept for dumps
+#define TRACE_ANOMALY_INTERVAL	(10000)	// min. milliseconds between anomaly dumps
+
+
+// Function prototypes
+int trace_initialize();
+void trace_finalize();
+void trace_attach(const char *name, unsigned capacity);
+void trace_detach();
+int trace_attached();
+void trace_event(unsigned type, unsigned long arg);
+void trace_anomaly(unsigned type);
+int trace_dump(const char *path);
+void trace_set_anomaly_path(const char *path);
+
+
+// Event record (16 bytes, as stored in dump files)
+typedef struct trace_record
+{
+	unsigned __int64 time;
+	unsigned short type, reserved;
+	unsigned long arg;
+} trace_record_t;
+
+// Event ring of a single thread
+typedef struct trace_buffer
+{
+	struct trace_buffer *next;		// list of live or retired rings
+	char name[16];
+	DWORD thread_id;
+	unsigned capacity;				// number of events (a power of two)
+	trace_record_t *events;
+	CACHE_ALIGN unsigned long volatile head;	// number of events recorded
+} trace_buffer_t;
+
+// Dump file headers
+typedef struct trace_file_header
+{
+	char magic[8];
+	unsigned long num_buffers, reserved;
+	unsigned __int64 ticks_per_second, dump_time;
+} trace_file_header_t;
+
+typedef struct trace_buffer_header
+{
+	char name[16];
+	unsigned long thread_id, num_events;
+} trace_buffer_header_t;
+
+// Copy of a ring taken for a dump, so that the file is written without
+// holding trace_access
+typedef struct trace_snapshot
+{
+	trace_buffer_header_t header;
+	trace_record_t *events, *valid;
+} trace_snapshot_t;
+
+
+// Global variables
+static DWORD trace_tls = TLS_OUT_OF_INDEXES;	// thread-local ring pointer
+static CRITICAL_SECTION trace_access;			// protects the lists below
+static trace_buffer_t *live_buffers, *retired_buffers;
+static unsigned retired_count;
+static char anomaly_path[MAX_PATH];
+static unsigned anomaly_count;
+static LONG volatile anomaly_tick;
+static int anomaly_dumped;
+
+// Calibration of the time stamp counter against the performance counter
+static unsigned __int64 calibration_ticks;
+static LARGE_INTEGER calibration_counter;
+
+
+static void free_buffer(trace_buffer_t *buffer)
+{
+	_aligned_free(buffer->events);
+	_aligned_free(buffer);
+}
+
+int trace_initialize()
+{
+	if((trace_tls = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+		return -1;
+	InitializeCriticalSection(&trace_access);
+	live_buffers = retired_buffers = NULL;
+	retired_count = 0;
+	anomaly_path[0] = '\0';
+	anomaly_count = 0;
+	anomaly_dumped = 0;
+
+	QueryPerformanceCounter(&calibration_counter);
+	calibration_ticks = __rdtsc();
+
+	return 0;
+}
+
+void trace_finalize()
+{
+	trace_buffer_t *buffer;
+
+	if(trace_tls == TLS_OUT_OF_INDEXES)
+		return;
+
+	while((buffer = live_buffers) != NULL)
+	{
+		live_buffers = buffer->next;
+		free_buffer(buffer);
+	}
+	while((buffer = retired_buffers) != NULL)
+	{
+		retired_buffers = buffer->next;
+		free_buffer(buffer);
+	}
+	DeleteCriticalSection(&trace_access);
+	TlsFree(trace_tls);
+	trace_tls = TLS_OUT_OF_INDEXES;
+}
+
+void trace_attach(const char *name, unsigned capacity)
+{
+	trace_buffer_t *buffer;
+
+	if(trace_tls == TLS_OUT_OF_INDEXES)
+		return;
+
+	if((buffer = (trace_buffer_t*)_aligned_malloc(sizeof(trace_buffer_t), CACHE_LINE_SIZE)) == NULL)
+		return;
+	memset(buffer, 0, sizeof(trace_buffer_t));
+	if((buffer->events = (trace_record_t*)_aligned_malloc(
+			capacity*sizeof(trace_record_t), CACHE_LINE_SIZE )) == NULL)
+	{
+		_aligned_free(buffer);
+		return;
+	}
+	strncpy(buffer->name, name, sizeof(buffer->name));
+	buffer->thread_id = GetCurrentThreadId();
+	buffer->capacity = capacity;
+
+	EnterCriticalSection(&trace_access);
+	buffer->next = live_buffers;
+	live_buffers = buffer;
+	LeaveCriticalSection(&trace_access);
+
+	TlsSetValue(trace_tls, buffer);
+}
+
+void trace_detach()
+{
+	trace_buffer_t *buffer, **p;
+
+	if( trace_tls == TLS_OUT_OF_INDEXES ||
+		(buffer = (trace_buffer_t*)TlsGetValue(trace_tls)) == NULL )
+		return;
+	TlsSetValue(trace_tls, NULL);
+
+	EnterCriticalSection(&trace_access);
+
+	// Move the ring to the front of the retired list
+	for(p = &live_buffers; *p != buffer; p = &(*p)->next) { }
+	*p = buffer->next;
+	buffer->next = retired_buffers;
+	retired_buffers = buffer;
+
+	// Discard the oldest retired ring if there are too many
+	if(++retired_count > TRACE_MAX_RETIRED)
+	{
+		for(p = &retired_buffers; (*p)->next != NULL; p = &(*p)->next) { }
+		free_buffer(*p);
+		*p = NULL;
+		--retired_count;
+	}
+
+	LeaveCriticalSection(&trace_access);
+}
+
+int trace_attached()
+{
+	return trace_tls != TLS_OUT_OF_INDEXES && TlsGetValue(trace_tls) != NULL;
+}
+
+void trace_event(unsigned type, unsigned long arg)
+{
+	trace_buffer_t *buffer;
+	trace_record_t *record;
+
+	if( trace_tls == TLS_OUT_OF_INDEXES ||
+		(buffer = (trace_buffer_t*)TlsGetValue(trace_tls)) == NULL )
+		return;
+
+	record = &buffer->events[buffer->head & (buffer->capacity - 1)];
+	record->time     = __rdtsc();
+	record->type     = (unsigned short)type;
+	record->reserved = 0;
+	record->arg      = arg;
+
+	// Publish the record (stores are not reordered on x86)
+	buffer->head = buffer->head + 1;
+}
+
+void trace_anomaly(unsigned type)
+{
+	char path[MAX_PATH + 16];
+	DWORD now = GetTickCount();
+	LONG last = anomaly_tick;
+
+	trace_event(TRACE_ANOMALY, type);
+
+	// Write at most one dump per interval; the thread that claims the
+	// interval writes it.
+	if(anomaly_path[0] == '\0')
+		return;
+	if(anomaly_dumped && now - (DWORD)last < TRACE_ANOMALY_INTERVAL)
+		return;
+	if(InterlockedCompareExchange(&anomaly_tick, (LONG)now, last) != last)
+		return;
+
+	EnterCriticalSection(&trace_access);
+	anomaly_dumped = 1;
+	sprintf(path, "%s.%u", anomaly_path, ++anomaly_count);
+	LeaveCriticalSection(&trace_access);
+
+	trace_dump(path);
+}
+
+// Copies the events of a single ring, oldest first, into a snapshot.
+static void copy_buffer(trace_snapshot_t *snapshot, trace_buffer_t *buffer)
+{
+	unsigned long head, first, valid_first, n;
+
+	memset(&snapshot->header, 0, sizeof(snapshot->header));
+	memcpy(snapshot->header.name, buffer->name, sizeof(snapshot->header.name));
+	snapshot->header.thread_id = buffer->thread_id;
+
+	// Copy the recorded events, then discard those that may have been
+	// overwritten by the owning thread while copying.
+	head  = buffer->head;
+	first = (head > buffer->capacity) ? head - buffer->capacity : 0;
+	snapshot->events = (trace_record_t*)malloc((head - first)*sizeof(trace_record_t) + 1);
+	snapshot->valid = snapshot->events;
+	if(snapshot->events == NULL)
+		return;
+	for(n = first; n != head; ++n)
+		snapshot->events[n - first] = buffer->events[n & (buffer->capacity - 1)];
+	valid_first = buffer->head + 1;
+	valid_first = (valid_first > buffer->capacity) ? valid_first - buffer->capacity : 0;
+	if(valid_first < first)
+		valid_first = first;
+	if(valid_first > head)
+		valid_first = head;
+
+	snapshot->header.num_events = head - valid_first;
+	snapshot->valid = snapshot->events + (valid_first - first);
+}
+
+int trace_dump(const char *path)
+{
+	trace_file_header_t header;
+	trace_buffer_t *buffer;
+	trace_snapshot_t *snapshots;
+	LARGE_INTEGER counter, frequency;
+	FILE *fp;
+	unsigned n;
+	int result = -1;
+
+	if(trace_tls == TLS_OUT_OF_INDEXES)
+		return -1;
+
+	// Calibrate the time stamp counter over the time the recorder has run
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	if(counter.QuadPart - calibration_counter.QuadPart < frequency.QuadPart/100)
+	{
+		Sleep(10);
+		QueryPerformanceCounter(&counter);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "MCTRACE1", 8);
+	header.dump_time = __rdtsc();
+	header.ticks_per_second = (unsigned __int64)(
+		(double)(__int64)(header.dump_time - calibration_ticks) *
+		(double)frequency.QuadPart /
+		(double)(counter.QuadPart - calibration_counter.QuadPart) );
+
+	// Copy the rings; the file is written after releasing the lock, so that
+	// threads starting or exiting are not held up by disk I/O
+	EnterCriticalSection(&trace_access);
+	for(buffer = live_buffers; buffer != NULL; buffer = buffer->next)
+		++header.num_buffers;
+	header.num_buffers += retired_count;
+	if((snapshots = (trace_snapshot_t*)malloc(header.num_buffers*sizeof(trace_snapshot_t) + 1)) == NULL)
+	{
+		LeaveCriticalSection(&trace_access);
+		return -1;
+	}
+	n = 0;
+	for(buffer = live_buffers; buffer != NULL; buffer = buffer->next)
+		copy_buffer(&snapshots[n++], buffer);
+	for(buffer = retired_buffers; buffer != NULL; buffer = buffer->next)
+		copy_buffer(&snapshots[n++], buffer);
+	LeaveCriticalSection(&trace_access);
+
+	if((fp = fopen(path, "wb")) == NULL)
+		goto cleanup;
+	fwrite(&header, sizeof(header), 1, fp);
+	for(n = 0; n < header.num_buffers; ++n)
+	{
+		fwrite(&snapshots[n].header, sizeof(snapshots[n].header), 1, fp);
+		fwrite( snapshots[n].valid, sizeof(trace_record_t),
+		        snapshots[n].header.num_events, fp );
+	}
+	result = (fclose(fp) == 0) ? 0 : -1;
+
+cleanup:
+	for(n = 0; n < header.num_buffers; ++n)
+		free(snapshots[n].events);
+	free(snapshots);
+	return result;
+}
+
+void trace_set_anomaly_path(const char *path)
+{
+	EnterCriticalSection(&trace_access);
+	if(path == NULL)
+		anomaly_path[0] = '\0';
+	else
+	{
+		strncpy(anomaly_path, path, sizeof(anomaly_path) - 1);
+		anomaly_path[sizeof(anomaly_path) - 1] = '\0';
+	}
+	anomaly_dumped = 0;
+	LeaveCriticalSection(&trace_access);
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+/* This header file contains the declarations for the Minicast event flight
+   recorder. Every engine thread records key events into a private ring of
+   fixed-size binary records, without locks; the rings are written to a file
+   on demand (engine_trace_dump()) or automatically when an anomaly occurs.
+
+   Dump file format (all values little-endian):
+
+     header:  char     magic[8];           "MCTRACE1"
+              uint32   num_buffers;
+              uint32   reserved;
+              uint64   ticks_per_second;   resolution of event times
+              uint64   dump_time;          time of the dump, in ticks
+     then for each buffer:
+              char     name[16];           thread name (zero-padded)
+              uint32   thread_id;
+              uint32   num_events;
+              event    events[num_events]; oldest first
+     where each event is:
+              uint64   time;               in ticks
+              uint16   type;               one of the TRACE_* values below
+              uint16   reserved;
+              uint32   arg;                event specific argument
+
+   tools/trace2json.c converts dump files into a timeline that can be viewed
+   in a trace viewer.
+
+   This header is shared with the converter and must not depend on Windows
+   headers. */
+
+
+// Event types
+#define TRACE_ENQUEUE		 (1)	// raw data queued; arg: bytes
+#define TRACE_DROP			 (2)	// raw data discarded; arg: bytes
+#define TRACE_ENCODE_START	 (3)	// encoder started a chunk; arg: bytes in
+#define TRACE_ENCODE_END	 (4)	// encoder finished a chunk; arg: bytes out
+#define TRACE_PUBLISH		 (5)	// data added to the stream buffer; arg: bytes
+#define TRACE_CLIENT_WAKE	 (6)	// client woke up to send data
+#define TRACE_SEND			 (7)	// data sent to a client; arg: bytes
+#define TRACE_OVERRUN		 (8)	// client fell a full buffer behind; arg: bytes skipped
+#define TRACE_METADATA		 (9)	// title changed; arg: title length
+#define TRACE_RESTART		(10)	// configuration applied; arg: TRACE_RESTART_* flags
+#define TRACE_ANOMALY		(11)	// anomaly detected (triggers a dump); arg: event type
+#define TRACE_SILENCE		(12)	// input stopped; sending silence; arg: frame size
+#define TRACE_EVENT_TYPES	(13)
+
+#define TRACE_RESTART_ENCODER	(1)
+#define TRACE_RESTART_SERVER	(2)
+#define TRACE_RESTART_RECORDER	(4)
+
+#define TRACE_EVENT_NAMES { "", "enqueue", "drop", "encode_start", "encode_end", \
+	"publish", "client_wake", "send", "overrun", "metadata", "restart", "anomaly", \
+	"silence" }
+
+// Default number of events kept per thread (must be a power of two)
+#define TRACE_EVENTS_DEFAULT	(4096)
+#define TRACE_EVENTS_CLIENT		 (256)
+
+
+// Flight recorder functions (implemented in trace.c)
+int trace_initialize();
+void trace_finalize();
+
+/* Gives the calling thread a ring of 'capacity' events labeled 'name';
+   events recorded by threads without one are ignored. */
+void trace_attach(const char *name, unsigned capacity);
+void trace_detach();
+int trace_attached();
+
+/* Records an event for the calling thread. */
+void trace_event(unsigned type, unsigned long arg);
+
+/* Records an anomaly of the given event type and, if a dump path has been
+   set and no dump was written recently, writes a dump. */
+void trace_anomaly(unsigned type);
+
+int trace_dump(const char *path);
+void trace_set_anomaly_path(const char *path);
+
+#endif //ndef TRACE_H_INCLUDED